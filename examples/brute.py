@@ -0,0 +1,77 @@
+# Brute-force references for the examples/test_*.py checks; plain Python, no numpy.
+
+import array, math, os, random, tempfile
+
+def key(i):
+    return i.to_bytes(16, "little")
+
+def ordinal(id):
+    return int.from_bytes(bytes(id), "little")
+
+def blob(vec):
+    return array.array("f", vec).tobytes()
+
+def floats(b):
+    return array.array("f", bytes(b)).tolist()
+
+def vectors(n, dim, seed=0):
+    rng = random.Random(seed)
+    return [array.array("f", [rng.gauss(0, 1) for _ in range(dim)]).tolist() for _ in range(n)]
+
+# The database and the files kept next to it
+SIDECARS = ("", ".ivf", ".hnsw", ".pq", ".sign", ".ids")
+
+def path(name, dir=None):
+    # In the temp directory (TMPDIR) unless dir says otherwise, with the sidecars of an earlier run removed.
+    p = os.path.join(dir or tempfile.gettempdir(), f"embeddings-{name}-{os.getpid()}.db")
+    remove(p)
+    return p
+
+def remove(p):
+    for ext in SIDECARS:
+        if os.path.exists(p + ext):
+            os.remove(p + ext)
+
+def score(metric, x, q):
+    # None for a zero vector under cosine, which has no direction and is never a hit.
+    if metric == "cosine":
+        nx = math.sqrt(sum(a * a for a in x))
+        nq = math.sqrt(sum(b * b for b in q))
+        return sum(a * b for a, b in zip(x, q)) / (nx * nq) if nx > 0 and nq > 0 else None
+    if metric == "ip":
+        return sum(a * b for a, b in zip(x, q))
+    if metric == "l2":
+        return sum((a - b) * (a - b) for a, b in zip(x, q))
+    return sum(abs(a - b) for a, b in zip(x, q))
+
+def better(metric, a, b):
+    return a < b if metric in ("l2", "l1") else a > b
+
+def topk(metric, rows, q, k):
+    """The k best (id, score) of rows, a dict of id -> vector, best first."""
+    scored = [(id, score(metric, x, q)) for id, x in rows.items()]
+    scored = [s for s in scored if s[1] is not None]
+    scored.sort(key=lambda s: s[1], reverse=metric not in ("l2", "l1"))
+    return scored[:k]
+
+def check(hits, metric, rows, q, k, tol=1e-4):
+    """hits must be the k best of rows up to ties within tol, with the reference scores."""
+    ref = topk(metric, rows, q, k)
+    assert len(hits) == len(ref), (len(hits), len(ref))
+    for id, s in hits:
+        id = bytes(id)
+        assert id in rows, id
+        want = score(metric, rows[id], q)
+        assert abs(want - s) <= tol * max(1.0, abs(want)), (want, s)
+    scores = [s for _, s in hits]
+    assert all(not better(metric, scores[i + 1], scores[i]) for i in range(len(scores) - 1)), scores
+    got = {bytes(id) for id, _ in hits}
+    last = scores[-1] if scores else None
+    for id, s in ref:
+        # Only a near-tie with the last hit may be missing.
+        assert id in got or abs(s - last) <= tol * max(1.0, abs(s)), (ordinal(id), s, last)
+
+def recall(hits, metric, rows, q, k):
+    """Share of the brute-force top-k found by an approximate search."""
+    ref = {id for id, _ in topk(metric, rows, q, k)}
+    return len({bytes(id) for id, _ in hits} & ref) / len(ref)
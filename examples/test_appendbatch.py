@@ -0,0 +1,50 @@
+# python examples/test_appendbatch.py: appendbatch writes the same records as one append per record
+
+import array, os, embeddings
+from brute import *
+
+dim = 300
+
+p = path("appendbatch")
+
+# More than one 8 MiB write
+N = 8000
+X = array.array("f", [((i * 7919) % 1000) / 500.0 - 1.0 for i in range(N * dim)])
+ids = [key(i) for i in range(N)]
+
+db = embeddings.Embeddings(path=p, dim=dim, mode="a+")
+db.appendbatch(b"".join(ids), X.tobytes(), flush=True)
+# Upserts, with the id index built, carry the same operation as with append
+assert db.get(ids[0]) is not None
+db.appendbatch(b"".join(ids[:100]), X[:100 * dim].tobytes())
+# An empty batch is a no-op
+db.appendbatch(b"", b"")
+db.close()
+
+one = path("append")
+db = embeddings.Embeddings(path=one, dim=dim, mode="a+")
+for i in range(N):
+    db.append(ids[i], X[i * dim:(i + 1) * dim].tobytes())
+assert db.get(ids[0]) is not None
+for i in range(100):
+    db.append(ids[i], X[i * dim:(i + 1) * dim].tobytes())
+db.close()
+
+with open(p, "rb") as a, open(one, "rb") as b:
+    assert a.read() == b.read()
+
+# Mismatched counts are refused, and nothing is written
+size = os.path.getsize(p)
+db = embeddings.Embeddings(path=p, dim=dim, mode="a+")
+try:
+    db.appendbatch(b"".join(ids[:3]), X[:2 * dim].tobytes())
+    assert False, "3 ids and 2 vectors"
+except ValueError:
+    pass
+db.close()
+assert os.path.getsize(p) == size
+
+remove(p)
+remove(one)
+
+print("\nPass\n")
@@ -0,0 +1,35 @@
+# python examples/test_batch.py: searchbatch gives every query the hits of its own search
+
+import embeddings
+from brute import *
+
+dim = 24
+
+p = path("batch")
+
+X = vectors(2500, dim)
+rows = {key(i): X[i] for i in range(2000)}
+
+db = embeddings.Embeddings(path=p, dim=dim, mode="a+")
+for id, x in rows.items():
+    db.append(id, blob(x))
+# An upsert, and two versions of one id side by side in a record pair of the blocked kernel
+rows[key(3)] = X[2400]
+db.append(key(3), blob(X[2400]))
+rows[key(5)] = X[2402]
+db.append(key(5), blob(X[2401]))
+db.append(key(5), blob(X[2402]))
+
+for nq in (1, 2, 3, 4, 5, 8):
+    Q = X[2000:2000 + nq - 1] + [X[2401]]
+    hits = db.searchbatch(blob(sum(Q, [])), topk=7, threshold=-1)
+    assert len(hits) == nq
+    for q, h in zip(Q, hits):
+        check(h, "cosine", rows, q, 7)
+        assert [bytes(id) for id, _ in h] == [bytes(id) for id, _ in db.search(blob(q), topk=7, threshold=-1)]
+
+db.close()
+
+remove(p)
+
+print("\nPass\n")
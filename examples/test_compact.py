@@ -0,0 +1,108 @@
+# python examples/test_compact.py: compact keeps the latest live record of every id, while appends go on
+
+import threading, embeddings
+from brute import *
+
+# 1100 float32 make records larger than the 4 KiB header
+for dim, N in ((16, 6000), (1100, 1200)):
+    p = path("compact")
+
+    M = N // 2
+    X = vectors(N + M, dim)
+    rows = {}
+
+    db = embeddings.Embeddings(path=p, dim=dim, mode="a+")
+    for i in range(N):
+        rows[key(i)] = X[i]
+    db.appendbatch(b"".join(rows), blob(sum(X[:N], [])))
+    for i in range(0, N, 3):
+        rows[key(i)] = X[N + i // 3 % M]
+        db.append(key(i), blob(rows[key(i)]))
+    for i in range(1, N, 5):
+        if key(i) in rows:
+            del rows[key(i)]
+            assert db.delete(key(i))
+    db.ivfbuild(nlist=8)
+    db.signbuild()
+
+    size = os.path.getsize(p)
+
+    # Appends and updates of another thread during the copy are carried over; compacting until the
+    # writer is done makes sure some of them land while a copy is running.
+    lock = threading.Lock()
+
+    def writer():
+        for j in range(N, N + M):
+            with lock:
+                rows[key(j)] = X[j]
+            db.append(key(j), blob(X[j]))
+            if j % 7 == 0 and key(j - N) in rows:
+                with lock:
+                    rows[key(j - N)] = X[j - 1]
+                assert db.update(key(j - N), blob(X[j - 1]))
+
+    t = threading.Thread(target=writer)
+    t.start()
+    assert db.compact(threads=4) is True
+    while t.is_alive():
+        assert db.compact(threads=4) is True
+    t.join()
+
+    def verify(db):
+        for id, x in rows.items():
+            assert floats(db.get(id)) == x, ordinal(id)
+        for i in range(1, N, 5):
+            assert db.get(key(i)) is None
+        cur = db.cursor()
+        n = 0
+        while True:
+            batch = cur.readbatch(1000)
+            if batch is None:
+                break
+            n += len(batch[0])
+        del batch
+        cur.close()
+        assert n == len(rows), (n, len(rows))
+        for q in (X[7], X[N + 5]):
+            check(db.search(blob(q), topk=10, threads=4), "cosine", rows, q, 10)
+            # The indexes were rebuilt over the new file
+            hits = db.search(blob(q), topk=10, nprobe=8)
+            assert all(db.get(id) is not None for id, _ in hits)
+
+    verify(db)
+    db.close()
+
+    assert os.path.getsize(p) < size
+
+    db = embeddings.Embeddings(path=p, dim=dim, mode="a+")
+    verify(db)
+    assert db.compact() is True
+    verify(db)
+
+    # Records another writer appended to the old file would be lost, so a compaction refuses to run
+    # beside one, and nothing opens for writing while it runs; readers are no obstacle.
+    reader = embeddings.Embeddings(path=p, dim=dim, mode="r")
+    other = embeddings.Embeddings(path=p, dim=dim, mode="a+")
+    try:
+        db.compact()
+        assert False, "compacted beside another writer"
+    except RuntimeError:
+        pass
+    other.close()
+    cur = db.cursor()
+    try:
+        db.compact()
+        assert False, "compacted beside an updating cursor"
+    except RuntimeError:
+        pass
+    cur.close()
+    assert db.compact() is True
+    reader.close()
+    verify(db)
+    db.close()
+
+    remove(p)
+
+    print(dim, "ok")
+
+print("\nPass\n")
@@ -0,0 +1,59 @@
+# python examples/test_delete.py: delete appends a tombstone that hides the id everywhere
+
+import embeddings
+from brute import *
+
+dim = 16
+
+for metric in ("cosine", "l2"):
+    p = path("delete")
+
+    X = vectors(3000, dim)
+    rows = {key(i): X[i] for i in range(len(X))}
+
+    db = embeddings.Embeddings(path=p, dim=dim, mode="a+", metric=metric)
+    db.appendbatch(b"".join(rows), blob(sum(X, [])))
+
+    q = X[42]
+    assert bytes(db.search(blob(q), topk=1)[0][0]) == key(42)
+
+    assert db.delete(key(42))
+    assert not db.delete(key(42))
+    assert not db.delete(key(100000))
+    del rows[key(42)]
+
+    assert db.get(key(42)) is None
+    assert not db.update(key(42), blob(q))
+
+    for threads in (1, 4):
+        check(db.search(blob(q), topk=10, threads=threads), metric, rows, q, 10)
+
+    for hits, x in zip(db.searchbatch(blob(X[40] + X[41] + X[42]), topk=5), (X[40], X[41], X[42])):
+        check(hits, metric, rows, x, 5)
+
+    # Deleted, then appended again
+    assert db.delete(key(43))
+    db.append(key(43), blob(X[43]))
+    assert floats(db.get(key(43))) == X[43]
+
+    # Upsert: only the latest version is scored
+    rows[key(44)] = X[0]
+    db.append(key(44), blob(X[0]))
+    check(db.search(blob(X[44]), topk=10, threads=4), metric, rows, X[44], 10)
+
+    db.close()
+
+    # The deletes survive a reopen, with the saved id index and without it
+    for sidecar in (True, False):
+        if not sidecar:
+            os.remove(p + ".ids")
+        db = embeddings.Embeddings(path=p, dim=dim, mode="a+", metric=metric)
+        assert db.get(key(42)) is None and db.get(key(43)) is not None
+        check(db.search(blob(q), topk=10), metric, rows, q, 10)
+        db.close()
+
+    remove(p)
+
+    print(metric, "ok")
+
+print("\nPass\n")
@@ -0,0 +1,55 @@
+# python examples/test_direct.py: direct I/O scans and cursors read what buffered ones do
+
+import embeddings
+from brute import *
+
+for dim in (13, 256):
+    # Next to the build tree: O_DIRECT needs a file system that supports it (not tmpfs)
+    p = path("direct", dir=os.getcwd())
+
+    X = vectors(3000, dim)
+    rows = {}
+    db = embeddings.Embeddings(path=p, dim=dim, mode="a+", direct=True)
+    for i in range(3000):
+        rows[key(i % 2500)] = X[i]
+    db.appendbatch(b"".join(key(i % 2500) for i in range(3000)), blob(sum(X, [])))
+
+    buffered = embeddings.Embeddings(path=p, dim=dim, mode="r")
+    for depth, records in ((1, 1024), (3, 100), (2, 7)):
+        db.readahead(depth=depth, records=records)
+        for threads in (1, 4):
+            hits = db.search(blob(X[17]), topk=10, threshold=-1, threads=threads)
+            check(hits, "cosine", rows, X[17], 10)
+            assert hits == buffered.search(blob(X[17]), topk=10, threshold=-1, threads=threads)
+
+    # A read-only cursor reads through the direct handle
+    direct = embeddings.Embeddings(path=p, dim=dim, mode="r", direct=True)
+    def records(db):
+        out = []
+        cur = db.cursor()
+        while True:
+            rec = cur.read()
+            if rec is None:
+                break
+            out.append((bytes(rec[0]), bytes(rec[1])))
+        cur.close()
+        return out
+    recs = records(direct)
+    assert recs == records(buffered) and len(recs) == 3000
+
+    # Appended after the direct handle was opened, and compacted
+    db.append(key(9999), blob(X[0]))
+    rows[key(9999)] = X[0]
+    check(db.search(blob(X[0]), topk=3, threshold=-1), "cosine", rows, X[0], 3)
+    assert db.compact() is True
+    check(db.search(blob(X[5]), topk=10, threshold=-1), "cosine", rows, X[5], 10)
+
+    direct.close()
+    buffered.close()
+    db.close()
+
+    remove(p)
+
+    print(dim, "ok")
+
+print("\nPass\n")
@@ -0,0 +1,46 @@
+# python examples/test_float16.py: float16 storage rounds each component and searches score the stored values
+
+import os, struct, embeddings
+from brute import *
+
+dim = 40
+
+def half(x):
+    return [struct.unpack("e", struct.pack("e", v))[0] for v in x]
+
+p = path("float16")
+
+X = vectors(2000, dim)
+rows = {key(i): half(X[i]) for i in range(len(X))}
+
+db = embeddings.Embeddings(path=p, dim=dim, mode="a+", dtype="float16")
+for i, x in enumerate(X):
+    db.append(key(i), blob(x))
+assert os.path.getsize(p) < 2000 * dim * 4
+
+# Stored as float16 exactly
+cur = db.cursor()
+while True:
+    rec = cur.read()
+    if rec is None:
+        break
+    assert floats(rec[1]) == rows[bytes(rec[0])]
+cur.close()
+
+for q in (X[3], X[1500], half(X[9])):
+    for threads in (1, 3):
+        check(db.search(blob(q), topk=10, threshold=-1, threads=threads), "cosine", rows, q, 10, tol=1e-3)
+for h, q in zip(db.searchbatch(blob(sum(X[4:9], [])), topk=5, threshold=-1), X[4:9]):
+    check(h, "cosine", rows, q, 5, tol=1e-3)
+
+# An upsert of a hit: the scan scores the latest version of every id again
+rows[key(3)] = half(X[1999])
+db.append(key(3), blob(X[1999]))
+for threads in (1, 3):
+    check(db.search(blob(X[3]), topk=10, threshold=-1, threads=threads), "cosine", rows, X[3], 10, tol=1e-3)
+
+db.close()
+
+remove(p)
+
+print("\nPass\n")
@@ -0,0 +1,76 @@
+# python examples/test_gil.py: searches and appends release the GIL, and concurrent ones stay exact
+
+import sys, threading, embeddings
+from brute import *
+
+dim = 128
+n = 8000
+
+X = vectors(n + 20, dim)
+rows = {key(i): X[i] for i in range(n)}
+
+db = embeddings.Embeddings(path=":temp:", dim=dim, mode="a+")
+db.appendbatch(b"".join(rows), b"".join(blob(x) for x in X[:n]))
+
+# Another Python thread runs while a native search is in flight. With a long
+# switch interval the interpreter never preempts the searching thread, so the
+# ticks counted during a call can only grow if that call drops the GIL
+q = X[n]
+bq = blob(q)
+ticks = 0
+during = []
+done = threading.Event()
+def scan():
+    for _ in range(3):
+        before = ticks
+        db.search(bq, topk=10, threshold=-1)
+        during.append(ticks - before)
+    done.set()
+
+interval = sys.getswitchinterval()
+sys.setswitchinterval(0.25)
+t = threading.Thread(target=scan)
+t.start()
+while not done.is_set():
+    ticks += 1
+t.join()
+sys.setswitchinterval(interval)
+assert max(during) > 0, during
+
+# Concurrent searches on one handle each get the exact top-k
+errors = []
+def search(j):
+    try:
+        for _ in range(5):
+            check(db.search(blob(X[n + j]), topk=10, threshold=-1), "cosine", rows, X[n + j], 10)
+    except Exception as e:
+        errors.append(e)
+
+ts = [threading.Thread(target=search, args=(j,)) for j in range(4)]
+[t.start() for t in ts]
+[t.join() for t in ts]
+assert not errors, errors
+
+# Appends alongside searches: every record lands and the final top-k is exact
+more = vectors(400, dim, seed=7)
+def append(j):
+    try:
+        for i in range(j, 400, 4):
+            db.append(key(n + 100 + i), blob(more[i]))
+    except Exception as e:
+        errors.append(e)
+
+ts = [threading.Thread(target=append, args=(j,)) for j in range(4)]
+ts += [threading.Thread(target=lambda: [db.search(blob(q), topk=10, threshold=-1) for _ in range(5)])]
+[t.start() for t in ts]
+[t.join() for t in ts]
+assert not errors, errors
+
+rows.update({key(n + 100 + i): more[i] for i in range(400)})
+for i in range(400):
+    assert floats(db.get(key(n + 100 + i))) == more[i]
+check(db.search(blob(q), topk=10, threshold=-1), "cosine", rows, q, 10)
+
+db.close()
+
+print("\nPass\n")
@@ -0,0 +1,95 @@
+# python examples/test_groupcommit.py: group commit keeps every durable append and the order of the calls
+
+import threading, embeddings
+from brute import *
+
+dim = 16
+T, PER = 4, 200
+
+p = path("groupcommit")
+
+X = vectors(T * PER + 100, dim)
+
+for delay, batch in ((0, 0), (2000, 0), (1000000, 4)):
+    db = embeddings.Embeddings(path=p, dim=dim, mode="a++")
+    db.groupcommit(max_delay=delay, max_batch=batch)
+
+    def worker(t):
+        for i in range(PER):
+            k = t * PER + i
+            db.append(key(k), blob(X[k]), flush=True)
+
+    threads = [threading.Thread(target=worker, args=(t,)) for t in range(T)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+
+    rows = {key(k): X[k] for k in range(T * PER)}
+    # Durable appends are visible once they return
+    check(db.search(blob(X[5]), topk=10), "cosine", rows, X[5], 10)
+    db.close()
+
+    db = embeddings.Embeddings(path=p, dim=dim, mode="r")
+    cur = db.cursor()
+    seen = {}
+    while True:
+        rec = cur.read()
+        if rec is None:
+            break
+        seen[bytes(rec[0])] = floats(rec[1])
+    cur.close()
+    db.close()
+    assert seen == rows, len(seen)
+
+    print(delay, batch, "ok")
+
+# Queued appends, then delete and update of the same ids: as without group commit
+for enable in (False, True):
+    db = embeddings.Embeddings(path=p, dim=dim, mode="a++")
+    if enable:
+        db.groupcommit(max_delay=1000000)
+    for k in range(10):
+        db.append(key(k), blob(X[k]))
+    assert db.delete(key(3))
+    assert db.update(key(4), blob(X[50]))
+    db.flush()
+    assert db.get(key(3)) is None
+    assert floats(db.get(key(4))) == X[50]
+    assert floats(db.get(key(5))) == X[5]
+    assert len(db.search(blob(X[0]), topk=20, threshold=-1)) == 9
+    db.close()
+
+# Disabling commits what is queued
+db = embeddings.Embeddings(path=p, dim=dim, mode="a++")
+db.groupcommit(max_delay=1000000)
+db.appendbatch(b"".join(key(k) for k in range(100)), blob(sum(X[:100], [])))
+db.groupcommit(enable=False)
+assert len(db.search(blob(X[0]), topk=200, threshold=-1)) == 100
+db.close()
+
+# Turned on and off while other threads append: every record lands once
+remove(p)
+db = embeddings.Embeddings(path=p, dim=dim, mode="a++")
+
+def appender(t):
+    for i in range(PER):
+        k = t * PER + i
+        db.append(key(k), blob(X[k]), flush=(i % 3 == 0))
+
+threads = [threading.Thread(target=appender, args=(t,)) for t in range(T)]
+for t in threads:
+    t.start()
+while any(t.is_alive() for t in threads):
+    db.groupcommit(max_delay=1000)
+    db.groupcommit(max_delay=1000)
+    db.groupcommit(enable=False)
+for t in threads:
+    t.join()
+db.flush()
+assert len(db.search(blob(X[0]), topk=T * PER + 10, threshold=-1)) == T * PER
+db.close()
+
+remove(p)
+
+print("\nPass\n")
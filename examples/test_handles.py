@@ -0,0 +1,50 @@
+# python examples/test_handles.py: a second handle sees the records the first one appends
+
+import embeddings
+from brute import *
+
+dim = 8
+
+p = path("handles")
+
+X = vectors(50, dim)
+
+writer = embeddings.Embeddings(path=p, dim=dim, mode="a+")
+writer.append(key(0), blob(X[0]), flush=True)
+
+reader = embeddings.Embeddings(path=p, dim=dim, mode="r")
+assert reader.get(key(0)) is not None
+assert len(reader.search(blob(X[0]), topk=10)) == 1
+
+for i in range(1, 5):
+    writer.append(key(i), blob(X[i]), flush=True)
+
+rows = {key(i): X[i] for i in range(5)}
+
+for threads in (1, 4):
+    check(reader.search(blob(X[3]), topk=10, threshold=-1, threads=threads), "cosine", rows, X[3], 10)
+assert floats(reader.get(key(4))) == X[4]
+assert all(b is not None for b in reader.getmany(list(rows)))
+
+cur = reader.cursor()
+n = 0
+while cur.read() is not None:
+    n += 1
+cur.close()
+assert n == 5, n
+
+# Deletes and upserts of the writer too
+writer.delete(key(1), flush=True)
+writer.append(key(2), blob(X[10]), flush=True)
+del rows[key(1)]
+rows[key(2)] = X[10]
+assert reader.get(key(1)) is None
+assert floats(reader.get(key(2))) == X[10]
+check(reader.search(blob(X[10]), topk=10, threshold=-1), "cosine", rows, X[10], 10)
+
+reader.close()
+writer.close()
+
+remove(p)
+
+print("\nPass\n")
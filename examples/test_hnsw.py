@@ -0,0 +1,73 @@
+# python examples/test_hnsw.py: the HNSW graph against the brute-force top-k
+
+import os, threading, embeddings
+from brute import *
+
+dim = 16
+
+for metric in ("cosine", "l2"):
+    p = path("hnsw")
+
+    X = vectors(2600, dim)
+    rows = {key(i): X[i] for i in range(1500)}
+
+    db = embeddings.Embeddings(path=p, dim=dim, mode="a+", metric=metric)
+    for id, x in rows.items():
+        db.append(id, blob(x))
+    # Built (and the file mapped) while exhaustive searches run on other threads
+    done = False
+    errors = []
+    def searcher():
+        try:
+            while not done:
+                check(db.search(blob(X[2599]), topk=5, threshold=-1 if metric == "cosine" else 0), metric, rows, X[2599], 5)
+        except AssertionError as e:
+            errors.append(e)
+    ts = [threading.Thread(target=searcher) for _ in range(2)]
+    for t in ts:
+        t.start()
+    db.hnswbuild(M=16, ef_construction=100)
+    done = True
+    for t in ts:
+        t.join()
+    assert not errors, errors
+
+    threshold = -1 if metric == "cosine" else 0
+    Q = X[2500:2510]
+
+    def verify(db, least):
+        r = 0
+        for q in Q:
+            hits = db.search(blob(q), topk=10, threshold=threshold, ef=128)
+            r += recall(hits, metric, rows, q, 10)
+            for id, s in hits:
+                assert abs(score(metric, rows[bytes(id)], q) - s) <= 1e-4 * max(1.0, abs(s))
+        assert r / len(Q) >= least, r / len(Q)
+
+    verify(db, 0.9)
+
+    # Appends are inserted into the graph; upserts and deletes hide the old nodes
+    for i in range(1500, 2000):
+        rows[key(i)] = X[i]
+        db.append(key(i), blob(X[i]))
+    rows[key(1)] = X[2400]
+    db.append(key(1), blob(X[2400]))
+    del rows[key(2)]
+    db.delete(key(2))
+    verify(db, 0.9)
+    assert bytes(db.search(blob(X[2400]), topk=1, threshold=threshold, ef=64)[0][0]) == key(1)
+    assert all(abs(s - score(metric, X[2400], X[1])) <= 1e-4 * max(1.0, abs(s)) for id, s in db.search(blob(X[1]), topk=10, threshold=threshold, ef=64) if bytes(id) == key(1))
+    assert key(2) not in [bytes(id) for id, _ in db.search(blob(X[2]), topk=10, threshold=threshold, ef=64)]
+    db.close()
+
+    # Loaded from <path>.hnsw
+    assert os.path.exists(p + ".hnsw")
+    db = embeddings.Embeddings(path=p, dim=dim, mode="a+")
+    verify(db, 0.9)
+    db.close()
+
+    remove(p)
+
+    print(metric, "ok")
+
+print("\nPass\n")
@@ -0,0 +1,90 @@
+# python examples/test_ids.py: get, getmany and update through the id index
+
+import os, embeddings
+from brute import *
+
+dim = 16
+
+M = (1 << 64) - 1
+
+def collide(id):
+    # Another id with the same 64-bit key in the index (_uiidhash mixes the first half, then adds the second)
+    def mix(x):
+        h = (x + 0x9E3779B97F4A7C15) & M
+        h = ((h ^ (h >> 30)) * 0xBF58476D1CE4E5B9) & M
+        h = ((h ^ (h >> 27)) * 0x94D049BB133111EB) & M
+        return h ^ (h >> 31)
+    p0 = int.from_bytes(id[:8], "little")
+    p1 = int.from_bytes(id[8:], "little")
+    q0 = p0 ^ 0x5A5A
+    q1 = (p1 + mix(p0) - mix(q0)) & M
+    return q0.to_bytes(8, "little") + q1.to_bytes(8, "little")
+
+for dtype in ("float32", "float16", "int8"):
+    p = path("ids")
+
+    X = vectors(3000, dim)
+    rows = {key(i): X[i] for i in range(2000)}
+
+    db = embeddings.Embeddings(path=p, dim=dim, mode="a+", dtype=dtype)
+    db.appendbatch(b"".join(rows), blob(sum(X[:2000], [])))
+
+    def same(b, x):
+        tol = 0 if dtype == "float32" else 0.02 * max(abs(v) for v in x)
+        return b is not None and max(abs(a - v) for a, v in zip(floats(b), x)) <= tol + 1e-6
+
+    # Upserts: the latest version
+    for i in range(0, 2000, 7):
+        rows[key(i)] = X[2000 + i // 7]
+        db.append(key(i), blob(rows[key(i)]))
+
+    # Two ids with the same key are told apart
+    twin = collide(key(5))
+    assert twin != key(5)
+    assert db.get(twin) is None
+    assert not db.update(twin, blob(X[0]))
+    assert not db.delete(twin)
+    rows[twin] = X[2999]
+    db.append(twin, blob(X[2999]))
+    assert same(db.get(twin), X[2999]) and same(db.get(key(5)), rows[key(5)])
+
+    def verify(db):
+        for id in (key(0), key(5), key(7), key(1999), twin):
+            assert same(db.get(id), rows[id]), ordinal(id)
+        assert db.get(key(5000)) is None
+        wanted = [key(i) for i in range(0, 2000, 13)] + [key(3), key(3), twin, key(5000)]
+        got = db.getmany(wanted)
+        assert got[-1] is None
+        for id, b in zip(wanted[:-1], got[:-1]):
+            assert same(b, rows[id]), ordinal(id)
+
+    verify(db)
+
+    # In-place update, then the search and get see it
+    rows[key(11)] = X[2998]
+    assert db.update(key(11), blob(X[2998]), flush=True)
+    assert not db.update(key(5000), blob(X[0]))
+    assert bytes(db.search(blob(X[2998]), topk=1)[0][0]) == key(11)
+    rows[twin] = X[2996]
+    assert db.update(twin, blob(X[2996]))
+    assert same(db.get(twin), X[2996]) and same(db.get(key(5)), rows[key(5)])
+    assert db.delete(twin)
+    del rows[twin]
+    assert db.get(twin) is None and same(db.get(key(5)), rows[key(5)])
+    db.close()
+
+    # With the saved index, and rebuilt without it
+    for sidecar in (True, False):
+        if not sidecar:
+            os.remove(p + ".ids")
+        db = embeddings.Embeddings(path=p, dim=dim, mode="a+", dtype=dtype)
+        rows[twin] = X[2997]
+        db.append(twin, blob(X[2997]))
+        verify(db)
+        db.close()
+
+    remove(p)
+
+    print(dtype, "ok")
+
+print("\nPass\n")
@@ -0,0 +1,42 @@
+# python examples/test_int8.py: int8 storage keeps each vector within half a quantization step
+
+import embeddings
+from brute import *
+
+dim = 48
+
+p = path("int8")
+
+X = vectors(2000, dim)
+X[10] = [0.0] * dim
+
+db = embeddings.Embeddings(path=p, dim=dim, mode="a+", dtype="int8")
+for i, x in enumerate(X):
+    db.append(key(i), blob(x))
+
+# The stored vectors, as searches score them
+rows = {}
+cur = db.cursor()
+while True:
+    rec = cur.read()
+    if rec is None:
+        break
+    rows[bytes(rec[0])] = floats(rec[1])
+cur.close()
+assert len(rows) == len(X)
+for i in (0, 10, 1999):
+    x = rows[key(i)]
+    step = max(abs(v) for v in X[i]) / 127
+    assert all(abs(a - b) <= step / 2 + 1e-6 for a, b in zip(x, X[i])), i
+
+for q in (X[3], X[1500], vectors(1, dim, seed=7)[0]):
+    for threads in (1, 4):
+        check(db.search(blob(q), topk=10, threshold=-1, threads=threads), "cosine", rows, q, 10, tol=1e-3)
+for h, q in zip(db.searchbatch(blob(sum(X[4:9], [])), topk=5, threshold=-1), X[4:9]):
+    check(h, "cosine", rows, q, 5, tol=1e-3)
+
+db.close()
+
+remove(p)
+
+print("\nPass\n")
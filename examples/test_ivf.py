@@ -0,0 +1,57 @@
+# python examples/test_ivf.py: the IVF index against the brute-force top-k
+
+import os, embeddings
+from brute import *
+
+dim = 16
+
+for metric in ("cosine", "l2"):
+    p = path("ivf")
+
+    X = vectors(3000, dim)
+    rows = {key(i): X[i] for i in range(2000)}
+
+    db = embeddings.Embeddings(path=p, dim=dim, mode="a+", metric=metric)
+    for id, x in rows.items():
+        db.append(id, blob(x))
+    db.ivfbuild(nlist=16)
+
+    threshold = -1 if metric == "cosine" else 0
+    Q = X[2900:2910]
+
+    # Every list probed: exact
+    for q in Q:
+        check(db.search(blob(q), topk=10, threshold=threshold, nprobe=16), metric, rows, q, 10)
+
+    # A few lists: most of the top-k, with exact scores
+    r = 0
+    for q in Q:
+        hits = db.search(blob(q), topk=10, threshold=threshold, nprobe=4)
+        r += recall(hits, metric, rows, q, 10)
+        for id, s in hits:
+            assert abs(score(metric, rows[bytes(id)], q) - s) <= 1e-4 * max(1.0, abs(s))
+    assert r / len(Q) >= 0.7, r / len(Q)
+
+    # The unindexed tail, upserts and deletes
+    for i in range(2000, 2500):
+        rows[key(i)] = X[i]
+        db.append(key(i), blob(X[i]))
+    rows[key(1)] = X[2600]
+    db.append(key(1), blob(X[2600]))
+    del rows[key(2)]
+    db.delete(key(2))
+    for q in Q + [X[2600], X[1], X[2]]:
+        check(db.search(blob(q), topk=10, threshold=threshold, nprobe=16), metric, rows, q, 10)
+    db.close()
+
+    # Loaded from <path>.ivf
+    assert os.path.exists(p + ".ivf")
+    db = embeddings.Embeddings(path=p, dim=dim, mode="r")
+    check(db.search(blob(Q[0]), topk=10, threshold=threshold, nprobe=16), metric, rows, Q[0], 10)
+    db.close()
+
+    remove(p)
+
+    print(metric, "ok")
+
+print("\nPass\n")
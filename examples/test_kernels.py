@@ -0,0 +1,28 @@
+# python examples/test_kernels.py: the kernels of every SIMD level at dimensions that leave a remainder
+
+import os, subprocess, sys, embeddings
+from brute import *
+
+if len(sys.argv) == 1:
+    # One process per level: the kernels are picked once, when the module loads
+    for level in ("scalar", "sse42", "avx2", "avx512"):
+        subprocess.run([sys.executable, __file__, level], env=dict(os.environ, EMBEDDINGS_SIMD=level), check=True)
+    print("\nPass\n")
+    sys.exit(0)
+
+for dim in (1, 3, 7, 8, 15, 17, 33, 100, 257, 769):
+    X = vectors(300, dim, seed=dim)
+    rows = {key(i): X[i] for i in range(250)}
+
+    db = embeddings.Embeddings(path=":temp:", dim=dim, mode="a+")
+    for id, x in rows.items():
+        db.append(id, blob(x))
+
+    for q in X[250:253]:
+        check(db.search(blob(q), topk=5, threshold=-1), "cosine", rows, q, 5)
+    # Four queries go through the blocked kernel, the fifth through the plain dot
+    for h, q in zip(db.searchbatch(blob(sum(X[253:258], [])), topk=5, threshold=-1), X[253:258]):
+        check(h, "cosine", rows, q, 5)
+    db.close()
+
+print(sys.argv[1], "ok")
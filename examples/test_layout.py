@@ -0,0 +1,27 @@
+# python examples/test_layout.py: version 3 records are id + blob + norm + operation, padded to 64 bytes
+
+import os, struct, embeddings
+from brute import *
+
+for dim, dtype, stride in ((768, "float32", 3136), (1536, "float16", 3136), (5, "float32", 64), (100, "int8", 128)):
+    p = path("layout")
+
+    X = vectors(40, dim)
+    rows = {key(i): X[i] for i in range(len(X))}
+
+    db = embeddings.Embeddings(path=p, dim=dim, mode="a+", dtype=dtype)
+    for id, x in rows.items():
+        db.append(id, blob(x))
+    db.flush()
+    assert os.path.getsize(p) == 4096 + len(X) * stride, (dim, dtype, os.path.getsize(p))
+    if dtype == "float32":
+        check(db.search(blob(X[0]), topk=5, threshold=-1), "cosine", rows, X[0], 5)
+    db.close()
+
+    with open(p, "rb") as f:
+        version, = struct.unpack_from("<I", f.read(20), 16)
+    assert version == 3, version
+
+    remove(p)
+
+print("\nPass\n")
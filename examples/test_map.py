@@ -0,0 +1,37 @@
+# python examples/test_map.py: searches over the memory-mapped file
+
+import embeddings
+from brute import *
+
+dim = 32
+
+p = path("map")
+
+X = vectors(3000, dim)
+rows = {key(i): X[i] for i in range(2000)}
+
+db = embeddings.Embeddings(path=p, dim=dim, mode="a+")
+for id, x in rows.items():
+    db.append(id, blob(x))
+
+db.map(sequential=True, willneed=True)
+for q in (X[0], X[1999], X[2500]):
+    for threads in (1, 4):
+        check(db.search(blob(q), topk=10, threshold=-1, threads=threads), "cosine", rows, q, 10)
+
+# Appended after the mapping: read past its end
+for i in range(2000, 3000):
+    rows[key(i)] = X[i]
+    db.append(key(i), blob(X[i]))
+check(db.search(blob(X[2500]), topk=10, threshold=-1), "cosine", rows, X[2500], 10)
+
+# Mapped again, and back to reads
+db.map()
+check(db.search(blob(X[2999]), topk=5), "cosine", rows, X[2999], 5)
+db.unmap()
+check(db.search(blob(X[2999]), topk=5), "cosine", rows, X[2999], 5)
+db.close()
+
+remove(p)
+
+print("\nPass\n")
@@ -0,0 +1,51 @@
+# python examples/test_metrics.py: cosine, inner product, L2 and L1 against their definitions
+
+import array, embeddings
+from brute import *
+
+dim = 20
+
+X = vectors(2500, dim)
+# Norms from 0.2 to 3, so that the inner product and cosine disagree
+X = [[v * (0.2 + 2.8 * (i % 11) / 10) for v in x] for i, x in enumerate(X)]
+X = [array.array("f", x).tolist() for x in X]
+
+for metric in ("cosine", "ip", "l2", "l1"):
+    p = path("metrics")
+
+    rows = {key(i): X[i] for i in range(2000)}
+
+    db = embeddings.Embeddings(path=p, dim=dim, mode="a+", metric=metric)
+    for id, x in rows.items():
+        db.append(id, blob(x))
+
+    threshold = -1 if metric == "cosine" else -1e30
+    for q in (X[2000], X[2100], X[17]):
+        for threads in (1, 4):
+            check(db.search(blob(q), topk=10, threshold=threshold, threads=threads), metric, rows, q, 10)
+
+    # The threshold is the smallest score, or for distances the largest distance, returned
+    ref = topk(metric, rows, X[2000], 10)
+    limit = ref[4][1] + (1e-4 if metric in ("l2", "l1") else -1e-4) * max(1.0, abs(ref[4][1]))
+    hits = db.search(blob(X[2000]), topk=10, threshold=limit)
+    assert [bytes(id) for id, _ in hits] == [id for id, _ in ref[:5]], hits
+
+    # An upsert retires the hit of the older version
+    rows[key(17)] = X[2200]
+    db.append(key(17), blob(X[2200]))
+    for threads in (1, 4):
+        check(db.search(blob(X[17]), topk=10, threshold=threshold, threads=threads), metric, rows, X[17], 10)
+        check(db.search(blob(X[2200]), topk=10, threshold=threshold, threads=threads), metric, rows, X[2200], 10)
+
+    db.close()
+
+    # The metric is stored in the file
+    db = embeddings.Embeddings(path=p, dim=dim, mode="r")
+    check(db.search(blob(X[2300]), topk=5, threshold=threshold), metric, rows, X[2300], 5)
+    db.close()
+
+    remove(p)
+
+    print(metric, "ok")
+
+print("\nPass\n")
@@ -0,0 +1,60 @@
+# python examples/test_norms.py: the norms stored with the records follow every write
+
+import embeddings
+from brute import *
+
+dim = 16
+
+p = path("norms")
+
+X = vectors(600, dim)
+rows = {key(i): X[i] for i in range(500)}
+
+db = embeddings.Embeddings(path=p, dim=dim, mode="a+")
+for id, x in rows.items():
+    db.append(id, blob(x))
+
+def dot(x, q):
+    # norm=False: neither side is normalized
+    return sum(a * b for a, b in zip(x, q))
+
+def verify():
+    for q in (X[500], X[501]):
+        check(db.search(blob(q), topk=10, threshold=-1), "cosine", rows, q, 10)
+        hits = db.search(blob(q), topk=10, threshold=-1e30, norm=False)
+        ref = sorted(((id, dot(x, q)) for id, x in rows.items()), key=lambda s: -s[1])[:10]
+        assert [bytes(id) for id, _ in hits] == [id for id, _ in ref]
+        for (_, s), (_, want) in zip(hits, ref):
+            assert abs(s - want) <= 1e-4 * max(1.0, abs(want))
+
+verify()
+
+# cursor update rewrites the norm with the vector
+rows[key(3)] = [v * 10 for v in X[502]]
+rows[key(4)] = [v * 0.1 for v in X[503]]
+cur = db.cursor()
+while True:
+    rec = cur.read()
+    if rec is None:
+        break
+    if bytes(rec[0]) in (key(3), key(4)):
+        cur.update(rec[0], blob(rows[bytes(rec[0])]))
+cur.close()
+verify()
+assert bytes(db.search(blob(X[502]), topk=1)[0][0]) == key(3)
+assert bytes(db.search(blob(X[503]), topk=1)[0][0]) == key(4)
+
+# A zero vector has no direction: never a hit
+rows[key(5)] = [0.0] * dim
+db.append(key(5), blob(rows[key(5)]))
+assert key(5) not in [bytes(id) for id, _ in db.search(blob(X[0]), topk=500, threshold=-1)]
+del rows[key(5)]
+db.close()
+
+db = embeddings.Embeddings(path=p, dim=dim, mode="r")
+verify()
+db.close()
+
+remove(p)
+
+print("\nPass\n")
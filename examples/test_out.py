@@ -0,0 +1,66 @@
+# python examples/test_out.py: hits written into caller buffers and cursor records as views
+
+import array, struct, embeddings
+from brute import *
+
+dim = 12
+
+X = vectors(600, dim)
+rows = {key(i): X[i] for i in range(500)}
+
+db = embeddings.Embeddings(path=":temp:", dim=dim, mode="a+")
+
+# A 2-D buffer of vectors with the ids of its rows
+flat = array.array("f", sum(X[:500], []))
+db.append(b"".join(rows), memoryview(flat).cast("B").cast("f", (500, dim)))
+assert floats(db.get(key(499))) == X[499]
+
+SCORE = struct.Struct("<16sf")
+
+def unpack(buff, n, offset=0):
+    return [SCORE.unpack_from(buff, offset + i * SCORE.size) for i in range(n)]
+
+# search(out=): the count, and the hits of search() in the buffer
+q = X[500]
+hits = db.search(blob(q), topk=10, threshold=-1)
+check(hits, "cosine", rows, q, 10)
+out = bytearray(10 * SCORE.size)
+n = db.search(blob(q), topk=10, threshold=-1, out=out)
+assert n == 10
+assert [(id, s) for id, s in unpack(out, n)] == [(bytes(id), struct.unpack("f", struct.pack("f", s))[0]) for id, s in hits]
+
+try:
+    db.search(blob(q), topk=10, out=bytearray(5 * SCORE.size))
+    assert False, "out too small"
+except ValueError:
+    pass
+try:
+    db.search(blob(q), topk=10, out=bytes(10 * SCORE.size))
+    assert False, "out read-only"
+except (TypeError, BufferError):
+    pass
+
+# searchbatch(out=): rows of topk records and the count of each
+outb = bytearray(3 * 10 * SCORE.size)
+counts = db.searchbatch(blob(X[501] + X[502] + X[503]), topk=10, threshold=-1, out=outb)
+assert counts == [10, 10, 10]
+for j, x in enumerate(X[501:504]):
+    got = unpack(outb, counts[j], j * 10 * SCORE.size)
+    check(got, "cosine", rows, x, 10)
+
+# read(copy=False): views of the cursor's buffer, which hold the cursor open
+cur = db.cursor()
+id, vec = cur.read(copy=False)
+assert vec.format == "f" and len(vec) == dim
+assert id.tobytes() == key(0) and vec.tolist() == X[0]
+try:
+    cur.close()
+    assert False, "closed under a view"
+except BufferError:
+    pass
+del id, vec
+cur.close()
+
+db.close()
+
+print("\nPass\n")
@@ -0,0 +1,62 @@
+# python examples/test_posix.py: create, append, reopen and scan a file on disk
+
+import embeddings
+from brute import *
+
+dim = 24
+
+p = path("posix")
+
+X = vectors(300, dim)
+rows = {key(i): X[i] for i in range(len(X))}
+
+db = embeddings.Embeddings(path=p, dim=dim, mode="a+")
+for i in range(200):
+    db.append(key(i), blob(X[i]))
+db.flush()
+db.close()
+
+print("Reopening...")
+
+# a+ keeps the records and appends after them
+db = embeddings.Embeddings(path=p, dim=dim, mode="a+")
+for i in range(200, 300):
+    db.append(key(i), blob(X[i]))
+db.close()
+
+db = embeddings.Embeddings(path=p, dim=dim, mode="r")
+
+cur = db.cursor()
+n = 0
+while True:
+    rec = cur.read()
+    if rec is None:
+        break
+    assert bytes(rec[0]) == key(n)
+    assert floats(rec[1]) == X[n]
+    n += 1
+cur.close()
+assert n == len(X), n
+
+for i in (0, 7, 299):
+    check(db.search(blob(X[i]), topk=5), "cosine", rows, X[i], 5)
+    assert bytes(db.search(blob(X[i]), topk=1)[0][0]) == key(i)
+
+# r does not write
+try:
+    db.append(key(300), blob(X[0]))
+    assert False, "append on a read-only file"
+except Exception:
+    pass
+
+db.close()
+
+# a++ truncates
+db = embeddings.Embeddings(path=p, dim=dim, mode="a++")
+db.append(key(0), blob(X[0]))
+assert len(db.search(blob(X[0]), topk=10)) == 1
+db.close()
+
+remove(p)
+
+print("\nPass\n")
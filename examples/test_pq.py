@@ -0,0 +1,56 @@
+# python examples/test_pq.py: product quantization with rerank against the brute-force top-k
+
+import os, embeddings
+from brute import *
+
+dim = 32
+
+for metric in ("cosine", "l2"):
+    p = path("pq")
+
+    X = vectors(3000, dim)
+    rows = {key(i): X[i] for i in range(2000)}
+
+    db = embeddings.Embeddings(path=p, dim=dim, mode="a+", metric=metric)
+    for id, x in rows.items():
+        db.append(id, blob(x))
+    db.pqbuild(M=8, nbits=4)
+
+    threshold = -1 if metric == "cosine" else 0
+    Q = X[2900:2910]
+
+    def verify(db):
+        r = 0
+        for q in Q:
+            # Every record reranked: exact
+            check(db.search(blob(q), topk=10, threshold=threshold, pq=True, rerank=len(rows) + 100), metric, rows, q, 10)
+            hits = db.search(blob(q), topk=10, threshold=threshold, pq=True, rerank=200)
+            r += recall(hits, metric, rows, q, 10)
+            for id, s in hits:
+                assert abs(score(metric, rows[bytes(id)], q) - s) <= 1e-4 * max(1.0, abs(s))
+        assert r / len(Q) >= 0.8, r / len(Q)
+
+    verify(db)
+
+    # Records appended after the build, upserts and deletes
+    for i in range(2000, 2300):
+        rows[key(i)] = X[i]
+        db.append(key(i), blob(X[i]))
+    rows[key(1)] = X[2600]
+    db.append(key(1), blob(X[2600]))
+    del rows[key(2)]
+    db.delete(key(2))
+    verify(db)
+    db.close()
+
+    # Loaded from <path>.pq
+    assert os.path.exists(p + ".pq")
+    db = embeddings.Embeddings(path=p, dim=dim, mode="r")
+    verify(db)
+    db.close()
+
+    remove(p)
+
+    print(metric, "ok")
+
+print("\nPass\n")
@@ -0,0 +1,54 @@
+# python examples/test_readahead.py: the scan gives the same hits at every read-ahead depth and buffer size
+
+import threading, embeddings
+from brute import *
+
+dim = 13
+
+p = path("readahead")
+
+X = vectors(5000, dim)
+rows = {}
+db = embeddings.Embeddings(path=p, dim=dim, mode="a+")
+for i in range(4000):
+    rows[key(i % 3000)] = X[i]
+db.appendbatch(b"".join(key(i % 3000) for i in range(4000)), blob(sum(X[:4000], [])))
+del rows[key(10)]
+db.delete(key(10))
+
+for depth, records in ((1, 1024), (2, 7), (3, 100), (8, 1), (4, 4096)):
+    db.readahead(depth=depth, records=records)
+    for threads in (1, 3):
+        for q in (X[4500], X[10]):
+            check(db.search(blob(q), topk=10, threshold=-1, threads=threads), "cosine", rows, q, 10)
+    for h, q in zip(db.searchbatch(blob(X[4501] + X[4502]), topk=5, threshold=-1), X[4501:4503]):
+        check(h, "cosine", rows, q, 5)
+    print(depth, records, "ok")
+
+# Changed while searches run on other threads
+stop = False
+errors = []
+def searcher():
+    try:
+        while not stop:
+            check(db.search(blob(X[4504]), topk=10, threshold=-1, threads=2), "cosine", rows, X[4504], 10)
+    except AssertionError as e:
+        errors.append(e)
+ts = [threading.Thread(target=searcher) for _ in range(3)]
+for t in ts:
+    t.start()
+for depth, records in ((1, 1024), (8, 1), (4, 4096), (2, 7)) * 5:
+    db.readahead(depth=depth, records=records)
+stop = True
+for t in ts:
+    t.join()
+assert not errors, errors
+
+# Back to the defaults
+db.readahead()
+check(db.search(blob(X[4503]), topk=10, threshold=-1), "cosine", rows, X[4503], 10)
+db.close()
+
+remove(p)
+
+print("\nPass\n")
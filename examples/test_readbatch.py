@@ -0,0 +1,62 @@
+# python examples/test_readbatch.py: readbatch returns the records read() does, many per call
+
+import embeddings
+from brute import *
+
+dim = 10
+
+for dtype in ("float32", "float16", "int8"):
+    p = path("readbatch")
+
+    X = vectors(2100, dim)
+    db = embeddings.Embeddings(path=p, dim=dim, mode="a+", dtype=dtype)
+    db.appendbatch(b"".join(key(i) for i in range(2000)), blob(sum(X[:2000], [])))
+    # Tombstones are stepped over, upserts read as they are in the file
+    db.delete(key(5))
+    db.append(key(6), blob(X[2000]))
+
+    def reads(db):
+        out = []
+        cur = db.cursor()
+        while True:
+            rec = cur.read()
+            if rec is None:
+                break
+            out.append((bytes(rec[0]), floats(rec[1])))
+        cur.close()
+        return out
+
+    expect = reads(db)
+    assert len(expect) == 2001, len(expect)
+
+    for n in (1, 7, 1000, 5000):
+        got = []
+        cur = db.cursor()
+        while True:
+            batch = cur.readbatch(n)
+            if batch is None:
+                break
+            ids, vecs = batch
+            assert ids.shape[1] == 16 and vecs.shape == (len(ids), dim) and 0 < len(ids) <= n
+            raw, flat = ids.tobytes(), floats(vecs.tobytes())
+            got += [(raw[i * 16:(i + 1) * 16], flat[i * dim:(i + 1) * dim]) for i in range(len(ids))]
+            del ids, vecs, batch
+        # Mixed with read() and after reset
+        cur.reset()
+        first = cur.read()
+        assert bytes(first[0]) == expect[0][0]
+        del first
+        batch = cur.readbatch(3)
+        raw = batch[0].tobytes()
+        assert [raw[i * 16:(i + 1) * 16] for i in range(3)] == [e[0] for e in expect[1:4]]
+        del batch
+        cur.close()
+        assert got == expect, n
+
+    db.close()
+
+    remove(p)
+
+    print(dtype, "ok")
+
+print("\nPass\n")
@@ -0,0 +1,60 @@
+# python examples/test_threads.py: the chunks of a multi-threaded search merge into the exact top-k
+
+import embeddings
+from brute import *
+
+dim = 16
+
+p = path("threads")
+
+X = vectors(4000, dim)
+rows = {}
+
+# A thread scans at least one read buffer (1024 records): up to 4 chunks
+db = embeddings.Embeddings(path=p, dim=dim, mode="a+")
+for i in range(2000):
+    rows[key(i)] = X[i]
+    db.append(key(i), blob(X[i]))
+
+# Upserts in later chunks: the earlier versions scored best, the new ones worst
+q = X[0]
+ranked = [bytes(id) for id, _ in topk("cosine", rows, q, 20)]
+for j, id in enumerate(ranked[:10]):
+    x = [-v for v in q] if j % 2 else X[2000 + j]
+    rows[id] = x
+    db.append(id, blob(x))
+for i in range(2010, 4000):
+    rows[key(i)] = X[i]
+    db.append(key(i), blob(X[i]))
+
+for threads in (1, 2, 3, 4, 8, 0):
+    for k in (1, 5, 20):
+        check(db.search(blob(q), topk=k, threshold=-1, threads=threads), "cosine", rows, q, k)
+    for x in (X[1], X[2500]):
+        check(db.search(blob(x), topk=10, threads=threads), "cosine", rows, x, 10)
+
+db.close()
+
+# A and B best in the first chunk, A upserted to a poor version in the last one. Each chunk cuts
+# its hits to topk, so B must not have been left out of it for the stale A; with one thread, the
+# poor A retires the good one after B was turned away.
+db = embeddings.Embeddings(path=p, dim=dim, mode="a++")
+A = [1.0] * dim
+B = [1.0] * (dim - 1) + [0.5]
+rows = {key(0): A, key(1): B}
+db.append(key(0), blob(A))
+db.append(key(1), blob(B))
+for i in range(2, 2000):
+    rows[key(i)] = [-abs(v) for v in X[i]]
+    db.append(key(i), blob(rows[key(i)]))
+rows[key(0)] = [-1.0] * dim
+db.append(key(0), blob(rows[key(0)]))
+for threads in (1, 2, 4):
+    hits = db.search(blob(A), topk=1, threshold=-1, threads=threads)
+    assert bytes(hits[0][0]) == key(1), (threads, hits)
+    check(db.search(blob(A), topk=3, threshold=-1, threads=threads), "cosine", rows, A, 3)
+db.close()
+
+remove(p)
+
+print("\nPass\n")
@@ -0,0 +1,42 @@
+# python examples/test_topk.py: the bounded top-k heap and its id table
+
+import embeddings
+from brute import *
+
+dim = 8
+
+X = vectors(1200, dim)
+
+db = embeddings.Embeddings(path=":temp:", dim=dim, mode="a+")
+
+# Fewer records than topk
+rows = {key(i): X[i] for i in range(5)}
+for id, x in rows.items():
+    db.append(id, blob(x))
+check(db.search(blob(X[0]), topk=50, threshold=-1), "cosine", rows, X[0], 50)
+
+# Many versions of a few ids: each id once, with its latest vector
+for r in range(200):
+    i = r % 5
+    rows[key(i)] = X[5 + r]
+    db.append(key(i), blob(X[5 + r]))
+for k in (1, 3, 5, 50):
+    hits = db.search(blob(X[1000]), topk=k, threshold=-1)
+    assert len({bytes(id) for id, _ in hits}) == len(hits)
+    check(hits, "cosine", rows, X[1000], k)
+
+# topk from 1 to every record, including hits that replace the heap's root over and over
+for i in range(5, 1000):
+    rows[key(i)] = X[i]
+    db.append(key(i), blob(X[i]))
+for k in (1, 2, 10, 100, 999, 1000, 5000):
+    check(db.search(blob(X[1001]), topk=k, threshold=-1), "cosine", rows, X[1001], k)
+
+# The threshold cuts the heap short
+ref = topk("cosine", rows, X[1002], 1000)
+hits = db.search(blob(X[1002]), topk=1000, threshold=0.5)
+assert len(hits) == sum(1 for _, s in ref if s >= 0.5), len(hits)
+
+db.close()
+
+print("\nPass\n")
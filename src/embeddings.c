@@ -1,18 +1,61 @@
 #define EMBEDDINGS_C
 
-#if !defined(_WIN64)
+#if !defined(_WIN64) && !(defined(__SIZEOF_POINTER__) && __SIZEOF_POINTER__ == 8)
 #error "Only 64-bit builds are supported."
 #endif
 
+#if !defined(_WIN32)
+#define _GNU_SOURCE
+#endif
+
 #include "embeddings.h"
 #include <assert.h>
 #include <time.h>
 #include <math.h>
+#include <stddef.h>
+
+#if !defined(_WIN32)
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
 
-#define VERSION 1
+/*
+    1: records are id + blob padded to a power of two (or the page size).
+    2: records are id + blob + norm padded to 64 bytes only, see _recsize.
+    3: records are id + blob + norm + operation (RECORDOP) padded to 64 bytes.
+*/
+#define VERSION 3
+#define RECALIGN 64
 
 #define __alignup(x,a)  (((x) + ((a) - 1)) & ~((a) - 1))
 
+#if !defined(_WIN32)
+typedef int errno_t;
+#define __forceinline inline __attribute__((always_inline))
+#define __cdecl
+#define GetLastError() ((DWORD)errno)
+#define localtime_s(ptm, pt) localtime_r((pt), (ptm))
+static inline void* _aligned_malloc(size_t size, size_t alignment) {
+    void* p = NULL;
+    if (alignment < sizeof(void*)) alignment = sizeof(void*);
+    return posix_memalign(&p, alignment, size) == 0 ? p : NULL;
+}
+static inline void _aligned_free(void* p) {
+    free(p);
+}
+static inline errno_t memcpy_s(void* dst, size_t dstSize, const void* src, size_t count) {
+    if (!dst || !src) return EINVAL;
+    if (count > dstSize) return ERANGE;
+    memcpy(dst, src, count);
+    return 0;
+}
+#endif
+
 #if !defined(DEBUGGING)
 #define _dbglog(...) ((void)0)
 #endif
@@ -35,562 +78,8138 @@
 
 #define MAXHEAD 4096
 #define MAXBLOB 65536
+#define SCAN_RECORDS 1024 /* records per read buffer of the scan (see filesetreadahead) */
+#define SCAN_DEPTH 2 /* read buffers in flight per scan thread */
+#define SCAN_MAXBYTES (1u << 30) /* largest read-ahead per scan thread, depth x buffer */
+#define DIRECT_ALIGN 4096 /* offset, length and buffer alignment of direct reads (see filesetdirect) */
+#define DIRECT_WINDOW (1u << 20) /* bytes a direct cursor reads at a time */
+#define CURSOR_BATCH (8u << 20) /* largest read of cursorreadbatch, in bytes (at least one record) */
 
-static inline uint32_t powoftwo(uint32_t x)
+/* Stored bytes of one vector of dim components. */
+static inline uint32_t _vecsize(uint8_t dtype, uint32_t dim)
 {
-    if (x == 0) return 1;
-    x--;
-    x |= x >> 1;
-    x |= x >> 2;
-    x |= x >> 4;
-    x |= x >> 8;
-    x |= x >> 16;
-    x++;
-    return x;
+    switch (dtype) {
+    case DTYPE_FLOAT16: return dim * 2;
+    case DTYPE_INT8: return (uint32_t)sizeof(float) + dim;
+    default: return dim * (uint32_t)sizeof(float);
+    }
 }
 
-EMBEDDINGS_API Embeddings* EMBEDDINGS_CALL fileopen(
-    const wchar_t* pwszpath, DWORD dwAccess, DWORD dwCreationDisposition, uint32_t dwBlobSize)
+/*
+    Bytes per record on disk. Version 2 records always reserve the norm slot (HEADER_NORMS) and
+    are padded to RECALIGN, the cache line and widest SIMD register size, instead of a power of two.
+*/
+static inline uint32_t _recsize(const FileHeader* header)
 {
-	Embeddings* db = malloc(sizeof(Embeddings));
-    _dbglog(">> fileopen(path='%ls' blob=%u access=0x%08X, disposition=0x%08X);\n", pwszpath, dwBlobSize, dwAccess, dwCreationDisposition);
-    memset(db, 0, sizeof(*db));
-    DWORD flags;
-    assert(PATH >= MAX_PATH);
-    if (!pwszpath || wcscmp(pwszpath, L":temp:") == 0) {
-        wchar_t userTempFolder[PATH];
-        GetTempPathW(PATH, userTempFolder);
-        if (!GetTempFileNameW(userTempFolder, L"embeddings", 0, db->wszPath)) {
-            free(db);
-            fprintf(stderr, "Failed to create a temporary file name: %lu\n", GetLastError());
-            return NULL;
-        }
-        flags = FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE | FILE_FLAG_SEQUENTIAL_SCAN;
-		dwCreationDisposition = CREATE_ALWAYS;
-        dwAccess = FILE_READ_DATA | FILE_APPEND_DATA | FILE_WRITE_DATA;
-		pwszpath = db->wszPath;
-    } else {
-        if (!GetFullPathNameW(pwszpath, PATH, db->wszPath, NULL)) {
-            free(db);
-            fprintf(stderr, "GetFullPathNameW failed: %lu\n", GetLastError());
-            return NULL;
+    uint32_t cb = (uint32_t)sizeof(uiid) + header->blobSize;
+    if (header->version >= 2) cb += (uint32_t)sizeof(float);
+    if (header->version >= 3) cb += (uint32_t)sizeof(uint32_t);
+    return __alignup(cb, header->alignment);
+}
+
+/* RECORDOP of a record, stored after its norm. Records before version 3 are all RECORD_ADD. */
+static inline uint32_t _recop(const FileHeader* header, const uint8_t* rec)
+{
+    if (header->version < 3) return RECORD_ADD;
+    uint32_t op;
+    memcpy(&op, rec + sizeof(uiid) + header->blobSize + sizeof(float), sizeof(op));
+    return op;
+}
+
+/* Number of components per vector. */
+static inline uint32_t _vecdim(const FileHeader* header)
+{
+    switch (header->dtype) {
+    case DTYPE_FLOAT16: return header->blobSize / 2;
+    case DTYPE_INT8: return header->blobSize >= sizeof(float) ? header->blobSize - (uint32_t)sizeof(float) : 0;
+    default: return header->blobSize / (uint32_t)sizeof(float);
+    }
+}
+
+/*
+    Portable file I/O.
+
+    Record reads and in-place writes are positional (ReadFile/WriteFile with an OVERLAPPED offset on Windows,
+    pread/pwrite on POSIX) so that searches and cursors never share a file pointer with the appending handle.
+*/
+
+#if !defined(_WIN32)
+#define _fd(h) ((int)(intptr_t)(h))
+#define _handle(fd) ((HANDLE)(intptr_t)(fd))
+#endif
+
+#if !defined(_WIN32)
+/*
+    Embeddings is packed, so wszPath is not wchar_t aligned. glibc's vectorized wide string
+    routines assume alignment, so paths are only ever converted through aligned local copies.
+*/
+static BOOL _iowcstombs(char* dst, size_t cb, const wchar_t* src)
+{
+    wchar_t wsz[PATH];
+    size_t n = 0;
+    do {
+        if (n >= PATH) {
+            errno = ENAMETOOLONG;
+            return FALSE;
         }
-        flags = FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN;
-        pwszpath = db->wszPath;
+        memcpy(&wsz[n], (const uint8_t*)src + n * sizeof(wchar_t), sizeof(wchar_t));
+    } while (wsz[n++] != L'\0');
+    size_t len = wcstombs(dst, wsz, cb);
+    if (len == (size_t)-1 || len >= cb) {
+        errno = len == (size_t)-1 ? EILSEQ : ENAMETOOLONG;
+        return FALSE;
     }
-    _dbglog("path='%ls' blob=%u access=0x%08X, disposition=0x%08X\n",
-        pwszpath,
-        dwBlobSize,
-        dwAccess,
-        dwCreationDisposition);
-    GetSystemInfo(&db->os);
-    db->os.dwPageSize = db->os.dwPageSize ? db->os.dwPageSize : 4096;
-    db->os.dwAllocationGranularity = db->os.dwAllocationGranularity ? db->os.dwAllocationGranularity : 65536;
-	if (dwBlobSize > MAXBLOB) {
-        free(db);
-        fprintf(stderr, "The specified blob size %lu is invalid. Maximum blob size is %lu.\n", dwBlobSize, MAXBLOB);
-        return NULL;
+    return TRUE;
+}
+
+static BOOL _iombstowcs(wchar_t* dst, const char* src)
+{
+    wchar_t wsz[PATH];
+    size_t len = mbstowcs(wsz, src, PATH);
+    if (len == (size_t)-1 || len >= PATH) {
+        errno = len == (size_t)-1 ? EILSEQ : ENAMETOOLONG;
+        return FALSE;
     }
-    if (dwBlobSize > 0) {
-        if ((dwBlobSize % sizeof(float)) != 0) {
-            free(db);
-            fprintf(stderr, "Blob size must be a multiple of %zu (size of float32).\n", sizeof(float));
-            return NULL;
-        }
+    memcpy(dst, wsz, (len + 1) * sizeof(wchar_t));
+    return TRUE;
+}
+#endif
+
+static BOOL _iotemppath(wchar_t* pwszpath)
+{
+#if defined(_WIN32)
+    wchar_t userTempFolder[PATH];
+    GetTempPathW(PATH, userTempFolder);
+    return GetTempFileNameW(userTempFolder, L"embeddings", 0, pwszpath) != 0;
+#else
+    const char* dir = getenv("TMPDIR");
+    char path[PATH];
+    if (!dir || !*dir) dir = "/tmp";
+    if (snprintf(path, sizeof(path), "%s/embeddingsXXXXXX", dir) >= (int)sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return FALSE;
     }
-    memset(&db->header, 0, sizeof(db->header));
-    static const char kMagic[] = "EMBEDDINGS";
-    memcpy(db->header.magic, kMagic,
-        (sizeof(kMagic) - 1 < sizeof(db->header.magic))
-        ? (sizeof(kMagic) - 1)
-        : sizeof(db->header.magic));
-    db->header.version = VERSION;
-    db->header.size = sizeof(FileHeader);
-    db->header.alignment = db->os.dwPageSize;
-    if ((dwBlobSize + sizeof(uiid)) < db->header.alignment) {
-        // For small blobs, align to next power of two, minimum 64 bytes
-        uint32_t align = (dwBlobSize == 0)
-            ? sizeof(uiid)
-            : powoftwo(dwBlobSize + sizeof(uiid));
-        /* ensure power-of-two minimum of 64 */
-        align = (align < 64) ? 64 : align;
-        /* align MUST be power-of-two; if you change sizeof(uiid), re-assert here */
-        assert((align & (align - 1)) == 0);
-        db->header.alignment = align;
-    }
-    db->header.blobSize = dwBlobSize;
-	// Header is always aligned to 4096 bytes no matter the system page size.
-    if (__alignup(db->header.size, MAXHEAD) > MAXHEAD) {
-        free(db);
-        fprintf(stderr, "Invalid header size.\n");
-        return NULL;
+    int fd = mkstemp(path);
+    if (fd < 0) return FALSE;
+    close(fd);
+    return _iombstowcs(pwszpath, path);
+#endif
+}
+
+static BOOL _iofullpath(const wchar_t* pwszpath, wchar_t* pwszfull)
+{
+#if defined(_WIN32)
+    return GetFullPathNameW(pwszpath, PATH, pwszfull, NULL) != 0;
+#else
+    char path[PATH * 4];
+    if (!_iowcstombs(path, sizeof(path), pwszpath)) return FALSE;
+    if (path[0] == '/') {
+        return _iombstowcs(pwszfull, path);
     }
-	db->access = dwAccess;
-	db->dwCreationDisposition = dwCreationDisposition;
-    db->hWrite = CreateFileW(pwszpath,
+    char cwd[PATH];
+    char full[PATH * 4];
+    if (!getcwd(cwd, sizeof(cwd))) return FALSE;
+    if (snprintf(full, sizeof(full), "%s/%s", cwd, path) >= (int)sizeof(full)) {
+        errno = ENAMETOOLONG;
+        return FALSE;
+    }
+    return _iombstowcs(pwszfull, full);
+#endif
+}
+
+static HANDLE _ioopen(const wchar_t* pwszpath, DWORD dwAccess, DWORD dwCreationDisposition, BOOL bTemporary)
+{
+#if defined(_WIN32)
+    DWORD flags = bTemporary
+        ? FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE | FILE_FLAG_SEQUENTIAL_SCAN
+        : FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN;
+    return CreateFileW(pwszpath,
         dwAccess,
-        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, // filecompact replaces the file while it is open
         NULL,
         dwCreationDisposition,
         flags,
         NULL);
-    if (!db->hWrite || db->hWrite == INVALID_HANDLE_VALUE) {
-        free(db);
-        fprintf(stderr, "CreateFileW failed: %lu\n", GetLastError());
-        return NULL;
+#else
+    char path[PATH * 4];
+    if (!_iowcstombs(path, sizeof(path), pwszpath)) {
+        return INVALID_HANDLE_VALUE;
+    }
+    int flags = O_CLOEXEC;
+    flags |= (dwAccess & (FILE_WRITE_DATA | FILE_APPEND_DATA)) ? O_RDWR : O_RDONLY;
+    if (dwAccess & FILE_APPEND_DATA) flags |= O_APPEND;
+    switch (dwCreationDisposition) {
+    case CREATE_NEW: flags |= O_CREAT | O_EXCL; break;
+    case CREATE_ALWAYS: flags |= O_CREAT | O_TRUNC; break;
+    case OPEN_ALWAYS: flags |= O_CREAT; break;
+    case OPEN_EXISTING: break;
+    default:
+        errno = EINVAL;
+        return INVALID_HANDLE_VALUE;
+    }
+    int fd = open(path, flags, 0644);
+    if (fd < 0) return INVALID_HANDLE_VALUE;
+    if (fd == 0) {
+        /* A zero descriptor would read as a NULL handle. */
+        int fd2 = fcntl(fd, F_DUPFD_CLOEXEC, 1);
+        close(fd);
+        if (fd2 < 0) return INVALID_HANDLE_VALUE;
+        fd = fd2;
+    }
+    (void)bTemporary;
+#if defined(POSIX_FADV_SEQUENTIAL)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    return _handle(fd);
+#endif
+}
+
+/*
+    Read-only handle that bypasses the page cache (O_DIRECT, FILE_FLAG_NO_BUFFERING, F_NOCACHE on macOS).
+    Reads through it must be DIRECT_ALIGN aligned in offset, length and buffer address (see _ioreaddirect).
+*/
+static HANDLE _ioopendirect(const wchar_t* pwszpath)
+{
+#if defined(_WIN32)
+    return CreateFileW(pwszpath,
+        FILE_READ_DATA,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING,
+        NULL);
+#else
+    char path[PATH * 4];
+    if (!_iowcstombs(path, sizeof(path), pwszpath)) {
+        return INVALID_HANDLE_VALUE;
+    }
+#if defined(O_DIRECT)
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_DIRECT);
+#else
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+#endif
+    if (fd < 0) return INVALID_HANDLE_VALUE;
+#if defined(__APPLE__)
+    if (fcntl(fd, F_NOCACHE, 1) != 0) {
+        close(fd);
+        return INVALID_HANDLE_VALUE;
+    }
+#endif
+    if (fd == 0) {
+        /* A zero descriptor would read as a NULL handle. */
+        int fd2 = fcntl(fd, F_DUPFD_CLOEXEC, 1);
+        close(fd);
+        if (fd2 < 0) return INVALID_HANDLE_VALUE;
+        fd = fd2;
+    }
+    return _handle(fd);
+#endif
+}
+
+static void _ioclose(HANDLE h)
+{
+#if defined(_WIN32)
+    CloseHandle(h);
+#else
+    close(_fd(h));
+#endif
+}
+
+static BOOL _iolock(HANDLE h)
+{
+#if defined(_WIN32)
+    OVERLAPPED ov = { 0 };
+    return LockFileEx(h, LOCKFILE_EXCLUSIVE_LOCK, 0, MAXHEAD, 0, &ov);
+#else
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    /* fcntl refuses write locks on read-only descriptors; a reader only has to exclude header writers. */
+    int mode = fcntl(_fd(h), F_GETFL);
+    if (mode < 0) return FALSE;
+    fl.l_type = (mode & O_ACCMODE) == O_RDONLY ? F_RDLCK : F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = 0;
+    fl.l_len = MAXHEAD;
+#if defined(F_OFD_SETLKW)
+    const int cmd = F_OFD_SETLKW; /* Owned by the open file description, like LockFileEx is by the handle. */
+#else
+    const int cmd = F_SETLKW;
+#endif
+    while (fcntl(_fd(h), cmd, &fl) != 0) {
+        if (errno != EINTR) return FALSE;
+    }
+    return TRUE;
+#endif
+}
+
+static void _iounlock(HANDLE h)
+{
+#if defined(_WIN32)
+    OVERLAPPED ov = { 0 };
+    UnlockFileEx(h, 0, MAXHEAD, 0, &ov);
+#else
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_UNLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = 0;
+    fl.l_len = MAXHEAD;
+#if defined(F_OFD_SETLK)
+    fcntl(_fd(h), F_OFD_SETLK, &fl);
+#else
+    fcntl(_fd(h), F_SETLK, &fl);
+#endif
+#endif
+}
+
+/*
+    The writers lock, one byte far past any record. Every handle that writes the file (fileopen for
+    writing, cursors opened for updates) holds it shared; filecompact holds it exclusively from the
+    copy to the swap, so it never runs beside another writer, whose records would go to the replaced
+    file. Never waits: FALSE when the other side holds it. Without OFD locks (POSIX record locks are
+    per process there) only writers in other processes are seen.
+*/
+#define WRITERS_LOCK ((uint64_t)1 << 62)
+
+static BOOL _iowriters(HANDLE h, BOOL bExclusive)
+{
+#if defined(_WIN32)
+    OVERLAPPED ov = { 0 };
+    ov.OffsetHigh = (DWORD)(WRITERS_LOCK >> 32);
+    // LockFileEx does not convert a lock: the one held is dropped first, and taken again on failure.
+    UnlockFileEx(h, 0, 1, 0, &ov);
+    if (!bExclusive) {
+        return LockFileEx(h, LOCKFILE_FAIL_IMMEDIATELY, 0, 1, 0, &ov);
+    }
+    if (LockFileEx(h, LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY, 0, 1, 0, &ov)) return TRUE;
+    DWORD err = GetLastError();
+    LockFileEx(h, 0, 0, 1, 0, &ov);
+    SetLastError(err);
+    return FALSE;
+#else
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = bExclusive ? F_WRLCK : F_RDLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = (off_t)WRITERS_LOCK;
+    fl.l_len = 1;
+#if defined(F_OFD_SETLK)
+    const int cmd = F_OFD_SETLK; /* Converts the lock of this handle in place. */
+#else
+    const int cmd = F_SETLK;
+#endif
+    while (fcntl(_fd(h), cmd, &fl) != 0) {
+        if (errno != EINTR) return FALSE;
+    }
+    return TRUE;
+#endif
+}
+
+/* FALSE if pwszpath no longer names the file h has open (filecompact replaced it). */
+static BOOL _iocurrent(HANDLE h, const wchar_t* pwszpath)
+{
+#if defined(_WIN32)
+    HANDLE hPath = CreateFileW(pwszpath, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hPath == INVALID_HANDLE_VALUE) return FALSE;
+    BY_HANDLE_FILE_INFORMATION a, b;
+    BOOL bSame = GetFileInformationByHandle(h, &a) && GetFileInformationByHandle(hPath, &b) &&
+        a.dwVolumeSerialNumber == b.dwVolumeSerialNumber &&
+        a.nFileIndexHigh == b.nFileIndexHigh && a.nFileIndexLow == b.nFileIndexLow;
+    CloseHandle(hPath);
+    return bSame;
+#else
+    char path[PATH * 4];
+    struct stat a, b;
+    if (!_iowcstombs(path, sizeof(path), pwszpath)) return FALSE;
+    return fstat(_fd(h), &a) == 0 && stat(path, &b) == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+#endif
+}
+
+static BOOL _iosize(HANDLE h, uint64_t* pcbSize)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(h, &fileSize)) return FALSE;
+    *pcbSize = (uint64_t)fileSize.QuadPart;
+    return TRUE;
+#else
+    struct stat st;
+    if (fstat(_fd(h), &st) != 0) return FALSE;
+    *pcbSize = (uint64_t)st.st_size;
+    return TRUE;
+#endif
+}
+
+/* Positional read. Returns TRUE with *pcbRead < cb at EOF. */
+static BOOL _ioread(HANDLE h, void* buff, DWORD cb, uint64_t offset, DWORD* pcbRead)
+{
+    *pcbRead = 0;
+#if defined(_WIN32)
+    OVERLAPPED ov = { 0 };
+    ov.Offset = (DWORD)offset;
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+    if (!ReadFile(h, buff, cb, pcbRead, &ov)) {
+        return GetLastError() == ERROR_HANDLE_EOF;
+    }
+    return TRUE;
+#else
+    size_t total = 0;
+    while (total < cb) {
+        ssize_t n = pread(_fd(h), (uint8_t*)buff + total, cb - total, (off_t)(offset + total));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            *pcbRead = (DWORD)total;
+            return FALSE;
+        }
+        if (n == 0) break;
+        total += (size_t)n;
+    }
+    *pcbRead = (DWORD)total;
+    return TRUE;
+#endif
+}
+
+/* Positional read on a handle from _ioopendirect. A read that comes back short of cb ended at EOF. */
+static BOOL _ioreaddirect(HANDLE h, void* buff, DWORD cb, uint64_t offset, DWORD* pcbRead)
+{
+#if defined(_WIN32)
+    return _ioread(h, buff, cb, offset, pcbRead);
+#else
+    // Unlike _ioread, do not retry after a short read: the next offset would not be aligned.
+    *pcbRead = 0;
+    size_t total = 0;
+    while (total < cb) {
+        ssize_t n = pread(_fd(h), (uint8_t*)buff + total, cb - total, (off_t)(offset + total));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            *pcbRead = (DWORD)total;
+            return FALSE;
+        }
+        total += (size_t)n;
+        if (n == 0 || ((size_t)n & (DIRECT_ALIGN - 1)) != 0) break;
+    }
+    *pcbRead = (DWORD)total;
+    return TRUE;
+#endif
+}
+
+/* Positional write. The handle must not be in append mode (pwrite ignores the offset under O_APPEND). */
+static BOOL _iowrite(HANDLE h, const void* buff, DWORD cb, uint64_t offset, DWORD* pcbWritten)
+{
+    *pcbWritten = 0;
+#if defined(_WIN32)
+    OVERLAPPED ov = { 0 };
+    ov.Offset = (DWORD)offset;
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+    return WriteFile(h, buff, cb, pcbWritten, &ov);
+#else
+    size_t total = 0;
+    while (total < cb) {
+        ssize_t n = pwrite(_fd(h), (const uint8_t*)buff + total, cb - total, (off_t)(offset + total));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            /* A write that makes no progress would be retried forever. */
+            if (n == 0) errno = EIO;
+            *pcbWritten = (DWORD)total;
+            return FALSE;
+        }
+        total += (size_t)n;
+    }
+    *pcbWritten = (DWORD)total;
+    return TRUE;
+#endif
+}
+
+/* Write at the end of the file. */
+static BOOL _ioappend(HANDLE h, DWORD dwAccess, const void* buff, DWORD cb, DWORD* pcbWritten)
+{
+    *pcbWritten = 0;
+#if defined(_WIN32)
+    if (dwAccess & FILE_APPEND_DATA) {
+        /* Move to end is automatic */
+    }
+    else {
+        fprintf(stderr, "WARNING: File was open without FILE_APPEND_DATA. Performing explicit seek to EOF.\n");
+        LARGE_INTEGER zero = { 0 };
+        if (!SetFilePointerEx(h, zero, NULL, FILE_END)) {
+            return FALSE;
+        }
+    }
+    return WriteFile(h, buff, cb, pcbWritten, NULL);
+#else
+    if (dwAccess & FILE_APPEND_DATA) {
+        /* O_APPEND: move to end is automatic and atomic */
+    }
+    else {
+        fprintf(stderr, "WARNING: File was open without FILE_APPEND_DATA. Performing explicit seek to EOF.\n");
+        if (lseek(_fd(h), 0, SEEK_END) < 0) {
+            return FALSE;
+        }
+    }
+    size_t total = 0;
+    while (total < cb) {
+        ssize_t n = write(_fd(h), (const uint8_t*)buff + total, cb - total);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            /* A write that makes no progress would be retried forever. */
+            if (n == 0) errno = EIO;
+            *pcbWritten = (DWORD)total;
+            return FALSE;
+        }
+        total += (size_t)n;
+    }
+    *pcbWritten = (DWORD)total;
+    return TRUE;
+#endif
+}
+
+static BOOL _iosync(HANDLE h)
+{
+#if defined(_WIN32)
+    return FlushFileBuffers(h);
+#elif defined(__APPLE__)
+    return fsync(_fd(h)) == 0;
+#else
+    return fdatasync(_fd(h)) == 0;
+#endif
+}
+
+/* A second handle on the same file for scanning. Never in append mode, so that positional writes land in place. */
+static HANDLE _ioreopen(Embeddings* db, BOOL bReadOnly)
+{
+#if defined(_WIN32)
+    HANDLE h = NULL;
+    if (!DuplicateHandle(
+        GetCurrentProcess(),
+        db->hWrite,
+        GetCurrentProcess(),
+        &h,
+        bReadOnly
+            ? FILE_READ_DATA // The most basic level read possible
+            : FILE_READ_DATA | FILE_WRITE_DATA, // Allow updates
+        FALSE,
+        0))
+    {
+        return INVALID_HANDLE_VALUE;
+    }
+    return h;
+#else
+    return _ioopen(db->wszPath,
+        bReadOnly
+            ? FILE_READ_DATA
+            : FILE_READ_DATA | FILE_WRITE_DATA,
+        OPEN_EXISTING,
+        FALSE);
+#endif
+}
+
+/* Path of a file kept next to the database, e.g. <path>.ivf. */
+static BOOL _iosidecar(const Embeddings* db, const wchar_t* ext, wchar_t* pwszpath)
+{
+    // wszPath is not wchar_t aligned (see _iowcstombs), so copy it out before using the wide string routines.
+    memcpy(pwszpath, (const uint8_t*)db->wszPath, sizeof(db->wszPath));
+    pwszpath[PATH - 1] = L'\0';
+    size_t n = wcslen(pwszpath), m = wcslen(ext);
+    if (n + m >= PATH) {
+        return FALSE;
+    }
+    memcpy(pwszpath + n, ext, (m + 1) * sizeof(wchar_t));
+    return TRUE;
+}
+
+/* Replaces pwszto with pwszfrom. */
+static BOOL _iorename(const wchar_t* pwszfrom, const wchar_t* pwszto)
+{
+#if defined(_WIN32)
+    return MoveFileExW(pwszfrom, pwszto, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    char from[PATH * 4], to[PATH * 4];
+    if (!_iowcstombs(from, sizeof(from), pwszfrom) || !_iowcstombs(to, sizeof(to), pwszto)) return FALSE;
+    return rename(from, to) == 0;
+#endif
+}
+
+static BOOL _iodelete(const wchar_t* pwszpath)
+{
+#if defined(_WIN32)
+    return DeleteFileW(pwszpath) != 0;
+#else
+    char path[PATH * 4];
+    if (!_iowcstombs(path, sizeof(path), pwszpath)) return FALSE;
+    return unlink(path) == 0;
+#endif
+}
+
+/* _ioread and _iowrite in chunks that fit a DWORD. Return TRUE only when all cb bytes were transferred. */
+static BOOL _ioreadall(HANDLE h, void* buff, size_t cb, uint64_t offset)
+{
+    while (cb > 0) {
+        DWORD want = cb > (1u << 30) ? (1u << 30) : (DWORD)cb, got = 0;
+        if (!_ioread(h, buff, want, offset, &got) || got != want) return FALSE;
+        buff = (uint8_t*)buff + got;
+        offset += got;
+        cb -= got;
+    }
+    return TRUE;
+}
+
+static BOOL _iowriteall(HANDLE h, const void* buff, size_t cb, uint64_t offset)
+{
+    while (cb > 0) {
+        DWORD want = cb > (1u << 30) ? (1u << 30) : (DWORD)cb, written = 0;
+        if (!_iowrite(h, buff, want, offset, &written) || written != want) return FALSE;
+        buff = (const uint8_t*)buff + written;
+        offset += written;
+        cb -= written;
+    }
+    return TRUE;
+}
+
+/* Portable threads. */
+
+typedef void (*ThreadProc)(void* arg);
+
+typedef struct Thread {
+#if defined(_WIN32)
+    HANDLE h;
+#else
+    pthread_t t;
+#endif
+    ThreadProc proc;
+    void* arg;
+} Thread;
+
+#if defined(_WIN32)
+static DWORD WINAPI _threadmain(LPVOID p) {
+    Thread* th = (Thread*)p;
+    th->proc(th->arg);
+    return 0;
+}
+#else
+static void* _threadmain(void* p) {
+    Thread* th = (Thread*)p;
+    th->proc(th->arg);
+    return NULL;
+}
+#endif
+
+static BOOL _threadstart(Thread* th, ThreadProc proc, void* arg) {
+    th->proc = proc;
+    th->arg = arg;
+#if defined(_WIN32)
+    th->h = CreateThread(NULL, 0, _threadmain, th, 0, NULL);
+    return th->h != NULL;
+#else
+    return pthread_create(&th->t, NULL, _threadmain, th) == 0;
+#endif
+}
+
+static void _threadjoin(Thread* th) {
+#if defined(_WIN32)
+    WaitForSingleObject(th->h, INFINITE);
+    CloseHandle(th->h);
+#else
+    pthread_join(th->t, NULL);
+#endif
+}
+
+/* Portable mutex. */
+
+typedef struct Lock {
+#if defined(_WIN32)
+    CRITICAL_SECTION cs;
+#else
+    pthread_mutex_t m;
+#endif
+} Lock;
+
+static void _lockinit(Lock* l) {
+#if defined(_WIN32)
+    InitializeCriticalSection(&l->cs);
+#else
+    pthread_mutex_init(&l->m, NULL);
+#endif
+}
+
+static void _lockfree(Lock* l) {
+#if defined(_WIN32)
+    DeleteCriticalSection(&l->cs);
+#else
+    pthread_mutex_destroy(&l->m);
+#endif
+}
+
+static void _lockenter(Lock* l) {
+#if defined(_WIN32)
+    EnterCriticalSection(&l->cs);
+#else
+    pthread_mutex_lock(&l->m);
+#endif
+}
+
+static void _lockleave(Lock* l) {
+#if defined(_WIN32)
+    LeaveCriticalSection(&l->cs);
+#else
+    pthread_mutex_unlock(&l->m);
+#endif
+}
+
+/* Portable condition variable, waited on with its Lock held. */
+
+typedef struct Cond {
+#if defined(_WIN32)
+    CONDITION_VARIABLE cv;
+#else
+    pthread_cond_t c;
+#endif
+} Cond;
+
+static void _condinit(Cond* c) {
+#if defined(_WIN32)
+    InitializeConditionVariable(&c->cv);
+#elif defined(__APPLE__)
+    pthread_cond_init(&c->c, NULL);
+#else
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&c->c, &attr);
+    pthread_condattr_destroy(&attr);
+#endif
+}
+
+static void _condfree(Cond* c) {
+#if defined(_WIN32)
+    (void)c;
+#else
+    pthread_cond_destroy(&c->c);
+#endif
+}
+
+/* Microseconds from a monotonic clock. */
+static uint64_t _clockus(void) {
+#if defined(_WIN32)
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if (!freq.QuadPart) QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000 + (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000 / (uint64_t)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+#endif
+}
+
+/* Waits at most dwMicroseconds (UINT32_MAX: no limit). Wakes up spuriously like the platform primitives do. */
+static void _condwait(Cond* c, Lock* l, uint32_t dwMicroseconds) {
+#if defined(_WIN32)
+    SleepConditionVariableCS(&c->cv, &l->cs, dwMicroseconds == UINT32_MAX ? INFINITE : (dwMicroseconds + 999) / 1000);
+#else
+    if (dwMicroseconds == UINT32_MAX) {
+        pthread_cond_wait(&c->c, &l->m);
+        return;
+    }
+    struct timespec ts;
+#if defined(__APPLE__)
+    clock_gettime(CLOCK_REALTIME, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    uint64_t ns = (uint64_t)ts.tv_nsec + (uint64_t)dwMicroseconds * 1000;
+    ts.tv_sec += (time_t)(ns / 1000000000);
+    ts.tv_nsec = (long)(ns % 1000000000);
+    pthread_cond_timedwait(&c->c, &l->m, &ts);
+#endif
+}
+
+static void _condbroadcast(Cond* c) {
+#if defined(_WIN32)
+    WakeAllConditionVariable(&c->cv);
+#else
+    pthread_cond_broadcast(&c->c);
+#endif
+}
+
+/*
+    Read-only views of the file for zero-copy search (see filemap).
+
+    A search takes a reference on the current Mapping and scores records in place. When the file has
+    grown by more than an eighth past the mapped length, the next search maps the file again; the old
+    Mapping is released once the last search using it finishes. Records past the mapped length are
+    read through the regular buffered path, so a search always sees the whole file.
+*/
+
+typedef struct Mapping {
+    const uint8_t* base;
+    uint64_t size;
+    uint32_t refs;
+#if defined(_WIN32)
+    HANDLE hFile;
+    HANDLE hSection;
+#endif
+} Mapping;
+
+struct View {
+    Lock lock;
+    Mapping* current;
+    DWORD dwHints;
+};
+
+static Mapping* _mapcreate(Embeddings* db, uint64_t size, DWORD dwHints)
+{
+    Mapping* map = (Mapping*)calloc(1, sizeof(Mapping));
+    if (!map) return NULL;
+    map->size = size;
+    map->refs = 1;
+#if defined(_WIN32)
+    // PAGE_READONLY sections need GENERIC_READ, which the append handle may not have.
+    map->hFile = CreateFileW(db->wszPath,
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL);
+    if (map->hFile == INVALID_HANDLE_VALUE) {
+        free(map);
+        return NULL;
+    }
+    map->hSection = CreateFileMappingW(map->hFile, NULL, PAGE_READONLY, (DWORD)(size >> 32), (DWORD)size, NULL);
+    if (!map->hSection) {
+        CloseHandle(map->hFile);
+        free(map);
+        return NULL;
+    }
+    map->base = (const uint8_t*)MapViewOfFile(map->hSection, FILE_MAP_READ, 0, 0, (SIZE_T)size);
+    if (!map->base) {
+        CloseHandle(map->hSection);
+        CloseHandle(map->hFile);
+        free(map);
+        return NULL;
+    }
+    if (dwHints & MAPHINT_WILLNEED) {
+        WIN32_MEMORY_RANGE_ENTRY range = { (PVOID)map->base, (SIZE_T)size };
+        PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+    }
+#else
+    void* base = mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED, _fd(db->hWrite), 0);
+    if (base == MAP_FAILED) {
+        free(map);
+        return NULL;
+    }
+    map->base = (const uint8_t*)base;
+    if (dwHints & MAPHINT_SEQUENTIAL) madvise(base, (size_t)size, MADV_SEQUENTIAL);
+    if (dwHints & MAPHINT_WILLNEED) madvise(base, (size_t)size, MADV_WILLNEED);
+#if defined(MADV_HUGEPAGE)
+    if (dwHints & MAPHINT_HUGEPAGES) madvise(base, (size_t)size, MADV_HUGEPAGE);
+#endif
+#endif
+    return map;
+}
+
+static void _mapdestroy(Mapping* map)
+{
+#if defined(_WIN32)
+    UnmapViewOfFile(map->base);
+    CloseHandle(map->hSection);
+    CloseHandle(map->hFile);
+#else
+    munmap((void*)map->base, (size_t)map->size);
+#endif
+    free(map);
+}
+
+/* Returns a referenced mapping that covers at least most of the file, or NULL if the view is not enabled. */
+static Mapping* _mapacquire(Embeddings* db)
+{
+    struct View* view = db->view;
+    if (!view) return NULL;
+    _lockenter(&view->lock);
+    uint64_t fileSize = 0;
+    if (_iosize(db->hWrite, &fileSize)) {
+        uint64_t mapped = view->current ? view->current->size : 0;
+        if (fileSize > mapped + mapped / 8) {
+            Mapping* map = _mapcreate(db, fileSize, view->dwHints);
+            if (map) {
+                if (view->current && --view->current->refs == 0) _mapdestroy(view->current);
+                view->current = map;
+            }
+            else {
+                fprintf(stderr, "Warning: failed to map the database (system error %lu); using reads.\n", (unsigned long)GetLastError());
+            }
+        }
+    }
+    Mapping* map = view->current;
+    if (map) map->refs++;
+    _lockleave(&view->lock);
+    return map;
+}
+
+static void _maprelease(Embeddings* db, Mapping* map)
+{
+    if (!map) return;
+    _lockenter(&db->view->lock);
+    if (--map->refs == 0) _mapdestroy(map);
+    _lockleave(&db->view->lock);
+}
+
+/*
+    filecompact swaps the file under the open handle. Every call that uses the file, its mapping or
+    its indexes holds the gate shared; the swap holds it exclusively once the calls already inside
+    have left. Calls that arrive while it waits queue behind it, except the group commit flusher:
+    appenders inside the gate may be waiting for their commit. Index builds and fileunmap take it
+    exclusively too, for as long as they replace what the searches inside use.
+*/
+
+struct Compact {
+    Lock lock;
+    Cond cond;
+    uint32_t shared; /* calls inside the gate */
+    BOOL bWaiting; /* the swap waits for the calls inside to leave */
+    BOOL bExclusive; /* a swap is in progress */
+    BOOL bDraining; /* filesetgroupcommit holds the gate and waits for the flusher's last commit */
+    uint32_t swaps; /* files swapped in by filecompact: an index built before the last one is stale */
+    BOOL bRunning; /* a compaction is copying: fileupdate notes the records it overwrites */
+    BOOL bLost; /* an overwritten record could not be noted, so the copy is not current */
+    uint32_t* updated; /* record ordinals overwritten by fileupdate since the copy started */
+    size_t nUpdated;
+    size_t capUpdated;
+};
+
+static struct Compact* _compactcreate(void)
+{
+    struct Compact* cp = (struct Compact*)calloc(1, sizeof(struct Compact));
+    if (!cp) return NULL;
+    _lockinit(&cp->lock);
+    _condinit(&cp->cond);
+    return cp;
+}
+
+static void _compactfree(struct Compact* cp)
+{
+    if (!cp) return;
+    _condfree(&cp->cond);
+    _lockfree(&cp->lock);
+    free(cp->updated);
+    free(cp);
+}
+
+/* Notes record ord, overwritten in place, so that a compaction in progress copies it again. */
+static void _compactnote(Embeddings* db, uint32_t ord)
+{
+    struct Compact* cp = db->compact;
+    _lockenter(&cp->lock);
+    if (cp->bRunning) {
+        if (cp->nUpdated == cp->capUpdated) {
+            size_t cap = cp->capUpdated ? 2 * cp->capUpdated : 64;
+            uint32_t* updated = (uint32_t*)realloc(cp->updated, cap * sizeof(uint32_t));
+            if (updated) {
+                cp->updated = updated;
+                cp->capUpdated = cap;
+            }
+        }
+        if (cp->nUpdated < cp->capUpdated) cp->updated[cp->nUpdated++] = ord;
+        else cp->bLost = TRUE;
+    }
+    _lockleave(&cp->lock);
+}
+
+static void _gateenter(Embeddings* db, BOOL bFlusher)
+{
+    struct Compact* cp = db ? db->compact : NULL;
+    if (!cp) return;
+    _lockenter(&cp->lock);
+    while ((cp->bExclusive && !(bFlusher && cp->bDraining)) || (cp->bWaiting && !bFlusher)) {
+        _condwait(&cp->cond, &cp->lock, UINT32_MAX);
+    }
+    cp->shared++;
+    _lockleave(&cp->lock);
+}
+
+static void _gateleave(Embeddings* db)
+{
+    struct Compact* cp = db ? db->compact : NULL;
+    if (!cp) return;
+    _lockenter(&cp->lock);
+    if (--cp->shared == 0 && cp->bWaiting) {
+        _condbroadcast(&cp->cond);
+    }
+    _lockleave(&cp->lock);
+}
+
+/* Waits for the calls inside the gate to leave and keeps new ones out until _gateunlock. The caller is not inside. */
+static void _gatelock(Embeddings* db)
+{
+    struct Compact* cp = db ? db->compact : NULL;
+    if (!cp) return;
+    _lockenter(&cp->lock);
+    for (;;) {
+        if (!cp->bExclusive) {
+            cp->bWaiting = TRUE;
+            if (cp->shared == 0) break;
+        }
+        _condwait(&cp->cond, &cp->lock, UINT32_MAX);
+    }
+    cp->bWaiting = FALSE;
+    cp->bExclusive = TRUE;
+    _lockleave(&cp->lock);
+}
+
+/* Lets the group commit flusher past the gate the caller holds exclusively (bDrain) or not any more. */
+static void _gatedrain(Embeddings* db, BOOL bDrain)
+{
+    struct Compact* cp = db ? db->compact : NULL;
+    if (!cp) return;
+    _lockenter(&cp->lock);
+    cp->bDraining = bDrain;
+    _condbroadcast(&cp->cond);
+    _lockleave(&cp->lock);
+}
+
+static void _gateunlock(Embeddings* db)
+{
+    struct Compact* cp = db ? db->compact : NULL;
+    if (!cp) return;
+    _lockenter(&cp->lock);
+    cp->bExclusive = FALSE;
+    _condbroadcast(&cp->cond);
+    _lockleave(&cp->lock);
+}
+
+/* The number of file swaps so far, read by a build inside the gate to tell whether its index is still current. */
+static uint32_t _gateswaps(Embeddings* db)
+{
+    struct Compact* cp = db ? db->compact : NULL;
+    if (!cp) return 0;
+    _lockenter(&cp->lock);
+    uint32_t swaps = cp->swaps;
+    _lockleave(&cp->lock);
+    return swaps;
+}
+
+/*
+    Holds the gate exclusively for a build to put its index in place, once the searches that may be
+    reading the old one have left. Returns FALSE, without holding it, if filecompact swapped the file
+    since swaps was read: the index describes the old file.
+*/
+static BOOL _gateswap(Embeddings* db, uint32_t swaps)
+{
+    _gatelock(db);
+    if (_gateswaps(db) == swaps) {
+        return TRUE;
+    }
+    _gateunlock(db);
+    fprintf(stderr, "The database was compacted during the build; build the index again.\n");
+    return FALSE;
+}
+
+static void _ivfload(Embeddings* db);
+static void _ivffree(struct Ivf* ivf);
+static void _hnswload(Embeddings* db);
+static void _hnswclose(Embeddings* db);
+static void _hnswappend(Embeddings* db);
+static void _pqload(Embeddings* db);
+static void _pqclose(Embeddings* db);
+static void _signload(Embeddings* db);
+static void _signclose(Embeddings* db);
+static void _signappend(Embeddings* db);
+static void _fileunmap(Embeddings* db);
+static void _idsload(Embeddings* db);
+static void _idsclose(Embeddings* db);
+static void _idsappend(Embeddings* db);
+static void _idsops(Embeddings* db, const uiid* keys, uint32_t n, uint32_t* ops);
+static BOOL _idsfind(Embeddings* db, const uiid* keys, uint32_t n, uint32_t* ords);
+static BOOL _commitstop(Embeddings* db);
+
+/* Indexes kept next to the file (<path><ext>) that refer to its records by position. */
+static const wchar_t* const kIndexes[] = { L".ivf", L".hnsw", L".pq", L".sign", L".ids" };
+
+EMBEDDINGS_API Embeddings* EMBEDDINGS_CALL fileopen(
+    const wchar_t* pwszpath, DWORD dwAccess, DWORD dwCreationDisposition, uint32_t dwBlobSize)
+{
+    return fileopenex(pwszpath, dwAccess, dwCreationDisposition, dwBlobSize, DTYPE_FLOAT32, METRIC_COSINE);
+}
+
+EMBEDDINGS_API Embeddings* EMBEDDINGS_CALL fileopenex(
+    const wchar_t* pwszpath, DWORD dwAccess, DWORD dwCreationDisposition, uint32_t dwBlobSize, uint8_t dtype, uint8_t metric)
+{
+    if (dtype != DTYPE_FLOAT32 && dtype != DTYPE_FLOAT16 && dtype != DTYPE_INT8) {
+        fprintf(stderr, "The specified dtype %u is not supported.\n", (unsigned)dtype);
+        return NULL;
+    }
+    if (metric > METRIC_L1) {
+        fprintf(stderr, "The specified metric %u is not supported.\n", (unsigned)metric);
+        return NULL;
+    }
+	Embeddings* db = malloc(sizeof(Embeddings));
+    _dbglog(">> fileopen(path='%ls' blob=%u dtype=%u metric=%u access=0x%08X, disposition=0x%08X);\n", pwszpath, dwBlobSize, (unsigned)dtype, (unsigned)metric, dwAccess, dwCreationDisposition);
+    memset(db, 0, sizeof(*db));
+    db->bRescore = TRUE;
+    db->dwReadDepth = SCAN_DEPTH;
+    db->dwReadRecords = SCAN_RECORDS;
+    assert(PATH >= MAX_PATH);
+    if (!pwszpath || wcscmp(pwszpath, L":temp:") == 0) {
+        if (!_iotemppath(db->wszPath)) {
+            free(db);
+            fprintf(stderr, "Failed to create a temporary file name: %lu\n", (unsigned long)GetLastError());
+            return NULL;
+        }
+        db->bTemporary = TRUE;
+		dwCreationDisposition = CREATE_ALWAYS;
+        dwAccess = FILE_READ_DATA | FILE_APPEND_DATA | FILE_WRITE_DATA;
+		pwszpath = db->wszPath;
+    } else {
+        if (!_iofullpath(pwszpath, db->wszPath)) {
+            free(db);
+            fprintf(stderr, "GetFullPathNameW failed: %lu\n", (unsigned long)GetLastError());
+            return NULL;
+        }
+        pwszpath = db->wszPath;
+    }
+    _dbglog("path='%ls' blob=%u access=0x%08X, disposition=0x%08X\n",
+        pwszpath,
+        dwBlobSize,
+        dwAccess,
+        dwCreationDisposition);
+#if defined(_WIN32)
+    GetSystemInfo(&db->os);
+#else
+    long pageSize = sysconf(_SC_PAGESIZE);
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    db->os.dwPageSize = pageSize > 0 ? (DWORD)pageSize : 0;
+    db->os.dwAllocationGranularity = db->os.dwPageSize;
+    db->os.dwNumberOfProcessors = processors > 0 ? (DWORD)processors : 1;
+#endif
+    db->os.dwPageSize = db->os.dwPageSize ? db->os.dwPageSize : 4096;
+    db->os.dwAllocationGranularity = db->os.dwAllocationGranularity ? db->os.dwAllocationGranularity : 65536;
+	if (dwBlobSize > MAXBLOB) {
+        free(db);
+        fprintf(stderr, "The specified blob size %lu is invalid. Maximum blob size is %lu.\n", (unsigned long)dwBlobSize, (unsigned long)MAXBLOB);
+        return NULL;
+    }
+    if (dwBlobSize > 0) {
+        if ((dwBlobSize % sizeof(float)) != 0) {
+            free(db);
+            fprintf(stderr, "Blob size must be a multiple of %zu (size of float32).\n", sizeof(float));
+            return NULL;
+        }
+    }
+    memset(&db->header, 0, sizeof(db->header));
+    static const char kMagic[] = "EMBEDDINGS";
+    memcpy(db->header.magic, kMagic,
+        (sizeof(kMagic) - 1 < sizeof(db->header.magic))
+        ? (sizeof(kMagic) - 1)
+        : sizeof(db->header.magic));
+    db->header.version = VERSION;
+    db->header.size = sizeof(FileHeader);
+    db->header.dtype = dtype;
+    db->header.metric = metric;
+    // dwBlobSize is the size of the float32 vectors the API takes, cbStored what a record holds.
+    uint32_t cbStored = _vecsize(dtype, dwBlobSize / sizeof(float));
+    db->header.alignment = RECALIGN;
+    db->header.blobSize = cbStored;
+    db->header.flags |= HEADER_NORMS;
+	// Header is always aligned to 4096 bytes no matter the system page size.
+    if (__alignup(db->header.size, MAXHEAD) > MAXHEAD) {
+        free(db);
+        fprintf(stderr, "Invalid header size.\n");
+        return NULL;
+    }
+	db->access = dwAccess;
+	db->dwCreationDisposition = dwCreationDisposition;
+    db->hWrite = _ioopen(pwszpath,
+        dwAccess,
+        dwCreationDisposition,
+        db->bTemporary);
+    if (!db->hWrite || db->hWrite == INVALID_HANDLE_VALUE) {
+        free(db);
+        fprintf(stderr, "CreateFileW failed: %lu\n", (unsigned long)GetLastError());
+        return NULL;
+    }
+    // A writer holds the writers lock shared, checked against a swap that came between the open and the lock.
+    if ((dwAccess & (FILE_WRITE_DATA | FILE_APPEND_DATA)) &&
+        (!_iowriters(db->hWrite, FALSE) || (!db->bTemporary && !_iocurrent(db->hWrite, pwszpath)))) {
+        fprintf(stderr, "The database is being compacted; open it for writing once the compaction is done.\n");
+        _ioclose(db->hWrite);
+        free(db);
+        return NULL;
+    }
+    if (!_iolock(db->hWrite)) {
+        fprintf(stderr, "LockFileEx failed: %lu\n", (unsigned long)GetLastError());
+        _ioclose(db->hWrite);
+        free(db);
+        return NULL;
+    }
+    uint64_t fileSize = 0;
+    if (!_iosize(db->hWrite, &fileSize)) {
+        _iounlock(db->hWrite);
+        _ioclose(db->hWrite);
+        free(db);
+        return NULL;
+    }
+    if (fileSize == 0) {
+		assert(db->header.size <= MAXHEAD);
+        uint8_t* buff = (uint8_t*)_aligned_malloc(MAXHEAD, MAXHEAD);
+        if (!buff) {
+            _iounlock(db->hWrite);
+            _ioclose(db->hWrite);
+            free(db);
+            fprintf(stderr, "Memory allocation failed\n");
+            return NULL;
+        }
+        memset(buff, 0, MAXHEAD);
+        errno_t err = memcpy_s(buff, MAXHEAD, &db->header, sizeof(db->header));
+        if (err) {
+            _aligned_free(buff);
+            _iounlock(db->hWrite);
+            _ioclose(db->hWrite);
+            free(db);
+            fprintf(stderr, "memcpy_s failed (%d)\n", err);
+            return NULL;
+        }
+        DWORD written = 0;
+        if (!_ioappend(db->hWrite, db->access, buff, MAXHEAD, &written) || written != MAXHEAD) {
+            fprintf(stderr, "WriteFile failed: %lu\n", (unsigned long)GetLastError());
+            _aligned_free(buff);
+            _iounlock(db->hWrite);
+            _ioclose(db->hWrite);
+            free(db);
+            return NULL;
+        }
+        _iosync(db->hWrite);
+        _aligned_free(buff);
+        // Indexes left over from an earlier file of the same name describe records that are gone.
+        for (size_t i = 0; i < sizeof(kIndexes) / sizeof(kIndexes[0]) && !db->bTemporary; ++i) {
+            wchar_t wszIndex[PATH];
+            if (_iosidecar(db, kIndexes[i], wszIndex)) {
+                _iodelete(wszIndex);
+            }
+        }
+    }
+    else {
+        DWORD read = 0;
+        if (!_ioread(db->hWrite, &db->header, sizeof(db->header), 0, &read) ||
+            read != sizeof(db->header)) {
+            _iounlock(db->hWrite);
+            _ioclose(db->hWrite);
+            free(db);
+            return NULL;
+        }
+        if (memcmp(db->header.magic, kMagic, sizeof(kMagic) - 1) != 0 ||
+            db->header.version < 1 ||
+            db->header.version > VERSION ||
+            db->header.size < offsetof(FileHeader, flags) ||
+            db->header.size > sizeof(FileHeader)) {
+            fprintf(stderr, "Invalid or mismatched DB format\n");
+            _iounlock(db->hWrite);
+            _ioclose(db->hWrite);
+            free(db);
+            return NULL;
+        }
+        // Fields added after the file was created read as zero.
+        memset((uint8_t*)&db->header + db->header.size, 0, sizeof(FileHeader) - db->header.size);
+        // An existing file keeps the dtype it was created with.
+        if (db->header.dtype != DTYPE_FLOAT32 && db->header.dtype != DTYPE_FLOAT16 && db->header.dtype != DTYPE_INT8) {
+            fprintf(stderr, "Unsupported dtype %u.\n", (unsigned)db->header.dtype);
+            _iounlock(db->hWrite);
+            _ioclose(db->hWrite);
+            free(db);
+            return NULL;
+        }
+        if (db->header.metric > METRIC_L1) {
+            fprintf(stderr, "Unsupported metric %u.\n", (unsigned)db->header.metric);
+            _iounlock(db->hWrite);
+            _ioclose(db->hWrite);
+            free(db);
+            return NULL;
+        }
+        if (_vecdim(&db->header) * sizeof(float) != dwBlobSize) {
+            fprintf(stderr, "Invalid blob size.\n");
+            _iounlock(db->hWrite);
+            _ioclose(db->hWrite);
+            free(db);
+            return NULL;
+        }
+        if (db->header.version == 1 && db->header.alignment != db->os.dwPageSize) {
+            if (db->header.alignment > db->os.dwPageSize) {
+                fprintf(stderr, "Error: file created with alignment=%u (system=%u)\n",
+                    db->header.alignment, db->os.dwPageSize);
+                _iounlock(db->hWrite);
+                _ioclose(db->hWrite);
+                free(db);
+                return NULL;
+            }
+            fprintf(stderr, "Warning: file created with alignment=%u (system=%u)\n",
+                db->header.alignment, db->os.dwPageSize);
+        }
+    }
+    _iounlock(db->hWrite);
+    if (!db->bTemporary) {
+        _ivfload(db);
+        _hnswload(db);
+        _pqload(db);
+        _signload(db);
+    }
+    _idsload(db);
+    db->compact = _compactcreate();
+    if (!db->compact) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        fileclose(db);
+        return NULL;
+    }
+    return db;
+}
+
+EMBEDDINGS_API void EMBEDDINGS_CALL fileclose(Embeddings* db)
+{
+    _dbglog("fileclose();\n");
+    if (!db) return;
+    if (!_commitstop(db)) {
+        fprintf(stderr, "Warning: a group commit failed; the last appends may be lost.\n");
+    }
+    _hnswclose(db);
+    _pqclose(db);
+    _signclose(db);
+    _idsclose(db);
+    fileunmap(db);
+    _ivffree(db->ivf);
+    db->ivf = NULL;
+    if (db->hWrite && db->hWrite != INVALID_HANDLE_VALUE)
+        _ioclose(db->hWrite);
+    if (db->hDirect)
+        _ioclose(db->hDirect);
+    _compactfree(db->compact);
+#if !defined(_WIN32)
+    /* FILE_FLAG_DELETE_ON_CLOSE */
+    if (db->bTemporary) {
+        char path[PATH * 4];
+        if (_iowcstombs(path, sizeof(path), db->wszPath))
+            unlink(path);
+    }
+#endif
+    free(db);
+}
+
+/* Score is packed, so ids are not 8-byte aligned; memcpy compiles to plain 64-bit loads. */
+static __forceinline BOOL _uiidcmp(const uiid* a, const uiid* b) {
+    uint64_t pa[2], pb[2];
+    memcpy(pa, a->bytes, sizeof(pa));
+    memcpy(pb, b->bytes, sizeof(pb));
+    return (pa[0] == pb[0]) && (pa[1] == pb[1]);
+}
+
+static __forceinline void _uiidcpy(uiid* dst, const uiid* src) {
+    memcpy(dst->bytes, src->bytes, sizeof(dst->bytes));
+}
+
+static inline uint64_t _uiidhash(uiid* a) {
+    uint64_t p[2];
+    memcpy(p, a->bytes, sizeof(p));
+    uint64_t h = p[0] + 0x9E3779B97F4A7C15ULL;
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+    h = (h ^ (h >> 31)) + p[1];
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+    return h ^ (h >> 31);
+}
+
+EMBEDDINGS_API uint32_t EMBEDDINGS_CALL fileversion(Embeddings* db) {
+    if (!db) {
+        fprintf(stderr, "The specified database pointer is NULL.\n");
+        return 0;
+    }
+	return db->header.version;
+}
+
+static void _vecencode(uint8_t dtype, void* dst, const float* src, uint32_t dim);
+static inline float _vecnrm2(uint8_t dtype, const void* blob, uint32_t dim);
+
+/*
+    Lays out one record in rec: the id, the vector in the stored form, its norm (HEADER_NORMS), the
+    operation (version 3) and zero padding. A tombstone has no blob: its vector and norm are zero.
+*/
+static void _recencode(const Embeddings* db, uint8_t* rec, const uiid* id, const float* blob, uint32_t op)
+{
+    const uint32_t dim = _vecdim(&db->header);
+    size_t used = sizeof(uiid) + db->header.blobSize;
+    _uiidcpy((uiid*)rec, id);
+    if (blob) {
+        _vecencode(db->header.dtype, rec + sizeof(uiid), blob, dim);
+    }
+    else {
+        memset(rec + sizeof(uiid), 0, db->header.blobSize);
+    }
+    if (db->header.flags & HEADER_NORMS) {
+        float norm = blob ? _vecnrm2(db->header.dtype, rec + sizeof(uiid), dim) : 0;
+        memcpy(rec + used, &norm, sizeof(float));
+        used += sizeof(float);
+    }
+    if (db->header.version >= 3) {
+        memcpy(rec + used, &op, sizeof(op));
+        used += sizeof(op);
+    }
+    memset(rec + used, 0, _recsize(&db->header) - used);
+}
+
+/* Brings the indexes that follow appends (HNSW, sign sketches, ids) up to the end of the file. */
+static void _appended(Embeddings* db)
+{
+    if (db->hnsw) {
+        _hnswappend(db);
+    }
+    if (db->sign) {
+        _signappend(db);
+    }
+    if (db->ids) {
+        _idsappend(db);
+    }
+}
+
+/*
+    Group commit (see filesetgroupcommit). Appenders encode their records outside the lock, queue
+    them in pending and take a ticket: the number of records queued up to and including theirs.
+    One flusher thread takes the whole queue, writes it with one call, syncs once, and wakes every
+    appender whose ticket that covers. It starts a commit once the oldest queued record has waited
+    dwMaxDelay microseconds, dwMaxBatch records are queued or fileflush asks for one; records queued
+    while it writes and syncs make up the next group.
+
+    While group commit is on every append goes through the queue, so the file keeps the order of the
+    calls. A failed write or sync fails the appenders of that group and every later append until
+    group commit is turned off: what reached the disk is then unknown.
+*/
+
+#define COMMIT_MAXBATCH 4096 /* default dwMaxBatch */
+
+struct Commit {
+    Lock lock;
+    Cond work; /* the flusher waits for records, a flush or the stop */
+    Cond done; /* appenders wait for their commit or for room in the queue */
+    Thread thread;
+    uint8_t* pending; /* queued records */
+    size_t cb; /* bytes queued */
+    size_t capacity;
+    uint32_t num; /* records queued */
+    uint64_t since; /* _clockus() when the oldest queued record was queued */
+    uint64_t queued; /* tickets handed out */
+    uint64_t committed; /* tickets written and synced */
+    uint64_t urgent; /* commit up to this ticket without waiting for the delay */
+    uint32_t dwMaxDelay;
+    uint32_t dwMaxBatch;
+    BOOL bStop;
+    BOOL bFailed;
+};
+
+static void _commitmain(void* arg)
+{
+    Embeddings* db = (Embeddings*)arg;
+    struct Commit* c = db->commit;
+    uint8_t* spare = NULL;
+    size_t spareCapacity = 0;
+    _lockenter(&c->lock);
+    for (;;) {
+        if (c->num == 0) {
+            if (c->bStop) break;
+            _condwait(&c->work, &c->lock, UINT32_MAX);
+            continue;
+        }
+        uint64_t waited = _clockus() - c->since;
+        if (!c->bStop && c->urgent <= c->committed && c->num < c->dwMaxBatch && waited < c->dwMaxDelay) {
+            _condwait(&c->work, &c->lock, (uint32_t)(c->dwMaxDelay - waited));
+            continue;
+        }
+        // Take the queue; the appenders fill the other buffer meanwhile.
+        uint8_t* buff = c->pending;
+        size_t cb = c->cb, capacity = c->capacity;
+        uint64_t ticket = c->queued;
+        c->pending = spare;
+        c->capacity = spareCapacity;
+        spare = buff;
+        spareCapacity = capacity;
+        c->cb = 0;
+        c->num = 0;
+        _condbroadcast(&c->done);
+        _lockleave(&c->lock);
+        _gateenter(db, TRUE);
+        BOOL bOk = TRUE;
+        for (size_t off = 0; off < cb && bOk;) {
+            DWORD want = cb - off < (1u << 30) ? (DWORD)(cb - off) : (1u << 30), written = 0;
+            bOk = _ioappend(db->hWrite, db->access, buff + off, want, &written) && written == want;
+            off += want;
+        }
+        if (!bOk) {
+            fprintf(stderr, "Group commit failed to append %zu bytes (system error %lu).\n", cb, (unsigned long)GetLastError());
+        }
+        else if (!_iosync(db->hWrite)) {
+            fprintf(stderr, "Group commit failed to flush data to disk (system error %lu).\n", (unsigned long)GetLastError());
+            bOk = FALSE;
+        }
+        if (bOk) {
+            _appended(db);
+        }
+        _gateleave(db);
+        _lockenter(&c->lock);
+        if (bOk) {
+            c->committed = ticket;
+        }
+        else {
+            c->bFailed = TRUE;
+            c->cb = 0;
+            c->num = 0;
+        }
+        _condbroadcast(&c->done);
+    }
+    _lockleave(&c->lock);
+    free(spare);
+}
+
+/* Queues n encoded records (recs) and with bWait blocks until they are written and synced. */
+static BOOL _commitappend(Embeddings* db, const uint8_t* recs, uint32_t n, BOOL bWait)
+{
+    struct Commit* c = db->commit;
+    const size_t cb = (size_t)n * _recsize(&db->header);
+    _lockenter(&c->lock);
+    // A full queue waits for the commit in progress; a batch larger than dwMaxBatch goes in alone.
+    while (!c->bFailed && c->num > 0 && c->num + n > c->dwMaxBatch) {
+        c->urgent = c->queued;
+        _condbroadcast(&c->work);
+        _condwait(&c->done, &c->lock, UINT32_MAX);
+    }
+    if (c->bFailed) {
+        _lockleave(&c->lock);
+        fprintf(stderr, "A group commit failed; appends are refused until group commit is turned off.\n");
+        return FALSE;
+    }
+    if (c->cb + cb > c->capacity) {
+        size_t capacity = c->capacity ? 2 * c->capacity : cb;
+        if (capacity < c->cb + cb) capacity = c->cb + cb;
+        uint8_t* pending = (uint8_t*)realloc(c->pending, capacity);
+        if (!pending) {
+            _lockleave(&c->lock);
+            fprintf(stderr, "Memory allocation failed while queueing the records.\n");
+            return FALSE;
+        }
+        c->pending = pending;
+        c->capacity = capacity;
+    }
+    memcpy(c->pending + c->cb, recs, cb);
+    c->cb += cb;
+    c->num += n;
+    c->queued += n;
+    uint64_t ticket = c->queued;
+    if (c->num == n) {
+        c->since = _clockus();
+    }
+    if (c->num == n || c->num >= c->dwMaxBatch) {
+        _condbroadcast(&c->work);
+    }
+    BOOL bOk = TRUE;
+    if (bWait) {
+        while (c->committed < ticket && !c->bFailed) {
+            _condwait(&c->done, &c->lock, UINT32_MAX);
+        }
+        bOk = c->committed >= ticket;
+    }
+    _lockleave(&c->lock);
+    if (!bOk) {
+        fprintf(stderr, "Failed to commit the appended records.\n");
+    }
+    return bOk;
+}
+
+/* Commits everything queued so far without waiting for the delay. */
+static BOOL _commitflush(Embeddings* db)
+{
+    struct Commit* c = db->commit;
+    _lockenter(&c->lock);
+    uint64_t ticket = c->queued;
+    c->urgent = ticket;
+    _condbroadcast(&c->work);
+    while (c->committed < ticket && !c->bFailed) {
+        _condwait(&c->done, &c->lock, UINT32_MAX);
+    }
+    BOOL bOk = c->committed >= ticket;
+    _lockleave(&c->lock);
+    return bOk;
+}
+
+/* Commits what is queued, stops the flusher and goes back to direct writes. */
+static BOOL _commitstop(Embeddings* db)
+{
+    struct Commit* c = db->commit;
+    if (!c) return TRUE;
+    _lockenter(&c->lock);
+    c->bStop = TRUE;
+    _condbroadcast(&c->work);
+    _lockleave(&c->lock);
+    _threadjoin(&c->thread);
+    BOOL bOk = !c->bFailed;
+    db->commit = NULL;
+    _condfree(&c->work);
+    _condfree(&c->done);
+    _lockfree(&c->lock);
+    free(c->pending);
+    free(c);
+    return bOk;
+}
+
+/*
+    The id index only holds the records group commit has written. Before filedelete or fileupdate
+    takes id for missing, commits the queue, so that they see the appends that came before them as
+    they do without group commit.
+*/
+static BOOL _commitfind(Embeddings* db, const uiid* id)
+{
+    uint32_t ord = 0;
+    if (!db->commit || !_idsfind(db, id, 1, &ord) || ord != UINT32_MAX) return TRUE;
+    if (!_commitflush(db)) {
+        fprintf(stderr, "Failed to commit the queued records.\n");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static BOOL _filesetgroupcommit(Embeddings* db, BOOL bEnable, uint32_t dwMaxDelay, uint32_t dwMaxBatch)
+{
+    _dbglog("filesetgroupcommit(enable = %d, delay = %u, batch = %u);\n", bEnable, dwMaxDelay, dwMaxBatch);
+    if (!db) {
+        fprintf(stderr, "The specified database pointer is NULL.\n");
+        return FALSE;
+    }
+    if (!db->hWrite || db->hWrite == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "The specified database is closed or invalid.\n");
+        return FALSE;
+    }
+    if (!bEnable) {
+        // The caller holds the gate; the flusher still gets in to commit what is queued.
+        _gatedrain(db, TRUE);
+        BOOL bOk = _commitstop(db);
+        _gatedrain(db, FALSE);
+        if (!bOk) {
+            fprintf(stderr, "A group commit failed before group commit was turned off.\n");
+            return FALSE;
+        }
+        return TRUE;
+    }
+    if (!(db->access & FILE_APPEND_DATA)) {
+        fprintf(stderr, "Group commit needs a database opened for appending.\n");
+        return FALSE;
+    }
+    if (dwMaxBatch == 0) dwMaxBatch = COMMIT_MAXBATCH;
+    if (dwMaxDelay == UINT32_MAX) dwMaxDelay = UINT32_MAX - 1;
+    if (db->commit) {
+        _lockenter(&db->commit->lock);
+        db->commit->dwMaxDelay = dwMaxDelay;
+        db->commit->dwMaxBatch = dwMaxBatch;
+        _condbroadcast(&db->commit->work);
+        _lockleave(&db->commit->lock);
+        return TRUE;
+    }
+    struct Commit* c = (struct Commit*)calloc(1, sizeof(struct Commit));
+    if (!c) {
+        fprintf(stderr, "Memory allocation failed while starting group commit.\n");
+        return FALSE;
+    }
+    _lockinit(&c->lock);
+    _condinit(&c->work);
+    _condinit(&c->done);
+    c->dwMaxDelay = dwMaxDelay;
+    c->dwMaxBatch = dwMaxBatch;
+    db->commit = c;
+    if (!_threadstart(&c->thread, _commitmain, db)) {
+        fprintf(stderr, "Failed to start the group commit thread (system error %lu).\n", (unsigned long)GetLastError());
+        db->commit = NULL;
+        _condfree(&c->work);
+        _condfree(&c->done);
+        _lockfree(&c->lock);
+        free(c);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+EMBEDDINGS_API BOOL EMBEDDINGS_CALL filesetgroupcommit(Embeddings* db, BOOL bEnable, uint32_t dwMaxDelay, uint32_t dwMaxBatch)
+{
+    // Appenders read db->commit inside the gate, so it is created and freed with none of them inside.
+    _gatelock(db);
+    BOOL result = _filesetgroupcommit(db, bEnable, dwMaxDelay, dwMaxBatch);
+    _gateunlock(db);
+    return result;
+}
+
+/* Encodes one record and writes it (or queues it, see filesetgroupcommit). */
+static BOOL _appendone(Embeddings* db, const uiid* id, const float* blob, uint32_t op, BOOL bFlush)
+{
+	size_t cc = _recsize(&db->header);
+    uint8_t* buff = (uint8_t*)_aligned_malloc(cc, db->header.alignment);
+    if (!buff) {
+        fprintf(stderr, "Memory allocation failed while preparing the record buffer.\n");
+        return FALSE;
+    }
+    _recencode(db, buff, id, blob, op);
+    if (db->commit) {
+        BOOL bOk = _commitappend(db, buff, 1, bFlush);
+        _aligned_free(buff);
+        return bOk;
+    }
+    DWORD written = 0;
+    BOOL bOk = _ioappend(db->hWrite, db->access, buff, (DWORD)cc, &written);
+    _aligned_free(buff);
+    if (!bOk) {
+        fprintf(stderr, "Failed to append record to the database (system error %lu).\n", (unsigned long)GetLastError());
+        return FALSE;
+    }
+    if (written != cc) {
+        fprintf(stderr, "Incomplete write: expected %lu bytes but only wrote %lu bytes.\n",
+            (unsigned long)cc,
+            (unsigned long)written);
+        return FALSE;
+    }
+    if (bFlush && !_iosync(db->hWrite)) {
+        fprintf(stderr, "Failed to flush data to disk (system error %lu).\n", (unsigned long)GetLastError());
+        return FALSE;
+    }
+    _appended(db);
+    return TRUE;
+}
+
+//  Warning: Does not lock. Assumes FILE_APPEND_DATA.
+static BOOL _fileappend(Embeddings* db, uiid id, const void* blob, DWORD blobSize, BOOL bFlush) {
+    if (!db) {
+        fprintf(stderr, "The specified database pointer is NULL.\n");
+        return FALSE;
+    }
+    if (db->hWrite == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "The specified database is closed or invalid.\n");
+        return FALSE;
+    }
+    if (!blob) {
+        fprintf(stderr, "The specified blob pointer is NULL.\n");
+        return FALSE;
+    }
+    const uint32_t dim = _vecdim(&db->header);
+    if (blobSize != dim * sizeof(float)) {
+        fprintf(stderr,
+            "The specified blob size (%u) does not match the database configuration (%u).\n",
+            blobSize,
+            dim * (unsigned)sizeof(float));
+        return FALSE;
+    }
+    uint32_t op;
+    _idsops(db, &id, 1, &op);
+    return _appendone(db, &id, (const float*)blob, op, bFlush);
+}
+
+EMBEDDINGS_API BOOL EMBEDDINGS_CALL fileappend(Embeddings* db, uiid id, const void* blob, DWORD blobSize, BOOL bFlush)
+{
+    _gateenter(db, FALSE);
+    BOOL result = _fileappend(db, id, blob, blobSize, bFlush);
+    _gateleave(db);
+    return result;
+}
+
+static int32_t _filedelete(Embeddings* db, uiid id, BOOL bFlush) {
+    _dbglog("filedelete();\n");
+    if (!db) {
+        fprintf(stderr, "The specified database pointer is NULL.\n");
+        return -1;
+    }
+    if (db->hWrite == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "The specified database is closed or invalid.\n");
+        return -1;
+    }
+    if (db->header.version < 3) {
+        fprintf(stderr, "The database was created with format version %u, which cannot store deletes.\n", db->header.version);
+        return -1;
+    }
+    if (!_commitfind(db, &id)) {
+        return -1;
+    }
+    // Without the id index the tombstone is written regardless; it hides nothing if there is nothing to hide.
+    uint32_t ord = 0;
+    if (_idsfind(db, &id, 1, &ord) && ord == UINT32_MAX) {
+        return 0;
+    }
+    return _appendone(db, &id, NULL, RECORD_DELETE, bFlush) ? 1 : -1;
+}
+
+EMBEDDINGS_API int32_t EMBEDDINGS_CALL filedelete(Embeddings* db, uiid id, BOOL bFlush)
+{
+    _gateenter(db, FALSE);
+    int32_t result = _filedelete(db, id, bFlush);
+    _gateleave(db);
+    return result;
+}
+
+#define APPEND_CHUNK (8u << 20) /* largest write of fileappendbatch, in bytes (at least one record) */
+
+//  Warning: Does not lock. Assumes FILE_APPEND_DATA.
+static BOOL _fileappendbatch(Embeddings* db, const uiid* ids, const float* blobs, uint32_t n, BOOL bFlush) {
+    _dbglog("fileappendbatch(n = %u);\n", n);
+    if (!db) {
+        fprintf(stderr, "The specified database pointer is NULL.\n");
+        return FALSE;
+    }
+    if (db->hWrite == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "The specified database is closed or invalid.\n");
+        return FALSE;
+    }
+    if (n == 0) {
+        return TRUE;
+    }
+    if (!ids || !blobs) {
+        fprintf(stderr, "The specified ids or blobs pointer is NULL.\n");
+        return FALSE;
+    }
+    const uint32_t dim = _vecdim(&db->header);
+    const size_t cc = _recsize(&db->header);
+    // The records are laid out in one buffer and written with one call, APPEND_CHUNK bytes at a time.
+    uint32_t per = (uint32_t)(APPEND_CHUNK / cc);
+    if (per == 0) per = 1;
+    if (per > n) per = n;
+    uint8_t* buff = (uint8_t*)_aligned_malloc((size_t)per * cc, db->header.alignment);
+    uint32_t* ops = (uint32_t*)malloc((size_t)per * sizeof(uint32_t));
+    if (!buff || !ops) {
+        fprintf(stderr, "Memory allocation failed while preparing the record buffer.\n");
+        _aligned_free(buff);
+        free(ops);
+        return FALSE;
+    }
+    BOOL bOk = TRUE;
+    for (uint32_t i = 0; i < n && bOk; i += per) {
+        uint32_t m = n - i < per ? n - i : per;
+        _idsops(db, &ids[i], m, ops);
+        for (uint32_t r = 0; r < m; ++r) {
+            _recencode(db, buff + (size_t)r * cc, &ids[i + r], blobs + (size_t)(i + r) * dim, ops[r]);
+        }
+        if (db->commit) {
+            // The last chunk's ticket covers the chunks queued before it.
+            bOk = _commitappend(db, buff, m, bFlush && i + m == n);
+            continue;
+        }
+        DWORD written = 0;
+        if (!_ioappend(db->hWrite, db->access, buff, (DWORD)(m * cc), &written)) {
+            fprintf(stderr, "Failed to append records to the database (system error %lu).\n", (unsigned long)GetLastError());
+            bOk = FALSE;
+        }
+        else if (written != m * cc) {
+            fprintf(stderr, "Incomplete write: expected %lu bytes but only wrote %lu bytes.\n",
+                (unsigned long)(m * cc),
+                (unsigned long)written);
+            bOk = FALSE;
+        }
+    }
+    _aligned_free(buff);
+    free(ops);
+    if (db->commit) {
+        return bOk;
+    }
+    if (bOk && bFlush && !_iosync(db->hWrite)) {
+        fprintf(stderr, "Failed to flush data to disk (system error %lu).\n", (unsigned long)GetLastError());
+        bOk = FALSE;
+    }
+    // The indexes pick up whatever part of the batch made it to the file.
+    _appended(db);
+    return bOk;
+}
+
+EMBEDDINGS_API BOOL EMBEDDINGS_CALL fileappendbatch(Embeddings* db, const uiid* ids, const float* blobs, uint32_t n, BOOL bFlush)
+{
+    _gateenter(db, FALSE);
+    BOOL result = _fileappendbatch(db, ids, blobs, n, bFlush);
+    _gateleave(db);
+    return result;
+}
+
+static BOOL _fileflush(Embeddings* db) {
+    _dbglog("fileflush();\n");
+    if (!db) {
+        fprintf(stderr, "The specified database pointer is NULL.\n");
+        return FALSE;
+    }
+    if (db->hWrite == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "The specified database is closed or invalid.\n");
+        return FALSE;
+    }
+    if (db->commit) {
+        if (!_commitflush(db)) {
+            fprintf(stderr, "Failed to commit the queued records.\n");
+            return FALSE;
+        }
+        return TRUE;
+    }
+    if (!_iosync(db->hWrite)) {
+        fprintf(stderr, "Failed to flush data to disk (system error %lu).\n", (unsigned long)GetLastError());
+        return FALSE;
+    }
+    return TRUE;
+}
+
+EMBEDDINGS_API BOOL EMBEDDINGS_CALL fileflush(Embeddings* db)
+{
+    _gateenter(db, FALSE);
+    BOOL result = _fileflush(db);
+    _gateleave(db);
+    return result;
+}
+
+static BOOL _filemap(Embeddings* db, DWORD dwHints) {
+    _dbglog("filemap(hints=0x%08X);\n", dwHints);
+    if (!db) {
+        fprintf(stderr, "The specified database pointer is NULL.\n");
+        return FALSE;
+    }
+    if (!db->hWrite || db->hWrite == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "The specified database is closed or invalid.\n");
+        return FALSE;
+    }
+    if (db->view) {
+        db->view->dwHints = dwHints;
+        return TRUE;
+    }
+    struct View* view = (struct View*)calloc(1, sizeof(struct View));
+    if (!view) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        return FALSE;
+    }
+    _lockinit(&view->lock);
+    view->dwHints = dwHints;
+    db->view = view;
+    // Map now so that the first search does not pay for it, and so that failures surface here.
+    Mapping* map = _mapacquire(db);
+    if (!map) {
+        uint64_t fileSize = 0;
+        if (!_iosize(db->hWrite, &fileSize) || fileSize > 0) {
+            _fileunmap(db);
+            return FALSE;
+        }
+    }
+    _maprelease(db, map);
+    return TRUE;
+}
+
+EMBEDDINGS_API BOOL EMBEDDINGS_CALL filemap(Embeddings* db, DWORD dwHints)
+{
+    // Searches pick up db->view as they start, so it is put in place with none of them inside.
+    _gatelock(db);
+    BOOL result = _filemap(db, dwHints);
+    _gateunlock(db);
+    return result;
+}
+
+static void _fileunmap(Embeddings* db) {
+    if (!db || !db->view) return;
+    struct View* view = db->view;
+    db->view = NULL;
+    if (view->current) {
+        /* Searches holding the mapping have left the gate (see fileunmap); the caller owns the handle's lifetime. */
+        assert(view->current->refs == 1);
+        _mapdestroy(view->current);
+    }
+    _lockfree(&view->lock);
+    free(view);
+}
+
+EMBEDDINGS_API void EMBEDDINGS_CALL fileunmap(Embeddings* db)
+{
+    // The searches scoring records in place leave before the mapping goes.
+    _gatelock(db);
+    _fileunmap(db);
+    _gateunlock(db);
+}
+
+EMBEDDINGS_API BOOL EMBEDDINGS_CALL filesetrescore(Embeddings* db, BOOL bRescore) {
+    if (!db) {
+        fprintf(stderr, "The specified database pointer is NULL.\n");
+        return FALSE;
+    }
+    // Searches copy the settings in _searchprep, inside the gate.
+    _gatelock(db);
+    db->bRescore = bRescore ? TRUE : FALSE;
+    _gateunlock(db);
+    return TRUE;
+}
+
+EMBEDDINGS_API BOOL EMBEDDINGS_CALL filesetreadahead(Embeddings* db, uint32_t dwDepth, uint32_t dwRecords) {
+    if (!db) {
+        fprintf(stderr, "The specified database pointer is NULL.\n");
+        return FALSE;
+    }
+    if (!dwDepth) dwDepth = SCAN_DEPTH;
+    if (!dwRecords) dwRecords = SCAN_RECORDS;
+    if ((uint64_t)dwDepth * dwRecords * _recsize(&db->header) > SCAN_MAXBYTES) {
+        fprintf(stderr, "The read-ahead of %u buffers of %u records is larger than %u bytes.\n",
+            dwDepth, dwRecords, SCAN_MAXBYTES);
+        return FALSE;
+    }
+    // Set as a pair with no search inside, so that none pairs the new depth with the old record count.
+    _gatelock(db);
+    db->dwReadDepth = dwDepth;
+    db->dwReadRecords = dwRecords;
+    _gateunlock(db);
+    return TRUE;
+}
+
+static BOOL _filesetdirect(Embeddings* db, BOOL bDirect) {
+    _dbglog("filesetdirect(bDirect = %d);\n", bDirect);
+    if (!db) {
+        fprintf(stderr, "The specified database pointer is NULL.\n");
+        return FALSE;
+    }
+    if (!db->hWrite || db->hWrite == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "The specified database is closed or invalid.\n");
+        return FALSE;
+    }
+    HANDLE h = NULL;
+    if (bDirect) {
+        // Opened before the old handle goes, so that a failure leaves the mode as it was.
+        wchar_t wszPath[PATH];
+        _iosidecar(db, L"", wszPath);
+        h = _ioopendirect(wszPath);
+        if (!h || h == INVALID_HANDLE_VALUE) {
+            fprintf(stderr, "Failed to open '%ls' for direct I/O (system error %lu).\n", wszPath, (unsigned long)GetLastError());
+            return FALSE;
+        }
+    }
+    if (db->hDirect) {
+        _ioclose(db->hDirect);
+    }
+    db->hDirect = h;
+    return TRUE;
+}
+
+EMBEDDINGS_API BOOL EMBEDDINGS_CALL filesetdirect(Embeddings* db, BOOL bDirect)
+{
+    // Searches and cursors pick up db->hDirect as they start, so it is swapped with none of them inside.
+    _gatelock(db);
+    BOOL result = _filesetdirect(db, bDirect);
+    _gateunlock(db);
+    return result;
+}
+
+/*
+    Distance kernels.
+
+    The scalar kernels accumulate in double and are the reference. The SIMD kernels accumulate in float32
+    across W = lanes x accumulators partial sums (SSE4.2: 16, AVX2: 32, AVX-512: 64) that are reduced pairwise
+    at the end. Against the double reference the absolute error is bounded by
+
+        |sdot_simd - sdot_ref| <= (ceil(n / W) + log2(W)) * 2^-24 * sum(|a[i] * b[i]|)
+
+    For unit vectors of 768 dimensions that is < 4e-6 worst case (typically ~1e-7), well below the
+    resolution that matters for ranking. cblas_snrm2 has the same bound on the sum of squares.
+
+    The best kernel set is picked once at load time from CPUID (see _simdinit). Set EMBEDDINGS_SIMD to
+    scalar, sse42, avx2 or avx512 to force a lower level.
+*/
+
+static float _sdot_scalar(const float* a, const float* b, uint32_t n) {
+    double s = 0.0;
+    for (uint32_t i = 0; i < n; ++i) s += (double)a[i] * (double)b[i];
+    return (float)s;
+}
+
+static float _snrm2_scalar(const float* a, uint32_t n) {
+    double s = 0.0;
+    for (uint32_t i = 0; i < n; ++i) s += (double)a[i] * (double)a[i];
+    return (float)sqrt(s);
+}
+
+/* Squared Euclidean distance (METRIC_L2). */
+static float _sl2_scalar(const float* a, const float* b, uint32_t n) {
+    double s = 0.0;
+    for (uint32_t i = 0; i < n; ++i) {
+        double d = (double)a[i] - (double)b[i];
+        s += d * d;
+    }
+    return (float)s;
+}
+
+/* Manhattan distance (METRIC_L1). */
+static float _sl1_scalar(const float* a, const float* b, uint32_t n) {
+    double s = 0.0;
+    for (uint32_t i = 0; i < n; ++i) s += fabs((double)a[i] - (double)b[i]);
+    return (float)s;
+}
+
+/*
+    IEEE 754 binary16 <-> binary32, round to nearest even. The reference for the F16C kernels,
+    and what runs when the CPU has no F16C.
+*/
+static inline uint16_t _f32tof16(float f) {
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t exp = (x >> 23) & 0xFF;
+    uint32_t man = x & 0x7FFFFF;
+    if (exp == 0xFF) {
+        return (uint16_t)(sign | 0x7C00 | (man ? 0x200 | (man >> 13) : 0)); /* Inf, NaN */
+    }
+    int32_t e = (int32_t)exp - 127 + 15;
+    if (e >= 0x1F) {
+        return (uint16_t)(sign | 0x7C00); /* Overflow */
+    }
+    if (e <= 0) {
+        if (e < -10) return (uint16_t)sign; /* Underflow */
+        man |= 0x800000;
+        uint32_t shift = (uint32_t)(14 - e);
+        uint32_t half = man >> shift;
+        uint32_t rem = man & ((1u << shift) - 1), mid = 1u << (shift - 1);
+        if (rem > mid || (rem == mid && (half & 1))) half++;
+        return (uint16_t)(sign | half); /* Subnormal */
+    }
+    uint32_t half = ((uint32_t)e << 10) | (man >> 13);
+    uint32_t rem = man & 0x1FFF;
+    if (rem > 0x1000 || (rem == 0x1000 && (half & 1))) half++; /* May carry into the exponent, up to Inf */
+    return (uint16_t)(sign | half);
+}
+
+static inline float _f16tof32(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1F;
+    uint32_t man = h & 0x3FF;
+    uint32_t x;
+    if (exp == 0) {
+        if (man == 0) {
+            x = sign;
+        }
+        else {
+            exp = 127 - 15 + 1;
+            while (!(man & 0x400)) { man <<= 1; exp--; }
+            x = sign | (exp << 23) | ((man & 0x3FF) << 13);
+        }
+    }
+    else if (exp == 0x1F) {
+        x = sign | 0x7F800000 | (man << 13);
+    }
+    else {
+        x = sign | ((exp + 127 - 15) << 23) | (man << 13);
+    }
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+static void _hwiden_scalar(float* dst, const uint16_t* src, uint32_t n) {
+    for (uint32_t i = 0; i < n; ++i) dst[i] = _f16tof32(src[i]);
+}
+
+static void _hnarrow_scalar(uint16_t* dst, const float* src, uint32_t n) {
+    for (uint32_t i = 0; i < n; ++i) dst[i] = _f32tof16(src[i]);
+}
+
+static float _hdot_scalar(const float* a, const uint16_t* b, uint32_t n) {
+    double s = 0.0;
+    for (uint32_t i = 0; i < n; ++i) s += (double)a[i] * (double)_f16tof32(b[i]);
+    return (float)s;
+}
+
+static float _hnrm2_scalar(const uint16_t* a, uint32_t n) {
+    double s = 0.0;
+    for (uint32_t i = 0; i < n; ++i) {
+        double v = _f16tof32(a[i]);
+        s += v * v;
+    }
+    return (float)sqrt(s);
+}
+
+/* DTYPE_INT8: exact integer dot product of two quantized vectors. */
+static int32_t _idot_scalar(const int8_t* a, const int8_t* b, uint32_t n) {
+    int32_t s = 0;
+    for (uint32_t i = 0; i < n; ++i) s += (int32_t)a[i] * (int32_t)b[i];
+    return s;
+}
+
+/*
+    Blocked kernel for batched search: two records against four queries, out[r * 4 + q].
+    Every record chunk is loaded once for all four queries and every query chunk once for both records.
+*/
+static void _sdot2x4_scalar(const float* a0, const float* a1, const float* const q[4], uint32_t n, float out[8]) {
+    double s[8] = { 0 };
+    for (uint32_t i = 0; i < n; ++i) {
+        for (uint32_t k = 0; k < 4; ++k) {
+            s[k] += (double)a0[i] * (double)q[k][i];
+            s[4 + k] += (double)a1[i] * (double)q[k][i];
+        }
+    }
+    for (uint32_t k = 0; k < 8; ++k) out[k] = (float)s[k];
+}
+
+/*
+    PQ 4-bit fast-scan: ADC scores of a block of 32 codes against a lookup table quantized to uint8
+    (lut: M x 16). The block holds 16 bytes per sub-quantizer; byte j of sub-quantizer m has the code
+    of vector j in its low nibble and the code of vector j + 16 in its high nibble. M is even and
+    at most 256, so the sums fit in 16 bits.
+*/
+static void _pqscan4_scalar(const uint8_t* block, const uint8_t* lut, uint32_t M, uint16_t out[32]) {
+    memset(out, 0, 32 * sizeof(uint16_t));
+    for (uint32_t m = 0; m < M; ++m) {
+        const uint8_t* codes = block + (size_t)m * 16;
+        const uint8_t* t = lut + (size_t)m * 16;
+        for (uint32_t j = 0; j < 16; ++j) {
+            out[j] += t[codes[j] & 15];
+            out[j + 16] += t[codes[j] >> 4];
+        }
+    }
+}
+
+/* Hamming distances from the sign sketch q to n sketches stored back to back, words 64-bit words each. */
+static void _hamming_scalar(const uint64_t* q, const uint64_t* codes, uint32_t words, uint32_t n, uint32_t* out) {
+    for (uint32_t i = 0; i < n; ++i) {
+        const uint64_t* c = codes + (size_t)i * words;
+        uint32_t h = 0;
+        for (uint32_t w = 0; w < words; ++w) {
+            uint64_t x = q[w] ^ c[w];
+            x = x - ((x >> 1) & 0x5555555555555555ULL);
+            x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+            x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+            h += (uint32_t)((x * 0x0101010101010101ULL) >> 56);
+        }
+        out[i] = h;
+    }
+}
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define SIMD_X64
+
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define _TARGET(x)
+#else
+#include <cpuid.h>
+#define _TARGET(x) __attribute__((target(x)))
+#endif
+
+_TARGET("sse4.2")
+static inline float _hsum128(__m128 v) {
+    __m128 shuf = _mm_movehdup_ps(v);
+    __m128 sums = _mm_add_ps(v, shuf);
+    shuf = _mm_movehl_ps(shuf, sums);
+    sums = _mm_add_ss(sums, shuf);
+    return _mm_cvtss_f32(sums);
+}
+
+_TARGET("sse4.2")
+static float _sdot_sse42(const float* a, const float* b, uint32_t n) {
+    __m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps(), s2 = _mm_setzero_ps(), s3 = _mm_setzero_ps();
+    uint32_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        s1 = _mm_add_ps(s1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+        s2 = _mm_add_ps(s2, _mm_mul_ps(_mm_loadu_ps(a + i + 8), _mm_loadu_ps(b + i + 8)));
+        s3 = _mm_add_ps(s3, _mm_mul_ps(_mm_loadu_ps(a + i + 12), _mm_loadu_ps(b + i + 12)));
+    }
+    for (; i + 4 <= n; i += 4) {
+        s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    }
+    float s = _hsum128(_mm_add_ps(_mm_add_ps(s0, s1), _mm_add_ps(s2, s3)));
+    for (; i < n; ++i) s += a[i] * b[i];
+    return s;
+}
+
+_TARGET("sse4.2")
+static float _snrm2_sse42(const float* a, uint32_t n) {
+    return sqrtf(_sdot_sse42(a, a, n));
+}
+
+_TARGET("sse4.2")
+static float _sl2_sse42(const float* a, const float* b, uint32_t n) {
+    __m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+        s0 = _mm_add_ps(s0, _mm_mul_ps(d0, d0));
+        s1 = _mm_add_ps(s1, _mm_mul_ps(d1, d1));
+    }
+    for (; i + 4 <= n; i += 4) {
+        __m128 d = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        s0 = _mm_add_ps(s0, _mm_mul_ps(d, d));
+    }
+    float s = _hsum128(_mm_add_ps(s0, s1));
+    for (; i < n; ++i) s += (a[i] - b[i]) * (a[i] - b[i]);
+    return s;
+}
+
+/* |x| clears the sign bit. */
+_TARGET("sse4.2")
+static float _sl1_sse42(const float* a, const float* b, uint32_t n) {
+    const __m128 abs = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    __m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        s0 = _mm_add_ps(s0, _mm_and_ps(abs, _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i))));
+        s1 = _mm_add_ps(s1, _mm_and_ps(abs, _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4))));
+    }
+    for (; i + 4 <= n; i += 4) {
+        s0 = _mm_add_ps(s0, _mm_and_ps(abs, _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i))));
+    }
+    float s = _hsum128(_mm_add_ps(s0, s1));
+    for (; i < n; ++i) s += fabsf(a[i] - b[i]);
+    return s;
+}
+
+/*
+    Signed x signed int8 dot via pmaddubsw, which wants unsigned x signed: |a| x (b * sign(a)).
+    The quantizer keeps values in [-127, 127], so the int16 pair sums (<= 2 x 127 x 127) cannot saturate.
+*/
+_TARGET("sse4.2")
+static int32_t _idot_sse42(const int8_t* a, const int8_t* b, uint32_t n) {
+    const __m128i ones = _mm_set1_epi16(1);
+    __m128i acc = _mm_setzero_si128();
+    uint32_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+        __m128i p = _mm_maddubs_epi16(_mm_sign_epi8(x, x), _mm_sign_epi8(y, x));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(p, ones));
+    }
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    int32_t s = _mm_cvtsi128_si32(acc);
+    for (; i < n; ++i) s += (int32_t)a[i] * (int32_t)b[i];
+    return s;
+}
+
+_TARGET("sse4.2")
+static void _sdot2x4_sse42(const float* a0, const float* a1, const float* const q[4], uint32_t n, float out[8]) {
+    __m128 s[8];
+    for (uint32_t k = 0; k < 8; ++k) s[k] = _mm_setzero_ps();
+    uint32_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 x0 = _mm_loadu_ps(a0 + i), x1 = _mm_loadu_ps(a1 + i);
+        for (uint32_t k = 0; k < 4; ++k) {
+            __m128 y = _mm_loadu_ps(q[k] + i);
+            s[k] = _mm_add_ps(s[k], _mm_mul_ps(x0, y));
+            s[4 + k] = _mm_add_ps(s[4 + k], _mm_mul_ps(x1, y));
+        }
+    }
+    for (uint32_t k = 0; k < 4; ++k) {
+        float t0 = _hsum128(s[k]), t1 = _hsum128(s[4 + k]);
+        for (uint32_t j = i; j < n; ++j) {
+            t0 += a0[j] * q[k][j];
+            t1 += a1[j] * q[k][j];
+        }
+        out[k] = t0; out[4 + k] = t1;
+    }
+}
+
+_TARGET("popcnt")
+static void _hamming_popcnt(const uint64_t* q, const uint64_t* codes, uint32_t words, uint32_t n, uint32_t* out) {
+    for (uint32_t i = 0; i < n; ++i) {
+        const uint64_t* c = codes + (size_t)i * words;
+        uint64_t h0 = 0, h1 = 0;
+        uint32_t w = 0;
+        for (; w + 2 <= words; w += 2) {
+            h0 += (uint64_t)_mm_popcnt_u64(q[w] ^ c[w]);
+            h1 += (uint64_t)_mm_popcnt_u64(q[w + 1] ^ c[w + 1]);
+        }
+        if (w < words) h0 += (uint64_t)_mm_popcnt_u64(q[w] ^ c[w]);
+        out[i] = (uint32_t)(h0 + h1);
+    }
+}
+
+/* pshufb looks up 16 codes per instruction; the uint8 results are summed as even and odd uint16 lanes. */
+_TARGET("sse4.2")
+static void _pqscan4_sse42(const uint8_t* block, const uint8_t* lut, uint32_t M, uint16_t out[32]) {
+    const __m128i nibble = _mm_set1_epi8(0x0F), low = _mm_set1_epi16(0x00FF);
+    __m128i lo0 = _mm_setzero_si128(), lo1 = _mm_setzero_si128(), hi0 = _mm_setzero_si128(), hi1 = _mm_setzero_si128();
+    for (uint32_t m = 0; m < M; ++m) {
+        __m128i c = _mm_loadu_si128((const __m128i*)(block + (size_t)m * 16));
+        __m128i t = _mm_loadu_si128((const __m128i*)(lut + (size_t)m * 16));
+        __m128i a = _mm_shuffle_epi8(t, _mm_and_si128(c, nibble));
+        __m128i b = _mm_shuffle_epi8(t, _mm_and_si128(_mm_srli_epi16(c, 4), nibble));
+        lo0 = _mm_add_epi16(lo0, _mm_and_si128(a, low));
+        lo1 = _mm_add_epi16(lo1, _mm_srli_epi16(a, 8));
+        hi0 = _mm_add_epi16(hi0, _mm_and_si128(b, low));
+        hi1 = _mm_add_epi16(hi1, _mm_srli_epi16(b, 8));
+    }
+    _mm_storeu_si128((__m128i*)(out + 0), _mm_unpacklo_epi16(lo0, lo1));
+    _mm_storeu_si128((__m128i*)(out + 8), _mm_unpackhi_epi16(lo0, lo1));
+    _mm_storeu_si128((__m128i*)(out + 16), _mm_unpacklo_epi16(hi0, hi1));
+    _mm_storeu_si128((__m128i*)(out + 24), _mm_unpackhi_epi16(hi0, hi1));
+}
+
+_TARGET("avx2,fma")
+static inline float _hsum256(__m256 v) {
+    __m128 lo = _mm256_castps256_ps128(v);
+    __m128 hi = _mm256_extractf128_ps(v, 1);
+    return _hsum128(_mm_add_ps(lo, hi));
+}
+
+_TARGET("avx2,fma")
+static float _sdot_avx2(const float* a, const float* b, uint32_t n) {
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps(), s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+    uint32_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), s0);
+        s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), s1);
+        s2 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 16), _mm256_loadu_ps(b + i + 16), s2);
+        s3 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 24), _mm256_loadu_ps(b + i + 24), s3);
+    }
+    for (; i + 8 <= n; i += 8) {
+        s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), s0);
+    }
+    float s = _hsum256(_mm256_add_ps(_mm256_add_ps(s0, s1), _mm256_add_ps(s2, s3)));
+    for (; i < n; ++i) s += a[i] * b[i];
+    return s;
+}
+
+_TARGET("avx2,fma")
+static float _snrm2_avx2(const float* a, uint32_t n) {
+    return sqrtf(_sdot_avx2(a, a, n));
+}
+
+_TARGET("avx2,fma")
+static float _sl2_avx2(const float* a, const float* b, uint32_t n) {
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps(), s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+    uint32_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        __m256 d2 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 16), _mm256_loadu_ps(b + i + 16));
+        __m256 d3 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 24), _mm256_loadu_ps(b + i + 24));
+        s0 = _mm256_fmadd_ps(d0, d0, s0);
+        s1 = _mm256_fmadd_ps(d1, d1, s1);
+        s2 = _mm256_fmadd_ps(d2, d2, s2);
+        s3 = _mm256_fmadd_ps(d3, d3, s3);
+    }
+    for (; i + 8 <= n; i += 8) {
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        s0 = _mm256_fmadd_ps(d, d, s0);
+    }
+    float s = _hsum256(_mm256_add_ps(_mm256_add_ps(s0, s1), _mm256_add_ps(s2, s3)));
+    for (; i < n; ++i) s += (a[i] - b[i]) * (a[i] - b[i]);
+    return s;
+}
+
+_TARGET("avx2,fma")
+static float _sl1_avx2(const float* a, const float* b, uint32_t n) {
+    const __m256 abs = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps(), s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+    uint32_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        s0 = _mm256_add_ps(s0, _mm256_and_ps(abs, _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i))));
+        s1 = _mm256_add_ps(s1, _mm256_and_ps(abs, _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8))));
+        s2 = _mm256_add_ps(s2, _mm256_and_ps(abs, _mm256_sub_ps(_mm256_loadu_ps(a + i + 16), _mm256_loadu_ps(b + i + 16))));
+        s3 = _mm256_add_ps(s3, _mm256_and_ps(abs, _mm256_sub_ps(_mm256_loadu_ps(a + i + 24), _mm256_loadu_ps(b + i + 24))));
+    }
+    for (; i + 8 <= n; i += 8) {
+        s0 = _mm256_add_ps(s0, _mm256_and_ps(abs, _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i))));
+    }
+    float s = _hsum256(_mm256_add_ps(_mm256_add_ps(s0, s1), _mm256_add_ps(s2, s3)));
+    for (; i < n; ++i) s += fabsf(a[i] - b[i]);
+    return s;
+}
+
+_TARGET("avx2,fma")
+static int32_t _idot_avx2(const int8_t* a, const int8_t* b, uint32_t n) {
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256();
+    uint32_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        __m256i x0 = _mm256_loadu_si256((const __m256i*)(a + i)), y0 = _mm256_loadu_si256((const __m256i*)(b + i));
+        __m256i x1 = _mm256_loadu_si256((const __m256i*)(a + i + 32)), y1 = _mm256_loadu_si256((const __m256i*)(b + i + 32));
+        acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_maddubs_epi16(_mm256_sign_epi8(x0, x0), _mm256_sign_epi8(y0, x0)), ones));
+        acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_maddubs_epi16(_mm256_sign_epi8(x1, x1), _mm256_sign_epi8(y1, x1)), ones));
+    }
+    for (; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(a + i)), y = _mm256_loadu_si256((const __m256i*)(b + i));
+        acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_maddubs_epi16(_mm256_sign_epi8(x, x), _mm256_sign_epi8(y, x)), ones));
+    }
+    __m256i acc = _mm256_add_epi32(acc0, acc1);
+    __m128i v = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    int32_t s = _mm_cvtsi128_si32(v);
+    for (; i < n; ++i) s += (int32_t)a[i] * (int32_t)b[i];
+    return s;
+}
+
+_TARGET("avx2,fma")
+static void _sdot2x4_avx2(const float* a0, const float* a1, const float* const q[4], uint32_t n, float out[8]) {
+    __m256 s[8];
+    for (uint32_t k = 0; k < 8; ++k) s[k] = _mm256_setzero_ps();
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 x0 = _mm256_loadu_ps(a0 + i), x1 = _mm256_loadu_ps(a1 + i);
+        for (uint32_t k = 0; k < 4; ++k) {
+            __m256 y = _mm256_loadu_ps(q[k] + i);
+            s[k] = _mm256_fmadd_ps(x0, y, s[k]);
+            s[4 + k] = _mm256_fmadd_ps(x1, y, s[4 + k]);
+        }
+    }
+    for (uint32_t k = 0; k < 4; ++k) {
+        float t0 = _hsum256(s[k]), t1 = _hsum256(s[4 + k]);
+        for (uint32_t j = i; j < n; ++j) {
+            t0 += a0[j] * q[k][j];
+            t1 += a1[j] * q[k][j];
+        }
+        out[k] = t0; out[4 + k] = t1;
+    }
+}
+
+/* Two sub-quantizers per instruction, one in each 128-bit lane; the lanes are folded at the end. */
+_TARGET("avx2,fma")
+static void _pqscan4_avx2(const uint8_t* block, const uint8_t* lut, uint32_t M, uint16_t out[32]) {
+    const __m256i nibble = _mm256_set1_epi8(0x0F), low = _mm256_set1_epi16(0x00FF);
+    __m256i lo0 = _mm256_setzero_si256(), lo1 = _mm256_setzero_si256(), hi0 = _mm256_setzero_si256(), hi1 = _mm256_setzero_si256();
+    for (uint32_t m = 0; m < M; m += 2) {
+        __m256i c = _mm256_loadu_si256((const __m256i*)(block + (size_t)m * 16));
+        __m256i t = _mm256_loadu_si256((const __m256i*)(lut + (size_t)m * 16));
+        __m256i a = _mm256_shuffle_epi8(t, _mm256_and_si256(c, nibble));
+        __m256i b = _mm256_shuffle_epi8(t, _mm256_and_si256(_mm256_srli_epi16(c, 4), nibble));
+        lo0 = _mm256_add_epi16(lo0, _mm256_and_si256(a, low));
+        lo1 = _mm256_add_epi16(lo1, _mm256_srli_epi16(a, 8));
+        hi0 = _mm256_add_epi16(hi0, _mm256_and_si256(b, low));
+        hi1 = _mm256_add_epi16(hi1, _mm256_srli_epi16(b, 8));
+    }
+    __m128i l0 = _mm_add_epi16(_mm256_castsi256_si128(lo0), _mm256_extracti128_si256(lo0, 1));
+    __m128i l1 = _mm_add_epi16(_mm256_castsi256_si128(lo1), _mm256_extracti128_si256(lo1, 1));
+    __m128i h0 = _mm_add_epi16(_mm256_castsi256_si128(hi0), _mm256_extracti128_si256(hi0, 1));
+    __m128i h1 = _mm_add_epi16(_mm256_castsi256_si128(hi1), _mm256_extracti128_si256(hi1, 1));
+    _mm_storeu_si128((__m128i*)(out + 0), _mm_unpacklo_epi16(l0, l1));
+    _mm_storeu_si128((__m128i*)(out + 8), _mm_unpackhi_epi16(l0, l1));
+    _mm_storeu_si128((__m128i*)(out + 16), _mm_unpacklo_epi16(h0, h1));
+    _mm_storeu_si128((__m128i*)(out + 24), _mm_unpackhi_epi16(h0, h1));
+}
+
+/* F16C: widen 8 halves per instruction, accumulate in float32 exactly like _sdot_avx2. */
+
+_TARGET("avx2,fma,f16c")
+static float _hdot_f16c(const float* a, const uint16_t* b, uint32_t n) {
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps(), s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+    uint32_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(b + i))), s0);
+        s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(b + i + 8))), s1);
+        s2 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 16), _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(b + i + 16))), s2);
+        s3 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 24), _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(b + i + 24))), s3);
+    }
+    for (; i + 8 <= n; i += 8) {
+        s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(b + i))), s0);
+    }
+    float s = _hsum256(_mm256_add_ps(_mm256_add_ps(s0, s1), _mm256_add_ps(s2, s3)));
+    for (; i < n; ++i) s += a[i] * _f16tof32(b[i]);
+    return s;
+}
+
+_TARGET("avx2,fma,f16c")
+static float _hnrm2_f16c(const uint16_t* a, uint32_t n) {
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+    uint32_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 x0 = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(a + i)));
+        __m256 x1 = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(a + i + 8)));
+        s0 = _mm256_fmadd_ps(x0, x0, s0);
+        s1 = _mm256_fmadd_ps(x1, x1, s1);
+    }
+    float s = _hsum256(_mm256_add_ps(s0, s1));
+    for (; i < n; ++i) {
+        float v = _f16tof32(a[i]);
+        s += v * v;
+    }
+    return sqrtf(s);
+}
+
+_TARGET("avx2,fma,f16c")
+static void _hwiden_f16c(float* dst, const uint16_t* src, uint32_t n) {
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(src + i))));
+    }
+    for (; i < n; ++i) dst[i] = _f16tof32(src[i]);
+}
+
+_TARGET("avx2,fma,f16c")
+static void _hnarrow_f16c(uint16_t* dst, const float* src, uint32_t n) {
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm_storeu_si128((__m128i*)(dst + i), _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+    }
+    for (; i < n; ++i) dst[i] = _f32tof16(src[i]);
+}
+
+_TARGET("avx512f")
+static float _sdot_avx512(const float* a, const float* b, uint32_t n) {
+    __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps(), s2 = _mm512_setzero_ps(), s3 = _mm512_setzero_ps();
+    uint32_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        s0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), s0);
+        s1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), s1);
+        s2 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 32), _mm512_loadu_ps(b + i + 32), s2);
+        s3 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 48), _mm512_loadu_ps(b + i + 48), s3);
+    }
+    for (; i + 16 <= n; i += 16) {
+        s0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), s0);
+    }
+    if (i < n) {
+        __mmask16 m = (__mmask16)((1u << (n - i)) - 1);
+        s1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i), s1);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(_mm512_add_ps(s0, s1), _mm512_add_ps(s2, s3)));
+}
+
+_TARGET("avx512f")
+static float _snrm2_avx512(const float* a, uint32_t n) {
+    return sqrtf(_sdot_avx512(a, a, n));
+}
+
+_TARGET("avx512f")
+static float _sl2_avx512(const float* a, const float* b, uint32_t n) {
+    __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+    uint32_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+        s0 = _mm512_fmadd_ps(d0, d0, s0);
+        s1 = _mm512_fmadd_ps(d1, d1, s1);
+    }
+    for (; i < n; i += 16) {
+        __mmask16 m = n - i >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - i)) - 1);
+        __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i));
+        s0 = _mm512_fmadd_ps(d, d, s0);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(s0, s1));
+}
+
+_TARGET("avx512f")
+static float _sl1_avx512(const float* a, const float* b, uint32_t n) {
+    __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+    uint32_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        s0 = _mm512_add_ps(s0, _mm512_abs_ps(_mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i))));
+        s1 = _mm512_add_ps(s1, _mm512_abs_ps(_mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16))));
+    }
+    for (; i < n; i += 16) {
+        __mmask16 m = n - i >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - i)) - 1);
+        s0 = _mm512_add_ps(s0, _mm512_abs_ps(_mm512_sub_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i))));
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(s0, s1));
+}
+
+/* AVX-512 VPOPCNTDQ: eight words per instruction, the tail of a sketch under a mask. */
+_TARGET("avx512f,avx512vpopcntdq")
+static void _hamming_vpopcntdq(const uint64_t* q, const uint64_t* codes, uint32_t words, uint32_t n, uint32_t* out) {
+    for (uint32_t i = 0; i < n; ++i) {
+        const uint64_t* c = codes + (size_t)i * words;
+        __m512i acc = _mm512_setzero_si512();
+        for (uint32_t w = 0; w < words; w += 8) {
+            __mmask8 m = words - w >= 8 ? (__mmask8)0xFF : (__mmask8)((1u << (words - w)) - 1);
+            __m512i x = _mm512_xor_si512(_mm512_maskz_loadu_epi64(m, q + w), _mm512_maskz_loadu_epi64(m, c + w));
+            acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(x));
+        }
+        out[i] = (uint32_t)_mm512_reduce_add_epi64(acc);
+    }
+}
+
+/* AVX-512 VNNI: vpdpbusd on |a| x (b * sign(a)), 64 products per instruction without int16 intermediates. */
+_TARGET("avx512f,avx512bw,avx512vnni")
+static int32_t _idot_vnni(const int8_t* a, const int8_t* b, uint32_t n) {
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i acc = _mm512_setzero_si512();
+    uint32_t i = 0;
+    for (; i < n; i += 64) {
+        __mmask64 m = n - i >= 64 ? ~(__mmask64)0 : (((__mmask64)1 << (n - i)) - 1);
+        __m512i x = _mm512_maskz_loadu_epi8(m, a + i), y = _mm512_maskz_loadu_epi8(m, b + i);
+        __m512i sy = _mm512_mask_sub_epi8(y, _mm512_movepi8_mask(x), zero, y);
+        acc = _mm512_dpbusd_epi32(acc, _mm512_abs_epi8(x), sy);
+    }
+    return _mm512_reduce_add_epi32(acc);
+}
+
+_TARGET("avx512f")
+static float _hdot_avx512(const float* a, const uint16_t* b, uint32_t n) {
+    __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+    uint32_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        s0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(b + i))), s0);
+        s1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(b + i + 16))), s1);
+    }
+    for (; i + 16 <= n; i += 16) {
+        s0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(b + i))), s0);
+    }
+    float s = _mm512_reduce_add_ps(_mm512_add_ps(s0, s1));
+    for (; i < n; ++i) s += a[i] * _f16tof32(b[i]);
+    return s;
+}
+
+_TARGET("avx512f")
+static float _hnrm2_avx512(const uint16_t* a, uint32_t n) {
+    __m512 s0 = _mm512_setzero_ps();
+    uint32_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 x = _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(a + i)));
+        s0 = _mm512_fmadd_ps(x, x, s0);
+    }
+    float s = _mm512_reduce_add_ps(s0);
+    for (; i < n; ++i) {
+        float v = _f16tof32(a[i]);
+        s += v * v;
+    }
+    return sqrtf(s);
+}
+
+_TARGET("avx512f")
+static void _sdot2x4_avx512(const float* a0, const float* a1, const float* const q[4], uint32_t n, float out[8]) {
+    __m512 s[8];
+    for (uint32_t k = 0; k < 8; ++k) s[k] = _mm512_setzero_ps();
+    uint32_t i = 0;
+    for (; i < n; i += 16) {
+        __mmask16 m = n - i >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - i)) - 1);
+        __m512 x0 = _mm512_maskz_loadu_ps(m, a0 + i), x1 = _mm512_maskz_loadu_ps(m, a1 + i);
+        for (uint32_t k = 0; k < 4; ++k) {
+            __m512 y = _mm512_maskz_loadu_ps(m, q[k] + i);
+            s[k] = _mm512_fmadd_ps(x0, y, s[k]);
+            s[4 + k] = _mm512_fmadd_ps(x1, y, s[4 + k]);
+        }
+    }
+    for (uint32_t k = 0; k < 8; ++k) out[k] = _mm512_reduce_add_ps(s[k]);
+}
+
+static void _cpuid(uint32_t leaf, uint32_t sub, uint32_t r[4]) {
+#if defined(_MSC_VER)
+    int regs[4];
+    __cpuidex(regs, (int)leaf, (int)sub);
+    r[0] = regs[0]; r[1] = regs[1]; r[2] = regs[2]; r[3] = regs[3];
+#else
+    __cpuid_count(leaf, sub, r[0], r[1], r[2], r[3]);
+#endif
+}
+
+static uint64_t _xgetbv0(void) {
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    uint32_t lo, hi;
+    __asm__ volatile ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return ((uint64_t)hi << 32) | lo;
+#endif
+}
+#endif
+
+typedef enum SIMD {
+    SIMD_SCALAR = 0,
+    SIMD_SSE42 = 1,
+    SIMD_AVX2 = 2,
+    SIMD_AVX512 = 3
+} SIMD;
+
+typedef struct Kernels {
+    SIMD level;
+    const char* name;
+    float (*sdot)(const float* a, const float* b, uint32_t n);
+    float (*snrm2)(const float* a, uint32_t n);
+    float (*sl2)(const float* a, const float* b, uint32_t n);
+    float (*sl1)(const float* a, const float* b, uint32_t n);
+    void (*sdot2x4)(const float* a0, const float* a1, const float* const q[4], uint32_t n, float out[8]);
+    /* DTYPE_FLOAT16 */
+    float (*hdot)(const float* a, const uint16_t* b, uint32_t n);
+    float (*hnrm2)(const uint16_t* a, uint32_t n);
+    void (*hwiden)(float* dst, const uint16_t* src, uint32_t n);
+    void (*hnarrow)(uint16_t* dst, const float* src, uint32_t n);
+    /* DTYPE_INT8 */
+    int32_t (*idot)(const int8_t* a, const int8_t* b, uint32_t n);
+    /* PQ fast-scan */
+    void (*pqscan4)(const uint8_t* block, const uint8_t* lut, uint32_t M, uint16_t out[32]);
+    /* Sign sketches */
+    void (*hamming)(const uint64_t* q, const uint64_t* codes, uint32_t words, uint32_t n, uint32_t* out);
+} Kernels;
+
+#define KERNELS_SCALAR { SIMD_SCALAR, "scalar", _sdot_scalar, _snrm2_scalar, _sl2_scalar, _sl1_scalar, _sdot2x4_scalar, \
+    _hdot_scalar, _hnrm2_scalar, _hwiden_scalar, _hnarrow_scalar, _idot_scalar, _pqscan4_scalar, \
+    _hamming_scalar }
+
+static Kernels _kernels = KERNELS_SCALAR;
+
+static SIMD _simddetect(void) {
+    SIMD level = SIMD_SCALAR;
+#if defined(SIMD_X64)
+    uint32_t r[4];
+    _cpuid(0, 0, r);
+    uint32_t max = r[0];
+    if (max < 1) return level;
+    _cpuid(1, 0, r);
+    const uint32_t ecx1 = r[2];
+    if (ecx1 & (1u << 20)) level = SIMD_SSE42;
+    const BOOL osxsave = (ecx1 & (1u << 27)) != 0;
+    const BOOL avx = (ecx1 & (1u << 28)) != 0;
+    const BOOL fma = (ecx1 & (1u << 12)) != 0;
+    if (max < 7 || !osxsave || !avx) return level;
+    const uint64_t xcr0 = _xgetbv0();
+    if ((xcr0 & 0x6) != 0x6) return level; /* XMM and YMM state */
+    _cpuid(7, 0, r);
+    const uint32_t ebx7 = r[1];
+    if ((ebx7 & (1u << 5)) && fma) level = SIMD_AVX2;
+    /* The AVX-512 set also runs AVX2 and FMA kernels, so it needs the AVX2 level first. */
+    if (level == SIMD_AVX2 && (ebx7 & (1u << 16)) && (xcr0 & 0xE6) == 0xE6) level = SIMD_AVX512; /* + opmask, ZMM_Hi256, Hi16_ZMM */
+#endif
+    return level;
+}
+
+static BOOL _hasf16c(void) {
+#if defined(SIMD_X64)
+    uint32_t r[4];
+    _cpuid(1, 0, r);
+    return (r[2] & (1u << 29)) != 0;
+#else
+    return FALSE;
+#endif
+}
+
+static BOOL _haspopcnt(void) {
+#if defined(SIMD_X64)
+    uint32_t r[4];
+    _cpuid(1, 0, r);
+    return (r[2] & (1u << 23)) != 0;
+#else
+    return FALSE;
+#endif
+}
+
+static BOOL _hasvpopcntdq(void) {
+#if defined(SIMD_X64)
+    uint32_t r[4];
+    _cpuid(7, 0, r);
+    return (r[2] & (1u << 14)) != 0; /* AVX512_VPOPCNTDQ */
+#else
+    return FALSE;
+#endif
+}
+
+static BOOL _hasvnni(void) {
+#if defined(SIMD_X64)
+    uint32_t r[4];
+    _cpuid(7, 0, r);
+    return (r[1] & (1u << 30)) && (r[2] & (1u << 11)); /* AVX512BW, AVX512_VNNI */
+#else
+    return FALSE;
+#endif
+}
+
+static void _simdinit(void) {
+    SIMD level = _simddetect();
+    const char* force = getenv("EMBEDDINGS_SIMD");
+    if (force && *force) {
+        SIMD want = level;
+        if (strcmp(force, "scalar") == 0) want = SIMD_SCALAR;
+        else if (strcmp(force, "sse42") == 0) want = SIMD_SSE42;
+        else if (strcmp(force, "avx2") == 0) want = SIMD_AVX2;
+        else if (strcmp(force, "avx512") == 0) want = SIMD_AVX512;
+        else fprintf(stderr, "Warning: unknown EMBEDDINGS_SIMD='%s' ignored.\n", force);
+        if (want < level) level = want;
+    }
+    Kernels k = KERNELS_SCALAR;
+#if defined(SIMD_X64)
+    switch (level) {
+    case SIMD_AVX512:
+        k.level = SIMD_AVX512; k.name = "avx512"; k.sdot = _sdot_avx512; k.snrm2 = _snrm2_avx512; k.sdot2x4 = _sdot2x4_avx512;
+        k.sl2 = _sl2_avx512; k.sl1 = _sl1_avx512;
+        k.hdot = _hdot_avx512; k.hnrm2 = _hnrm2_avx512;
+        k.idot = _hasvnni() ? _idot_vnni : _idot_avx2;
+        k.pqscan4 = _pqscan4_avx2;
+        if (_hasvpopcntdq()) k.hamming = _hamming_vpopcntdq;
+        else if (_haspopcnt()) k.hamming = _hamming_popcnt;
+        if (_hasf16c()) {
+            k.hwiden = _hwiden_f16c; k.hnarrow = _hnarrow_f16c;
+        }
+        break;
+    case SIMD_AVX2:
+        k.level = SIMD_AVX2; k.name = "avx2"; k.sdot = _sdot_avx2; k.snrm2 = _snrm2_avx2; k.sdot2x4 = _sdot2x4_avx2; k.idot = _idot_avx2;
+        k.sl2 = _sl2_avx2; k.sl1 = _sl1_avx2;
+        k.pqscan4 = _pqscan4_avx2;
+        if (_haspopcnt()) k.hamming = _hamming_popcnt;
+        if (_hasf16c()) {
+            k.hdot = _hdot_f16c; k.hnrm2 = _hnrm2_f16c; k.hwiden = _hwiden_f16c; k.hnarrow = _hnarrow_f16c;
+        }
+        break;
+    case SIMD_SSE42:
+        k.level = SIMD_SSE42; k.name = "sse42"; k.sdot = _sdot_sse42; k.snrm2 = _snrm2_sse42; k.sdot2x4 = _sdot2x4_sse42; k.idot = _idot_sse42;
+        k.sl2 = _sl2_sse42; k.sl1 = _sl1_sse42;
+        k.pqscan4 = _pqscan4_sse42;
+        if (_haspopcnt()) k.hamming = _hamming_popcnt;
+        break;
+    default:
+        break;
+    }
+#endif
+    _kernels = k;
+    _dbglog("simd = %s;\n", _kernels.name);
+}
+
+#if !defined(_WIN32)
+/* Windows runs _simdinit from DllMain(DLL_PROCESS_ATTACH). */
+__attribute__((constructor))
+static void _simdload(void) {
+    _simdinit();
+}
+#endif
+
+static inline float cblas_sdot(const float* a, const float* b, uint32_t n) {
+    return _kernels.sdot(a, b, n);
+}
+
+static inline float cblas_snrm2(const float* a, uint32_t n) {
+    return _kernels.snrm2(a, n);
+}
+
+/*
+    Vector storage by DTYPE. The API always takes and returns float32 vectors; the file holds
+    them as header.dtype and the scan scores the stored form against the float32 query directly.
+
+    DTYPE_INT8 is symmetric per-vector quantization: [float scale][dim x int8_t] with
+    scale = max|x| / 127 and x[i] ~ scale * q[i], q[i] in [-127, 127].
+*/
+
+static void _i8encode(uint8_t* dst, const float* src, uint32_t dim) {
+    float amax = 0;
+    for (uint32_t i = 0; i < dim; ++i) {
+        float a = fabsf(src[i]);
+        if (a > amax) amax = a;
+    }
+    float scale = amax / 127.0f;
+    float inv = scale > 0 ? 1.0f / scale : 0;
+    memcpy(dst, &scale, sizeof(float));
+    int8_t* q = (int8_t*)(dst + sizeof(float));
+    for (uint32_t i = 0; i < dim; ++i) {
+        float v = src[i] * inv;
+        if (v != v) v = 0; /* NaN */
+        v = v > 127.0f ? 127.0f : (v < -127.0f ? -127.0f : v);
+        q[i] = (int8_t)lrintf(v);
+    }
+}
+
+static inline float _i8scale(const void* blob) {
+    float scale;
+    memcpy(&scale, blob, sizeof(float));
+    return scale;
+}
+
+static void _vecencode(uint8_t dtype, void* dst, const float* src, uint32_t dim) {
+    switch (dtype) {
+    case DTYPE_FLOAT16: _kernels.hnarrow((uint16_t*)dst, src, dim); break;
+    case DTYPE_INT8: _i8encode((uint8_t*)dst, src, dim); break;
+    default: memcpy(dst, src, (size_t)dim * sizeof(float)); break;
+    }
+}
+
+static void _vecdecode(uint8_t dtype, float* dst, const void* src, uint32_t dim) {
+    switch (dtype) {
+    case DTYPE_FLOAT16: _kernels.hwiden(dst, (const uint16_t*)src, dim); break;
+    case DTYPE_INT8: {
+        float scale = _i8scale(src);
+        const int8_t* q = (const int8_t*)src + sizeof(float);
+        for (uint32_t i = 0; i < dim; ++i) dst[i] = scale * (float)q[i];
+        break;
+    }
+    default: memcpy(dst, src, (size_t)dim * sizeof(float)); break;
+    }
+}
+
+/* Dot product of the stored vector with a float32 query. For DTYPE_INT8 this is the float32 rescoring path. */
+static inline float _vecdot(uint8_t dtype, const void* blob, const float* query, uint32_t dim) {
+    switch (dtype) {
+    case DTYPE_FLOAT16: return _kernels.hdot(query, (const uint16_t*)blob, dim);
+    case DTYPE_INT8: {
+        const int8_t* q = (const int8_t*)blob + sizeof(float);
+        double s = 0.0;
+        for (uint32_t i = 0; i < dim; ++i) s += (double)query[i] * (double)q[i];
+        return (float)(s * _i8scale(blob));
+    }
+    default: return cblas_sdot((const float*)blob, query, dim);
+    }
+}
+
+static inline float _vecnrm2(uint8_t dtype, const void* blob, uint32_t dim) {
+    switch (dtype) {
+    case DTYPE_FLOAT16: return _kernels.hnrm2((const uint16_t*)blob, dim);
+    case DTYPE_INT8: {
+        const int8_t* q = (const int8_t*)blob + sizeof(float);
+        return _i8scale(blob) * sqrtf((float)_kernels.idot(q, q, dim));
+    }
+    default: return cblas_snrm2((const float*)blob, dim);
+    }
+}
+
+const float EPSILON = 1e-6f;
+
+static int __cdecl heap_qsort_func(const void* pa, const void* pb)
+{
+    const Score* a = (const Score*)pa;
+    const Score* b = (const Score*)pb;
+    return (a->score < b->score) - (a->score > b->score);
+}
+
+/*
+    Bounded top-k: a binary min-heap on score (the root is the weakest hit) plus an open-addressing
+    table keyed by _uiidhash that maps each id in the heap to its heap position. Insert, evict and
+    remove-by-id are O(log k); checking whether a scanned id is already in the heap is O(1).
+*/
+
+typedef struct TopK {
+    Score* heap;
+    uint64_t* hash; /* _uiidhash of heap[i].id */
+    uint32_t* slot; /* table slot that points at heap[i] */
+    uint32_t* table; /* heap index + 1, 0 when empty */
+    size_t mask;
+    size_t num;
+    uint32_t topk;
+} TopK;
+
+static BOOL topkinit(TopK* h, uint32_t topk)
+{
+    memset(h, 0, sizeof(*h));
+    size_t cap = 16;
+    while (cap < (size_t)topk * 2) cap <<= 1;
+    h->heap = (Score*)calloc(topk, sizeof(Score));
+    h->hash = (uint64_t*)calloc(topk, sizeof(uint64_t));
+    h->slot = (uint32_t*)calloc(topk, sizeof(uint32_t));
+    h->table = (uint32_t*)calloc(cap, sizeof(uint32_t));
+    h->mask = cap - 1;
+    h->topk = topk;
+    if (!h->heap || !h->hash || !h->slot || !h->table) {
+        free(h->heap); free(h->hash); free(h->slot); free(h->table);
+        memset(h, 0, sizeof(*h));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void topkfree(TopK* h)
+{
+    free(h->heap); free(h->hash); free(h->slot); free(h->table);
+    memset(h, 0, sizeof(*h));
+}
+
+static void topkclear(TopK* h)
+{
+    memset(h->table, 0, (h->mask + 1) * sizeof(uint32_t));
+    h->num = 0;
+}
+
+static inline void _topkset(TopK* h, size_t i, const Score* s, uint64_t hash, uint32_t slot)
+{
+    h->heap[i] = *s;
+    h->hash[i] = hash;
+    h->slot[i] = slot;
+    h->table[slot] = (uint32_t)i + 1;
+}
+
+static void _topksiftup(TopK* h, size_t i)
+{
+    Score s = h->heap[i]; uint64_t hash = h->hash[i]; uint32_t slot = h->slot[i];
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!(s.score < h->heap[parent].score)) break;
+        _topkset(h, i, &h->heap[parent], h->hash[parent], h->slot[parent]);
+        i = parent;
+    }
+    _topkset(h, i, &s, hash, slot);
+}
+
+static void _topksiftdown(TopK* h, size_t i)
+{
+    Score s = h->heap[i]; uint64_t hash = h->hash[i]; uint32_t slot = h->slot[i];
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= h->num) break;
+        if (child + 1 < h->num && h->heap[child + 1].score < h->heap[child].score) child++;
+        if (!(h->heap[child].score < s.score)) break;
+        _topkset(h, i, &h->heap[child], h->hash[child], h->slot[child]);
+        i = child;
+    }
+    _topkset(h, i, &s, hash, slot);
+}
+
+/* Returns the table slot holding id, or the empty slot where it would go. */
+static inline size_t _topkprobe(const TopK* h, const uiid* id, uint64_t hash, BOOL* pFound)
+{
+    size_t i = (size_t)hash & h->mask;
+    while (h->table[i]) {
+        size_t e = h->table[i] - 1;
+        if (h->hash[e] == hash && _uiidcmp(&h->heap[e].id, id)) {
+            *pFound = TRUE;
+            return i;
+        }
+        i = (i + 1) & h->mask;
+    }
+    *pFound = FALSE;
+    return i;
+}
+
+/* Backward-shift deletion keeps the probe sequences intact without tombstones. */
+static void _topkunlink(TopK* h, size_t i)
+{
+    size_t j = i;
+    for (;;) {
+        h->table[i] = 0;
+        for (;;) {
+            j = (j + 1) & h->mask;
+            if (!h->table[j]) return;
+            size_t e = h->table[j] - 1;
+            size_t home = (size_t)h->hash[e] & h->mask;
+            BOOL bStays = (i <= j)
+                ? (i < home && home <= j)
+                : (i < home || home <= j);
+            if (!bStays) break;
+        }
+        size_t e = h->table[j] - 1;
+        h->table[i] = h->table[j];
+        h->slot[e] = (uint32_t)i;
+        i = j;
+    }
+}
+
+static void _topkremoveat(TopK* h, size_t i)
+{
+    _topkunlink(h, h->slot[i]);
+    h->num--;
+    if (i == h->num) return;
+    _topkset(h, i, &h->heap[h->num], h->hash[h->num], h->slot[h->num]);
+    if (i > 0 && h->heap[i].score < h->heap[(i - 1) / 2].score)
+        _topksiftup(h, i);
+    else
+        _topksiftdown(h, i);
+}
+
+/* A later record with the same id replaces the earlier one (upsert). TRUE when it removed a hit. */
+static inline BOOL topkremoveif(TopK* h, const uiid* id)
+{
+    if (!h->num) return FALSE;
+    BOOL bFound;
+    uint64_t hash = _uiidhash((uiid*)id);
+    size_t i = _topkprobe(h, id, hash, &bFound);
+    if (bFound) {
+        _topkremoveat(h, h->table[i] - 1);
+    }
+    return bFound;
+}
+
+static inline void topkpush(TopK* h, const uiid* id, float score)
+{
+    if (h->num >= h->topk && !(score > h->heap[0].score)) {
+        return;
+    }
+    Score s;
+    _uiidcpy(&s.id, id);
+    s.score = score;
+    uint64_t hash = _uiidhash((uiid*)id);
+    if (h->num < h->topk) {
+        // start accumulating until we fill the heap
+        BOOL bFound;
+        size_t slot = _topkprobe(h, id, hash, &bFound);
+        assert(!bFound);
+        size_t i = h->num++;
+        _topkset(h, i, &s, hash, (uint32_t)slot);
+        _topksiftup(h, i);
+    }
+    else {
+        // evict the lowest score
+        _topkunlink(h, h->slot[0]);
+        BOOL bFound;
+        size_t slot = _topkprobe(h, id, hash, &bFound);
+        assert(!bFound);
+        _topkset(h, 0, &s, hash, (uint32_t)slot);
+        _topksiftdown(h, 0);
+    }
+}
+
+/* Lowest score that can still enter the heap. */
+static inline float topkfloor(const TopK* h)
+{
+    return h->num < h->topk ? -INFINITY : h->heap[0].score;
+}
+
+/* Copies the hits out in descending score order. The heap is consumed. */
+static size_t topkdrain(TopK* h, Score* scores)
+{
+    size_t num = h->num;
+    memcpy(scores, h->heap, num * sizeof(Score));
+    qsort(scores, num, sizeof(Score), heap_qsort_func);
+    return num;
+}
+
+/*
+    Set of 64-bit id hashes (open addressing, linear probing). Used by the parallel scan to
+    remember every id a worker has seen, so that a later version of a record in a later chunk
+    can retire a hit from an earlier chunk, and by _scanlatest. Hash collisions between
+    distinct ids are ~2^-64.
+*/
+
+typedef struct IdSet {
+    uint64_t* slots;
+    size_t mask;
+} IdSet;
+
+static BOOL _idsetinit(IdSet* set, size_t count) {
+    size_t cap = 16;
+    while (cap < count * 2) cap <<= 1;
+    set->slots = (uint64_t*)calloc(cap, sizeof(uint64_t));
+    set->mask = cap - 1;
+    return set->slots != NULL;
+}
+
+static void _idsetfree(IdSet* set) {
+    free(set->slots);
+    set->slots = NULL;
+}
+
+/* Bytes of the live bitmap of count records. */
+static inline size_t _livesize(uint64_t count)
+{
+    return (size_t)((count + 63) / 64) * sizeof(uint64_t);
+}
+
+static inline BOOL _liveget(const uint64_t* live, uint64_t i)
+{
+    return (BOOL)((live[i >> 6] >> (i & 63)) & 1);
+}
+
+/* Live records in one word of the bitmap. */
+static inline uint32_t _livecount(uint64_t x)
+{
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (uint32_t)((x * 0x0101010101010101ULL) >> 56);
+}
+
+static inline uint64_t _idsetkey(const uiid* id) {
+    uint64_t h = _uiidhash((uiid*)id);
+    return h ? h : 1; /* 0 marks an empty slot */
+}
+
+/* TRUE when key was not in the set yet. */
+static inline BOOL _idsetadd(IdSet* set, uint64_t key) {
+    size_t i = (size_t)key & set->mask;
+    while (set->slots[i] && set->slots[i] != key) i = (i + 1) & set->mask;
+    BOOL bNew = !set->slots[i];
+    set->slots[i] = key;
+    return bNew;
+}
+
+static inline BOOL _idsethas(const IdSet* set, uint64_t key) {
+    size_t i = (size_t)key & set->mask;
+    while (set->slots[i]) {
+        if (set->slots[i] == key) return TRUE;
+        i = (i + 1) & set->mask;
+    }
+    return FALSE;
+}
+
+/*
+    Latest record ordinal per id (_idsetkey keys, open addressing, linear probing, 0 marks an empty
+    slot). The indexes use it to hide the older versions of upserted ids. A map with bFull also
+    keeps the id of every slot (_idmapputid, _idmapgetid), so that ids whose keys collide stay apart.
+*/
+
+typedef struct IdMap {
+    uint64_t* keys;
+    uint32_t* values;
+    uiid* ids; /* bFull: the id of every slot */
+    size_t mask;
+    size_t count;
+    BOOL bFull;
+} IdMap;
+
+static void _idmapfree(IdMap* map) {
+    BOOL bFull = map->bFull;
+    free(map->keys);
+    free(map->values);
+    free(map->ids);
+    memset(map, 0, sizeof(*map));
+    map->bFull = bFull;
+}
+
+/* Room for count keys without growing the table (at most half full). */
+static BOOL _idmapreserve(IdMap* map, size_t count) {
+    if (map->keys && 2 * count <= map->mask + 1) return TRUE;
+    size_t cap = map->keys ? 2 * (map->mask + 1) : 1024;
+    while (2 * count > cap) cap <<= 1;
+    uint64_t* keys = (uint64_t*)calloc(cap, sizeof(uint64_t));
+    uint32_t* values = (uint32_t*)malloc(cap * sizeof(uint32_t));
+    uiid* ids = map->bFull ? (uiid*)malloc(cap * sizeof(uiid)) : NULL;
+    if (!keys || !values || (map->bFull && !ids)) {
+        free(keys);
+        free(values);
+        free(ids);
+        return FALSE;
+    }
+    for (size_t i = 0; map->keys && i <= map->mask; ++i) {
+        if (!map->keys[i]) continue;
+        size_t j = (size_t)map->keys[i] & (cap - 1);
+        while (keys[j]) j = (j + 1) & (cap - 1);
+        keys[j] = map->keys[i];
+        values[j] = map->values[i];
+        if (ids) _uiidcpy(&ids[j], &map->ids[i]);
+    }
+    free(map->keys);
+    free(map->values);
+    free(map->ids);
+    map->keys = keys;
+    map->values = values;
+    map->ids = ids;
+    map->mask = cap - 1;
+    return TRUE;
+}
+
+/* Maps key to value. Returns the value it replaces, or UINT32_MAX. */
+static uint32_t _idmapput(IdMap* map, uint64_t key, uint32_t value) {
+    if (!_idmapreserve(map, map->count + 1)) {
+        return UINT32_MAX; // Out of memory: the older version stays visible.
+    }
+    size_t i = (size_t)key & map->mask;
+    while (map->keys[i] && map->keys[i] != key) i = (i + 1) & map->mask;
+    uint32_t prev = map->keys[i] ? map->values[i] : UINT32_MAX;
+    if (!map->keys[i]) map->count++;
+    map->keys[i] = key;
+    map->values[i] = value;
+    return prev;
+}
+
+/* bFull: maps id to value. Returns the value it replaces, or UINT32_MAX. */
+static uint32_t _idmapputid(IdMap* map, const uiid* id, uint32_t value) {
+    if (!_idmapreserve(map, map->count + 1)) {
+        return UINT32_MAX; // Out of memory: the older version stays visible.
+    }
+    uint64_t key = _idsetkey(id);
+    size_t i = (size_t)key & map->mask;
+    while (map->keys[i] && !(map->keys[i] == key && _uiidcmp(&map->ids[i], id))) i = (i + 1) & map->mask;
+    uint32_t prev = map->keys[i] ? map->values[i] : UINT32_MAX;
+    if (!map->keys[i]) map->count++;
+    map->keys[i] = key;
+    map->values[i] = value;
+    _uiidcpy(&map->ids[i], id);
+    return prev;
+}
+
+/* bFull: the value of id, or UINT32_MAX. */
+static uint32_t _idmapgetid(const IdMap* map, const uiid* id) {
+    if (!map->keys) return UINT32_MAX;
+    uint64_t key = _idsetkey(id);
+    size_t i = (size_t)key & map->mask;
+    while (map->keys[i]) {
+        if (map->keys[i] == key && _uiidcmp(&map->ids[i], id)) return map->values[i];
+        i = (i + 1) & map->mask;
+    }
+    return UINT32_MAX;
+}
+
+typedef struct NodeItem {
+    float sim;
+    uint32_t node;
+} NodeItem;
+
+/* Binary min-heap of (sim, record ordinal). Candidate queues push -sim to pop the best first. */
+typedef struct NodeHeap {
+    NodeItem* items;
+    uint32_t num;
+    uint32_t cap;
+} NodeHeap;
+
+static BOOL _nodepush(NodeHeap* h, float sim, uint32_t node)
+{
+    if (h->num == h->cap) {
+        uint32_t cap = h->cap ? 2 * h->cap : 64;
+        NodeItem* items = (NodeItem*)realloc(h->items, (size_t)cap * sizeof(NodeItem));
+        if (!items) return FALSE;
+        h->items = items;
+        h->cap = cap;
+    }
+    uint32_t i = h->num++;
+    while (i > 0 && h->items[(i - 1) / 2].sim > sim) {
+        h->items[i] = h->items[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    h->items[i].sim = sim;
+    h->items[i].node = node;
+    return TRUE;
+}
+
+static NodeItem _nodepop(NodeHeap* h)
+{
+    NodeItem top = h->items[0];
+    NodeItem last = h->items[--h->num];
+    uint32_t i = 0;
+    for (;;) {
+        uint32_t c = 2 * i + 1;
+        if (c >= h->num) break;
+        if (c + 1 < h->num && h->items[c + 1].sim < h->items[c].sim) c++;
+        if (h->items[c].sim >= last.sim) break;
+        h->items[i] = h->items[c];
+        i = c;
+    }
+    if (h->num) h->items[i] = last;
+    return top;
+}
+
+static int __cdecl _nodecmp(const void* pa, const void* pb)
+{
+    const NodeItem* a = (const NodeItem*)pa;
+    const NodeItem* b = (const NodeItem*)pb;
+    if (a->sim != b->sim) return a->sim < b->sim ? 1 : -1;
+    return a->node < b->node ? -1 : (a->node > b->node);
+}
+
+/* Keeps the cap best (sim, node) pairs seen so far. */
+static inline BOOL _nodekeep(NodeHeap* h, uint32_t cap, float sim, uint32_t node)
+{
+    if (h->num == cap) {
+        if (!(sim > h->items[0].sim)) return TRUE;
+        _nodepop(h);
+    }
+    return _nodepush(h, sim, node);
+}
+
+/* Every job type run by _parallel starts with these fields. */
+typedef struct Work {
+    uint64_t begin, end;
+    BOOL bOk;
+} Work;
+
+/* Splits items [0, count) across the workers and runs proc on each. Returns FALSE if any worker failed. */
+static BOOL _parallel(void* jobs, size_t cbJob, Thread* threads, uint32_t dwThreads, uint64_t count, ThreadProc proc)
+{
+    uint64_t per = count / dwThreads, extra = count % dwThreads, first = 0;
+    for (uint32_t t = 0; t < dwThreads; ++t) {
+        Work* work = (Work*)((uint8_t*)jobs + t * cbJob);
+        work->begin = first;
+        work->end = first + per + (t < extra ? 1 : 0);
+        work->bOk = FALSE;
+        first = work->end;
+    }
+    // The calling thread takes the first part; a worker that fails to start runs inline.
+    BOOL* started = (BOOL*)calloc(dwThreads, sizeof(BOOL));
+    for (uint32_t t = 1; t < dwThreads && started; ++t) {
+        started[t] = _threadstart(&threads[t], proc, (uint8_t*)jobs + t * cbJob);
+    }
+    proc(jobs);
+    BOOL bOk = ((Work*)jobs)->bOk;
+    for (uint32_t t = 1; t < dwThreads; ++t) {
+        Work* work = (Work*)((uint8_t*)jobs + t * cbJob);
+        if (started && started[t]) _threadjoin(&threads[t]);
+        else proc(work);
+        bOk = bOk && work->bOk;
+    }
+    free(started);
+    return bOk;
+}
+
+typedef struct ScanJob {
+    Embeddings* db;
+    const float* queries; /* nq x len */
+    uint32_t nq;
+    uint32_t len;
+    const float* qnorms; /* nq */
+    float min;
+    BOOL bNorm;
+    BOOL bStored; /* HEADER_NORMS */
+    uint8_t dtype;
+    uint8_t metric; /* METRIC */
+    uint32_t blobSize; /* stored bytes per vector */
+    float* scratch; /* 2 x len, vectors widened to float32 for the blocked and distance kernels */
+    const int8_t* qi8; /* DTYPE_INT8: query quantized like a stored vector ([scale][len x int8_t]) */
+    float qmargin; /* DTYPE_INT8: bound on |int8 score - float32 score| per unit of record norm */
+    BOOL bRescore; /* DTYPE_INT8: rescore candidates near the top-k floor against the float32 query */
+    uint32_t stride;
+    uint64_t begin; /* first record offset */
+    uint64_t end; /* one past the last record offset, UINT64_MAX to read until EOF; where the scan stopped once done */
+    TopK* heaps; /* nq */
+    IdSet* seen; /* optional */
+    const IdSet* later; /* see _scanlatest: the ids of the chunks after this one */
+    uint32_t nlater;
+    BOOL bRetired; /* a record retired the hit of an earlier version of its id, see cosine */
+    const Mapping* map; /* optional, see filemap */
+    const uint64_t* live; /* optional, see _idslive: only the records with their bit set are scored */
+    BOOL bOps; /* RECORDOP stored, the scan has tombstones to skip */
+    uint32_t records; /* records per read buffer, see filesetreadahead */
+    uint32_t depth; /* read buffers in flight, see filesetreadahead */
+    HANDLE hDirect; /* optional, see filesetdirect: reads bypass the page cache */
+    BOOL bOk;
+} ScanJob;
+
+static uint64_t* _idslive(Embeddings* db, ScanJob* proto);
+
+/*
+    L2 norm of the record vector. Files with HEADER_NORMS keep it right after the blob, written
+    by fileappend and cursorupdate, so the scan does not pay for a second pass over the vector.
+    A stored 0 means unknown (e.g. a zero vector) and is recomputed.
+*/
+static inline float _recnorm(const ScanJob* job, const uint8_t* buff) {
+    const uint8_t* blob = buff + sizeof(uiid);
+    if (job->bStored) {
+        float norm;
+        memcpy(&norm, blob + job->blobSize, sizeof(float));
+        if (norm > 0) return norm;
+    }
+    return _vecnrm2(job->dtype, blob, job->len);
+}
+
+/*
+    DTYPE_INT8 scoring: the quantized query against the quantized record with the integer kernel.
+    Quantizing the query moves each component by at most qscale / 2, so the int8 score is within
+    qscale / 2 * |r|_1 / (|q| |r|) <= qscale / 2 * sqrt(len) / |q| (job->qmargin) of the float32
+    score. Only records that could reach the top-k within that margin are rescored in float32,
+    which gives the same hits as scoring every record in float32.
+*/
+static inline float _i8score(ScanJob* job, const uint8_t* buff, float norm, float floor)
+{
+    const uint8_t* blob = buff + sizeof(uiid);
+    int32_t dot = _kernels.idot((const int8_t*)job->qi8 + sizeof(float), (const int8_t*)blob + sizeof(float), job->len);
+    double scale = (double)_i8scale(job->qi8) * (double)_i8scale(blob);
+    float score = (float)((double)dot * scale / ((double)job->qnorms[0] * (double)norm));
+    if (job->bRescore) {
+        // Without normalization the error scales with the record norm.
+        float margin = job->qmargin * (job->bNorm ? 1 : _recnorm(job, buff)) + EPSILON;
+        if (score + margin >= floor && score + margin >= job->min) {
+            double exact = _vecdot(job->dtype, blob, job->queries, job->len);
+            score = (float)(exact / ((double)job->qnorms[0] * (double)norm));
+        }
+    }
+    return score;
+}
+
+/*
+    Scores one record into the heap, where it first retires the hit of an earlier version of its id
+    and then sets job->bRetired: a record the heap turned away since may belong in the top-k.
+*/
+static void cosine(ScanJob* job, const uint8_t* buff)
+{
+    const uiid* id = (const uiid*)buff;
+    // A zero vector is never a hit, but as an upsert it still replaces the earlier version.
+    if (!job->live) {
+        job->bRetired |= topkremoveif(
+            &job->heaps[0],
+            id
+        );
+    }
+    float norm = job->bNorm
+        ? _recnorm(job, buff)
+        : 1;
+    if (norm < EPSILON) {
+        return;
+    }
+    if (job->dtype == DTYPE_INT8) {
+        float score = _i8score(job, buff, norm, topkfloor(&job->heaps[0]));
+        if (score >= job->min) {
+            topkpush(&job->heaps[0], id, score);
+        }
+        return;
+    }
+    double dot = _vecdot(job->dtype, buff + sizeof(uiid), job->queries, job->len);
+    float score = (float)(dot / ((double)job->qnorms[0] * (double)norm));
+    if (score >= job->min) {
+        topkpush(&job->heaps[0], id, score);
+    }
+}
+
+/*
+    Scores up to two records against every query of the batch. The blocked kernel loads each
+    record chunk once for four queries, so the scan is bound by arithmetic rather than by
+    memory bandwidth. Record norms are computed once per record, not once per query, and
+    non-float32 records are widened once per record into job->scratch.
+*/
+static void cosinebatch(ScanJob* job, const uint8_t* a, const uint8_t* b)
+{
+    const uint32_t len = job->len;
+    const uint8_t* recs[2] = { a, b };
+    const float* blobs[2] = { NULL, NULL };
+    float norms[2] = { 0, 0 };
+    uint32_t nrec = b ? 2 : 1;
+    for (uint32_t r = 0; r < nrec; ++r) {
+        const uiid* id = (const uiid*)recs[r];
+        if (job->dtype == DTYPE_FLOAT32) {
+            blobs[r] = (const float*)(recs[r] + sizeof(uiid));
+        }
+        else {
+            _vecdecode(job->dtype, job->scratch + (size_t)r * len, recs[r] + sizeof(uiid), len);
+            blobs[r] = job->scratch + (size_t)r * len;
+        }
+        norms[r] = job->bNorm
+            ? _recnorm(job, recs[r])
+            : 1;
+        if (job->live) {
+            continue;
+        }
+        for (uint32_t j = 0; j < job->nq; ++j) {
+            job->bRetired |= topkremoveif(&job->heaps[j], id);
+        }
+    }
+    // The second record's upsert must not retire a hit of the first record scored below.
+    if (nrec == 2 && !job->live && _uiidcmp((const uiid*)a, (const uiid*)b)) {
+        norms[0] = 0;
+    }
+    const float* q = job->queries;
+    uint32_t j = 0;
+    float dots[8];
+    for (; j + 4 <= job->nq; j += 4) {
+        const float* qs[4] = { q + (size_t)j * len, q + (size_t)(j + 1) * len, q + (size_t)(j + 2) * len, q + (size_t)(j + 3) * len };
+        if (nrec == 2) {
+            _kernels.sdot2x4(blobs[0], blobs[1], qs, len, dots);
+        }
+        else {
+            for (uint32_t k = 0; k < 4; ++k) dots[k] = cblas_sdot(blobs[0], qs[k], len);
+        }
+        for (uint32_t r = 0; r < nrec; ++r) {
+            if (norms[r] < EPSILON) continue;
+            for (uint32_t k = 0; k < 4; ++k) {
+                float score = (float)((double)dots[r * 4 + k] / ((double)job->qnorms[j + k] * (double)norms[r]));
+                if (score >= job->min) {
+                    topkpush(&job->heaps[j + k], (const uiid*)recs[r], score);
+                }
+            }
+        }
+    }
+    for (; j < job->nq; ++j) {
+        for (uint32_t r = 0; r < nrec; ++r) {
+            if (norms[r] < EPSILON) continue;
+            double dot = cblas_sdot(blobs[r], q + (size_t)j * len, len);
+            float score = (float)(dot / ((double)job->qnorms[j] * (double)norms[r]));
+            if (score >= job->min) {
+                topkpush(&job->heaps[j], (const uiid*)recs[r], score);
+            }
+        }
+    }
+}
+
+/*
+    METRIC_L2 and METRIC_L1: the record against every query of the batch with the distance kernel.
+    The heaps keep the highest score first for every metric, so a distance is pushed negated
+    (see _metricmin and _metricout).
+*/
+static void distance(ScanJob* job, const uint8_t* buff)
+{
+    const uiid* id = (const uiid*)buff;
+    const float* blob = (const float*)(buff + sizeof(uiid));
+    if (job->dtype != DTYPE_FLOAT32) {
+        _vecdecode(job->dtype, job->scratch, buff + sizeof(uiid), job->len);
+        blob = job->scratch;
+    }
+    for (uint32_t j = 0; j < job->nq; ++j) {
+        const float* q = job->queries + (size_t)j * job->len;
+        float score = -(job->metric == METRIC_L2
+            ? _kernels.sl2(blob, q, job->len)
+            : _kernels.sl1(blob, q, job->len));
+        if (!job->live) job->bRetired |= topkremoveif(&job->heaps[j], id);
+        if (score >= job->min) {
+            topkpush(&job->heaps[j], id, score);
+        }
+    }
+}
+
+/* Scores one record against a single query by the metric of the file. */
+static inline void _score(ScanJob* job, const uint8_t* buff)
+{
+    if (job->metric == METRIC_L2 || job->metric == METRIC_L1) {
+        distance(job, buff);
+    }
+    else {
+        cosine(job, buff);
+    }
+}
+
+/* A tombstone retires the hits of its id scored so far. */
+static inline void _retire(ScanJob* job, const uiid* id)
+{
+    for (uint32_t j = 0; j < job->nq; ++j) {
+        job->bRetired |= topkremoveif(&job->heaps[j], id);
+    }
+}
+
+/*
+    Scores the whole records in buff, which starts at the file offset offset, and returns the
+    number of bytes consumed. With job->live only the live records are scored; otherwise every
+    record is, each replacing the hits of its id, and tombstones retire their id.
+*/
+static size_t _scanrecords(ScanJob* job, const uint8_t* buff, size_t cb, uint64_t offset) {
+    const uint32_t stride = job->stride;
+    const BOOL bBatch = job->nq > 1 && job->metric != METRIC_L2 && job->metric != METRIC_L1;
+    uint64_t ord = (offset - MAXHEAD) / stride;
+    const uint8_t* held = NULL; /* bBatch: a record waiting for a second one to score with */
+    size_t pos = 0;
+    for (; pos + stride <= cb; pos += stride, ++ord) {
+        const uint8_t* rec = buff + pos;
+        if (job->live) {
+            if (!_liveget(job->live, ord)) continue;
+        }
+        else {
+            if (job->seen) {
+                _idsetadd(job->seen, _idsetkey((const uiid*)rec));
+            }
+            if (job->bOps && _recop(&job->db->header, rec) == RECORD_DELETE) {
+                if (held) {
+                    cosinebatch(job, held, NULL);
+                    held = NULL;
+                }
+                _retire(job, (const uiid*)rec);
+                continue;
+            }
+        }
+        if (!bBatch) {
+            _score(job, rec);
+        }
+        else if (held) {
+            cosinebatch(job, held, rec);
+            held = NULL;
+        }
+        else {
+            held = rec;
+        }
+    }
+    if (held) {
+        cosinebatch(job, held, NULL);
+    }
+    return pos;
+}
+
+/*
+    Reads want bytes of records at offset into buff for the scan and returns how many it got (0: EOF
+    or error), with *pdata at the first of them. Direct reads (see filesetdirect) are widened to
+    DIRECT_ALIGN boundaries, which takes up to DIRECT_ALIGN bytes more than want (see _scanslot).
+*/
+static DWORD _scanread(const ScanJob* job, uint8_t* buff, uint64_t want, uint64_t offset, const uint8_t** pdata)
+{
+    DWORD bytesRead = 0;
+    *pdata = buff;
+    if (!job->hDirect) {
+        // Positional reads: the file pointer of db->hWrite is never touched, so concurrent searches do not interfere.
+        return _ioread(job->db->hWrite, buff, (DWORD)want, offset, &bytesRead) ? bytesRead : 0;
+    }
+    uint64_t first = offset & ~(uint64_t)(DIRECT_ALIGN - 1);
+    uint64_t skip = offset - first;
+    uint64_t cb = __alignup(skip + want, (uint64_t)DIRECT_ALIGN);
+    if (!_ioreaddirect(job->hDirect, buff, (DWORD)cb, first, &bytesRead) || bytesRead <= skip) {
+        return 0;
+    }
+    *pdata = buff + skip;
+    return bytesRead - skip < want ? (DWORD)(bytesRead - skip) : (DWORD)want;
+}
+
+/* Bytes of one read buffer of cbBuffer bytes of records, see _scanread. */
+static inline uint64_t _scanslot(const ScanJob* job, uint64_t cbBuffer)
+{
+    return job->hDirect ? __alignup(cbBuffer, (uint64_t)DIRECT_ALIGN) + DIRECT_ALIGN : cbBuffer;
+}
+
+/*
+    Read-ahead for the buffered scan. A reader thread keeps up to depth buffers of records read ahead
+    of the scorer, so the disk works on the next buffers while the CPU scores the current one. The
+    reader fills buffer produced % depth once the scorer has let go of it; the scorer scores buffer
+    consumed % depth once the reader has filled it.
+*/
+typedef struct ReadAhead {
+    const ScanJob* job;
+    uint8_t* buffs; /* depth x cbSlot */
+    uint64_t cbBuffer;
+    uint64_t cbSlot; /* see _scanslot */
+    uint32_t depth;
+    uint64_t begin;
+    uint64_t end;
+    DWORD* filled; /* depth, bytes of records in each buffer */
+    uint64_t* offsets; /* depth, file offset of each buffer */
+    const uint8_t** data; /* depth, first record in each buffer */
+    uint64_t produced; /* buffers filled so far */
+    uint64_t consumed; /* buffers scored so far */
+    BOOL bDone; /* the reader is past the end, EOF or a read error */
+    BOOL bStop; /* the scorer is done */
+    Lock lock;
+    Cond cond;
+} ReadAhead;
+
+static void _readahead(void* arg)
+{
+    ReadAhead* ra = (ReadAhead*)arg;
+    uint64_t offset = ra->begin;
+    while (offset < ra->end) {
+        _lockenter(&ra->lock);
+        while (!ra->bStop && ra->produced - ra->consumed >= ra->depth) {
+            _condwait(&ra->cond, &ra->lock, UINT32_MAX);
+        }
+        BOOL bStop = ra->bStop;
+        uint32_t slot = (uint32_t)(ra->produced % ra->depth);
+        _lockleave(&ra->lock);
+        if (bStop) break;
+        uint64_t want = ra->cbBuffer;
+        if (ra->end - offset < want) want = ra->end - offset;
+        const uint8_t* data = NULL;
+        DWORD bytesRead = _scanread(ra->job, ra->buffs + slot * ra->cbSlot, want, offset, &data);
+        if (bytesRead == 0) break; // EOF
+        _lockenter(&ra->lock);
+        ra->filled[slot] = bytesRead;
+        ra->offsets[slot] = offset;
+        ra->data[slot] = data;
+        ra->produced++;
+        _condbroadcast(&ra->cond);
+        _lockleave(&ra->lock);
+        if (bytesRead < want) break; // EOF, maybe in the middle of an append in flight
+        offset += bytesRead;
+    }
+    _lockenter(&ra->lock);
+    ra->bDone = TRUE;
+    _condbroadcast(&ra->cond);
+    _lockleave(&ra->lock);
+}
+
+/* Scores [offset, job->end) through the read-ahead buffers. FALSE if the reader could not be started. */
+static BOOL _scanahead(ScanJob* job, uint8_t* big, uint64_t cbBuffer, uint64_t offset)
+{
+    ReadAhead ra;
+    memset(&ra, 0, sizeof(ra));
+    ra.job = job;
+    ra.buffs = big;
+    ra.cbBuffer = cbBuffer;
+    ra.cbSlot = _scanslot(job, cbBuffer);
+    ra.depth = job->depth;
+    ra.begin = offset;
+    ra.end = job->end;
+    ra.filled = (DWORD*)calloc(ra.depth, sizeof(DWORD));
+    ra.offsets = (uint64_t*)calloc(ra.depth, sizeof(uint64_t));
+    ra.data = (const uint8_t**)calloc(ra.depth, sizeof(const uint8_t*));
+    if (!ra.filled || !ra.offsets || !ra.data) {
+        free(ra.filled);
+        free(ra.offsets);
+        free(ra.data);
+        return FALSE;
+    }
+    _lockinit(&ra.lock);
+    _condinit(&ra.cond);
+    Thread reader;
+    if (!_threadstart(&reader, _readahead, &ra)) {
+        _condfree(&ra.cond);
+        _lockfree(&ra.lock);
+        free(ra.filled);
+        free(ra.offsets);
+        free(ra.data);
+        return FALSE;
+    }
+    // As the blocking loop does, job->end is moved back to where the records ran out.
+    uint64_t scanned = offset;
+    for (;;) {
+        _lockenter(&ra.lock);
+        while (ra.consumed == ra.produced && !ra.bDone) {
+            _condwait(&ra.cond, &ra.lock, UINT32_MAX);
+        }
+        BOOL bEmpty = ra.consumed == ra.produced;
+        uint32_t slot = (uint32_t)(ra.consumed % ra.depth);
+        _lockleave(&ra.lock);
+        if (bEmpty) break;
+        size_t pos = _scanrecords(job, ra.data[slot], ra.filled[slot], ra.offsets[slot]);
+        scanned = ra.offsets[slot] + pos;
+        _lockenter(&ra.lock);
+        ra.consumed++;
+        if (pos == 0) ra.bStop = TRUE; // Partial record at EOF (an append in flight)
+        _condbroadcast(&ra.cond);
+        _lockleave(&ra.lock);
+        if (pos == 0) break;
+    }
+    _lockenter(&ra.lock);
+    ra.bStop = TRUE;
+    _condbroadcast(&ra.cond);
+    _lockleave(&ra.lock);
+    _threadjoin(&reader);
+    _condfree(&ra.cond);
+    _lockfree(&ra.lock);
+    free(ra.filled);
+    free(ra.offsets);
+    free(ra.data);
+    job->end = scanned;
+    return TRUE;
+}
+
+static void _scanrange(void* arg) {
+    ScanJob* job = (ScanJob*)arg;
+    const uint32_t MAX = job->records ? job->records : SCAN_RECORDS;
+    const uint32_t stride = job->stride;
+    job->bRetired = FALSE;
+    job->bOk = FALSE;
+    uint64_t offset = job->begin;
+    if (job->map && offset < job->map->size) {
+        // Zero-copy: score the mapped part of the range in place.
+        uint64_t end = job->map->size < job->end ? job->map->size : job->end;
+        offset += _scanrecords(job, job->map->base + offset, (size_t)(end - offset), offset);
+    }
+    if (offset >= job->end) {
+        job->bOk = TRUE;
+        return;
+    }
+    const uint64_t cbBuffer = (uint64_t)MAX * stride;
+    const uint64_t cbSlot = _scanslot(job, cbBuffer);
+    const size_t alignment = job->hDirect ? DIRECT_ALIGN : job->db->header.alignment;
+    // No point reading ahead of a range that fits in one buffer.
+    uint32_t depth = job->end - offset > cbBuffer ? job->depth : 1;
+    uint8_t* big = depth > 1 ? (uint8_t*)_aligned_malloc((size_t)(depth * cbSlot), alignment) : NULL;
+    if (big && _scanahead(job, big, cbBuffer, offset)) {
+        _aligned_free(big);
+        job->bOk = TRUE;
+        return;
+    }
+    // Blocking reads, also the fallback when the read-ahead buffers or thread are not available.
+    _aligned_free(big);
+    big = (uint8_t*)_aligned_malloc((size_t)cbSlot, alignment);
+    if (!big) {
+        fprintf(stderr, "Memory allocation failed while preparing the read buffers.\n");
+        return;
+    }
+    while (offset < job->end) {
+        uint64_t want = cbBuffer;
+        if (job->end - offset < want) want = job->end - offset;
+        const uint8_t* data = NULL;
+        DWORD bytesRead = _scanread(job, big, want, offset, &data);
+        if (bytesRead == 0) {
+            break; // EOF
+        }
+        size_t pos = _scanrecords(job, data, bytesRead, offset);
+        if (pos == 0) {
+            break; // Partial record at EOF (an append in flight)
+        }
+        offset += pos;
+    }
+    _aligned_free(big);
+    job->end = offset;
+    job->bOk = TRUE;
+}
+
+/*
+    Scans the chunk of job again, scoring only the latest version of every id. The forward scan
+    retires an older version when the newer one comes, but by then the older version may have
+    turned a record away from the full heap. Here the records are read from the end of the chunk
+    backwards, so the first version met of an id is its latest, and an id that job->later holds
+    has a newer version in a later chunk. Only needed when an upsert touched the top-k.
+*/
+static void _scanlatest(void* arg) {
+    ScanJob* job = (ScanJob*)arg;
+    const uint32_t MAX = 1024;
+    const uint32_t stride = job->stride;
+    for (uint32_t j = 0; j < job->nq; ++j) {
+        topkclear(&job->heaps[j]);
+    }
+    job->bOk = FALSE;
+    IdSet mine;
+    uint8_t* big = (uint8_t*)_aligned_malloc((size_t)(MAX * stride), job->db->header.alignment);
+    if (!big || !_idsetinit(&mine, (size_t)((job->end - job->begin) / stride))) {
+        fprintf(stderr, "Memory allocation failed while preparing the read buffers.\n");
+        _aligned_free(big);
+        return;
+    }
+    uint64_t end = job->end;
+    while (end > job->begin) {
+        uint64_t n = (end - job->begin) / stride;
+        if (n > MAX) n = MAX;
+        uint64_t offset = end - n * stride;
+        DWORD bytesRead = 0;
+        if (!_ioread(job->db->hWrite, big, (DWORD)(n * stride), offset, &bytesRead) || bytesRead != n * stride) {
+            fprintf(stderr, "Failed to read the database (system error %lu).\n", (unsigned long)GetLastError());
+            break;
+        }
+        for (size_t pos = (size_t)(n * stride); pos > 0;) {
+            pos -= stride;
+            uint64_t key = _idsetkey((const uiid*)(big + pos));
+            BOOL bLatest = _idsetadd(&mine, key);
+            for (uint32_t t = 0; t < job->nlater && bLatest; ++t) {
+                bLatest = !_idsethas(&job->later[t], key);
+            }
+            // A tombstone hides the older versions of its id and is never a hit itself.
+            if (!bLatest || (job->bOps && _recop(&job->db->header, big + pos) == RECORD_DELETE)) {
+                continue;
+            }
+            if (job->nq == 1 || job->metric == METRIC_L2 || job->metric == METRIC_L1) {
+                _score(job, big + pos);
+            }
+            else {
+                cosinebatch(job, big + pos, NULL);
+            }
+        }
+        end = offset;
+    }
+    _idsetfree(&mine);
+    _aligned_free(big);
+    job->bOk = end == job->begin;
+}
+
+/* TRUE when a hit of job has a newer version in a later chunk. */
+static BOOL _scanstale(const ScanJob* job, const IdSet* later, uint32_t nlater)
+{
+    for (uint32_t j = 0; j < job->nq; ++j) {
+        for (size_t i = 0; i < job->heaps[j].num; ++i) {
+            uint64_t key = _idsetkey(&job->heaps[j].heap[i].id);
+            for (uint32_t t = 0; t < nlater; ++t) {
+                if (_idsethas(&later[t], key)) return TRUE;
+            }
+        }
+    }
+    return FALSE;
+}
+
+/* n records from ordinal i, in place when mapped, otherwise read into buff. */
+static const uint8_t* _records(Embeddings* db, const Mapping* map, uint32_t stride, uint64_t i, uint32_t n, uint8_t* buff)
+{
+    uint64_t offset = MAXHEAD + i * stride;
+    if (map && offset + (uint64_t)n * stride <= map->size) {
+        return map->base + offset;
+    }
+    return _ioreadall(db->hWrite, buff, (size_t)n * stride, offset) ? buff : NULL;
+}
+
+static BOOL _jobinit(ScanJob* job, const ScanJob* proto, uint32_t topk) {
+    *job = *proto;
+    if ((proto->nq > 1 || proto->metric == METRIC_L2 || proto->metric == METRIC_L1) && proto->dtype != DTYPE_FLOAT32) {
+        job->scratch = (float*)malloc(2 * (size_t)proto->len * sizeof(float));
+        if (!job->scratch) return FALSE;
+    }
+    job->heaps = (TopK*)calloc(proto->nq, sizeof(TopK));
+    if (!job->heaps) return FALSE;
+    for (uint32_t j = 0; j < proto->nq; ++j) {
+        if (!topkinit(&job->heaps[j], topk)) return FALSE;
+    }
+    return TRUE;
+}
+
+static void _jobfree(ScanJob* job) {
+    free(job->scratch);
+    job->scratch = NULL;
+    if (!job->heaps) return;
+    for (uint32_t j = 0; j < job->nq; ++j) topkfree(&job->heaps[j]);
+    free(job->heaps);
+    job->heaps = NULL;
+}
+
+static int __cdecl _nodeordcmp(const void* pa, const void* pb)
+{
+    const NodeItem* a = (const NodeItem*)pa;
+    const NodeItem* b = (const NodeItem*)pb;
+    return a->node < b->node ? -1 : (a->node > b->node);
+}
+
+/*
+    Scores the candidate records exactly (the rerank of the compressed indexes). They are read in
+    file order, which turns the reads past the mapping into a forward sweep. buff holds one record.
+*/
+static BOOL _rescore(ScanJob* job, NodeHeap* cand, uint8_t* buff)
+{
+    qsort(cand->items, cand->num, sizeof(NodeItem), _nodeordcmp);
+    for (uint32_t c = 0; c < cand->num; ++c) {
+        const uint8_t* rec = _records(job->db, job->map, job->stride, cand->items[c].node, 1, buff);
+        if (!rec) {
+            fprintf(stderr, "Failed to read the database (system error %lu).\n", (unsigned long)GetLastError());
+            return FALSE;
+        }
+        if (job->bOps && _recop(&job->db->header, rec) == RECORD_DELETE) continue;
+        _score(job, rec);
+    }
+    return TRUE;
+}
+
+/* bNorm only means something to METRIC_COSINE: the other metrics score the vectors as they are. */
+static inline BOOL _metricnorm(const Embeddings* db, BOOL bNorm)
+{
+    return bNorm && db->header.metric == METRIC_COSINE;
+}
+
+/*
+    The smallest score kept. METRIC_L2 and METRIC_L1 rank by the negated distance, so min, the
+    largest distance wanted, is negated too, and 0 or less keeps every record.
+*/
+static inline float _metricmin(const Embeddings* db, float min)
+{
+    if (db->header.metric == METRIC_L2 || db->header.metric == METRIC_L1) {
+        return min > 0 ? -min : -INFINITY;
+    }
+    return min;
+}
+
+/*
+    Candidate rank for the compressed indexes, from their estimate of dot = q . x / |x| and the
+    record norm, when the search does not normalize: dot x |x| for METRIC_IP (and METRIC_COSINE
+    without bNorm), 2 q . x - |x|^2 = |q|^2 - |q - x|^2 for METRIC_L2. METRIC_L1 candidates are
+    ranked like METRIC_L2; the rerank scores them exactly.
+*/
+static inline float _metricest(const Embeddings* db, float dot, float norm)
+{
+    if (db->header.metric == METRIC_L2 || db->header.metric == METRIC_L1) {
+        return norm * (2 * dot - norm);
+    }
+    return dot * norm;
+}
+
+/* Turns the negated distances of the hits back into distances. */
+static void _metricout(const Embeddings* db, Score* scores, size_t num)
+{
+    if (db->header.metric == METRIC_L2 || db->header.metric == METRIC_L1) {
+        for (size_t i = 0; i < num; ++i) scores[i].score = -scores[i].score;
+    }
+}
+
+/*
+    Validates the queries and fills the scan prototype shared by every search path. Returns the
+    query norms (and the quantized query, see bQuantize) that the prototype points to; the caller
+    frees them. Returns NULL on error.
+*/
+static float* _searchprep(
+    Embeddings* db,
+    const float* queries, uint32_t nq, uint32_t len,
+    float min,
+    BOOL bNorm,
+    ScanJob* proto)
+{
+    if (!db->hWrite || db->hWrite == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "The specified database is closed or invalid.\n");
+        return NULL;
+    }
+    if (_vecdim(&db->header) != len) {
+        fprintf(stderr,
+            "Query size (%u bytes) does not match database blob size (%u bytes).\n",
+            len * (unsigned)sizeof(float),
+            _vecdim(&db->header) * (unsigned)sizeof(float));
+        return NULL;
+    }
+    bNorm = _metricnorm(db, bNorm);
+    // The single query scan of a DTYPE_INT8 file also needs the query quantized, kept after the norms.
+    BOOL bQuantize = db->header.dtype == DTYPE_INT8 && nq == 1 &&
+        (db->header.metric == METRIC_COSINE || db->header.metric == METRIC_IP);
+    float* qnorms = (float*)malloc(nq * sizeof(float) + (bQuantize ? _vecsize(DTYPE_INT8, len) : 0));
+    if (!qnorms) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        return NULL;
+    }
+    for (uint32_t j = 0; j < nq; ++j) {
+        qnorms[j] = bNorm
+            ? cblas_snrm2(queries + (size_t)j * len, len)
+            : 1;
+        _dbglog("qnorm = %f;\n", qnorms[j]);
+        if (qnorms[j] < EPSILON) {
+            fprintf(stderr, "Query vector norm too small (%.8g).\n", qnorms[j]);
+            free(qnorms);
+            return NULL;
+        }
+    }
+    memset(proto, 0, sizeof(*proto));
+    proto->db = db;
+    proto->queries = queries;
+    proto->nq = nq;
+    proto->len = len;
+    proto->qnorms = qnorms;
+    proto->min = _metricmin(db, min);
+    proto->bNorm = bNorm;
+    proto->bStored = (db->header.flags & HEADER_NORMS) != 0;
+    proto->dtype = db->header.dtype;
+    proto->metric = db->header.metric;
+    proto->blobSize = db->header.blobSize;
+    if (bQuantize) {
+        uint8_t* qi8 = (uint8_t*)(qnorms + nq);
+        _i8encode(qi8, queries, len);
+        proto->qi8 = (const int8_t*)qi8;
+        proto->qmargin = (float)(0.5 * _i8scale(qi8) * sqrt((double)len) / qnorms[0]);
+        proto->bRescore = db->bRescore;
+    }
+    proto->stride = _recsize(&db->header);
+    proto->bOps = db->header.version >= 3;
+    proto->records = db->dwReadRecords;
+    proto->depth = db->dwReadDepth;
+    proto->hDirect = db->hDirect;
+    proto->begin = MAXHEAD;
+    proto->end = UINT64_MAX;
+    return qnorms;
+}
+
+/* The scan behind filesearch, filesearchex and filesearchbatch. scores is nq x topk, counts is nq. */
+static BOOL _filesearch(
+    Embeddings* db,
+    const float* queries, uint32_t nq, uint32_t len,
+    uint32_t topk,
+    Score* scores,
+    int32_t* counts,
+    float min,
+    BOOL bNorm,
+    uint32_t dwThreads)
+{
+    ScanJob proto;
+    float* qnorms = _searchprep(db, queries, nq, len, min, bNorm, &proto);
+    if (!qnorms) {
+        return FALSE;
+    }
+    uint32_t stride = proto.stride;
+    if (dwThreads == 0) {
+        dwThreads = db->os.dwNumberOfProcessors ? db->os.dwNumberOfProcessors : 1;
+    }
+    // Scan only the live records of the id index; the chunks then have no upserts to resolve.
+    uint64_t* live = _idslive(db, &proto);
+    uint64_t records = 0;
+    if (live) {
+        records = (proto.end - MAXHEAD) / stride;
+        uint64_t most = (records + proto.records - 1) / proto.records;
+        if (dwThreads > most) dwThreads = most ? (uint32_t)most : 1;
+    }
+    else if (dwThreads > 1) {
+        uint64_t fileSize = 0;
+        if (!_iosize(db->hWrite, &fileSize)) {
+            fprintf(stderr, "Failed to query the database size (system error %lu).\n", (unsigned long)GetLastError());
+            free(qnorms);
+            return FALSE;
+        }
+        records = fileSize > MAXHEAD ? (fileSize - MAXHEAD) / stride : 0;
+        // Not worth a thread for less than one read buffer of records.
+        uint64_t most = (records + proto.records - 1) / proto.records;
+        if (dwThreads > most) dwThreads = most ? (uint32_t)most : 1;
+    }
+    Mapping* map = _mapacquire(db);
+    proto.map = map;
+    memset(scores, 0, (size_t)nq * topk * sizeof(Score));
+    if (dwThreads <= 1) {
+        ScanJob job;
+        BOOL bOk = _jobinit(&job, &proto, topk);
+        if (!bOk) {
+            fprintf(stderr, "Memory allocation failed while preparing the top-k heap.\n");
+        }
+        else {
+            _scanrange(&job);
+            if (job.bOk && job.bRetired) {
+                _scanlatest(&job);
+            }
+            bOk = job.bOk;
+        }
+        _maprelease(db, map);
+        if (bOk) {
+            for (uint32_t j = 0; j < nq; ++j) {
+                size_t num = topkdrain(&job.heaps[j], scores + (size_t)j * topk);
+                assert(num <= topk);
+                _metricout(db, scores + (size_t)j * topk, num);
+                counts[j] = (int32_t)num;
+            }
+        }
+        _jobfree(&job);
+        free(live);
+        free(qnorms);
+        return bOk;
+    }
+    // Split [MAXHEAD, EOF) into contiguous stride-aligned chunks, one per worker, each with private heaps.
+    // Records appended after the snapshot of the file size are not part of this search.
+    ScanJob* jobs = (ScanJob*)calloc(dwThreads, sizeof(ScanJob));
+    IdSet* seen = (IdSet*)calloc(dwThreads, sizeof(IdSet));
+    Thread* threads = (Thread*)calloc(dwThreads, sizeof(Thread));
+    BOOL* running = (BOOL*)calloc(dwThreads, sizeof(BOOL));
+    if (!jobs || !seen || !threads || !running) {
+        fprintf(stderr, "Memory allocation failed while preparing the search workers.\n");
+        free(jobs); free(seen); free(threads); free(running);
+        _maprelease(db, map);
+        free(live);
+        free(qnorms);
+        return FALSE;
+    }
+    BOOL result = FALSE;
+    uint32_t started = 0;
+    uint64_t per = records / dwThreads, extra = records % dwThreads, first = 0;
+    for (uint32_t t = 0; t < dwThreads; ++t) {
+        uint64_t count = per + (t < extra ? 1 : 0);
+        if (!_jobinit(&jobs[t], &proto, topk)) {
+            fprintf(stderr, "Memory allocation failed while preparing the top-k heap.\n");
+            goto done;
+        }
+        jobs[t].begin = MAXHEAD + first * stride;
+        jobs[t].end = jobs[t].begin + count * stride;
+        // The first chunk has nothing before it to retire, so it does not need to remember its ids.
+        if (t > 0 && !live) {
+            if (!_idsetinit(&seen[t], (size_t)count)) {
+                fprintf(stderr, "Memory allocation failed while preparing the search workers.\n");
+                goto done;
+            }
+            jobs[t].seen = &seen[t];
+        }
+        first += count;
+    }
+    // The calling thread takes the first chunk; a worker that fails to start runs inline, as in _parallel.
+    for (uint32_t t = 1; t < dwThreads; ++t) {
+        running[t] = _threadstart(&threads[t], _scanrange, &jobs[t]);
+    }
+    _scanrange(&jobs[0]);
+    for (uint32_t t = 1; t < dwThreads; ++t) {
+        if (running[t]) _threadjoin(&threads[t]);
+        else _scanrange(&jobs[t]);
+    }
+    for (uint32_t t = 0; t < dwThreads; ++t) {
+        if (!jobs[t].bOk) goto done;
+    }
+    // A chunk whose top-k lost a hit to an upsert, in the chunk or after it, is scanned again for the latest versions only.
+    // With the live bitmap every scored record is already the latest version of its id.
+    started = 0;
+    for (uint32_t t = 0; t < dwThreads && !live; ++t) {
+        if (jobs[t].bRetired || _scanstale(&jobs[t], seen + t + 1, dwThreads - t - 1)) {
+            jobs[t].later = seen + t + 1;
+            jobs[t].nlater = dwThreads - t - 1;
+            if (!_threadstart(&threads[started], _scanlatest, &jobs[t])) {
+                _scanlatest(&jobs[t]);
+            }
+            else {
+                ++started;
+            }
+        }
+    }
+    for (uint32_t t = 0; t < started; ++t) {
+        _threadjoin(&threads[t]);
+    }
+    for (uint32_t t = 0; t < dwThreads; ++t) {
+        if (!jobs[t].bOk) goto done;
+    }
+    for (uint32_t j = 0; j < nq; ++j) {
+        // Merge: every hit left is the latest version of its id.
+        size_t total = 0;
+        for (uint32_t t = 0; t < dwThreads; ++t) total += jobs[t].heaps[j].num;
+        Score* all = (Score*)malloc((total ? total : 1) * sizeof(Score));
+        if (!all) {
+            fprintf(stderr, "Memory allocation failed while merging the search results.\n");
+            goto done;
+        }
+        size_t num = 0;
+        for (uint32_t t = 0; t < dwThreads; ++t) {
+            memcpy(all + num, jobs[t].heaps[j].heap, jobs[t].heaps[j].num * sizeof(Score));
+            num += jobs[t].heaps[j].num;
+        }
+        qsort(all, num, sizeof(Score), heap_qsort_func);
+        if (num > topk) num = topk;
+        Score* out = scores + (size_t)j * topk;
+        for (size_t i = 0; i < num; ++i) {
+            _uiidcpy(&out[i].id, &all[i].id);
+            out[i].score = all[i].score;
+        }
+        _metricout(db, out, num);
+        free(all);
+        counts[j] = (int32_t)num;
+    }
+    result = TRUE;
+done:
+    for (uint32_t t = 0; t < dwThreads; ++t) {
+        _idsetfree(&seen[t]);
+        _jobfree(&jobs[t]);
+    }
+    free(jobs); free(seen); free(threads); free(running);
+    _maprelease(db, map);
+    free(live);
+    free(qnorms);
+    return result;
+}
+
+EMBEDDINGS_API int32_t EMBEDDINGS_CALL filesearch(
+    Embeddings* db,
+    const float* query, uint32_t len,
+    uint32_t topk,
+    Score* scores,
+    float min,
+    BOOL bNorm)
+{
+    return filesearchex(db, query, len, topk, scores, min, bNorm, 1);
+}
+
+static int32_t _filesearchex(
+    Embeddings* db,
+    const float* query, uint32_t len,
+    uint32_t topk,
+    Score* scores,
+    float min,
+    BOOL bNorm,
+    uint32_t dwThreads)
+{
+    _dbglog("filesearch(min = %f, threads = %u);\n", min, dwThreads);
+    if (!db) {
+        fprintf(stderr, "The specified database pointer is NULL.\n");
+        return -1;
+    }
+    if (!query) {
+        fprintf(stderr, "The specified query pointer is NULL.\n");
+        return -1;
+    }
+    if (len == 0) {
+        fprintf(stderr, "The specified query length is zero.\n");
+        return -1;
+    }
+    if (topk == 0) {
+        fprintf(stderr, "The specified topk value must be greater than zero.\n");
+        return -1;
+    }
+    if (!scores) {
+        fprintf(stderr, "The specified scores buffer is NULL.\n");
+        return -1;
+    }
+    int32_t num = 0;
+    if (!_filesearch(db, query, 1, len, topk, scores, &num, min, bNorm, dwThreads)) {
+        return -1;
+    }
+    _dbglog("filesearch() = %d;\n", num);
+    return num;
+}
+
+EMBEDDINGS_API int32_t EMBEDDINGS_CALL filesearchex(
+    Embeddings* db,
+    const float* query, uint32_t len,
+    uint32_t topk,
+    Score* scores,
+    float min,
+    BOOL bNorm,
+    uint32_t dwThreads)
+{
+    _gateenter(db, FALSE);
+    int32_t result = _filesearchex(db, query, len, topk, scores, min, bNorm, dwThreads);
+    _gateleave(db);
+    return result;
+}
+
+static int32_t _filesearchbatch(
+    Embeddings* db,
+    const float* queries, uint32_t nq, uint32_t len,
+    uint32_t topk,
+    Score* scores,
+    int32_t* counts,
+    float min,
+    BOOL bNorm)
+{
+    _dbglog("filesearchbatch(nq = %u, min = %f);\n", nq, min);
+    if (!db) {
+        fprintf(stderr, "The specified database pointer is NULL.\n");
+        return -1;
+    }
+    if (!queries) {
+        fprintf(stderr, "The specified queries pointer is NULL.\n");
+        return -1;
+    }
+    if (nq == 0) {
+        fprintf(stderr, "The specified number of queries is zero.\n");
+        return -1;
+    }
+    if (len == 0) {
+        fprintf(stderr, "The specified query length is zero.\n");
+        return -1;
+    }
+    if (topk == 0) {
+        fprintf(stderr, "The specified topk value must be greater than zero.\n");
+        return -1;
+    }
+    if (!scores || !counts) {
+        fprintf(stderr, "The specified scores or counts buffer is NULL.\n");
+        return -1;
+    }
+    if (!_filesearch(db, queries, nq, len, topk, scores, counts, min, bNorm, 1)) {
+        return -1;
+    }
+    return (int32_t)nq;
+}
+
+EMBEDDINGS_API int32_t EMBEDDINGS_CALL filesearchbatch(
+    Embeddings* db,
+    const float* queries, uint32_t nq, uint32_t len,
+    uint32_t topk,
+    Score* scores,
+    int32_t* counts,
+    float min,
+    BOOL bNorm)
+{
+    _gateenter(db, FALSE);
+    int32_t result = _filesearchbatch(db, queries, nq, len, topk, scores, counts, min, bNorm);
+    _gateleave(db);
+    return result;
+}
+
+/*
+    IVF (inverted file) index.
+
+    nlist unit length centroids partition the vectors by direction, and every record offset is kept
+    in the posting list of its nearest centroid. A search ranks the centroids against the query and
+    scores only the records in the nprobe best lists, so it reads about nprobe / nlist of the file.
+
+    Records appended after the build ([end, EOF), the unindexed tail) are scanned exhaustively like
+    filesearch does. A tail record supersedes an indexed record with the same id, and the build only
+    indexes the latest version of each id, so upserts behave as in a full scan. cursorupdate changes
+    vectors in place without moving them between lists; that only costs recall until the next build.
+
+    Sidecar file <path>.ivf: IvfHeader, float centroids[nlist x dim], uint64_t lists[nlist + 1]
+    (prefix sums into offsets) and uint64_t offsets[count], each list in file order.
+*/
+
+#define IVF_VERSION 1
+#define IVF_NPROBE 8
+#define IVF_ITERS 16 /* mini-batches */
+#define IVF_BATCH 4096 /* minimum mini-batch size, at least 4 x nlist */
+#define IVF_GAP 8 /* records of a list at most this many records apart are read with one call */
+
+#pragma pack(push, 1)
+typedef struct IvfHeader {
+    char magic[0x10];
+    uint32_t version;
+    uint32_t size;
+    uint32_t nlist;
+    uint32_t dim;
+    uint32_t blobSize; /* FileHeader.blobSize of the indexed file */
+    uint32_t stride;
+    uint8_t dtype;
+    uint64_t end; /* records in [MAXHEAD, end) are indexed */
+    uiid last; /* id of the last indexed record, so that a rewritten file does not pick up a stale index */
+    uint64_t count;
+} IvfHeader;
+#pragma pack(pop)
+
+static const char kIvfMagic[] = "EMBEDDINGS.IVF";
+
+struct Ivf {
+    IvfHeader header;
+    float* centroids; /* nlist x dim */
+    uint64_t* lists; /* nlist + 1 */
+    uint64_t* offsets; /* count */
+};
+
+static void _ivffree(struct Ivf* ivf)
+{
+    if (!ivf) return;
+    free(ivf->centroids);
+    free(ivf->lists);
+    free(ivf->offsets);
+    free(ivf);
+}
+
+static BOOL _ivfalloc(struct Ivf* ivf)
+{
+    ivf->centroids = (float*)malloc((size_t)ivf->header.nlist * ivf->header.dim * sizeof(float));
+    ivf->lists = (uint64_t*)calloc((size_t)ivf->header.nlist + 1, sizeof(uint64_t));
+    ivf->offsets = (uint64_t*)malloc((ivf->header.count ? (size_t)ivf->header.count : 1) * sizeof(uint64_t));
+    return ivf->centroids && ivf->lists && ivf->offsets;
+}
+
+/* Loads <path>.ivf if there is one that matches the file. A missing index is not an error. */
+static void _ivfload(Embeddings* db)
+{
+    wchar_t wszPath[PATH];
+    if (!_iosidecar(db, L".ivf", wszPath)) return;
+    HANDLE h = _ioopen(wszPath, FILE_READ_DATA, OPEN_EXISTING, FALSE);
+    if (!h || h == INVALID_HANDLE_VALUE) return;
+    const char* reason = NULL;
+    struct Ivf* ivf = (struct Ivf*)calloc(1, sizeof(struct Ivf));
+    IvfHeader* hdr = ivf ? &ivf->header : NULL;
+    uint64_t fileSize = 0;
+    if (!ivf) {
+        reason = "out of memory";
+    }
+    else if (!_ioreadall(h, hdr, sizeof(*hdr), 0) ||
+        memcmp(hdr->magic, kIvfMagic, sizeof(kIvfMagic) - 1) != 0 ||
+        hdr->version != IVF_VERSION ||
+        hdr->size != sizeof(IvfHeader)) {
+        reason = "invalid format";
+    }
+    else if (hdr->dtype != db->header.dtype ||
+        hdr->blobSize != db->header.blobSize ||
+        hdr->stride != _recsize(&db->header) ||
+        hdr->dim != _vecdim(&db->header) ||
+        hdr->nlist == 0) {
+        reason = "built for a different record layout";
+    }
+    else if (!_iosize(db->hWrite, &fileSize) ||
+        hdr->end <= MAXHEAD ||
+        hdr->end > fileSize ||
+        (hdr->end - MAXHEAD) % hdr->stride != 0 ||
+        hdr->count > (hdr->end - MAXHEAD) / hdr->stride) {
+        reason = "stale";
+    }
+    else {
+        uiid last;
+        if (!_ioreadall(db->hWrite, &last, sizeof(last), hdr->end - hdr->stride) || !_uiidcmp(&last, &hdr->last)) {
+            reason = "stale";
+        }
+    }
+    if (!reason) {
+        uint64_t pos = sizeof(IvfHeader);
+        size_t cbCentroids = (size_t)hdr->nlist * hdr->dim * sizeof(float);
+        size_t cbLists = ((size_t)hdr->nlist + 1) * sizeof(uint64_t);
+        if (!_ivfalloc(ivf)) {
+            reason = "out of memory";
+        }
+        else if (!_ioreadall(h, ivf->centroids, cbCentroids, pos) ||
+            !_ioreadall(h, ivf->lists, cbLists, pos + cbCentroids) ||
+            !_ioreadall(h, ivf->offsets, (size_t)hdr->count * sizeof(uint64_t), pos + cbCentroids + cbLists)) {
+            reason = "truncated";
+        }
+        else if (ivf->lists[0] != 0 || ivf->lists[hdr->nlist] != hdr->count) {
+            reason = "corrupt posting lists";
+        }
+        else {
+            for (uint32_t c = 0; c < hdr->nlist && !reason; ++c) {
+                if (ivf->lists[c] > ivf->lists[c + 1]) reason = "corrupt posting lists";
+            }
+            for (uint64_t k = 0; k < hdr->count && !reason; ++k) {
+                uint64_t offset = ivf->offsets[k];
+                if (offset < MAXHEAD || offset >= hdr->end || (offset - MAXHEAD) % hdr->stride != 0) reason = "corrupt posting lists";
+            }
+        }
+    }
+    _ioclose(h);
+    if (reason) {
+        fprintf(stderr, "Warning: ignoring the IVF index '%ls' (%s).\n", wszPath, reason);
+        _ivffree(ivf);
+        return;
+    }
+    _ivffree(db->ivf);
+    db->ivf = ivf;
+}
+
+/* Writes <path>.ivf.tmp and renames it over <path>.ivf, so a crash never leaves a torn index behind. */
+static BOOL _ivfsave(Embeddings* db, const struct Ivf* ivf)
+{
+    wchar_t wszPath[PATH], wszTemp[PATH];
+    if (!_iosidecar(db, L".ivf", wszPath) || !_iosidecar(db, L".ivf.tmp", wszTemp)) {
+        fprintf(stderr, "The IVF index path is too long.\n");
+        return FALSE;
+    }
+    HANDLE h = _ioopen(wszTemp, FILE_READ_DATA | FILE_WRITE_DATA, CREATE_ALWAYS, FALSE);
+    if (!h || h == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "Failed to create '%ls' (system error %lu).\n", wszTemp, (unsigned long)GetLastError());
+        return FALSE;
+    }
+    const IvfHeader* hdr = &ivf->header;
+    uint64_t pos = sizeof(IvfHeader);
+    size_t cbCentroids = (size_t)hdr->nlist * hdr->dim * sizeof(float);
+    size_t cbLists = ((size_t)hdr->nlist + 1) * sizeof(uint64_t);
+    BOOL bOk = _iowriteall(h, hdr, sizeof(*hdr), 0) &&
+        _iowriteall(h, ivf->centroids, cbCentroids, pos) &&
+        _iowriteall(h, ivf->lists, cbLists, pos + cbCentroids) &&
+        _iowriteall(h, ivf->offsets, (size_t)hdr->count * sizeof(uint64_t), pos + cbCentroids + cbLists) &&
+        _iosync(h);
+    _ioclose(h);
+    if (bOk) {
+        bOk = _iorename(wszTemp, wszPath);
+    }
+    if (!bOk) {
+        fprintf(stderr, "Failed to write the IVF index '%ls' (system error %lu).\n", wszPath, (unsigned long)GetLastError());
+        _iodelete(wszTemp);
+    }
+    return bOk;
+}
+
+static inline uint64_t _ivfrand(uint64_t* state)
+{
+    // splitmix64: builds are deterministic for the same file.
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/* Nearest centroid (largest dot product) of a and of b (optional), four centroids per kernel call. */
+static void _ivfnearest(const float* centroids, uint32_t nlist, uint32_t dim, const float* a, const float* b, uint32_t best[2])
+{
+    float top[2] = { -INFINITY, -INFINITY };
+    float dots[8];
+    best[0] = best[1] = 0;
+    uint32_t c = 0;
+    for (; c + 4 <= nlist; c += 4) {
+        const float* cs[4] = { centroids + (size_t)c * dim, centroids + (size_t)(c + 1) * dim, centroids + (size_t)(c + 2) * dim, centroids + (size_t)(c + 3) * dim };
+        _kernels.sdot2x4(a, b ? b : a, cs, dim, dots);
+        for (uint32_t k = 0; k < 4; ++k) {
+            if (dots[k] > top[0]) { top[0] = dots[k]; best[0] = c + k; }
+            if (dots[4 + k] > top[1]) { top[1] = dots[4 + k]; best[1] = c + k; }
+        }
+    }
+    for (; c < nlist; ++c) {
+        const float* centroid = centroids + (size_t)c * dim;
+        float dot = cblas_sdot(a, centroid, dim);
+        if (dot > top[0]) { top[0] = dot; best[0] = c; }
+        if (b) {
+            dot = cblas_sdot(b, centroid, dim);
+            if (dot > top[1]) { top[1] = dot; best[1] = c; }
+        }
+    }
+}
+
+typedef struct IvfJob {
+    uint64_t begin, end; /* items of this worker, see _parallel */
+    BOOL bOk;
+    Embeddings* db;
+    const Mapping* map; /* optional */
+    uint32_t dim;
+    uint32_t stride;
+    uint32_t nlist;
+    const float* centroids;
+    const uint64_t* sample; /* training: record ordinals of the mini-batch */
+    float* vectors; /* training: the mini-batch, normalized */
+    uint32_t* assign; /* nearest list per item, UINT32_MAX for zero vectors while training */
+    uint64_t* keys; /* assignment: _idsetkey of every record */
+} IvfJob;
+
+/* Loads and normalizes the worker's part of the mini-batch, then assigns it if there are centroids yet. */
+static void _ivftrain(void* arg)
+{
+    IvfJob* job = (IvfJob*)arg;
+    const uint32_t dim = job->dim;
+    job->bOk = FALSE;
+    uint8_t* buff = (uint8_t*)malloc(job->stride);
+    if (!buff) return;
+    for (uint64_t i = job->begin; i < job->end; ++i) {
+        const uint8_t* rec = _records(job->db, job->map, job->stride, job->sample[i], 1, buff);
+        if (!rec) {
+            free(buff);
+            return;
+        }
+        float* x = job->vectors + i * dim;
+        _vecdecode(job->db->header.dtype, x, rec + sizeof(uiid), dim);
+        float norm = cblas_snrm2(x, dim);
+        if (norm < EPSILON) {
+            memset(x, 0, (size_t)dim * sizeof(float));
+            job->assign[i] = UINT32_MAX;
+            continue;
+        }
+        for (uint32_t d = 0; d < dim; ++d) x[d] /= norm;
+        job->assign[i] = 0;
+    }
+    free(buff);
+    if (job->centroids) {
+        for (uint64_t i = job->begin; i < job->end; i += 2) {
+            const float* b = i + 1 < job->end ? job->vectors + (i + 1) * dim : NULL;
+            uint32_t best[2];
+            _ivfnearest(job->centroids, job->nlist, dim, job->vectors + i * dim, b, best);
+            if (job->assign[i] != UINT32_MAX) job->assign[i] = best[0];
+            if (b && job->assign[i + 1] != UINT32_MAX) job->assign[i + 1] = best[1];
+        }
+    }
+    job->bOk = TRUE;
+}
+
+/* Assigns records [begin, end) to their nearest list. The argmax does not depend on the record norm. */
+static void _ivfassign(void* arg)
+{
+    IvfJob* job = (IvfJob*)arg;
+    const uint32_t MAX = 1024;
+    const uint32_t dim = job->dim;
+    job->bOk = FALSE;
+    uint8_t* big = (uint8_t*)_aligned_malloc((size_t)MAX * job->stride, job->db->header.alignment);
+    float* scratch = (float*)malloc(2 * (size_t)dim * sizeof(float));
+    if (!big || !scratch) {
+        _aligned_free(big);
+        free(scratch);
+        return;
+    }
+    for (uint64_t i = job->begin; i < job->end;) {
+        uint32_t n = job->end - i < MAX ? (uint32_t)(job->end - i) : MAX;
+        const uint8_t* recs = _records(job->db, job->map, job->stride, i, n, big);
+        if (!recs) goto done;
+        for (uint32_t r = 0; r < n; r += 2) {
+            const uint8_t* a = recs + (size_t)r * job->stride;
+            const uint8_t* b = r + 1 < n ? a + job->stride : NULL;
+            const float* x[2] = { (const float*)(a + sizeof(uiid)), b ? (const float*)(b + sizeof(uiid)) : NULL };
+            if (job->db->header.dtype != DTYPE_FLOAT32) {
+                _vecdecode(job->db->header.dtype, scratch, a + sizeof(uiid), dim);
+                x[0] = scratch;
+                if (b) {
+                    _vecdecode(job->db->header.dtype, scratch + dim, b + sizeof(uiid), dim);
+                    x[1] = scratch + dim;
+                }
+            }
+            uint32_t best[2];
+            _ivfnearest(job->centroids, job->nlist, dim, x[0], x[1], best);
+            job->assign[i + r] = best[0];
+            job->keys[i + r] = _idsetkey((const uiid*)a);
+            if (b) {
+                job->assign[i + r + 1] = best[1];
+                job->keys[i + r + 1] = _idsetkey((const uiid*)b);
+            }
+        }
+        i += n;
+    }
+    job->bOk = TRUE;
+done:
+    _aligned_free(big);
+    free(scratch);
+}
+
+static BOOL _ivfbuild(Embeddings* db, uint32_t nlist, uint32_t dwThreads, struct Ivf** pivf)
+{
+    _dbglog("ivfbuild(nlist = %u, threads = %u);\n", nlist, dwThreads);
+    if (!db) {
+        fprintf(stderr, "The specified database pointer is NULL.\n");
+        return FALSE;
+    }
+    if (!db->hWrite || db->hWrite == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "The specified database is closed or invalid.\n");
+        return FALSE;
+    }
+    const uint32_t dim = _vecdim(&db->header);
+    const uint32_t stride = _recsize(&db->header);
+    uint64_t fileSize = 0;
+    if (!_iosize(db->hWrite, &fileSize)) {
+        fprintf(stderr, "Failed to query the database size (system error %lu).\n", (unsigned long)GetLastError());
+        return FALSE;
+    }
+    // Records appended from here on are the unindexed tail.
+    uint64_t records = fileSize > MAXHEAD ? (fileSize - MAXHEAD) / stride : 0;
+    if (nlist == 0 || nlist > records) {
+        fprintf(stderr, "The number of lists (%u) must be between 1 and the number of records (%llu).\n",
+            nlist, (unsigned long long)records);
+        return FALSE;
+    }
+    if (dwThreads == 0) {
+        dwThreads = db->os.dwNumberOfProcessors ? db->os.dwNumberOfProcessors : 1;
+    }
+    if (dwThreads > records) {
+        dwThreads = (uint32_t)records;
+    }
+    uint64_t batch = (uint64_t)nlist * 4 > IVF_BATCH ? (uint64_t)nlist * 4 : IVF_BATCH;
+    if (batch > records) batch = records;
+    BOOL bOk = FALSE;
+    Mapping* map = _mapacquire(db);
+    struct Ivf* ivf = (struct Ivf*)calloc(1, sizeof(struct Ivf));
+    IvfJob* jobs = (IvfJob*)calloc(dwThreads, sizeof(IvfJob));
+    Thread* threads = (Thread*)calloc(dwThreads, sizeof(Thread));
+    uint64_t* sample = (uint64_t*)malloc((size_t)batch * sizeof(uint64_t));
+    float* vectors = (float*)malloc((size_t)batch * dim * sizeof(float));
+    uint32_t* assign = (uint32_t*)malloc((size_t)records * sizeof(uint32_t));
+    uint64_t* keys = (uint64_t*)malloc((size_t)records * sizeof(uint64_t));
+    uint64_t* counts = (uint64_t*)calloc(nlist, sizeof(uint64_t));
+    IdSet seen = { 0 };
+    if (!ivf || !jobs || !threads || !sample || !vectors || !assign || !keys || !counts) {
+        fprintf(stderr, "Memory allocation failed while preparing the IVF build.\n");
+        goto done;
+    }
+    memcpy(ivf->header.magic, kIvfMagic, sizeof(kIvfMagic) - 1);
+    ivf->header.version = IVF_VERSION;
+    ivf->header.size = sizeof(IvfHeader);
+    ivf->header.nlist = nlist;
+    ivf->header.dim = dim;
+    ivf->header.blobSize = db->header.blobSize;
+    ivf->header.stride = stride;
+    ivf->header.dtype = db->header.dtype;
+    ivf->header.end = MAXHEAD + records * stride;
+    if (!_ioreadall(db->hWrite, &ivf->header.last, sizeof(uiid), ivf->header.end - stride)) {
+        fprintf(stderr, "Failed to read the database (system error %lu).\n", (unsigned long)GetLastError());
+        goto done;
+    }
+    ivf->centroids = (float*)malloc((size_t)nlist * dim * sizeof(float));
+    ivf->lists = (uint64_t*)calloc((size_t)nlist + 1, sizeof(uint64_t));
+    if (!ivf->centroids || !ivf->lists) {
+        fprintf(stderr, "Memory allocation failed while preparing the IVF build.\n");
+        goto done;
+    }
+    for (uint32_t t = 0; t < dwThreads; ++t) {
+        jobs[t].db = db;
+        jobs[t].map = map;
+        jobs[t].dim = dim;
+        jobs[t].stride = stride;
+        jobs[t].nlist = nlist;
+        jobs[t].sample = sample;
+        jobs[t].vectors = vectors;
+        jobs[t].assign = assign;
+        jobs[t].keys = keys;
+    }
+    /*
+        Mini-batch spherical k-means: each round draws a random batch, assigns it to the nearest
+        centroids in parallel and moves every centroid towards its points with a per-centroid
+        learning rate of 1 / (points seen so far), then projects it back onto the unit sphere.
+        The first batch seeds the centroids; centroids that attract nothing are reseeded.
+    */
+    uint64_t state = 0x2545F4914F6CDD1DULL ^ records;
+    for (uint32_t round = 0; round <= IVF_ITERS; ++round) {
+        for (uint64_t i = 0; i < batch; ++i) {
+            sample[i] = _ivfrand(&state) % records;
+        }
+        for (uint32_t t = 0; t < dwThreads; ++t) {
+            jobs[t].centroids = round ? ivf->centroids : NULL;
+        }
+        if (!_parallel(jobs, sizeof(IvfJob), threads, dwThreads, batch, _ivftrain)) {
+            fprintf(stderr, "Failed to read the database (system error %lu).\n", (unsigned long)GetLastError());
+            goto done;
+        }
+        if (round == 0) {
+            for (uint32_t c = 0; c < nlist; ++c) {
+                memcpy(ivf->centroids + (size_t)c * dim, vectors + (size_t)c * dim, (size_t)dim * sizeof(float));
+            }
+            continue;
+        }
+        for (uint64_t i = 0; i < batch; ++i) {
+            if (assign[i] == UINT32_MAX) continue;
+            float* centroid = ivf->centroids + (size_t)assign[i] * dim;
+            const float* x = vectors + (size_t)i * dim;
+            float eta = 1.0f / (float)++counts[assign[i]];
+            for (uint32_t d = 0; d < dim; ++d) centroid[d] += eta * (x[d] - centroid[d]);
+        }
+        for (uint32_t c = 0; c < nlist; ++c) {
+            float* centroid = ivf->centroids + (size_t)c * dim;
+            float norm = cblas_snrm2(centroid, dim);
+            if (counts[c] == 0 || norm < EPSILON) {
+                uint64_t i = _ivfrand(&state) % batch;
+                memcpy(centroid, vectors + (size_t)i * dim, (size_t)dim * sizeof(float));
+                continue;
+            }
+            for (uint32_t d = 0; d < dim; ++d) centroid[d] /= norm;
+        }
+    }
+    for (uint32_t t = 0; t < dwThreads; ++t) {
+        jobs[t].centroids = ivf->centroids;
+    }
+    if (!_parallel(jobs, sizeof(IvfJob), threads, dwThreads, records, _ivfassign)) {
+        fprintf(stderr, "Failed to read the database (system error %lu).\n", (unsigned long)GetLastError());
+        goto done;
+    }
+    // Only the latest version of an id is indexed: walk backwards and drop the ids seen already.
+    if (!_idsetinit(&seen, (size_t)records)) {
+        fprintf(stderr, "Memory allocation failed while building the posting lists.\n");
+        goto done;
+    }
+    for (uint64_t i = records; i-- > 0;) {
+        if (_idsethas(&seen, keys[i])) {
+            assign[i] = UINT32_MAX;
+            continue;
+        }
+        _idsetadd(&seen, keys[i]);
+        ivf->lists[assign[i] + 1]++;
+        ivf->header.count++;
+    }
+    for (uint32_t c = 0; c < nlist; ++c) {
+        ivf->lists[c + 1] += ivf->lists[c];
+    }
+    ivf->offsets = (uint64_t*)malloc((ivf->header.count ? (size_t)ivf->header.count : 1) * sizeof(uint64_t));
+    if (!ivf->offsets) {
+        fprintf(stderr, "Memory allocation failed while building the posting lists.\n");
+        goto done;
+    }
+    // Counting sort in file order keeps every list ascending, so runs of neighbours are read together.
+    memcpy(counts, ivf->lists, (size_t)nlist * sizeof(uint64_t));
+    for (uint64_t i = 0; i < records; ++i) {
+        if (assign[i] != UINT32_MAX) ivf->offsets[counts[assign[i]]++] = MAXHEAD + i * stride;
+    }
+    // Temporary files go away on close, so their index is only kept in memory.
+    if (!db->bTemporary && !_ivfsave(db, ivf)) {
+        goto done;
+    }
+    *pivf = ivf;
+    ivf = NULL;
+    bOk = TRUE;
+done:
+    _idsetfree(&seen);
+    _ivffree(ivf);
+    free(jobs);
+    free(threads);
+    free(sample);
+    free(vectors);
+    free(assign);
+    free(keys);
+    free(counts);
+    _maprelease(db, map);
+    return bOk;
+}
+
+EMBEDDINGS_API BOOL EMBEDDINGS_CALL ivfbuild(Embeddings* db, uint32_t nlist, uint32_t dwThreads)
+{
+    struct Ivf* ivf = NULL;
+    _gateenter(db, FALSE);
+    uint32_t swaps = _gateswaps(db);
+    BOOL result = _ivfbuild(db, nlist, dwThreads, &ivf);
+    _gateleave(db);
+    if (result && (result = _gateswap(db, swaps))) {
+        _ivffree(db->ivf);
+        db->ivf = ivf;
+        ivf = NULL;
+        _gateunlock(db);
+    }
+    _ivffree(ivf);
+    return result;
+}
+
+typedef struct IvfProbe {
+    float score;
+    uint32_t list;
+} IvfProbe;
+
+static int __cdecl _ivfprobecmp(const void* pa, const void* pb)
+{
+    const IvfProbe* a = (const IvfProbe*)pa;
+    const IvfProbe* b = (const IvfProbe*)pb;
+    if (a->score != b->score) return a->score < b->score ? 1 : -1;
+    return a->list < b->list ? -1 : (a->list > b->list);
+}
+
+/* Scores an indexed record unless the tail holds a newer version of its id or it is a tombstone. */
+static inline void _ivfscore(ScanJob* job, const IdSet* tail, const uint8_t* rec)
+{
+    if (job->bOps && _recop(&job->db->header, rec) == RECORD_DELETE) return;
+    if (!_idsethas(tail, _idsetkey((const uiid*)rec))) {
+        _score(job, rec);
+    }
+}
+
+static int32_t _ivfsearch(
+    Embeddings* db,
+    const float* query, uint32_t len,
+    uint32_t topk,
+    Score* scores,
+    float min,
+    BOOL bNorm,
+    uint32_t nprobe)
+{
+    _dbglog("ivfsearch(min = %f, nprobe = %u);\n", min, nprobe);
+    if (!db) {
+        fprintf(stderr, "The specified database pointer is NULL.\n");
+        return -1;
+    }
+    if (!query) {
+        fprintf(stderr, "The specified query pointer is NULL.\n");
+        return -1;
+    }
+    if (len == 0) {
+        fprintf(stderr, "The specified query length is zero.\n");
+        return -1;
+    }
+    if (topk == 0) {
+        fprintf(stderr, "The specified topk value must be greater than zero.\n");
+        return -1;
+    }
+    if (!scores) {
+        fprintf(stderr, "The specified scores buffer is NULL.\n");
+        return -1;
+    }
+    struct Ivf* ivf = db->ivf;
+    if (!ivf) {
+        return _filesearchex(db, query, len, topk, scores, min, bNorm, 1);
+    }
+    ScanJob proto;
+    float* qnorms = _searchprep(db, query, 1, len, min, bNorm, &proto);
+    if (!qnorms) {
+        return -1;
+    }
+    const uint32_t MAX = 1024;
+    const uint32_t nlist = ivf->header.nlist;
+    const uint32_t stride = proto.stride;
+    if (nprobe == 0) nprobe = IVF_NPROBE;
+    if (nprobe > nlist) nprobe = nlist;
+    int32_t result = -1;
+    uint64_t fileSize = 0;
+    Mapping* map = _mapacquire(db);
+    proto.map = map;
+    ScanJob tail = { 0 }, hits = { 0 };
+    IdSet seen = { 0 };
+    uint8_t* big = NULL;
+    Score* all = NULL;
+    IvfProbe* probes = (IvfProbe*)malloc((size_t)nlist * sizeof(IvfProbe));
+    if (!probes || !_iosize(db->hWrite, &fileSize) ||
+        !_idsetinit(&seen, fileSize > ivf->header.end ? (size_t)((fileSize - ivf->header.end) / stride) : 0) ||
+        !_jobinit(&tail, &proto, topk) ||
+        !_jobinit(&hits, &proto, topk)) {
+        fprintf(stderr, "Memory allocation failed while preparing the IVF search.\n");
+        goto done;
+    }
+    // The unindexed tail first: its ids retire the older versions held in the lists.
+    tail.begin = ivf->header.end;
+    tail.seen = &seen;
+    _scanrange(&tail);
+    if (tail.bOk && tail.bRetired) {
+        _scanlatest(&tail);
+    }
+    if (!tail.bOk) goto done;
+    for (uint32_t c = 0; c < nlist; ++c) {
+        probes[c].score = cblas_sdot(query, ivf->centroids + (size_t)c * len, len);
+        probes[c].list = c;
+    }
+    qsort(probes, nlist, sizeof(IvfProbe), _ivfprobecmp);
+    for (uint32_t p = 0; p < nprobe; ++p) {
+        const uint64_t* offsets = ivf->offsets + ivf->lists[probes[p].list];
+        uint64_t count = ivf->lists[probes[p].list + 1] - ivf->lists[probes[p].list];
+        for (uint64_t k = 0; k < count;) {
+            uint64_t offset = offsets[k];
+            if (map && offset + stride <= map->size) {
+                _ivfscore(&hits, &seen, map->base + offset);
+                ++k;
+                continue;
+            }
+            // One read for the records of the list that lie close together; the few records in between are read and skipped.
+            uint32_t n = 1;
+            uint64_t span = stride;
+            while (k + n < count &&
+                offsets[k + n] - offset + stride <= (uint64_t)MAX * stride &&
+                offsets[k + n] - (offset + span) <= IVF_GAP * (uint64_t)stride) {
+                span = offsets[k + n] - offset + stride;
+                ++n;
+            }
+            if (!big) {
+                big = (uint8_t*)_aligned_malloc((size_t)MAX * stride, db->header.alignment);
+                if (!big) {
+                    fprintf(stderr, "Memory allocation failed while preparing the read buffers.\n");
+                    goto done;
+                }
+            }
+            if (!_ioreadall(db->hWrite, big, (size_t)span, offset)) {
+                fprintf(stderr, "Failed to read the database (system error %lu).\n", (unsigned long)GetLastError());
+                goto done;
+            }
+            for (uint32_t r = 0; r < n; ++r) {
+                _ivfscore(&hits, &seen, big + (offsets[k + r] - offset));
+            }
+            k += n;
+        }
+    }
+    // The two heaps hold different ids, so merging is a sort.
+    all = (Score*)malloc(2 * (size_t)topk * sizeof(Score));
+    if (!all) {
+        fprintf(stderr, "Memory allocation failed while merging the search results.\n");
+        goto done;
+    }
+    size_t num = topkdrain(&tail.heaps[0], all);
+    num += topkdrain(&hits.heaps[0], all + num);
+    qsort(all, num, sizeof(Score), heap_qsort_func);
+    if (num > topk) num = topk;
+    memset(scores, 0, (size_t)topk * sizeof(Score));
+    memcpy(scores, all, num * sizeof(Score));
+    _metricout(db, scores, num);
+    result = (int32_t)num;
+    _dbglog("ivfsearch() = %d;\n", result);
+done:
+    free(all);
+    _aligned_free(big);
+    _jobfree(&hits);
+    _jobfree(&tail);
+    _idsetfree(&seen);
+    free(probes);
+    _maprelease(db, map);
+    free(qnorms);
+    return result;
+}
+
+EMBEDDINGS_API int32_t EMBEDDINGS_CALL ivfsearch(
+    Embeddings* db,
+    const float* query, uint32_t len,
+    uint32_t topk,
+    Score* scores,
+    float min,
+    BOOL bNorm,
+    uint32_t nprobe)
+{
+    _gateenter(db, FALSE);
+    int32_t result = _ivfsearch(db, query, len, topk, scores, min, bNorm, nprobe);
+    _gateleave(db);
+    return result;
+}
+
+/*
+    HNSW (hierarchical navigable small world) graph index.
+
+    Node i is record ordinal i (offset MAXHEAD + i x stride). The graph holds links only and reads
+    the vectors from the file in place, so building or loading it enables filemap. Each node has up
+    to 2M links on layer 0 and up to M on each of its upper layers. A search descends greedily from
+    the entry point through the upper layers, then runs a best-first search over layer 0 that keeps
+    the efSearch best nodes.
+
+    fileappend inserts the records appended since the last insert (by any handle), and a search
+    does the same first, so the graph always covers the whole file. When a record repeats an id, the
+    older node stays in the graph for navigation but is left out of the results (upsert).
+    cursorupdate changes vectors under the graph; their links are revised by the next build.
+
+    Sidecar file <path>.hnsw: HnswHeader, uint8_t levels[count], uint64_t keys[count] (_idsetkey),
+    uint32_t links0[count x (2M + 1)] and then levels[i] x (M + 1) links for every node with
+    levels[i] > 0, in node order. A link list is [n][n node ordinals]. fileclose saves the graph
+    again when records were inserted since it was loaded.
+*/
+
+#define HNSW_VERSION 1
+#define HNSW_M 16
+#define HNSW_EFCONSTRUCTION 200
+#define HNSW_EFSEARCH 64
+#define HNSW_MAXLEVEL 16
+
+#pragma pack(push, 1)
+typedef struct HnswHeader {
+    char magic[0x10];
+    uint32_t version;
+    uint32_t size;
+    uint32_t M;
+    uint32_t efConstruction;
+    uint32_t dim;
+    uint32_t blobSize; /* FileHeader.blobSize of the indexed file */
+    uint32_t stride;
+    uint8_t dtype;
+    uint32_t count; /* records [0, count) are nodes */
+    uint32_t entry;
+    uint32_t maxlevel;
+    uiid last; /* id of record count - 1, so that a rewritten file does not pick up a stale graph */
+    uint64_t seed; /* state of the level generator */
+} HnswHeader;
+#pragma pack(pop)
+
+static const char kHnswMagic[] = "EMBEDDINGS.HNSW";
+
+struct Hnsw {
+    HnswHeader header;
+    uint32_t capacity;
+    uint8_t* levels;
+    uint64_t* keys;
+    uint32_t* links0; /* capacity x (2M + 1) */
+    uint32_t** upper; /* levels[i] x (M + 1), NULL for level 0 nodes */
+    uint8_t* stale; /* a later record has the same id */
+    uint32_t* visited; /* epoch per node */
+    uint32_t epoch;
+    IdMap ids; /* latest node per id */
+    Lock lock;
+    BOOL bDirty;
+};
+
+static void _hnswfree(struct Hnsw* g)
+{
+    if (!g) return;
+    if (g->upper) {
+        for (uint32_t i = 0; i < g->header.count; ++i) free(g->upper[i]);
+    }
+    free(g->levels);
+    free(g->keys);
+    free(g->links0);
+    free(g->upper);
+    free(g->stale);
+    free(g->visited);
+    _idmapfree(&g->ids);
+    _lockfree(&g->lock);
+    free(g);
+}
+
+static struct Hnsw* _hnswcreate(const Embeddings* db, uint32_t M, uint32_t efConstruction)
+{
+    struct Hnsw* g = (struct Hnsw*)calloc(1, sizeof(struct Hnsw));
+    if (!g) return NULL;
+    _lockinit(&g->lock);
+    memcpy(g->header.magic, kHnswMagic, sizeof(kHnswMagic) - 1);
+    g->header.version = HNSW_VERSION;
+    g->header.size = sizeof(HnswHeader);
+    g->header.M = M;
+    g->header.efConstruction = efConstruction;
+    g->header.dim = _vecdim(&db->header);
+    g->header.blobSize = db->header.blobSize;
+    g->header.stride = _recsize(&db->header);
+    g->header.dtype = db->header.dtype;
+    g->header.seed = 0x2545F4914F6CDD1DULL;
+    return g;
+}
+
+/* Room for capacity nodes. */
+static BOOL _hnswreserve(struct Hnsw* g, uint32_t capacity)
+{
+    if (capacity <= g->capacity) return TRUE;
+    const size_t width = 2 * (size_t)g->header.M + 1;
+    uint8_t* levels = (uint8_t*)realloc(g->levels, capacity);
+    if (levels) g->levels = levels;
+    uint64_t* keys = (uint64_t*)realloc(g->keys, (size_t)capacity * sizeof(uint64_t));
+    if (keys) g->keys = keys;
+    uint32_t* links0 = (uint32_t*)realloc(g->links0, (size_t)capacity * width * sizeof(uint32_t));
+    if (links0) g->links0 = links0;
+    uint32_t** upper = (uint32_t**)realloc(g->upper, (size_t)capacity * sizeof(uint32_t*));
+    if (upper) g->upper = upper;
+    uint8_t* stale = (uint8_t*)realloc(g->stale, capacity);
+    if (stale) g->stale = stale;
+    uint32_t* visited = (uint32_t*)realloc(g->visited, (size_t)capacity * sizeof(uint32_t));
+    if (visited) g->visited = visited;
+    if (!levels || !keys || !links0 || !upper || !stale || !visited) return FALSE;
+    memset(g->visited + g->capacity, 0, (size_t)(capacity - g->capacity) * sizeof(uint32_t));
+    g->capacity = capacity;
+    return TRUE;
+}
+
+static inline uint32_t* _hnswlinks(const struct Hnsw* g, uint32_t node, uint32_t layer)
+{
+    return layer == 0
+        ? g->links0 + (size_t)node * (2 * (size_t)g->header.M + 1)
+        : g->upper[node] + (size_t)(layer - 1) * (g->header.M + 1);
+}
+
+typedef struct HnswCtx {
+    Embeddings* db;
+    struct Hnsw* g;
+    const Mapping* map; /* optional */
+    uint8_t* buff; /* one record, for reads past the mapping */
+    float* q; /* dim: the node being inserted, unit length with METRIC_COSINE */
+    float* base; /* dim: the node whose links are being pruned */
+    float* vec; /* dim: the candidate being checked by the heuristic */
+    float* tmp; /* dim: a record widened to float32 for the distance kernels */
+    float qnorm;
+    BOOL bNorm;
+    uint8_t metric;
+    NodeHeap cand;
+    NodeHeap top;
+    BOOL bOk;
+} HnswCtx;
+
+static BOOL _hnswctxinit(HnswCtx* ctx, Embeddings* db, struct Hnsw* g, BOOL bNorm, float qnorm)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->db = db;
+    ctx->g = g;
+    ctx->bNorm = _metricnorm(db, bNorm);
+    ctx->qnorm = qnorm;
+    ctx->metric = db->header.metric;
+    ctx->bOk = TRUE;
+    ctx->map = _mapacquire(db);
+    ctx->buff = (uint8_t*)malloc(g->header.stride);
+    ctx->q = (float*)malloc(4 * (size_t)g->header.dim * sizeof(float));
+    ctx->base = ctx->q ? ctx->q + g->header.dim : NULL;
+    ctx->vec = ctx->q ? ctx->q + 2 * (size_t)g->header.dim : NULL;
+    ctx->tmp = ctx->q ? ctx->q + 3 * (size_t)g->header.dim : NULL;
+    return ctx->buff && ctx->q;
+}
+
+static void _hnswctxfree(HnswCtx* ctx)
+{
+    _maprelease(ctx->db, (Mapping*)ctx->map);
+    free(ctx->buff);
+    free(ctx->q);
+    free(ctx->cand.items);
+    free(ctx->top.items);
+}
+
+/* Record of node, in place when mapped. Valid until the next call. */
+static const uint8_t* _hnswrecord(HnswCtx* ctx, uint32_t node)
+{
+    const uint32_t stride = ctx->g->header.stride;
+    uint64_t offset = MAXHEAD + (uint64_t)node * stride;
+    if (ctx->map && offset + stride <= ctx->map->size) {
+        return ctx->map->base + offset;
+    }
+    if (!_ioreadall(ctx->db->hWrite, ctx->buff, stride, offset)) {
+        ctx->bOk = FALSE;
+        return NULL;
+    }
+    return ctx->buff;
+}
+
+/*
+    Same score as the scan gives the record: the dot product over both norms, the raw dot product
+    without bNorm, or the negated distance for METRIC_L2 and METRIC_L1.
+*/
+static float _hnswsim(HnswCtx* ctx, const float* q, uint32_t node)
+{
+    const HnswHeader* hdr = &ctx->g->header;
+    const uint8_t* rec = _hnswrecord(ctx, node);
+    if (!rec) return -INFINITY;
+    const uint8_t* blob = rec + sizeof(uiid);
+    if (ctx->metric == METRIC_L2 || ctx->metric == METRIC_L1) {
+        const float* x = (const float*)blob;
+        if (hdr->dtype != DTYPE_FLOAT32) {
+            _vecdecode(hdr->dtype, ctx->tmp, blob, hdr->dim);
+            x = ctx->tmp;
+        }
+        return -(ctx->metric == METRIC_L2 ? _kernels.sl2(x, q, hdr->dim) : _kernels.sl1(x, q, hdr->dim));
+    }
+    double dot = _vecdot(hdr->dtype, blob, q, hdr->dim);
+    if (!ctx->bNorm) return (float)dot;
+    float norm = 0;
+    if (ctx->db->header.flags & HEADER_NORMS) {
+        memcpy(&norm, blob + hdr->blobSize, sizeof(float));
+    }
+    if (!(norm > 0)) {
+        norm = _vecnrm2(hdr->dtype, blob, hdr->dim);
+    }
+    if (norm < EPSILON) return -INFINITY;
+    return (float)(dot / ((double)ctx->qnorm * (double)norm));
+}
+
+/* Decodes node into dst, at unit length with METRIC_COSINE. */
+static BOOL _hnswvector(HnswCtx* ctx, uint32_t node, float* dst)
+{
+    const HnswHeader* hdr = &ctx->g->header;
+    const uint8_t* rec = _hnswrecord(ctx, node);
+    if (!rec) return FALSE;
+    _vecdecode(hdr->dtype, dst, rec + sizeof(uiid), hdr->dim);
+    if (ctx->metric != METRIC_COSINE) return TRUE;
+    float norm = cblas_snrm2(dst, hdr->dim);
+    if (norm >= EPSILON) {
+        for (uint32_t d = 0; d < hdr->dim; ++d) dst[d] /= norm;
+    }
+    return TRUE;
+}
+
+static inline BOOL _hnswvisit(struct Hnsw* g, uint32_t node)
+{
+    if (g->visited[node] == g->epoch) return FALSE;
+    g->visited[node] = g->epoch;
+    return TRUE;
+}
+
+static void _hnswnewepoch(struct Hnsw* g)
+{
+    if (++g->epoch == 0) {
+        memset(g->visited, 0, (size_t)g->capacity * sizeof(uint32_t));
+        g->epoch = 1;
+    }
+}
+
+/* Greedy walk on one layer: moves ep to its best neighbor until none is better. */
+static void _hnswgreedy(HnswCtx* ctx, const float* q, uint32_t layer, NodeItem* ep)
+{
+    BOOL bChanged = TRUE;
+    while (bChanged && ctx->bOk) {
+        bChanged = FALSE;
+        const uint32_t* links = _hnswlinks(ctx->g, ep->node, layer);
+        for (uint32_t k = 1; k <= links[0]; ++k) {
+            float sim = _hnswsim(ctx, q, links[k]);
+            if (sim > ep->sim) {
+                ep->sim = sim;
+                ep->node = links[k];
+                bChanged = TRUE;
+            }
+        }
+    }
+}
+
+/*
+    Best-first search of one layer from the nodes in ctx->top, which receives the ef best nodes.
+    With bResults, stale nodes are walked through but not kept.
+*/
+static BOOL _hnswlayer(HnswCtx* ctx, const float* q, uint32_t layer, uint32_t ef, BOOL bResults)
+{
+    struct Hnsw* g = ctx->g;
+    _hnswnewepoch(g);
+    // The entry points seed the candidates, and top is rebuilt from them (the caller may have sorted it).
+    ctx->cand.num = 0;
+    for (uint32_t i = 0; i < ctx->top.num; ++i) {
+        _hnswvisit(g, ctx->top.items[i].node);
+        if (!_nodepush(&ctx->cand, -ctx->top.items[i].sim, ctx->top.items[i].node)) return FALSE;
+    }
+    ctx->top.num = 0;
+    for (uint32_t i = 0; i < ctx->cand.num; ++i) {
+        NodeItem seed = ctx->cand.items[i];
+        if (bResults && (g->stale[seed.node] || seed.sim == INFINITY)) continue;
+        if (!_nodepush(&ctx->top, -seed.sim, seed.node)) return FALSE;
+        if (ctx->top.num > ef) _nodepop(&ctx->top);
+    }
+    while (ctx->cand.num > 0 && ctx->bOk) {
+        NodeItem c = _nodepop(&ctx->cand);
+        if (ctx->top.num >= ef && -c.sim < ctx->top.items[0].sim) break;
+        const uint32_t* links = _hnswlinks(g, c.node, layer);
+        for (uint32_t k = 1; k <= links[0]; ++k) {
+            uint32_t e = links[k];
+            if (!_hnswvisit(g, e)) continue;
+            float sim = _hnswsim(ctx, q, e);
+            if (ctx->top.num < ef || sim > ctx->top.items[0].sim) {
+                if (!_nodepush(&ctx->cand, -sim, e)) return FALSE;
+                if (bResults && (g->stale[e] || sim == -INFINITY)) continue;
+                if (!_nodepush(&ctx->top, sim, e)) return FALSE;
+                if (ctx->top.num > ef) _nodepop(&ctx->top);
+            }
+        }
+    }
+    return ctx->bOk;
+}
+
+/*
+    Neighbor selection heuristic: takes the candidates (sims to the base node, best first) one by
+    one and keeps a candidate only if it is closer to the base than to every neighbor kept so far,
+    so the links spread out in different directions instead of crowding into one cluster.
+*/
+static uint32_t _hnswselect(HnswCtx* ctx, NodeItem* items, uint32_t num, uint32_t M, uint32_t* out)
+{
+    qsort(items, num, sizeof(NodeItem), _nodecmp);
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < num && n < M && ctx->bOk; ++i) {
+        BOOL bGood = TRUE;
+        if (n > 0) {
+            if (!_hnswvector(ctx, items[i].node, ctx->vec)) break;
+            for (uint32_t k = 0; k < n && bGood; ++k) {
+                bGood = _hnswsim(ctx, ctx->vec, out[k]) <= items[i].sim;
+            }
+        }
+        if (bGood) out[n++] = items[i].node;
+    }
+    return n;
+}
+
+/* Adds node to the links of n on layer, pruning them with the heuristic when full. */
+static void _hnswconnect(HnswCtx* ctx, uint32_t n, uint32_t node, uint32_t layer)
+{
+    struct Hnsw* g = ctx->g;
+    uint32_t cap = layer ? g->header.M : 2 * g->header.M;
+    uint32_t* links = _hnswlinks(g, n, layer);
+    if (links[0] < cap) {
+        links[++links[0]] = node;
+        return;
+    }
+    NodeItem items[2 * 255 + 1];
+    if (!_hnswvector(ctx, n, ctx->base)) return;
+    uint32_t num = 0;
+    for (uint32_t k = 1; k <= links[0]; ++k) {
+        items[num].node = links[k];
+        items[num++].sim = _hnswsim(ctx, ctx->base, links[k]);
+    }
+    items[num].node = node;
+    items[num++].sim = _hnswsim(ctx, ctx->base, node);
+    uint32_t pruned[2 * 255];
+    uint32_t kept = _hnswselect(ctx, items, num, cap, pruned);
+    if (!ctx->bOk || kept == 0) return;
+    memcpy(links + 1, pruned, kept * sizeof(uint32_t));
+    links[0] = kept;
+}
+
+static BOOL _hnswinsert(HnswCtx* ctx, uint32_t node)
+{
+    struct Hnsw* g = ctx->g;
+    HnswHeader* hdr = &g->header;
+    assert(node == hdr->count);
+    if (node >= g->capacity && !_hnswreserve(g, g->capacity ? (g->capacity > UINT32_MAX / 2 ? UINT32_MAX : 2 * g->capacity) : 1024)) {
+        fprintf(stderr, "Memory allocation failed while growing the HNSW graph.\n");
+        return FALSE;
+    }
+    const uint8_t* rec = _hnswrecord(ctx, node);
+    if (!rec) return FALSE;
+    uint64_t key = _idsetkey((const uiid*)rec);
+    if (!_hnswvector(ctx, node, ctx->q)) return FALSE;
+    // Level with P(level >= l) = M^-l. The header is packed, so the generator state is advanced through a copy.
+    uint64_t seed = hdr->seed;
+    double u = (double)((_ivfrand(&seed) >> 11) + 1) / 9007199254740993.0;
+    hdr->seed = seed;
+    uint32_t level = (uint32_t)(-log(u) / log((double)hdr->M));
+    if (level > HNSW_MAXLEVEL) level = HNSW_MAXLEVEL;
+    g->levels[node] = (uint8_t)level;
+    g->keys[node] = key;
+    g->stale[node] = 0;
+    g->upper[node] = NULL;
+    _hnswlinks(g, node, 0)[0] = 0;
+    if (level > 0) {
+        g->upper[node] = (uint32_t*)calloc((size_t)level * (hdr->M + 1), sizeof(uint32_t));
+        if (!g->upper[node]) {
+            fprintf(stderr, "Memory allocation failed while growing the HNSW graph.\n");
+            return FALSE;
+        }
+    }
+    uint32_t prev = _idmapput(&g->ids, key, node);
+    if (prev != UINT32_MAX) g->stale[prev] = 1;
+    if (hdr->count == 0) {
+        hdr->entry = node;
+        hdr->maxlevel = level;
+        hdr->count = 1;
+        return TRUE;
+    }
+    NodeItem ep = { _hnswsim(ctx, ctx->q, hdr->entry), hdr->entry };
+    for (uint32_t layer = hdr->maxlevel; layer > level; --layer) {
+        _hnswgreedy(ctx, ctx->q, layer, &ep);
+    }
+    ctx->top.num = 0;
+    if (!_nodepush(&ctx->top, ep.sim, ep.node)) return FALSE;
+    for (uint32_t layer = level < hdr->maxlevel ? level : hdr->maxlevel; ; --layer) {
+        if (!_hnswlayer(ctx, ctx->q, layer, hdr->efConstruction, FALSE)) return FALSE;
+        NodeItem* items = ctx->top.items;
+        uint32_t num = ctx->top.num;
+        uint32_t* links = _hnswlinks(g, node, layer);
+        links[0] = _hnswselect(ctx, items, num, hdr->M, links + 1);
+        for (uint32_t k = 1; k <= links[0]; ++k) {
+            _hnswconnect(ctx, links[k], node, layer);
+        }
+        if (!ctx->bOk) return FALSE;
+        // _hnswselect sorted the layer's nodes best first; they seed the next layer down.
+        if (layer == 0) break;
+    }
+    hdr->count = node + 1;
+    if (level > hdr->maxlevel) {
+        hdr->maxlevel = level;
+        hdr->entry = node;
+    }
+    _uiidcpy(&hdr->last, (const uiid*)_hnswrecord(ctx, node));
+    g->bDirty = TRUE;
+    return ctx->bOk;
+}
+
+/* Inserts the records appended since the last insert. The caller holds g->lock. */
+static BOOL _hnswsync(Embeddings* db, struct Hnsw* g)
+{
+    uint64_t fileSize = 0;
+    if (!_iosize(db->hWrite, &fileSize)) return FALSE;
+    uint64_t records = fileSize > MAXHEAD ? (fileSize - MAXHEAD) / g->header.stride : 0;
+    if (records >= UINT32_MAX) records = UINT32_MAX - 1;
+    if (records <= g->header.count) return TRUE;
+    HnswCtx ctx;
+    BOOL bOk = _hnswctxinit(&ctx, db, g, TRUE, 1);
+    if (!bOk) {
+        fprintf(stderr, "Memory allocation failed while preparing the HNSW insert.\n");
+    }
+    while (bOk && g->header.count < records) {
+        bOk = _hnswinsert(&ctx, g->header.count);
+    }
+    _hnswctxfree(&ctx);
+    return bOk;
+}
+
+static void _hnswappend(Embeddings* db)
+{
+    struct Hnsw* g = db->hnsw;
+    _lockenter(&g->lock);
+    if (!_hnswsync(db, g)) {
+        fprintf(stderr, "Warning: failed to insert into the HNSW graph (system error %lu); retrying on the next append.\n", (unsigned long)GetLastError());
+    }
+    _lockleave(&g->lock);
+}
+
+static BOOL _hnswsave(Embeddings* db, struct Hnsw* g)
+{
+    wchar_t wszPath[PATH], wszTemp[PATH];
+    if (!_iosidecar(db, L".hnsw", wszPath) || !_iosidecar(db, L".hnsw.tmp", wszTemp)) {
+        fprintf(stderr, "The HNSW index path is too long.\n");
+        return FALSE;
+    }
+    const HnswHeader* hdr = &g->header;
+    size_t cbUpper = 0;
+    for (uint32_t i = 0; i < hdr->count; ++i) {
+        cbUpper += (size_t)g->levels[i] * (hdr->M + 1) * sizeof(uint32_t);
+    }
+    uint8_t* upper = (uint8_t*)malloc(cbUpper ? cbUpper : 1);
+    if (!upper) {
+        fprintf(stderr, "Memory allocation failed while saving the HNSW index.\n");
+        return FALSE;
+    }
+    size_t pos = 0;
+    for (uint32_t i = 0; i < hdr->count; ++i) {
+        size_t cb = (size_t)g->levels[i] * (hdr->M + 1) * sizeof(uint32_t);
+        if (cb) memcpy(upper + pos, g->upper[i], cb);
+        pos += cb;
+    }
+    HANDLE h = _ioopen(wszTemp, FILE_READ_DATA | FILE_WRITE_DATA, CREATE_ALWAYS, FALSE);
+    if (!h || h == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "Failed to create '%ls' (system error %lu).\n", wszTemp, (unsigned long)GetLastError());
+        free(upper);
+        return FALSE;
+    }
+    uint64_t offset = sizeof(HnswHeader);
+    size_t cbLevels = hdr->count;
+    size_t cbKeys = (size_t)hdr->count * sizeof(uint64_t);
+    size_t cbLinks = (size_t)hdr->count * (2 * (size_t)hdr->M + 1) * sizeof(uint32_t);
+    BOOL bOk = _iowriteall(h, hdr, sizeof(*hdr), 0) &&
+        _iowriteall(h, g->levels, cbLevels, offset) &&
+        _iowriteall(h, g->keys, cbKeys, offset + cbLevels) &&
+        _iowriteall(h, g->links0, cbLinks, offset + cbLevels + cbKeys) &&
+        _iowriteall(h, upper, cbUpper, offset + cbLevels + cbKeys + cbLinks) &&
+        _iosync(h);
+    _ioclose(h);
+    free(upper);
+    if (bOk) {
+        bOk = _iorename(wszTemp, wszPath);
+    }
+    if (!bOk) {
+        fprintf(stderr, "Failed to write the HNSW index '%ls' (system error %lu).\n", wszPath, (unsigned long)GetLastError());
+        _iodelete(wszTemp);
+        return FALSE;
+    }
+    g->bDirty = FALSE;
+    return TRUE;
+}
+
+/* Loads <path>.hnsw if there is one that matches the file, then inserts the records appended since. */
+static void _hnswload(Embeddings* db)
+{
+    wchar_t wszPath[PATH];
+    if (!_iosidecar(db, L".hnsw", wszPath)) return;
+    HANDLE h = _ioopen(wszPath, FILE_READ_DATA, OPEN_EXISTING, FALSE);
+    if (!h || h == INVALID_HANDLE_VALUE) return;
+    const char* reason = NULL;
+    HnswHeader hdr;
+    uint64_t fileSize = 0;
+    struct Hnsw* g = NULL;
+    if (!_ioreadall(h, &hdr, sizeof(hdr), 0) ||
+        memcmp(hdr.magic, kHnswMagic, sizeof(kHnswMagic) - 1) != 0 ||
+        hdr.version != HNSW_VERSION ||
+        hdr.size != sizeof(HnswHeader) ||
+        hdr.M < 2 || hdr.M > 255) {
+        reason = "invalid format";
+    }
+    else if (hdr.dtype != db->header.dtype ||
+        hdr.blobSize != db->header.blobSize ||
+        hdr.stride != _recsize(&db->header) ||
+        hdr.dim != _vecdim(&db->header)) {
+        reason = "built for a different record layout";
+    }
+    else if (!_iosize(db->hWrite, &fileSize) ||
+        hdr.count > (fileSize > MAXHEAD ? (fileSize - MAXHEAD) / hdr.stride : 0) ||
+        (hdr.count > 0 && (hdr.entry >= hdr.count || hdr.maxlevel > HNSW_MAXLEVEL))) {
+        reason = "stale";
+    }
+    else if (hdr.count > 0) {
+        uiid last;
+        if (!_ioreadall(db->hWrite, &last, sizeof(last), MAXHEAD + (uint64_t)(hdr.count - 1) * hdr.stride) || !_uiidcmp(&last, &hdr.last)) {
+            reason = "stale";
+        }
+    }
+    if (!reason) {
+        g = _hnswcreate(db, hdr.M, hdr.efConstruction);
+        if (!g || !_hnswreserve(g, hdr.count > 1024 ? hdr.count : 1024)) {
+            reason = "out of memory";
+        }
+    }
+    if (!reason) {
+        uint64_t offset = sizeof(HnswHeader);
+        size_t width = 2 * (size_t)hdr.M + 1;
+        size_t cbLevels = hdr.count;
+        size_t cbKeys = (size_t)hdr.count * sizeof(uint64_t);
+        size_t cbLinks = (size_t)hdr.count * width * sizeof(uint32_t);
+        g->header = hdr;
+        g->header.count = 0; // Nodes are only freed up to count, see _hnswfree.
+        memset(g->upper, 0, (size_t)g->capacity * sizeof(uint32_t*));
+        if (!_ioreadall(h, g->levels, cbLevels, offset) ||
+            !_ioreadall(h, g->keys, cbKeys, offset + cbLevels) ||
+            !_ioreadall(h, g->links0, cbLinks, offset + cbLevels + cbKeys)) {
+            reason = "truncated";
+        }
+        offset += cbLevels + cbKeys + cbLinks;
+        size_t cbUpper = 0;
+        for (uint32_t i = 0; i < hdr.count && !reason; ++i) {
+            if (g->levels[i] > hdr.maxlevel) reason = "corrupt links";
+            cbUpper += (size_t)g->levels[i] * (hdr.M + 1) * sizeof(uint32_t);
+        }
+        uint8_t* upper = reason ? NULL : (uint8_t*)malloc(cbUpper ? cbUpper : 1);
+        if (!reason && !upper) {
+            reason = "out of memory";
+        }
+        else if (!reason && !_ioreadall(h, upper, cbUpper, offset)) {
+            reason = "truncated";
+        }
+        size_t pos = 0;
+        for (uint32_t i = 0; i < hdr.count && !reason; ++i) {
+            g->header.count = i + 1;
+            size_t cb = (size_t)g->levels[i] * (hdr.M + 1) * sizeof(uint32_t);
+            if (cb) {
+                g->upper[i] = (uint32_t*)malloc(cb);
+                if (!g->upper[i]) {
+                    reason = "out of memory";
+                    break;
+                }
+                memcpy(g->upper[i], upper + pos, cb);
+                pos += cb;
+            }
+            for (uint32_t layer = 0; layer <= g->levels[i] && !reason; ++layer) {
+                const uint32_t* links = _hnswlinks(g, i, layer);
+                if (links[0] > (layer ? hdr.M : 2 * hdr.M)) reason = "corrupt links";
+                for (uint32_t k = 1; k <= links[0] && !reason; ++k) {
+                    if (links[k] >= hdr.count) reason = "corrupt links";
+                }
+            }
+        }
+        free(upper);
+        if (!reason && hdr.count > 0 && g->levels[hdr.entry] != hdr.maxlevel) {
+            reason = "corrupt links";
+        }
+        for (uint32_t i = 0; i < hdr.count && !reason; ++i) {
+            g->stale[i] = 0;
+            uint32_t prev = _idmapput(&g->ids, g->keys[i], i);
+            if (prev != UINT32_MAX) g->stale[prev] = 1;
+        }
+    }
+    _ioclose(h);
+    if (reason) {
+        fprintf(stderr, "Warning: ignoring the HNSW index '%ls' (%s).\n", wszPath, reason);
+        _hnswfree(g);
+        return;
+    }
+    // The graph reads vectors in place. fileopen runs this before the handle is shared, so no
+    // search can race on db->view here.
+    if (!db->view && !_filemap(db, MAPHINT_NONE)) {
+        fprintf(stderr, "Warning: failed to map the database for the HNSW index; using reads.\n");
+    }
+    if (!_hnswsync(db, g)) {
+        fprintf(stderr, "Warning: failed to insert the new records into the HNSW graph; retrying on the next append.\n");
+    }
+    db->hnsw = g;
+}
+
+/* Saves the graph if records were inserted since it was loaded, then frees it. */
+static void _hnswclose(Embeddings* db)
+{
+    if (!db->hnsw) return;
+    if (db->hnsw->bDirty && !db->bTemporary) {
+        _hnswsave(db, db->hnsw);
+    }
+    _hnswfree(db->hnsw);
+    db->hnsw = NULL;
+}
+
+static BOOL _hnswbuild(Embeddings* db, uint32_t M, uint32_t efConstruction, struct Hnsw** pg)
+{
+    _dbglog("hnswbuild(M = %u, efConstruction = %u);\n", M, efConstruction);
+    if (!db) {
+        fprintf(stderr, "The specified database pointer is NULL.\n");
+        return FALSE;
+    }
+    if (!db->hWrite || db->hWrite == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "The specified database is closed or invalid.\n");
+        return FALSE;
+    }
+    if (M == 0) M = HNSW_M;
+    if (efConstruction == 0) efConstruction = HNSW_EFCONSTRUCTION;
+    if (M < 2 || M > 255) {
+        fprintf(stderr, "The specified M (%u) must be between 2 and 255.\n", M);
+        return FALSE;
+    }
+    if (efConstruction < M) efConstruction = M;
+    struct Hnsw* g = _hnswcreate(db, M, efConstruction);
+    if (!g) {
+        fprintf(stderr, "Memory allocation failed while preparing the HNSW build.\n");
+        return FALSE;
+    }
+    if (!_hnswsync(db, g) || (!db->bTemporary && !_hnswsave(db, g))) {
+        _hnswfree(g);
+        return FALSE;
+    }
+    *pg = g;
+    return TRUE;
+}
+
+EMBEDDINGS_API BOOL EMBEDDINGS_CALL hnswbuild(Embeddings* db, uint32_t M, uint32_t efConstruction)
+{
+    struct Hnsw* g = NULL;
+    // The graph reads vectors in place. Like filemap, the mapping is put in place with no search inside.
+    if (db && db->hWrite && db->hWrite != INVALID_HANDLE_VALUE) {
+        _gatelock(db);
+        if (!db->view && !_filemap(db, MAPHINT_NONE)) {
+            fprintf(stderr, "Warning: failed to map the database for the HNSW index; using reads.\n");
+        }
+        _gateunlock(db);
+    }
+    _gateenter(db, FALSE);
+    uint32_t swaps = _gateswaps(db);
+    BOOL result = _hnswbuild(db, M, efConstruction, &g);
+    _gateleave(db);
+    if (result && (result = _gateswap(db, swaps))) {
+        _hnswfree(db->hnsw);
+        db->hnsw = g;
+        g = NULL;
+        _gateunlock(db);
+    }
+    _hnswfree(g);
+    return result;
+}
+
+static int32_t _hnswsearch(
+    Embeddings* db,
+    const float* query, uint32_t len,
+    uint32_t topk,
+    Score* scores,
+    float min,
+    BOOL bNorm,
+    uint32_t efSearch)
+{
+    _dbglog("hnswsearch(min = %f, efSearch = %u);\n", min, efSearch);
+    if (!db) {
+        fprintf(stderr, "The specified database pointer is NULL.\n");
+        return -1;
+    }
+    if (!query) {
+        fprintf(stderr, "The specified query pointer is NULL.\n");
+        return -1;
+    }
+    if (len == 0) {
+        fprintf(stderr, "The specified query length is zero.\n");
+        return -1;
+    }
+    if (topk == 0) {
+        fprintf(stderr, "The specified topk value must be greater than zero.\n");
+        return -1;
+    }
+    if (!scores) {
+        fprintf(stderr, "The specified scores buffer is NULL.\n");
+        return -1;
+    }
+    struct Hnsw* g = db->hnsw;
+    if (!g) {
+        return _filesearchex(db, query, len, topk, scores, min, bNorm, 1);
+    }
+    if (!db->hWrite || db->hWrite == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "The specified database is closed or invalid.\n");
+        return -1;
+    }
+    if (g->header.dim != len) {
+        fprintf(stderr,
+            "Query size (%u bytes) does not match database blob size (%u bytes).\n",
+            len * (unsigned)sizeof(float),
+            g->header.dim * (unsigned)sizeof(float));
+        return -1;
+    }
+    float qnorm = _metricnorm(db, bNorm) ? cblas_snrm2(query, len) : 1;
+    if (qnorm < EPSILON) {
+        fprintf(stderr, "Query vector norm too small (%.8g).\n", qnorm);
+        return -1;
+    }
+    min = _metricmin(db, min);
+    if (efSearch == 0) efSearch = HNSW_EFSEARCH;
+    if (efSearch < topk) efSearch = topk;
+    int32_t result = -1;
+    _lockenter(&g->lock);
+    if (!_hnswsync(db, g)) {
+        fprintf(stderr, "Warning: failed to insert the new records into the HNSW graph; they are not searched.\n");
+    }
+    HnswCtx ctx;
+    if (!_hnswctxinit(&ctx, db, g, bNorm, qnorm)) {
+        fprintf(stderr, "Memory allocation failed while preparing the HNSW search.\n");
+        goto done;
+    }
+    memset(scores, 0, (size_t)topk * sizeof(Score));
+    if (g->header.count == 0) {
+        result = 0;
+        goto done;
+    }
+    NodeItem ep = { _hnswsim(&ctx, query, g->header.entry), g->header.entry };
+    for (uint32_t layer = g->header.maxlevel; layer > 0; --layer) {
+        _hnswgreedy(&ctx, query, layer, &ep);
+    }
+    if (!_nodepush(&ctx.top, ep.sim, ep.node) || !_hnswlayer(&ctx, query, 0, efSearch, TRUE)) {
+        fprintf(stderr, "Failed to search the HNSW graph (system error %lu).\n", (unsigned long)GetLastError());
+        goto done;
+    }
+    qsort(ctx.top.items, ctx.top.num, sizeof(NodeItem), _nodecmp);
+    uint32_t num = 0;
+    for (uint32_t i = 0; i < ctx.top.num && num < topk; ++i) {
+        if (!(ctx.top.items[i].sim >= min)) break;
+        const uint8_t* rec = _hnswrecord(&ctx, ctx.top.items[i].node);
+        if (!rec) goto done;
+        // A tombstone is a node like any other record, so that it retires the earlier versions of its id.
+        if (_recop(&db->header, rec) == RECORD_DELETE) continue;
+        _uiidcpy(&scores[num].id, (const uiid*)rec);
+        scores[num++].score = ctx.top.items[i].sim;
+    }
+    _metricout(db, scores, num);
+    result = (int32_t)num;
+    _dbglog("hnswsearch() = %d;\n", result);
+done:
+    _hnswctxfree(&ctx);
+    _lockleave(&g->lock);
+    return result;
+}
+
+EMBEDDINGS_API int32_t EMBEDDINGS_CALL hnswsearch(
+    Embeddings* db,
+    const float* query, uint32_t len,
+    uint32_t topk,
+    Score* scores,
+    float min,
+    BOOL bNorm,
+    uint32_t efSearch)
+{
+    _gateenter(db, FALSE);
+    int32_t result = _hnswsearch(db, query, len, topk, scores, min, bNorm, efSearch);
+    _gateleave(db);
+    return result;
+}
+
+/*
+    PQ (product quantization) index: a compressed copy of every vector for a fast approximate scan.
+
+    Vectors are scaled to unit length and split into M subvectors of dim / M components; each
+    subvector is replaced by the nearest of the 2^nbits centroids of its sub-quantizer, trained
+    with k-means on a sample of the file. A search builds a lookup table of the query subvectors
+    against every centroid, sums M table entries per record (asymmetric distance) to keep the best
+    rerank candidates, and scores those exactly against their records. With 4 bits the table is
+    quantized to uint8 and a block of 32 codes is scored at once with byte shuffles (see _pqscan4_*),
+    so the scan reads M / 2 bytes per record instead of the whole record.
+
+    pqsearch first encodes the records appended since the last encode (by any handle). When a
+    record repeats an id, the older version is skipped (upsert). cursorupdate changes vectors under
+    the codes: the rerank scores them exactly, but they are found by their old codes until the
+    next build.
+
+    Sidecar file <path>.pq: PqHeader, float codebooks[M x 2^nbits x dim / M], uint64_t keys[count]
+    (_idsetkey), float norms[count] and the codes: ceil(count / 32) blocks of M x 16 bytes laid out
+    as _pqscan4_* expects with 4 bits, count x M bytes with 8 bits. fileclose saves the index again
+    when records were encoded since it was loaded.
+*/
+
+#define PQ_VERSION 1
+#define PQ_MAXM 64 /* largest M picked when none is given */
+#define PQ_ITERS 16
+#define PQ_TRAIN 32 /* training samples per centroid */
+#define PQ_SAMPLE 4096 /* smallest training sample */
+#define PQ_RERANK 8 /* candidates per hit scored exactly */
+#define PQ_BLOCK 32 /* records per 4-bit block */
+
+#pragma pack(push, 1)
+typedef struct PqHeader {
+    char magic[0x10];
+    uint32_t version;
+    uint32_t size;
+    uint32_t M;
+    uint32_t nbits;
+    uint32_t dim;
+    uint32_t blobSize; /* FileHeader.blobSize of the indexed file */
+    uint32_t stride;
+    uint8_t dtype;
+    uint32_t count; /* records [0, count) are encoded */
+    uiid last; /* id of record count - 1, so that a rewritten file does not pick up stale codes */
+} PqHeader;
+#pragma pack(pop)
+
+static const char kPqMagic[] = "EMBEDDINGS.PQ";
+
+struct Pq {
+    PqHeader header;
+    uint32_t ksub; /* centroids per sub-quantizer */
+    uint32_t dsub; /* components per subvector */
+    uint32_t capacity; /* a multiple of PQ_BLOCK */
+    float* codebooks; /* M x ksub x dsub */
+    float* tables; /* M x (dsub + 1) x ksub: the centroids by component, then -|c|^2 / 2, see _pqnearest */
+    uint8_t* codes;
+    uint64_t* keys;
+    float* norms; /* record norm, to skip zero vectors and to score without normalization */
+    uint8_t* stale; /* a later record has the same id */
+    IdMap ids; /* latest record per id */
+    Lock lock;
+    BOOL bDirty;
+};
+
+/* Bytes of codes for n records. */
+static inline size_t _pqcodesize(const struct Pq* pq, uint64_t n)
+{
+    return pq->header.nbits == 4
+        ? (size_t)((n + PQ_BLOCK - 1) / PQ_BLOCK) * pq->header.M * 16
+        : (size_t)n * pq->header.M;
+}
+
+static void _pqfree(struct Pq* pq)
+{
+    if (!pq) return;
+    free(pq->codebooks);
+    free(pq->tables);
+    free(pq->codes);
+    free(pq->keys);
+    free(pq->norms);
+    free(pq->stale);
+    _idmapfree(&pq->ids);
+    _lockfree(&pq->lock);
+    free(pq);
+}
+
+static struct Pq* _pqcreate(const Embeddings* db, uint32_t M, uint32_t nbits)
+{
+    struct Pq* pq = (struct Pq*)calloc(1, sizeof(struct Pq));
+    if (!pq) return NULL;
+    _lockinit(&pq->lock);
+    memcpy(pq->header.magic, kPqMagic, sizeof(kPqMagic) - 1);
+    pq->header.version = PQ_VERSION;
+    pq->header.size = sizeof(PqHeader);
+    pq->header.M = M;
+    pq->header.nbits = nbits;
+    pq->header.dim = _vecdim(&db->header);
+    pq->header.blobSize = db->header.blobSize;
+    pq->header.stride = _recsize(&db->header);
+    pq->header.dtype = db->header.dtype;
+    pq->ksub = 1u << nbits;
+    pq->dsub = pq->header.dim / M;
+    pq->codebooks = (float*)malloc((size_t)M * pq->ksub * pq->dsub * sizeof(float));
+    pq->tables = (float*)malloc((size_t)M * (pq->dsub + 1) * pq->ksub * sizeof(float));
+    if (!pq->codebooks || !pq->tables) {
+        _pqfree(pq);
+        return NULL;
+    }
+    return pq;
+}
+
+/* Room for capacity records. New codes are zero, so that 4-bit codes can be set a nibble at a time. */
+static BOOL _pqreserve(struct Pq* pq, uint64_t capacity)
+{
+    if (capacity <= pq->capacity) return TRUE;
+    capacity = (capacity + PQ_BLOCK - 1) / PQ_BLOCK * PQ_BLOCK;
+    if (capacity > UINT32_MAX - PQ_BLOCK) return FALSE;
+    size_t cbOld = _pqcodesize(pq, pq->capacity), cbNew = _pqcodesize(pq, capacity);
+    uint8_t* codes = (uint8_t*)realloc(pq->codes, cbNew);
+    if (codes) {
+        memset(codes + cbOld, 0, cbNew - cbOld);
+        pq->codes = codes;
+    }
+    uint64_t* keys = (uint64_t*)realloc(pq->keys, (size_t)capacity * sizeof(uint64_t));
+    if (keys) pq->keys = keys;
+    float* norms = (float*)realloc(pq->norms, (size_t)capacity * sizeof(float));
+    if (norms) pq->norms = norms;
+    uint8_t* stale = (uint8_t*)realloc(pq->stale, (size_t)capacity);
+    if (stale) pq->stale = stale;
+    if (!codes || !keys || !norms || !stale) return FALSE;
+    pq->capacity = (uint32_t)capacity;
+    return TRUE;
+}
+
+/* Lays a codebook out for _pqnearest. */
+static void _pqtable(const float* codebook, uint32_t ksub, uint32_t dsub, float* table)
+{
+    for (uint32_t k = 0; k < ksub; ++k) {
+        const float* centroid = codebook + (size_t)k * dsub;
+        float s = 0;
+        for (uint32_t d = 0; d < dsub; ++d) {
+            table[(size_t)d * ksub + k] = centroid[d];
+            s += centroid[d] * centroid[d];
+        }
+        table[(size_t)dsub * ksub + k] = -0.5f * s;
+    }
+}
+
+static void _pqtables(struct Pq* pq)
+{
+    const uint32_t ksub = pq->ksub, dsub = pq->dsub;
+    for (uint32_t m = 0; m < pq->header.M; ++m) {
+        _pqtable(pq->codebooks + (size_t)m * ksub * dsub, ksub, dsub, pq->tables + (size_t)m * (dsub + 1) * ksub);
+    }
+}
+
+/*
+    Nearest of the ksub centroids to the subvector x: the largest x.c - |c|^2 / 2. The table holds
+    the centroids by component, so the scores of all of them are updated one component at a time.
+*/
+static inline uint32_t _pqnearest(const float* table, uint32_t ksub, uint32_t dsub, const float* x)
+{
+    float s[256];
+    memcpy(s, table + (size_t)dsub * ksub, (size_t)ksub * sizeof(float));
+    for (uint32_t d = 0; d < dsub; ++d) {
+        const float* row = table + (size_t)d * ksub;
+        const float xd = x[d];
+        for (uint32_t k = 0; k < ksub; ++k) s[k] += xd * row[k];
+    }
+    uint32_t best = 0;
+    for (uint32_t k = 1; k < ksub; ++k) {
+        if (s[k] > s[best]) best = k;
+    }
+    return best;
+}
+
+/* Sets the codes of record i. */
+static void _pqput(struct Pq* pq, uint64_t i, const uint8_t* code)
+{
+    const uint32_t M = pq->header.M;
+    if (pq->header.nbits == 8) {
+        memcpy(pq->codes + (size_t)i * M, code, M);
+        return;
+    }
+    uint8_t* block = pq->codes + (size_t)(i / PQ_BLOCK) * M * 16;
+    uint32_t j = (uint32_t)(i % PQ_BLOCK);
+    uint32_t shift = j < 16 ? 0 : 4;
+    for (uint32_t m = 0; m < M; ++m) {
+        uint8_t* b = block + (size_t)m * 16 + (j & 15);
+        *b = (uint8_t)((*b & ~(15u << shift)) | ((uint32_t)code[m] << shift));
+    }
+}
+
+typedef struct PqJob {
+    uint64_t begin, end; /* items of this worker, see _parallel */
+    BOOL bOk;
+    Embeddings* db;
+    const Mapping* map; /* optional */
+    struct Pq* pq;
+    const float* vectors; /* training: the sample, unit length */
+    uint64_t count; /* training: sample size */
+    uint64_t first; /* encoding: record ordinal of item 0 */
+    uint64_t records; /* encoding: one past the last record ordinal */
+    uint32_t group; /* encoding: records per item */
+} PqJob;
+
+/* Lloyd's k-means on the subvectors of the sample, for sub-quantizers [begin, end). */
+static void _pqtrain(void* arg)
+{
+    PqJob* job = (PqJob*)arg;
+    struct Pq* pq = job->pq;
+    const uint32_t ksub = pq->ksub, dsub = pq->dsub, dim = pq->header.dim;
+    const uint64_t count = job->count;
+    job->bOk = FALSE;
+    float* sums = (float*)malloc((size_t)ksub * dsub * sizeof(float));
+    uint64_t* counts = (uint64_t*)malloc((size_t)ksub * sizeof(uint64_t));
+    if (!sums || !counts) goto done;
+    for (uint64_t m = job->begin; m < job->end; ++m) {
+        float* codebook = pq->codebooks + (size_t)m * ksub * dsub;
+        float* table = pq->tables + (size_t)m * (dsub + 1) * ksub;
+        uint64_t state = 0x2545F4914F6CDD1DULL ^ m;
+        // The sample is in random order already: its first points seed the centroids.
+        for (uint32_t k = 0; k < ksub; ++k) {
+            memcpy(codebook + (size_t)k * dsub, job->vectors + (size_t)(k % count) * dim + m * dsub, (size_t)dsub * sizeof(float));
+        }
+        for (uint32_t iter = 0; iter < PQ_ITERS; ++iter) {
+            _pqtable(codebook, ksub, dsub, table);
+            memset(sums, 0, (size_t)ksub * dsub * sizeof(float));
+            memset(counts, 0, (size_t)ksub * sizeof(uint64_t));
+            for (uint64_t i = 0; i < count; ++i) {
+                const float* x = job->vectors + (size_t)i * dim + m * dsub;
+                uint32_t k = _pqnearest(table, ksub, dsub, x);
+                float* sum = sums + (size_t)k * dsub;
+                for (uint32_t d = 0; d < dsub; ++d) sum[d] += x[d];
+                counts[k]++;
+            }
+            // Centroids that attract nothing are reseeded with a random point.
+            for (uint32_t k = 0; k < ksub; ++k) {
+                float* centroid = codebook + (size_t)k * dsub;
+                if (counts[k] == 0) {
+                    uint64_t i = _ivfrand(&state) % count;
+                    memcpy(centroid, job->vectors + (size_t)i * dim + m * dsub, (size_t)dsub * sizeof(float));
+                    continue;
+                }
+                for (uint32_t d = 0; d < dsub; ++d) centroid[d] = sums[(size_t)k * dsub + d] / (float)counts[k];
+            }
+        }
+    }
+    job->bOk = TRUE;
+done:
+    free(sums);
+    free(counts);
+}
+
+/* Encodes the records of items [begin, end), group records per item. */
+static void _pqencode(void* arg)
+{
+    PqJob* job = (PqJob*)arg;
+    struct Pq* pq = job->pq;
+    const uint32_t MAX = 1024;
+    const uint32_t M = pq->header.M, dim = pq->header.dim, stride = pq->header.stride;
+    uint64_t first = job->first + job->begin * job->group;
+    uint64_t last = job->first + job->end * job->group;
+    if (last > job->records) last = job->records;
+    job->bOk = FALSE;
+    uint8_t* big = (uint8_t*)_aligned_malloc((size_t)MAX * stride, job->db->header.alignment);
+    float* x = (float*)malloc((size_t)dim * sizeof(float));
+    uint8_t* code = (uint8_t*)malloc(M);
+    if (!big || !x || !code) goto done;
+    for (uint64_t i = first; i < last;) {
+        uint32_t n = last - i < MAX ? (uint32_t)(last - i) : MAX;
+        const uint8_t* recs = _records(job->db, job->map, stride, i, n, big);
+        if (!recs) goto done;
+        for (uint32_t r = 0; r < n; ++r) {
+            const uint8_t* rec = recs + (size_t)r * stride;
+            _vecdecode(pq->header.dtype, x, rec + sizeof(uiid), dim);
+            float norm = cblas_snrm2(x, dim);
+            if (norm >= EPSILON) {
+                for (uint32_t d = 0; d < dim; ++d) x[d] /= norm;
+            }
+            for (uint32_t m = 0; m < M; ++m) {
+                code[m] = (uint8_t)_pqnearest(pq->tables + (size_t)m * (pq->dsub + 1) * pq->ksub, pq->ksub, pq->dsub, x + (size_t)m * pq->dsub);
+            }
+            _pqput(pq, i + r, code);
+            pq->keys[i + r] = _idsetkey((const uiid*)rec);
+            pq->norms[i + r] = norm;
+        }
+        i += n;
+    }
+    job->bOk = TRUE;
+done:
+    _aligned_free(big);
+    free(x);
+    free(code);
+}
+
+/* Takes the encoded records [count, records) into the index: marks the versions they replace. */
+static BOOL _pqcommit(Embeddings* db, struct Pq* pq, uint64_t records)
+{
+    if (!_ioreadall(db->hWrite, &pq->header.last, sizeof(uiid), MAXHEAD + (records - 1) * pq->header.stride)) {
+        return FALSE;
+    }
+    for (uint64_t i = pq->header.count; i < records; ++i) {
+        pq->stale[i] = 0;
+        uint32_t prev = _idmapput(&pq->ids, pq->keys[i], (uint32_t)i);
+        if (prev != UINT32_MAX) pq->stale[prev] = 1;
+    }
+    pq->header.count = (uint32_t)records;
+    pq->bDirty = TRUE;
+    return TRUE;
+}
+
+/* Encodes the records appended since the last encode. The caller holds pq->lock. */
+static BOOL _pqsync(Embeddings* db, struct Pq* pq)
+{
+    uint64_t fileSize = 0;
+    if (!_iosize(db->hWrite, &fileSize)) return FALSE;
+    uint64_t records = fileSize > MAXHEAD ? (fileSize - MAXHEAD) / pq->header.stride : 0;
+    if (records >= UINT32_MAX - PQ_BLOCK) records = UINT32_MAX - PQ_BLOCK - 1;
+    if (records <= pq->header.count) return TRUE;
+    if (records > pq->capacity && !_pqreserve(pq, records > 2 * (uint64_t)pq->capacity ? records : 2 * (uint64_t)pq->capacity)) return FALSE;
+    PqJob job = { 0 };
+    job.db = db;
+    job.map = _mapacquire(db);
+    job.pq = pq;
+    job.first = pq->header.count;
+    job.records = records;
+    job.group = 1;
+    job.end = records - pq->header.count;
+    _pqencode(&job);
+    _maprelease(db, (Mapping*)job.map);
+    return job.bOk && _pqcommit(db, pq, records);
+}
+
+static BOOL _pqsave(Embeddings* db, struct Pq* pq)
+{
+    wchar_t wszPath[PATH], wszTemp[PATH];
+    if (!_iosidecar(db, L".pq", wszPath) || !_iosidecar(db, L".pq.tmp", wszTemp)) {
+        fprintf(stderr, "The PQ index path is too long.\n");
+        return FALSE;
+    }
+    HANDLE h = _ioopen(wszTemp, FILE_READ_DATA | FILE_WRITE_DATA, CREATE_ALWAYS, FALSE);
+    if (!h || h == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "Failed to create '%ls' (system error %lu).\n", wszTemp, (unsigned long)GetLastError());
+        return FALSE;
+    }
+    const PqHeader* hdr = &pq->header;
+    uint64_t offset = sizeof(PqHeader);
+    size_t cbCodebooks = (size_t)hdr->M * pq->ksub * pq->dsub * sizeof(float);
+    size_t cbKeys = (size_t)hdr->count * sizeof(uint64_t);
+    size_t cbNorms = (size_t)hdr->count * sizeof(float);
+    BOOL bOk = _iowriteall(h, hdr, sizeof(*hdr), 0) &&
+        _iowriteall(h, pq->codebooks, cbCodebooks, offset) &&
+        _iowriteall(h, pq->keys, cbKeys, offset + cbCodebooks) &&
+        _iowriteall(h, pq->norms, cbNorms, offset + cbCodebooks + cbKeys) &&
+        _iowriteall(h, pq->codes, _pqcodesize(pq, hdr->count), offset + cbCodebooks + cbKeys + cbNorms) &&
+        _iosync(h);
+    _ioclose(h);
+    if (bOk) {
+        bOk = _iorename(wszTemp, wszPath);
+    }
+    if (!bOk) {
+        fprintf(stderr, "Failed to write the PQ index '%ls' (system error %lu).\n", wszPath, (unsigned long)GetLastError());
+        _iodelete(wszTemp);
+        return FALSE;
+    }
+    pq->bDirty = FALSE;
+    return TRUE;
+}
+
+/* Loads <path>.pq if there is one that matches the file. A missing index is not an error. */
+static void _pqload(Embeddings* db)
+{
+    wchar_t wszPath[PATH];
+    if (!_iosidecar(db, L".pq", wszPath)) return;
+    HANDLE h = _ioopen(wszPath, FILE_READ_DATA, OPEN_EXISTING, FALSE);
+    if (!h || h == INVALID_HANDLE_VALUE) return;
+    const char* reason = NULL;
+    PqHeader hdr;
+    uint64_t fileSize = 0;
+    struct Pq* pq = NULL;
+    if (!_ioreadall(h, &hdr, sizeof(hdr), 0) ||
+        memcmp(hdr.magic, kPqMagic, sizeof(kPqMagic) - 1) != 0 ||
+        hdr.version != PQ_VERSION ||
+        hdr.size != sizeof(PqHeader) ||
+        (hdr.nbits != 4 && hdr.nbits != 8) ||
+        hdr.M == 0 || hdr.M > 256 || (hdr.nbits == 4 && hdr.M % 2 != 0)) {
+        reason = "invalid format";
+    }
+    else if (hdr.dtype != db->header.dtype ||
+        hdr.blobSize != db->header.blobSize ||
+        hdr.stride != _recsize(&db->header) ||
+        hdr.dim != _vecdim(&db->header) ||
+        hdr.dim % hdr.M != 0) {
+        reason = "built for a different record layout";
+    }
+    else if (!_iosize(db->hWrite, &fileSize) ||
+        hdr.count == 0 ||
+        hdr.count > (fileSize > MAXHEAD ? (fileSize - MAXHEAD) / hdr.stride : 0)) {
+        reason = "stale";
+    }
+    else {
+        uiid last;
+        if (!_ioreadall(db->hWrite, &last, sizeof(last), MAXHEAD + (uint64_t)(hdr.count - 1) * hdr.stride) || !_uiidcmp(&last, &hdr.last)) {
+            reason = "stale";
+        }
+    }
+    if (!reason) {
+        pq = _pqcreate(db, hdr.M, hdr.nbits);
+        if (!pq || !_pqreserve(pq, hdr.count > 1024 ? hdr.count : 1024)) {
+            reason = "out of memory";
+        }
+    }
+    if (!reason) {
+        uint64_t offset = sizeof(PqHeader);
+        size_t cbCodebooks = (size_t)hdr.M * pq->ksub * pq->dsub * sizeof(float);
+        size_t cbKeys = (size_t)hdr.count * sizeof(uint64_t);
+        size_t cbNorms = (size_t)hdr.count * sizeof(float);
+        if (!_ioreadall(h, pq->codebooks, cbCodebooks, offset) ||
+            !_ioreadall(h, pq->keys, cbKeys, offset + cbCodebooks) ||
+            !_ioreadall(h, pq->norms, cbNorms, offset + cbCodebooks + cbKeys) ||
+            !_ioreadall(h, pq->codes, _pqcodesize(pq, hdr.count), offset + cbCodebooks + cbKeys + cbNorms)) {
+            reason = "truncated";
+        }
+    }
+    _ioclose(h);
+    if (!reason) {
+        _pqtables(pq);
+        _pqcommit(db, pq, hdr.count);
+        pq->bDirty = FALSE;
+    }
+    if (reason) {
+        fprintf(stderr, "Warning: ignoring the PQ index '%ls' (%s).\n", wszPath, reason);
+        _pqfree(pq);
+        return;
+    }
+    db->pq = pq;
+}
+
+/* Saves the codes if records were encoded since they were loaded, then frees them. */
+static void _pqclose(Embeddings* db)
+{
+    if (!db->pq) return;
+    if (db->pq->bDirty && !db->bTemporary) {
+        _pqsave(db, db->pq);
+    }
+    _pqfree(db->pq);
+    db->pq = NULL;
+}
+
+static BOOL _pqbuild(Embeddings* db, uint32_t M, uint32_t nbits, uint32_t dwThreads, struct Pq** ppq)
+{
+    _dbglog("pqbuild(M = %u, nbits = %u, threads = %u);\n", M, nbits, dwThreads);
+    if (!db) {
+        fprintf(stderr, "The specified database pointer is NULL.\n");
+        return FALSE;
+    }
+    if (!db->hWrite || db->hWrite == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "The specified database is closed or invalid.\n");
+        return FALSE;
+    }
+    if (nbits == 0) nbits = 4;
+    if (nbits != 4 && nbits != 8) {
+        fprintf(stderr, "The specified number of bits per code (%u) must be 4 or 8.\n", nbits);
+        return FALSE;
+    }
+    const uint32_t dim = _vecdim(&db->header);
+    const uint32_t stride = _recsize(&db->header);
+    if (M == 0) {
+        for (M = dim < PQ_MAXM ? dim : PQ_MAXM; M > 0; --M) {
+            if (dim % M == 0 && (nbits == 8 || M % 2 == 0)) break;
+        }
+    }
+    if (M == 0 || M > 256 || dim % M != 0 || (nbits == 4 && M % 2 != 0)) {
+        fprintf(stderr, "The number of sub-quantizers (%u) must divide the dimension (%u), be at most 256 and even with 4 bits.\n", M, dim);
+        return FALSE;
+    }
+    uint64_t fileSize = 0;
+    if (!_iosize(db->hWrite, &fileSize)) {
+        fprintf(stderr, "Failed to query the database size (system error %lu).\n", (unsigned long)GetLastError());
+        return FALSE;
+    }
+    uint64_t records = fileSize > MAXHEAD ? (fileSize - MAXHEAD) / stride : 0;
+    if (records >= UINT32_MAX - PQ_BLOCK) records = UINT32_MAX - PQ_BLOCK - 1;
+    if (records == 0) {
+        fprintf(stderr, "The PQ index needs at least one record to train on.\n");
+        return FALSE;
+    }
+    if (dwThreads == 0) {
+        dwThreads = db->os.dwNumberOfProcessors ? db->os.dwNumberOfProcessors : 1;
+    }
+    const uint32_t ksub = 1u << nbits;
+    uint64_t count = (uint64_t)PQ_TRAIN * ksub > PQ_SAMPLE ? (uint64_t)PQ_TRAIN * ksub : PQ_SAMPLE;
+    if (count > records) count = records;
+    uint64_t groups = (records + PQ_BLOCK - 1) / PQ_BLOCK;
+    BOOL bOk = FALSE;
+    Mapping* map = _mapacquire(db);
+    struct Pq* pq = _pqcreate(db, M, nbits);
+    IvfJob* loads = (IvfJob*)calloc(dwThreads, sizeof(IvfJob));
+    PqJob* jobs = (PqJob*)calloc(dwThreads, sizeof(PqJob));
+    Thread* threads = (Thread*)calloc(dwThreads, sizeof(Thread));
+    uint64_t* sample = (uint64_t*)malloc((size_t)count * sizeof(uint64_t));
+    float* vectors = (float*)malloc((size_t)count * dim * sizeof(float));
+    uint32_t* assign = (uint32_t*)malloc((size_t)count * sizeof(uint32_t));
+    if (!pq || !loads || !jobs || !threads || !sample || !vectors || !assign || !_pqreserve(pq, records)) {
+        fprintf(stderr, "Memory allocation failed while preparing the PQ build.\n");
+        goto done;
+    }
+    // The training sample is loaded and normalized like an IVF mini-batch.
+    uint64_t state = 0x2545F4914F6CDD1DULL ^ records;
+    for (uint64_t i = 0; i < count; ++i) {
+        sample[i] = count == records ? i : _ivfrand(&state) % records;
+    }
+    for (uint32_t t = 0; t < dwThreads; ++t) {
+        loads[t].db = db;
+        loads[t].map = map;
+        loads[t].dim = dim;
+        loads[t].stride = stride;
+        loads[t].sample = sample;
+        loads[t].vectors = vectors;
+        loads[t].assign = assign;
+        jobs[t].db = db;
+        jobs[t].map = map;
+        jobs[t].pq = pq;
+        jobs[t].vectors = vectors;
+        jobs[t].records = records;
+        jobs[t].group = PQ_BLOCK;
+    }
+    if (!_parallel(loads, sizeof(IvfJob), threads, count < dwThreads ? (uint32_t)count : dwThreads, count, _ivftrain)) {
+        fprintf(stderr, "Failed to read the database (system error %lu).\n", (unsigned long)GetLastError());
+        goto done;
+    }
+    // Zero vectors have no direction to train on.
+    uint64_t n = 0;
+    for (uint64_t i = 0; i < count; ++i) {
+        if (assign[i] == UINT32_MAX) continue;
+        if (n != i) memcpy(vectors + (size_t)n * dim, vectors + (size_t)i * dim, (size_t)dim * sizeof(float));
+        ++n;
+    }
+    if (n == 0) {
+        fprintf(stderr, "The PQ index needs non-zero vectors to train on.\n");
+        goto done;
+    }
+    for (uint32_t t = 0; t < dwThreads; ++t) {
+        jobs[t].count = n;
+    }
+    if (!_parallel(jobs, sizeof(PqJob), threads, M < dwThreads ? M : dwThreads, M, _pqtrain)) {
+        fprintf(stderr, "Memory allocation failed while training the PQ codebooks.\n");
+        goto done;
+    }
+    _pqtables(pq);
+    // Workers encode whole blocks of PQ_BLOCK records, so no two of them write the same 4-bit codes.
+    if (!_parallel(jobs, sizeof(PqJob), threads, groups < dwThreads ? (uint32_t)groups : dwThreads, groups, _pqencode) ||
+        !_pqcommit(db, pq, records)) {
+        fprintf(stderr, "Failed to read the database (system error %lu).\n", (unsigned long)GetLastError());
+        goto done;
+    }
+    // Temporary files go away on close, so their index is only kept in memory.
+    if (!db->bTemporary && !_pqsave(db, pq)) {
+        goto done;
+    }
+    *ppq = pq;
+    pq = NULL;
+    bOk = TRUE;
+done:
+    _pqfree(pq);
+    free(loads);
+    free(jobs);
+    free(threads);
+    free(sample);
+    free(vectors);
+    free(assign);
+    _maprelease(db, map);
+    return bOk;
+}
+
+EMBEDDINGS_API BOOL EMBEDDINGS_CALL pqbuild(Embeddings* db, uint32_t M, uint32_t nbits, uint32_t dwThreads)
+{
+    struct Pq* pq = NULL;
+    _gateenter(db, FALSE);
+    uint32_t swaps = _gateswaps(db);
+    BOOL result = _pqbuild(db, M, nbits, dwThreads, &pq);
+    _gateleave(db);
+    if (result && (result = _gateswap(db, swaps))) {
+        _pqfree(db->pq);
+        db->pq = pq;
+        pq = NULL;
+        _gateunlock(db);
+    }
+    _pqfree(pq);
+    return result;
+}
+
+static int32_t _pqsearch(
+    Embeddings* db,
+    const float* query, uint32_t len,
+    uint32_t topk,
+    Score* scores,
+    float min,
+    BOOL bNorm,
+    uint32_t rerank)
+{
+    _dbglog("pqsearch(min = %f, rerank = %u);\n", min, rerank);
+    if (!db) {
+        fprintf(stderr, "The specified database pointer is NULL.\n");
+        return -1;
+    }
+    if (!query) {
+        fprintf(stderr, "The specified query pointer is NULL.\n");
+        return -1;
+    }
+    if (len == 0) {
+        fprintf(stderr, "The specified query length is zero.\n");
+        return -1;
+    }
+    if (topk == 0) {
+        fprintf(stderr, "The specified topk value must be greater than zero.\n");
+        return -1;
+    }
+    if (!scores) {
+        fprintf(stderr, "The specified scores buffer is NULL.\n");
+        return -1;
+    }
+    struct Pq* pq = db->pq;
+    if (!pq) {
+        return _filesearchex(db, query, len, topk, scores, min, bNorm, 1);
+    }
+    ScanJob proto;
+    float* qnorms = _searchprep(db, query, 1, len, min, bNorm, &proto);
+    if (!qnorms) {
+        return -1;
+    }
+    if (rerank == 0) rerank = topk > UINT32_MAX / PQ_RERANK ? UINT32_MAX : PQ_RERANK * topk;
+    if (rerank < topk) rerank = topk;
+    const uint32_t M = pq->header.M, ksub = pq->ksub, dsub = pq->dsub;
+    int32_t result = -1;
+    _lockenter(&pq->lock);
+    if (!_pqsync(db, pq)) {
+        fprintf(stderr, "Warning: failed to encode the new records into the PQ index; they are not searched.\n");
+    }
+    const uint32_t count = pq->header.count;
+    Mapping* map = _mapacquire(db);
+    ScanJob job = { 0 };
+    NodeHeap cand = { 0 };
+    uint8_t* buff = (uint8_t*)malloc(proto.stride);
+    float* lut = (float*)malloc((size_t)M * ksub * sizeof(float));
+    uint8_t* lut8 = (uint8_t*)malloc((size_t)M * 16);
+    if (!buff || !lut || !lut8 || !_jobinit(&job, &proto, topk)) {
+        fprintf(stderr, "Memory allocation failed while preparing the PQ search.\n");
+        goto done;
+    }
+    job.map = map;
+    // The table scores the query against the centroids of unit length vectors, so the sums rank by
+    // cosine; without normalization they are scaled back by the record norm (see _metricest).
+    const BOOL bUnit = proto.bNorm;
+    for (uint32_t m = 0; m < M; ++m) {
+        const float* q = query + (size_t)m * dsub;
+        for (uint32_t k = 0; k < ksub; ++k) {
+            const float* centroid = pq->codebooks + ((size_t)m * ksub + k) * dsub;
+            float dot = 0;
+            for (uint32_t d = 0; d < dsub; ++d) dot += q[d] * centroid[d];
+            lut[(size_t)m * ksub + k] = dot;
+        }
+    }
+    if (pq->header.nbits == 4) {
+        // Fast-scan: every row of the table is shifted to start at 0 and all rows share one scale to
+        // uint8, so a sum of M entries dequantizes with one multiply and add.
+        float lows[256];
+        float bias = 0, range = 0;
+        for (uint32_t m = 0; m < M; ++m) {
+            const float* row = lut + (size_t)m * 16;
+            float lo = row[0], hi = row[0];
+            for (uint32_t k = 1; k < 16; ++k) {
+                if (row[k] < lo) lo = row[k];
+                if (row[k] > hi) hi = row[k];
+            }
+            lows[m] = lo;
+            bias += lo;
+            if (hi - lo > range) range = hi - lo;
+        }
+        float scale = range > 0 ? 255.0f / range : 1;
+        for (uint32_t m = 0; m < M; ++m) {
+            const float* row = lut + (size_t)m * 16;
+            for (uint32_t k = 0; k < 16; ++k) lut8[(size_t)m * 16 + k] = (uint8_t)((row[k] - lows[m]) * scale + 0.5f);
+        }
+        uint16_t sums[PQ_BLOCK];
+        for (uint32_t g = 0; g * PQ_BLOCK < count; ++g) {
+            _kernels.pqscan4(pq->codes + (size_t)g * M * 16, lut8, M, sums);
+            uint32_t n = count - g * PQ_BLOCK < PQ_BLOCK ? count - g * PQ_BLOCK : PQ_BLOCK;
+            for (uint32_t j = 0; j < n; ++j) {
+                uint32_t i = g * PQ_BLOCK + j;
+                if (pq->stale[i] || (bUnit && pq->norms[i] < EPSILON)) continue;
+                float sim = (float)sums[j] / scale + bias;
+                if (!bUnit) sim = _metricest(db, sim, pq->norms[i]);
+                if (!_nodekeep(&cand, rerank, sim, i)) goto nomem;
+            }
+        }
+    }
+    else {
+        for (uint32_t i = 0; i < count; ++i) {
+            if (pq->stale[i] || (bUnit && pq->norms[i] < EPSILON)) continue;
+            const uint8_t* code = pq->codes + (size_t)i * M;
+            float s[4] = { 0, 0, 0, 0 };
+            uint32_t m = 0;
+            for (; m + 4 <= M; m += 4) {
+                s[0] += lut[(size_t)m * 256 + code[m]];
+                s[1] += lut[(size_t)(m + 1) * 256 + code[m + 1]];
+                s[2] += lut[(size_t)(m + 2) * 256 + code[m + 2]];
+                s[3] += lut[(size_t)(m + 3) * 256 + code[m + 3]];
+            }
+            for (; m < M; ++m) s[0] += lut[(size_t)m * 256 + code[m]];
+            float sim = (s[0] + s[1]) + (s[2] + s[3]);
+            if (!bUnit) sim = _metricest(db, sim, pq->norms[i]);
+            if (!_nodekeep(&cand, rerank, sim, i)) goto nomem;
+        }
+    }
+    if (!_rescore(&job, &cand, buff)) {
+        goto done;
+    }
+    memset(scores, 0, (size_t)topk * sizeof(Score));
+    result = (int32_t)topkdrain(&job.heaps[0], scores);
+    _metricout(db, scores, (size_t)result);
+    _dbglog("pqsearch() = %d;\n", result);
+    goto done;
+nomem:
+    fprintf(stderr, "Memory allocation failed while collecting the PQ candidates.\n");
+done:
+    _jobfree(&job);
+    free(cand.items);
+    free(buff);
+    free(lut);
+    free(lut8);
+    _maprelease(db, map);
+    _lockleave(&pq->lock);
+    free(qnorms);
+    return result;
+}
+
+EMBEDDINGS_API int32_t EMBEDDINGS_CALL pqsearch(
+    Embeddings* db,
+    const float* query, uint32_t len,
+    uint32_t topk,
+    Score* scores,
+    float min,
+    BOOL bNorm,
+    uint32_t rerank)
+{
+    _gateenter(db, FALSE);
+    int32_t result = _pqsearch(db, query, len, topk, scores, min, bNorm, rerank);
+    _gateleave(db);
+    return result;
+}
+
+/*
+    Sign sketch index: one bit per dimension (set for positive components) of every vector. The
+    Hamming distance between two sketches estimates the angle between the vectors, so a search
+    ranks the sketches against the sketch of the query with popcounts and scores only the best
+    rerank candidates exactly against their records. A 768-dimensional vector takes 96 bytes.
+
+    fileappend adds the records appended since the last update (by any handle), and a search does
+    the same first, so the sketches always cover the whole file. When a record repeats an id, the
+    older version is skipped (upsert). cursorupdate changes vectors under the sketches: the rerank
+    scores them exactly, but they are found by their old sketches until the next build.
+
+    Sidecar file <path>.sign: SignHeader, uint64_t keys[count] (_idsetkey), float norms[count] and
+    uint64_t sketches[count x ceil(dim / 64)]. fileclose saves the index again when records were
+    added since it was loaded.
+*/
+
+#define SIGN_VERSION 1
+#define SIGN_RERANK 16 /* candidates per hit scored exactly */
+
+#pragma pack(push, 1)
+typedef struct SignHeader {
+    char magic[0x10];
+    uint32_t version;
+    uint32_t size;
+    uint32_t dim;
+    uint32_t blobSize; /* FileHeader.blobSize of the indexed file */
+    uint32_t stride;
+    uint8_t dtype;
+    uint32_t count; /* records [0, count) are sketched */
+    uiid last; /* id of record count - 1, so that a rewritten file does not pick up stale sketches */
+} SignHeader;
+#pragma pack(pop)
+
+static const char kSignMagic[] = "EMBEDDINGS.SIGN";
+
+struct Sign {
+    SignHeader header;
+    uint32_t words; /* 64-bit words per sketch */
+    uint32_t capacity;
+    uint64_t* sketches;
+    uint64_t* keys;
+    float* norms; /* record norm, to skip zero vectors and to score without normalization */
+    uint8_t* stale; /* a later record has the same id */
+    IdMap ids; /* latest record per id */
+    Lock lock;
+    BOOL bDirty;
+};
+
+static void _signfree(struct Sign* sg)
+{
+    if (!sg) return;
+    free(sg->sketches);
+    free(sg->keys);
+    free(sg->norms);
+    free(sg->stale);
+    _idmapfree(&sg->ids);
+    _lockfree(&sg->lock);
+    free(sg);
+}
+
+static struct Sign* _signcreate(const Embeddings* db)
+{
+    struct Sign* sg = (struct Sign*)calloc(1, sizeof(struct Sign));
+    if (!sg) return NULL;
+    _lockinit(&sg->lock);
+    memcpy(sg->header.magic, kSignMagic, sizeof(kSignMagic) - 1);
+    sg->header.version = SIGN_VERSION;
+    sg->header.size = sizeof(SignHeader);
+    sg->header.dim = _vecdim(&db->header);
+    sg->header.blobSize = db->header.blobSize;
+    sg->header.stride = _recsize(&db->header);
+    sg->header.dtype = db->header.dtype;
+    sg->words = (sg->header.dim + 63) / 64;
+    return sg;
+}
+
+/* Room for capacity records. */
+static BOOL _signreserve(struct Sign* sg, uint64_t capacity)
+{
+    if (capacity <= sg->capacity) return TRUE;
+    if (capacity >= UINT32_MAX) return FALSE;
+    uint64_t* sketches = (uint64_t*)realloc(sg->sketches, (size_t)capacity * sg->words * sizeof(uint64_t));
+    if (sketches) sg->sketches = sketches;
+    uint64_t* keys = (uint64_t*)realloc(sg->keys, (size_t)capacity * sizeof(uint64_t));
+    if (keys) sg->keys = keys;
+    float* norms = (float*)realloc(sg->norms, (size_t)capacity * sizeof(float));
+    if (norms) sg->norms = norms;
+    uint8_t* stale = (uint8_t*)realloc(sg->stale, (size_t)capacity);
+    if (stale) sg->stale = stale;
+    if (!sketches || !keys || !norms || !stale) return FALSE;
+    sg->capacity = (uint32_t)capacity;
+    return TRUE;
+}
+
+static void _signencode(const float* x, uint32_t dim, uint64_t* sketch)
+{
+    for (uint32_t w = 0; w < (dim + 63) / 64; ++w) {
+        uint64_t bits = 0;
+        uint32_t end = (w + 1) * 64 < dim ? (w + 1) * 64 : dim;
+        for (uint32_t d = w * 64; d < end; ++d) {
+            bits |= (uint64_t)(x[d] > 0) << (d & 63);
+        }
+        sketch[w] = bits;
+    }
+}
+
+typedef struct SignJob {
+    uint64_t begin, end; /* record ordinals of this worker, see _parallel */
+    BOOL bOk;
+    Embeddings* db;
+    const Mapping* map; /* optional */
+    struct Sign* sg;
+} SignJob;
+
+/* Sketches records [begin, end). */
+static void _signrange(void* arg)
+{
+    SignJob* job = (SignJob*)arg;
+    struct Sign* sg = job->sg;
+    const uint32_t MAX = 1024;
+    const uint32_t dim = sg->header.dim, stride = sg->header.stride;
+    job->bOk = FALSE;
+    uint8_t* big = (uint8_t*)_aligned_malloc((size_t)MAX * stride, job->db->header.alignment);
+    float* x = (float*)malloc((size_t)dim * sizeof(float));
+    if (!big || !x) goto done;
+    for (uint64_t i = job->begin; i < job->end;) {
+        uint32_t n = job->end - i < MAX ? (uint32_t)(job->end - i) : MAX;
+        const uint8_t* recs = _records(job->db, job->map, stride, i, n, big);
+        if (!recs) goto done;
+        for (uint32_t r = 0; r < n; ++r) {
+            const uint8_t* rec = recs + (size_t)r * stride;
+            _vecdecode(sg->header.dtype, x, rec + sizeof(uiid), dim);
+            _signencode(x, dim, sg->sketches + (size_t)(i + r) * sg->words);
+            sg->keys[i + r] = _idsetkey((const uiid*)rec);
+            sg->norms[i + r] = cblas_snrm2(x, dim);
+        }
+        i += n;
+    }
+    job->bOk = TRUE;
+done:
+    _aligned_free(big);
+    free(x);
+}
+
+/* Takes the sketched records [count, records) into the index: marks the versions they replace. */
+static BOOL _signcommit(Embeddings* db, struct Sign* sg, uint64_t records)
+{
+    if (records <= sg->header.count) return TRUE;
+    if (!_ioreadall(db->hWrite, &sg->header.last, sizeof(uiid), MAXHEAD + (records - 1) * sg->header.stride)) {
+        return FALSE;
+    }
+    for (uint64_t i = sg->header.count; i < records; ++i) {
+        sg->stale[i] = 0;
+        uint32_t prev = _idmapput(&sg->ids, sg->keys[i], (uint32_t)i);
+        if (prev != UINT32_MAX) sg->stale[prev] = 1;
+    }
+    sg->header.count = (uint32_t)records;
+    sg->bDirty = TRUE;
+    return TRUE;
+}
+
+/* Sketches the records appended since the last update. The caller holds sg->lock. */
+static BOOL _signsync(Embeddings* db, struct Sign* sg)
+{
+    uint64_t fileSize = 0;
+    if (!_iosize(db->hWrite, &fileSize)) return FALSE;
+    uint64_t records = fileSize > MAXHEAD ? (fileSize - MAXHEAD) / sg->header.stride : 0;
+    if (records >= UINT32_MAX) records = UINT32_MAX - 1;
+    if (records <= sg->header.count) return TRUE;
+    if (records > sg->capacity && !_signreserve(sg, records > 2 * (uint64_t)sg->capacity ? records : 2 * (uint64_t)sg->capacity)) return FALSE;
+    SignJob job = { 0 };
+    job.begin = sg->header.count;
+    job.end = records;
+    job.db = db;
+    job.map = _mapacquire(db);
+    job.sg = sg;
+    _signrange(&job);
+    _maprelease(db, (Mapping*)job.map);
+    return job.bOk && _signcommit(db, sg, records);
+}
+
+static void _signappend(Embeddings* db)
+{
+    struct Sign* sg = db->sign;
+    _lockenter(&sg->lock);
+    if (!_signsync(db, sg)) {
+        fprintf(stderr, "Warning: failed to update the sign sketches (system error %lu); retrying on the next append.\n", (unsigned long)GetLastError());
+    }
+    _lockleave(&sg->lock);
+}
+
+static BOOL _signsave(Embeddings* db, struct Sign* sg)
+{
+    wchar_t wszPath[PATH], wszTemp[PATH];
+    if (!_iosidecar(db, L".sign", wszPath) || !_iosidecar(db, L".sign.tmp", wszTemp)) {
+        fprintf(stderr, "The sign sketch path is too long.\n");
+        return FALSE;
+    }
+    HANDLE h = _ioopen(wszTemp, FILE_READ_DATA | FILE_WRITE_DATA, CREATE_ALWAYS, FALSE);
+    if (!h || h == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "Failed to create '%ls' (system error %lu).\n", wszTemp, (unsigned long)GetLastError());
+        return FALSE;
+    }
+    const SignHeader* hdr = &sg->header;
+    uint64_t offset = sizeof(SignHeader);
+    size_t cbKeys = (size_t)hdr->count * sizeof(uint64_t);
+    size_t cbNorms = (size_t)hdr->count * sizeof(float);
+    size_t cbSketches = (size_t)hdr->count * sg->words * sizeof(uint64_t);
+    BOOL bOk = _iowriteall(h, hdr, sizeof(*hdr), 0) &&
+        _iowriteall(h, sg->keys, cbKeys, offset) &&
+        _iowriteall(h, sg->norms, cbNorms, offset + cbKeys) &&
+        _iowriteall(h, sg->sketches, cbSketches, offset + cbKeys + cbNorms) &&
+        _iosync(h);
+    _ioclose(h);
+    if (bOk) {
+        bOk = _iorename(wszTemp, wszPath);
+    }
+    if (!bOk) {
+        fprintf(stderr, "Failed to write the sign sketches '%ls' (system error %lu).\n", wszPath, (unsigned long)GetLastError());
+        _iodelete(wszTemp);
+        return FALSE;
+    }
+    sg->bDirty = FALSE;
+    return TRUE;
+}
+
+/* Loads <path>.sign if there is one that matches the file, then sketches the records appended since. */
+static void _signload(Embeddings* db)
+{
+    wchar_t wszPath[PATH];
+    if (!_iosidecar(db, L".sign", wszPath)) return;
+    HANDLE h = _ioopen(wszPath, FILE_READ_DATA, OPEN_EXISTING, FALSE);
+    if (!h || h == INVALID_HANDLE_VALUE) return;
+    const char* reason = NULL;
+    SignHeader hdr;
+    uint64_t fileSize = 0;
+    struct Sign* sg = NULL;
+    if (!_ioreadall(h, &hdr, sizeof(hdr), 0) ||
+        memcmp(hdr.magic, kSignMagic, sizeof(kSignMagic) - 1) != 0 ||
+        hdr.version != SIGN_VERSION ||
+        hdr.size != sizeof(SignHeader)) {
+        reason = "invalid format";
+    }
+    else if (hdr.dtype != db->header.dtype ||
+        hdr.blobSize != db->header.blobSize ||
+        hdr.stride != _recsize(&db->header) ||
+        hdr.dim != _vecdim(&db->header)) {
+        reason = "built for a different record layout";
+    }
+    else if (!_iosize(db->hWrite, &fileSize) ||
+        hdr.count > (fileSize > MAXHEAD ? (fileSize - MAXHEAD) / hdr.stride : 0)) {
+        reason = "stale";
+    }
+    else if (hdr.count > 0) {
+        uiid last;
+        if (!_ioreadall(db->hWrite, &last, sizeof(last), MAXHEAD + (uint64_t)(hdr.count - 1) * hdr.stride) || !_uiidcmp(&last, &hdr.last)) {
+            reason = "stale";
+        }
+    }
+    if (!reason) {
+        sg = _signcreate(db);
+        if (!sg || !_signreserve(sg, hdr.count > 1024 ? hdr.count : 1024)) {
+            reason = "out of memory";
+        }
+    }
+    if (!reason) {
+        uint64_t offset = sizeof(SignHeader);
+        size_t cbKeys = (size_t)hdr.count * sizeof(uint64_t);
+        size_t cbNorms = (size_t)hdr.count * sizeof(float);
+        size_t cbSketches = (size_t)hdr.count * sg->words * sizeof(uint64_t);
+        if (!_ioreadall(h, sg->keys, cbKeys, offset) ||
+            !_ioreadall(h, sg->norms, cbNorms, offset + cbKeys) ||
+            !_ioreadall(h, sg->sketches, cbSketches, offset + cbKeys + cbNorms)) {
+            reason = "truncated";
+        }
+    }
+    _ioclose(h);
+    if (reason) {
+        fprintf(stderr, "Warning: ignoring the sign sketches '%ls' (%s).\n", wszPath, reason);
+        _signfree(sg);
+        return;
+    }
+    _signcommit(db, sg, hdr.count);
+    sg->bDirty = FALSE;
+    if (!_signsync(db, sg)) {
+        fprintf(stderr, "Warning: failed to sketch the new records; retrying on the next append.\n");
+    }
+    db->sign = sg;
+}
+
+/* Saves the sketches if records were added since they were loaded, then frees them. */
+static void _signclose(Embeddings* db)
+{
+    if (!db->sign) return;
+    if (db->sign->bDirty && !db->bTemporary) {
+        _signsave(db, db->sign);
+    }
+    _signfree(db->sign);
+    db->sign = NULL;
+}
+
+static BOOL _signbuild(Embeddings* db, uint32_t dwThreads, struct Sign** psg)
+{
+    _dbglog("signbuild(threads = %u);\n", dwThreads);
+    if (!db) {
+        fprintf(stderr, "The specified database pointer is NULL.\n");
+        return FALSE;
+    }
+    if (!db->hWrite || db->hWrite == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "The specified database is closed or invalid.\n");
+        return FALSE;
+    }
+    uint64_t fileSize = 0;
+    if (!_iosize(db->hWrite, &fileSize)) {
+        fprintf(stderr, "Failed to query the database size (system error %lu).\n", (unsigned long)GetLastError());
+        return FALSE;
+    }
+    const uint32_t stride = _recsize(&db->header);
+    uint64_t records = fileSize > MAXHEAD ? (fileSize - MAXHEAD) / stride : 0;
+    if (records >= UINT32_MAX) records = UINT32_MAX - 1;
+    if (dwThreads == 0) {
+        dwThreads = db->os.dwNumberOfProcessors ? db->os.dwNumberOfProcessors : 1;
+    }
+    if (dwThreads > records) {
+        dwThreads = records ? (uint32_t)records : 1;
+    }
+    BOOL bOk = FALSE;
+    Mapping* map = _mapacquire(db);
+    struct Sign* sg = _signcreate(db);
+    SignJob* jobs = (SignJob*)calloc(dwThreads, sizeof(SignJob));
+    Thread* threads = (Thread*)calloc(dwThreads, sizeof(Thread));
+    if (!sg || !jobs || !threads || !_signreserve(sg, records > 1024 ? records : 1024)) {
+        fprintf(stderr, "Memory allocation failed while preparing the sign sketches.\n");
+        goto done;
+    }
+    for (uint32_t t = 0; t < dwThreads; ++t) {
+        jobs[t].db = db;
+        jobs[t].map = map;
+        jobs[t].sg = sg;
+    }
+    if (!_parallel(jobs, sizeof(SignJob), threads, dwThreads, records, _signrange) || !_signcommit(db, sg, records)) {
+        fprintf(stderr, "Failed to read the database (system error %lu).\n", (unsigned long)GetLastError());
+        goto done;
+    }
+    // Temporary files go away on close, so their index is only kept in memory.
+    if (!db->bTemporary && !_signsave(db, sg)) {
+        goto done;
+    }
+    *psg = sg;
+    sg = NULL;
+    bOk = TRUE;
+done:
+    _signfree(sg);
+    free(jobs);
+    free(threads);
+    _maprelease(db, map);
+    return bOk;
+}
+
+EMBEDDINGS_API BOOL EMBEDDINGS_CALL signbuild(Embeddings* db, uint32_t dwThreads)
+{
+    struct Sign* sg = NULL;
+    _gateenter(db, FALSE);
+    uint32_t swaps = _gateswaps(db);
+    BOOL result = _signbuild(db, dwThreads, &sg);
+    _gateleave(db);
+    if (result && (result = _gateswap(db, swaps))) {
+        _signfree(db->sign);
+        db->sign = sg;
+        sg = NULL;
+        _gateunlock(db);
+    }
+    _signfree(sg);
+    return result;
+}
+
+static int32_t _signsearch(
+    Embeddings* db,
+    const float* query, uint32_t len,
+    uint32_t topk,
+    Score* scores,
+    float min,
+    BOOL bNorm,
+    uint32_t rerank)
+{
+    _dbglog("signsearch(min = %f, rerank = %u);\n", min, rerank);
+    if (!db) {
+        fprintf(stderr, "The specified database pointer is NULL.\n");
+        return -1;
+    }
+    if (!query) {
+        fprintf(stderr, "The specified query pointer is NULL.\n");
+        return -1;
+    }
+    if (len == 0) {
+        fprintf(stderr, "The specified query length is zero.\n");
+        return -1;
+    }
+    if (topk == 0) {
+        fprintf(stderr, "The specified topk value must be greater than zero.\n");
+        return -1;
+    }
+    if (!scores) {
+        fprintf(stderr, "The specified scores buffer is NULL.\n");
+        return -1;
+    }
+    struct Sign* sg = db->sign;
+    if (!sg) {
+        return _filesearchex(db, query, len, topk, scores, min, bNorm, 1);
+    }
+    ScanJob proto;
+    float* qnorms = _searchprep(db, query, 1, len, min, bNorm, &proto);
+    if (!qnorms) {
+        return -1;
+    }
+    if (rerank == 0) rerank = topk > UINT32_MAX / SIGN_RERANK ? UINT32_MAX : SIGN_RERANK * topk;
+    if (rerank < topk) rerank = topk;
+    const uint32_t MAX = 1024;
+    const uint32_t words = sg->words;
+    // Without normalization the angle estimate is scaled back by the norms (see _metricest).
+    const BOOL bUnit = proto.bNorm;
+    const float angle = 3.14159265f / (float)len;
+    const float qnorm = bUnit ? 1 : cblas_snrm2(query, len);
+    int32_t result = -1;
+    _lockenter(&sg->lock);
+    if (!_signsync(db, sg)) {
+        fprintf(stderr, "Warning: failed to sketch the new records; they are not searched.\n");
+    }
+    const uint32_t count = sg->header.count;
+    Mapping* map = _mapacquire(db);
+    ScanJob job = { 0 };
+    NodeHeap cand = { 0 };
+    uint8_t* buff = (uint8_t*)malloc(proto.stride);
+    uint64_t* sketch = (uint64_t*)malloc((size_t)words * sizeof(uint64_t));
+    uint32_t* dist = (uint32_t*)malloc((size_t)MAX * sizeof(uint32_t));
+    if (!buff || !sketch || !dist || !_jobinit(&job, &proto, topk)) {
+        fprintf(stderr, "Memory allocation failed while preparing the sign search.\n");
+        goto done;
+    }
+    job.map = map;
+    _signencode(query, len, sketch);
+    for (uint32_t i = 0; i < count; i += MAX) {
+        uint32_t n = count - i < MAX ? count - i : MAX;
+        _kernels.hamming(sketch, sg->sketches + (size_t)i * words, words, n, dist);
+        for (uint32_t r = 0; r < n; ++r) {
+            if (sg->stale[i + r] || (bUnit && sg->norms[i + r] < EPSILON)) continue;
+            float sim = bUnit ? -(float)dist[r] : _metricest(db, qnorm * cosf(angle * (float)dist[r]), sg->norms[i + r]);
+            if (!_nodekeep(&cand, rerank, sim, i + r)) {
+                fprintf(stderr, "Memory allocation failed while collecting the sign candidates.\n");
+                goto done;
+            }
+        }
+    }
+    if (!_rescore(&job, &cand, buff)) {
+        goto done;
+    }
+    memset(scores, 0, (size_t)topk * sizeof(Score));
+    result = (int32_t)topkdrain(&job.heaps[0], scores);
+    _metricout(db, scores, (size_t)result);
+    _dbglog("signsearch() = %d;\n", result);
+done:
+    _jobfree(&job);
+    free(cand.items);
+    free(buff);
+    free(sketch);
+    free(dist);
+    _maprelease(db, map);
+    _lockleave(&sg->lock);
+    free(qnorms);
+    return result;
+}
+
+EMBEDDINGS_API int32_t EMBEDDINGS_CALL signsearch(
+    Embeddings* db,
+    const float* query, uint32_t len,
+    uint32_t topk,
+    Score* scores,
+    float min,
+    BOOL bNorm,
+    uint32_t rerank)
+{
+    _gateenter(db, FALSE);
+    int32_t result = _signsearch(db, query, len, topk, scores, min, bNorm, rerank);
+    _gateleave(db);
+    return result;
+}
+
+/*
+    Id index: the ordinal of the latest record of every id, in a full IdMap, so that
+    fileget, filegetmany and fileupdate find a record with one probe and one positional read
+    instead of a scan. Next to it the live bitmap has bit i set when record i is the latest record
+    of its id and not a tombstone; the exhaustive scan skips every other record instead of retiring
+    superseded hits from its heaps. Appends keep both current and fileclose saves them as they are
+    next to the file (<path>.ids), so opening a large file does not read every id again. fileopen
+    builds them when there is no saved copy or it no longer matches the file.
+    The map keeps the whole id of every entry, so two ids whose keys collide are told apart.
+*/
+
+#define IDS_VERSION 2
+#define GET_SPAN 64 /* most records filegetmany reads with one call */
+#define GET_GAP 4 /* filegetmany reads over up to this many unwanted records rather than issue another read */
+
+#pragma pack(push, 1)
+typedef struct IdsHeader {
+    char magic[0x10];
+    uint32_t version;
+    uint32_t size;
+    uint32_t stride; /* record size of the indexed file */
+    uint32_t count; /* records [0, count) are indexed */
+    uiid last; /* id of record count - 1, so that a rewritten file does not pick up a stale table */
+    uint64_t slots; /* IdMap size (a power of two, 0: empty) */
+    uint64_t entries; /* distinct ids */
+} IdsHeader;
+#pragma pack(pop)
+
+static const char kIdsMagic[] = "EMBEDDINGS.IDS";
+
+struct Ids {
+    IdsHeader header;
+    IdMap map; /* id -> latest record ordinal (bFull) */
+    uint64_t* live; /* bit i: record i is live */
+    size_t cbLive; /* bytes allocated for live */
+    Lock lock;
+    HANDLE hUpdate; /* positional writes of fileupdate, opened on first use */
+    BOOL bReady; /* the map covers the file (set by fileopen); appends only index records once it is */
+    BOOL bDirty;
+};
+
+static void _idsfree(struct Ids* ids)
+{
+    if (!ids) return;
+    if (ids->hUpdate && ids->hUpdate != INVALID_HANDLE_VALUE) {
+        _ioclose(ids->hUpdate);
+    }
+    _idmapfree(&ids->map);
+    free(ids->live);
+    _lockfree(&ids->lock);
+    free(ids);
+}
+
+static struct Ids* _idscreate(const Embeddings* db)
+{
+    struct Ids* ids = (struct Ids*)calloc(1, sizeof(struct Ids));
+    if (!ids) return NULL;
+    _lockinit(&ids->lock);
+    ids->map.bFull = TRUE;
+    memcpy(ids->header.magic, kIdsMagic, sizeof(kIdsMagic) - 1);
+    ids->header.version = IDS_VERSION;
+    ids->header.size = sizeof(IdsHeader);
+    ids->header.stride = _recsize(&db->header);
+    ids->hUpdate = INVALID_HANDLE_VALUE;
+    return ids;
+}
+
+/* Indexes the records appended since the last update. The caller holds ids->lock. */
+static BOOL _idssync(Embeddings* db, struct Ids* ids)
+{
+    uint64_t fileSize = 0;
+    if (!_iosize(db->hWrite, &fileSize)) return FALSE;
+    const uint32_t MAX = 1024;
+    const uint32_t stride = ids->header.stride;
+    uint64_t records = fileSize > MAXHEAD ? (fileSize - MAXHEAD) / stride : 0;
+    if (records >= UINT32_MAX) records = UINT32_MAX - 1;
+    if (records <= ids->header.count) return TRUE;
+    if (!_idmapreserve(&ids->map, ids->map.count + (size_t)(records - ids->header.count))) return FALSE;
+    if (_livesize(records) > ids->cbLive) {
+        size_t cb = _livesize(records > 2 * (uint64_t)ids->header.count ? records : 2 * (uint64_t)ids->header.count);
+        uint64_t* live = (uint64_t*)realloc(ids->live, cb);
+        if (!live) return FALSE;
+        memset((uint8_t*)live + ids->cbLive, 0, cb - ids->cbLive);
+        ids->live = live;
+        ids->cbLive = cb;
+    }
+    uint8_t* buff = (uint8_t*)_aligned_malloc((size_t)MAX * stride, db->header.alignment);
+    if (!buff) return FALSE;
+    Mapping* map = _mapacquire(db);
+    BOOL bOk = TRUE;
+    for (uint64_t i = ids->header.count; i < records;) {
+        uint32_t n = records - i < MAX ? (uint32_t)(records - i) : MAX;
+        const uint8_t* recs = _records(db, map, stride, i, n, buff);
+        if (!recs) {
+            bOk = FALSE;
+            break;
+        }
+        for (uint32_t r = 0; r < n; ++r) {
+            const uint8_t* rec = recs + (size_t)r * stride;
+            uint64_t ord = i + r;
+            uint32_t prev = _idmapputid(&ids->map, (const uiid*)rec, (uint32_t)ord);
+            if (prev != UINT32_MAX) {
+                ids->live[prev >> 6] &= ~((uint64_t)1 << (prev & 63));
+            }
+            if (_recop(&db->header, rec) != RECORD_DELETE) {
+                ids->live[ord >> 6] |= (uint64_t)1 << (ord & 63);
+            }
+        }
+        _uiidcpy(&ids->header.last, (const uiid*)(recs + (size_t)(n - 1) * stride));
+        i += n;
+        ids->header.count = (uint32_t)i;
+        ids->bDirty = TRUE;
+    }
+    _maprelease(db, map);
+    _aligned_free(buff);
+    return bOk;
+}
+
+/*
+    Builds the map on first use and indexes the records appended since the last call, including
+    those other handles and processes appended, so that lookups and scans see the whole file.
+    The caller holds ids->lock.
+*/
+static BOOL _idsready(Embeddings* db, struct Ids* ids)
+{
+    if (!_idssync(db, ids)) {
+        fprintf(stderr, "Failed to index the record ids (system error %lu).\n", (unsigned long)GetLastError());
+        return FALSE;
+    }
+    ids->bReady = TRUE;
+    return TRUE;
+}
+
+static void _idsappend(Embeddings* db)
+{
+    struct Ids* ids = db->ids;
+    _lockenter(&ids->lock);
+    if (ids->bReady && !_idssync(db, ids)) {
+        fprintf(stderr, "Warning: failed to index the appended ids (system error %lu); retrying on the next append.\n", (unsigned long)GetLastError());
+    }
+    _lockleave(&ids->lock);
+}
+
+static BOOL _idssave(Embeddings* db, struct Ids* ids)
+{
+    wchar_t wszPath[PATH], wszTemp[PATH];
+    if (!_iosidecar(db, L".ids", wszPath) || !_iosidecar(db, L".ids.tmp", wszTemp)) {
+        fprintf(stderr, "The id index path is too long.\n");
+        return FALSE;
+    }
+    HANDLE h = _ioopen(wszTemp, FILE_READ_DATA | FILE_WRITE_DATA, CREATE_ALWAYS, FALSE);
+    if (!h || h == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "Failed to create '%ls' (system error %lu).\n", wszTemp, (unsigned long)GetLastError());
+        return FALSE;
+    }
+    IdsHeader* hdr = &ids->header;
+    hdr->slots = ids->map.keys ? (uint64_t)ids->map.mask + 1 : 0;
+    hdr->entries = ids->map.count;
+    uint64_t offset = sizeof(IdsHeader);
+    size_t cbKeys = (size_t)hdr->slots * sizeof(uint64_t);
+    size_t cbValues = (size_t)hdr->slots * sizeof(uint32_t);
+    size_t cbIds = (size_t)hdr->slots * sizeof(uiid);
+    BOOL bOk = _iowriteall(h, hdr, sizeof(*hdr), 0) &&
+        _iowriteall(h, ids->map.keys, cbKeys, offset) &&
+        _iowriteall(h, ids->map.values, cbValues, offset + cbKeys) &&
+        _iowriteall(h, ids->map.ids, cbIds, offset + cbKeys + cbValues) &&
+        _iowriteall(h, ids->live, _livesize(hdr->count), offset + cbKeys + cbValues + cbIds) &&
+        _iosync(h);
+    _ioclose(h);
+    if (bOk) {
+        bOk = _iorename(wszTemp, wszPath);
+    }
+    if (!bOk) {
+        fprintf(stderr, "Failed to write the id index '%ls' (system error %lu).\n", wszPath, (unsigned long)GetLastError());
+        _iodelete(wszTemp);
+        return FALSE;
+    }
+    ids->bDirty = FALSE;
+    return TRUE;
+}
+
+/* Reads a saved table into ids; on any mismatch leaves ids empty so that it is rebuilt. */
+static void _idsread(Embeddings* db, struct Ids* ids, HANDLE h, const wchar_t* wszPath)
+{
+    const char* reason = NULL;
+    IdsHeader hdr;
+    uint64_t fileSize = 0, cbIndex = 0;
+    if (!_ioreadall(h, &hdr, sizeof(hdr), 0) ||
+        memcmp(hdr.magic, kIdsMagic, sizeof(kIdsMagic) - 1) != 0 ||
+        hdr.version != IDS_VERSION ||
+        hdr.size != sizeof(IdsHeader) ||
+        hdr.slots > ((uint64_t)1 << 34) ||
+        (hdr.slots & (hdr.slots - 1)) != 0 ||
+        2 * hdr.entries > hdr.slots ||
+        hdr.entries > hdr.count) {
+        reason = "invalid format";
+    }
+    else if (hdr.stride != _recsize(&db->header)) {
+        reason = "built for a different record layout";
     }
-    OVERLAPPED ov = { 0 };
-    if (!LockFileEx(db->hWrite, LOCKFILE_EXCLUSIVE_LOCK, 0, MAXHEAD, 0, &ov)) {
-        CloseHandle(db->hWrite);
-        free(db);
-        fprintf(stderr, "LockFileEx failed: %lu\n", GetLastError());
-        return NULL;
+    else if (!_iosize(h, &cbIndex) || cbIndex != sizeof(IdsHeader) + hdr.slots * (sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uiid)) + _livesize(hdr.count)) {
+        reason = "truncated";
     }
-    LARGE_INTEGER fileSize;
-    if (!GetFileSizeEx(db->hWrite, &fileSize)) {
-        UnlockFileEx(db->hWrite, 0, MAXHEAD, 0, &ov);
-        CloseHandle(db->hWrite);
-        free(db);
-        return NULL;
+    else if (!_iosize(db->hWrite, &fileSize) ||
+        hdr.count > (fileSize > MAXHEAD ? (fileSize - MAXHEAD) / hdr.stride : 0)) {
+        reason = "stale";
     }
-    if (fileSize.QuadPart == 0) {
-		assert(db->header.size <= MAXHEAD);
-        uint8_t* buff = (uint8_t*)_aligned_malloc(MAXHEAD, MAXHEAD);
-        if (!buff) {
-            UnlockFileEx(db->hWrite, 0, MAXHEAD, 0, &ov);
-            CloseHandle(db->hWrite);
-            free(db);
-            fprintf(stderr, "Memory allocation failed\n");
-            return NULL;
-        }
-        memset(buff, 0, MAXHEAD);
-        errno_t err = memcpy_s(buff, MAXHEAD, &db->header, sizeof(db->header));
-        if (err) {
-            _aligned_free(buff);
-            UnlockFileEx(db->hWrite, 0, MAXHEAD, 0, &ov);
-            CloseHandle(db->hWrite);
-            free(db);
-            fprintf(stderr, "memcpy_s failed (%d)\n", err);
-            return NULL;
-        }
-        LARGE_INTEGER zero = { 0 };
-        if (!SetFilePointerEx(db->hWrite, zero, NULL, FILE_BEGIN)) {
-            _aligned_free(buff);
-            UnlockFileEx(db->hWrite, 0, MAXHEAD, 0, &ov);
-            CloseHandle(db->hWrite);
-            free(db);
-            fprintf(stderr, "SetFilePointerEx failed: %lu\n", GetLastError());
-            return NULL;
-        }
-        DWORD written = 0;
-        if (!WriteFile(db->hWrite, buff, MAXHEAD, &written, NULL) || written != MAXHEAD) {
-            fprintf(stderr, "WriteFile failed: %lu\n", GetLastError());
-            _aligned_free(buff);
-            UnlockFileEx(db->hWrite, 0, MAXHEAD, 0, &ov);
-            CloseHandle(db->hWrite);
-            free(db);
-            return NULL;
+    else if (hdr.count > 0) {
+        uiid last;
+        if (!_ioreadall(db->hWrite, &last, sizeof(last), MAXHEAD + (uint64_t)(hdr.count - 1) * hdr.stride) || !_uiidcmp(&last, &hdr.last)) {
+            reason = "stale";
         }
-        FlushFileBuffers(db->hWrite);
-        _aligned_free(buff);
     }
-    else {
-        LARGE_INTEGER zero = { 0 };
-        if (!SetFilePointerEx(db->hWrite, zero, NULL, FILE_BEGIN)) {
-            fprintf(stderr, "SetFilePointerEx failed: %lu\n", GetLastError());
-            UnlockFileEx(db->hWrite, 0, MAXHEAD, 0, &ov);
-            CloseHandle(db->hWrite);
-            free(db);
-            return NULL;
-        }
-        DWORD read = 0;
-        if (!ReadFile(db->hWrite, &db->header, sizeof(db->header), &read, NULL) ||
-            read != sizeof(db->header)) {
-            UnlockFileEx(db->hWrite, 0, MAXHEAD, 0, &ov);
-            CloseHandle(db->hWrite);
-            free(db);
-            return NULL;
+    if (!reason && hdr.slots > 0) {
+        ids->map.keys = (uint64_t*)malloc((size_t)hdr.slots * sizeof(uint64_t));
+        ids->map.values = (uint32_t*)malloc((size_t)hdr.slots * sizeof(uint32_t));
+        ids->map.ids = (uiid*)malloc((size_t)hdr.slots * sizeof(uiid));
+        if (!ids->map.keys || !ids->map.values || !ids->map.ids) {
+            reason = "out of memory";
         }
-        if (memcmp(db->header.magic, kMagic, sizeof(kMagic) - 1) != 0 ||
-            db->header.version != VERSION ||
-            db->header.size != sizeof(FileHeader)) {
-            fprintf(stderr, "Invalid or mismatched DB format\n");
-            UnlockFileEx(db->hWrite, 0, MAXHEAD, 0, &ov);
-            CloseHandle(db->hWrite);
-            free(db);
-            return NULL;
+        else if (!_ioreadall(h, ids->map.keys, (size_t)hdr.slots * sizeof(uint64_t), sizeof(IdsHeader)) ||
+            !_ioreadall(h, ids->map.values, (size_t)hdr.slots * sizeof(uint32_t), sizeof(IdsHeader) + hdr.slots * sizeof(uint64_t)) ||
+            !_ioreadall(h, ids->map.ids, (size_t)hdr.slots * sizeof(uiid), sizeof(IdsHeader) + hdr.slots * (sizeof(uint64_t) + sizeof(uint32_t)))) {
+            reason = "truncated";
         }
-        if (db->header.blobSize != dwBlobSize) {
-            fprintf(stderr, "Invalid blob size.\n");
-            UnlockFileEx(db->hWrite, 0, MAXHEAD, 0, &ov);
-            CloseHandle(db->hWrite);
-            free(db);
-            return NULL;
+        ids->map.mask = (size_t)hdr.slots - 1;
+        ids->map.count = (size_t)hdr.entries;
+    }
+    if (!reason) {
+        ids->cbLive = _livesize(hdr.count > 1024 ? hdr.count : 1024);
+        ids->live = (uint64_t*)calloc(1, ids->cbLive);
+        if (!ids->live) {
+            reason = "out of memory";
+            ids->cbLive = 0;
         }
-        if (db->header.alignment != db->os.dwPageSize) {
-            if (db->header.alignment > db->os.dwPageSize) {
-                fprintf(stderr, "Error: file created with alignment=%u (system=%u)\n",
-                    db->header.alignment, db->os.dwPageSize);
-                UnlockFileEx(db->hWrite, 0, MAXHEAD, 0, &ov);
-                CloseHandle(db->hWrite);
-                free(db);
-                return NULL;
-            }
-            fprintf(stderr, "Warning: file created with alignment=%u (system=%u)\n",
-                db->header.alignment, db->os.dwPageSize);
+        else if (!_ioreadall(h, ids->live, _livesize(hdr.count), sizeof(IdsHeader) + hdr.slots * (sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uiid)))) {
+            reason = "truncated";
         }
     }
-    UnlockFileEx(db->hWrite, 0, MAXHEAD, 0, &ov);
-    return db;
+    if (reason) {
+        fprintf(stderr, "Warning: rebuilding the id index '%ls' (%s).\n", wszPath, reason);
+        _idmapfree(&ids->map);
+        free(ids->live);
+        ids->live = NULL;
+        ids->cbLive = 0;
+        ids->bDirty = TRUE;
+    }
+    else {
+        ids->header = hdr;
+    }
 }
 
-EMBEDDINGS_API void EMBEDDINGS_CALL fileclose(Embeddings* db)
+/* Loads <path>.ids if there is one that matches the file, then indexes the records appended since. */
+static void _idsload(Embeddings* db)
 {
-    _dbglog("fileclose();\n");
-    if (!db) return;
-    if (db->hWrite && db->hWrite != INVALID_HANDLE_VALUE)
-        CloseHandle(db->hWrite);
-    free(db);
+    struct Ids* ids = _idscreate(db);
+    if (!ids) {
+        fprintf(stderr, "Warning: memory allocation failed while preparing the id index.\n");
+        return;
+    }
+    db->ids = ids;
+    wchar_t wszPath[PATH];
+    HANDLE h = INVALID_HANDLE_VALUE;
+    if (!db->bTemporary && _iosidecar(db, L".ids", wszPath)) {
+        h = _ioopen(wszPath, FILE_READ_DATA, OPEN_EXISTING, FALSE);
+    }
+    if (h && h != INVALID_HANDLE_VALUE) {
+        _idsread(db, ids, h, wszPath);
+        _ioclose(h);
+    }
+    ids->bReady = TRUE;
+    if (!_idssync(db, ids)) {
+        fprintf(stderr, "Warning: failed to index the record ids; retrying on the next append.\n");
+    }
 }
 
-#if defined(_WIN32) || defined(_WIN64)
-static __forceinline BOOL _uiidcmp(const uiid* a, const uiid* b) {
-    const uint64_t* pa = (const uint64_t*)a->bytes;
-    const uint64_t* pb = (const uint64_t*)b->bytes;
-    return (pa[0] == pb[0]) && (pa[1] == pb[1]);
+/* Saves the table if records were indexed since it was loaded, then frees it. */
+static void _idsclose(Embeddings* db)
+{
+    if (!db->ids) return;
+    if (db->ids->bDirty && db->ids->bReady && !db->bTemporary) {
+        _idssave(db, db->ids);
+    }
+    _idsfree(db->ids);
+    db->ids = NULL;
 }
 
-static __forceinline void _uiidcpy(uiid* dst, const uiid* src) {
-    const uint64_t* s = (const uint64_t*)src->bytes;
-    uint64_t* d = (uint64_t*)dst->bytes;
-    d[0] = s[0]; d[1] = s[1];
+/* Looks up n ids; ords[i] is the ordinal of the latest record of ids[i], or UINT32_MAX. */
+static BOOL _idsfind(Embeddings* db, const uiid* keys, uint32_t n, uint32_t* ords)
+{
+    struct Ids* ids = db->ids;
+    if (!ids) {
+        fprintf(stderr, "The id index is not available.\n");
+        return FALSE;
+    }
+    _lockenter(&ids->lock);
+    BOOL bOk = _idsready(db, ids);
+    for (uint32_t i = 0; i < n && bOk; ++i) {
+        ords[i] = _idmapgetid(&ids->map, &keys[i]);
+        // A deleted id maps to its tombstone.
+        if (ords[i] != UINT32_MAX && !_liveget(ids->live, ords[i])) ords[i] = UINT32_MAX;
+    }
+    _lockleave(&ids->lock);
+    return bOk;
 }
 
-static inline uint64_t _uiidhash(uiid* a) {
-    const uint64_t* p = (const uint64_t*)a->bytes;
-    uint64_t h = p[0] + 0x9E3779B97F4A7C15ULL;
-    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
-    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
-    h = (h ^ (h >> 31)) + p[1];
-    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
-    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
-    return h ^ (h >> 31);
+/*
+    ops[i] is RECORD_UPDATE when keys[i] has a live record, otherwise (or without the id index)
+    RECORD_ADD. One lock and one sync for all n, so that fileappendbatch looks up a chunk at once.
+*/
+static void _idsops(Embeddings* db, const uiid* keys, uint32_t n, uint32_t* ops)
+{
+    struct Ids* ids = db->ids;
+    for (uint32_t i = 0; i < n; ++i) ops[i] = RECORD_ADD;
+    if (!ids || db->header.version < 3) return;
+    _lockenter(&ids->lock);
+    if (ids->bReady && _idsready(db, ids)) {
+        for (uint32_t i = 0; i < n; ++i) {
+            uint32_t ord = _idmapgetid(&ids->map, &keys[i]);
+            if (ord != UINT32_MAX && _liveget(ids->live, ord)) ops[i] = RECORD_UPDATE;
+        }
+    }
+    _lockleave(&ids->lock);
 }
-#endif
 
-EMBEDDINGS_API uint32_t EMBEDDINGS_CALL fileversion(Embeddings* db) {
+/* A copy of the live bitmap of records [0, *pcount), or NULL when the index is not available. */
+static uint64_t* _idssnapshot(Embeddings* db, uint64_t* pcount)
+{
+    struct Ids* ids = db->ids;
+    if (!ids) return NULL;
+    uint64_t* live = NULL;
+    _lockenter(&ids->lock);
+    if (_idsready(db, ids)) {
+        size_t cb = _livesize(ids->header.count);
+        live = (uint64_t*)malloc(cb ? cb : sizeof(uint64_t));
+        if (live) {
+            if (cb) memcpy(live, ids->live, cb);
+            *pcount = ids->header.count;
+        }
+    }
+    _lockleave(&ids->lock);
+    return live;
+}
+
+/*
+    Gives the scan of proto a copy of the live bitmap: it then skips the records that are not live
+    and stops at the last indexed record. Returns the copy for the caller to free, or NULL when the
+    index is not available and the scan resolves upserts and tombstones itself.
+*/
+static uint64_t* _idslive(Embeddings* db, ScanJob* proto)
+{
+    uint64_t count = 0;
+    uint64_t* live = _idssnapshot(db, &count);
+    if (live) {
+        proto->live = live;
+        proto->end = MAXHEAD + count * proto->stride;
+    }
+    return live;
+}
+
+typedef struct GetItem {
+    uint32_t ord;
+    uint32_t i; /* position in the request */
+} GetItem;
+
+static int _getitemcmp(const void* a, const void* b)
+{
+    const GetItem* x = (const GetItem*)a;
+    const GetItem* y = (const GetItem*)b;
+    if (x->ord != y->ord) return x->ord < y->ord ? -1 : 1;
+    return x->i < y->i ? -1 : (x->i > y->i ? 1 : 0);
+}
+
+static int32_t _filegetmany(Embeddings* db, const uiid* ids, uint32_t n, float* blobs, uint8_t* found)
+{
     if (!db) {
         fprintf(stderr, "The specified database pointer is NULL.\n");
+        return -1;
+    }
+    if (!db->hWrite || db->hWrite == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "The specified database is closed or invalid.\n");
+        return -1;
+    }
+    if (n == 0) {
         return 0;
     }
-	return db->header.version;
+    if (!ids || !blobs) {
+        fprintf(stderr, "The specified ids or blobs pointer is NULL.\n");
+        return -1;
+    }
+    if (n > INT32_MAX) {
+        fprintf(stderr, "Too many ids (%u).\n", n);
+        return -1;
+    }
+    const uint32_t dim = _vecdim(&db->header);
+    const uint32_t stride = _recsize(&db->header);
+    int32_t result = -1;
+    Mapping* map = NULL;
+    uint32_t* ords = (uint32_t*)malloc((size_t)n * sizeof(uint32_t));
+    GetItem* items = (GetItem*)malloc((size_t)n * sizeof(GetItem));
+    uint8_t* buff = (uint8_t*)_aligned_malloc((size_t)GET_SPAN * stride, db->header.alignment);
+    if (!ords || !items || !buff) {
+        fprintf(stderr, "Memory allocation failed while preparing the read buffer.\n");
+        goto done;
+    }
+    if (!_idsfind(db, ids, n, ords)) {
+        goto done;
+    }
+    if (found) {
+        memset(found, 0, n);
+    }
+    // In file order, so that nearby records come in with one read.
+    uint32_t m = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+        if (ords[i] == UINT32_MAX) {
+            memset(blobs + (size_t)i * dim, 0, (size_t)dim * sizeof(float));
+            continue;
+        }
+        items[m].ord = ords[i];
+        items[m].i = i;
+        m++;
+    }
+    if (m > 1) {
+        qsort(items, m, sizeof(GetItem), _getitemcmp);
+    }
+    map = _mapacquire(db);
+    result = 0;
+    for (uint32_t k = 0; k < m;) {
+        const uint32_t first = items[k].ord;
+        uint32_t e = k + 1;
+        while (e < m && items[e].ord - items[e - 1].ord <= GET_GAP && items[e].ord - first < GET_SPAN) ++e;
+        const uint8_t* recs = _records(db, map, stride, first, items[e - 1].ord - first + 1, buff);
+        if (!recs) {
+            fprintf(stderr, "Failed to read the records (system error %lu).\n", (unsigned long)GetLastError());
+            result = -1;
+            break;
+        }
+        for (; k < e; ++k) {
+            const uint8_t* rec = recs + (size_t)(items[k].ord - first) * stride;
+            if (!_uiidcmp((const uiid*)rec, &ids[items[k].i])) {
+                memset(blobs + (size_t)items[k].i * dim, 0, (size_t)dim * sizeof(float));
+                continue;
+            }
+            _vecdecode(db->header.dtype, blobs + (size_t)items[k].i * dim, rec + sizeof(uiid), dim);
+            if (found) found[items[k].i] = 1;
+            result++;
+        }
+    }
+done:
+    if (map) _maprelease(db, map);
+    free(ords);
+    free(items);
+    _aligned_free(buff);
+    return result;
 }
 
-//  Warning: Does not lock. Assumes FILE_APPEND_DATA.
-EMBEDDINGS_API BOOL EMBEDDINGS_CALL fileappend(Embeddings* db, uiid id, const void* blob, DWORD blobSize, BOOL bFlush) {
+EMBEDDINGS_API int32_t EMBEDDINGS_CALL filegetmany(Embeddings* db, const uiid* ids, uint32_t n, float* blobs, uint8_t* found)
+{
+    _gateenter(db, FALSE);
+    int32_t result = _filegetmany(db, ids, n, blobs, found);
+    _gateleave(db);
+    return result;
+}
+
+static int32_t _fileget(Embeddings* db, uiid id, void* blob, DWORD blobSize)
+{
+    if (db && blob && blobSize != _vecdim(&db->header) * sizeof(float)) {
+        fprintf(stderr,
+            "The specified blob size (%u) does not match the database configuration (%u).\n",
+            blobSize,
+            _vecdim(&db->header) * (unsigned)sizeof(float));
+        return -1;
+    }
+    return _filegetmany(db, &id, 1, (float*)blob, NULL);
+}
+
+EMBEDDINGS_API int32_t EMBEDDINGS_CALL fileget(Embeddings* db, uiid id, void* blob, DWORD blobSize)
+{
+    _gateenter(db, FALSE);
+    int32_t result = _fileget(db, id, blob, blobSize);
+    _gateleave(db);
+    return result;
+}
+
+static int32_t _fileupdate(Embeddings* db, uiid id, const void* blob, DWORD blobSize, BOOL bFlush)
+{
     if (!db) {
         fprintf(stderr, "The specified database pointer is NULL.\n");
-        return FALSE;
+        return -1;
     }
-    if (db->hWrite == INVALID_HANDLE_VALUE) {
+    if (!db->hWrite || db->hWrite == INVALID_HANDLE_VALUE) {
         fprintf(stderr, "The specified database is closed or invalid.\n");
-        return FALSE;
+        return -1;
     }
     if (!blob) {
         fprintf(stderr, "The specified blob pointer is NULL.\n");
-        return FALSE;
+        return -1;
     }
-    if (blobSize != db->header.blobSize) {
+    const uint32_t dim = _vecdim(&db->header);
+    if (blobSize != dim * sizeof(float)) {
         fprintf(stderr,
             "The specified blob size (%u) does not match the database configuration (%u).\n",
             blobSize,
-            db->header.blobSize);
-        return FALSE;
-    }
-    // TODO : OP (0: Add, 1, Delete, 2 Update)
-	size_t cc = __alignup(sizeof(uiid) + db->header.blobSize, db->header.alignment);
-    uint8_t* buff = (uint8_t*)_aligned_malloc(cc, db->header.alignment);
-    if (!buff) {
-        fprintf(stderr, "Memory allocation failed while preparing the record buffer.\n");
-        return FALSE;
+            dim * (unsigned)sizeof(float));
+        return -1;
     }
-    memset(buff, 0, cc);
-    errno_t err = memcpy_s(buff, cc, &id, sizeof(uiid));
-    if (err) {
-        fprintf(stderr, "memcpy_s failed (%d)\n", err);
-        _aligned_free(buff);
-        return FALSE;
+    if (!(db->access & (FILE_WRITE_DATA | FILE_APPEND_DATA))) {
+        fprintf(stderr, "The database was not opened for writing.\n");
+        return -1;
     }
-    err = memcpy_s(buff + sizeof(uiid), cc - sizeof(uiid), blob, db->header.blobSize);
-    if (err) {
-        fprintf(stderr, "memcpy_s failed (%d)\n", err);
-        _aligned_free(buff);
-        return FALSE;
+    struct Ids* ids = db->ids;
+    if (!ids) {
+        fprintf(stderr, "The id index is not available.\n");
+        return -1;
     }
-    if (db->access & FILE_APPEND_DATA) {
-        /* Move to end is automatic */
+    if (!_commitfind(db, &id)) {
+        return -1;
     }
-    else {
-        fprintf(stderr, "WARNING: File was open without FILE_APPEND_DATA. Performing explicit seek to EOF.\n");
-        LARGE_INTEGER zero = { 0 };
-        if (!SetFilePointerEx(db->hWrite, zero, NULL, FILE_END)) {
-            fprintf(stderr, "Failed to seek to the end of the database file (system error %lu).\n", GetLastError());
-            _aligned_free(buff);
-            return FALSE;
+    // The append handle may be in append mode, where positional writes go to the end, so updates have their own.
+    _lockenter(&ids->lock);
+    uint32_t ord = UINT32_MAX;
+    BOOL bOk = _idsready(db, ids);
+    if (bOk) {
+        ord = _idmapgetid(&ids->map, &id);
+        if (ord != UINT32_MAX && !_liveget(ids->live, ord)) ord = UINT32_MAX;
+        if (ord != UINT32_MAX && ids->hUpdate == INVALID_HANDLE_VALUE) {
+            ids->hUpdate = _ioreopen(db, FALSE);
+            if (!ids->hUpdate || ids->hUpdate == INVALID_HANDLE_VALUE) {
+                ids->hUpdate = INVALID_HANDLE_VALUE;
+                fprintf(stderr, "Failed to open the database for updates (system error %lu).\n", (unsigned long)GetLastError());
+                bOk = FALSE;
+            }
         }
     }
-    DWORD written = 0;
-    BOOL bOk = WriteFile(db->hWrite, buff, cc, &written, NULL);
-    _aligned_free(buff);
+    HANDLE h = ids->hUpdate;
+    _lockleave(&ids->lock);
     if (!bOk) {
-        fprintf(stderr, "Failed to append record to the database (system error %lu).\n", GetLastError());
-        return FALSE;
+        return -1;
     }
-    if (written != cc) {
-        fprintf(stderr, "Incomplete write: expected %lu bytes but only wrote %lu bytes.\n",
-            (unsigned long)cc,
-            (unsigned long)written);
-        return FALSE;
+    if (ord == UINT32_MAX) {
+        return 0;
     }
-    if (bFlush && !FlushFileBuffers(db->hWrite)) {
-        fprintf(stderr, "Failed to flush data to disk (system error %lu).\n", GetLastError());
-        return FALSE;
+    // The blob and its norm, which directly follows it, with one positional write.
+    DWORD cb = db->header.blobSize + ((db->header.flags & HEADER_NORMS) ? sizeof(float) : 0);
+    uint8_t* tmp = (uint8_t*)malloc(cb);
+    if (!tmp) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        return -1;
     }
-    return TRUE;
-}
-
-EMBEDDINGS_API BOOL EMBEDDINGS_CALL fileflush(Embeddings* db) {
-    _dbglog("fileflush();\n");
-    if (!db) {
-        fprintf(stderr, "The specified database pointer is NULL.\n");
-        return FALSE;
+    _vecencode(db->header.dtype, tmp, (const float*)blob, dim);
+    if (db->header.flags & HEADER_NORMS) {
+        float norm = _vecnrm2(db->header.dtype, tmp, dim);
+        memcpy(tmp + db->header.blobSize, &norm, sizeof(float));
     }
-    if (db->hWrite == INVALID_HANDLE_VALUE) {
-        fprintf(stderr, "The specified database is closed or invalid.\n");
-        return FALSE;
+    DWORD written = 0;
+    bOk = _iowrite(h, tmp, cb, MAXHEAD + (uint64_t)ord * _recsize(&db->header) + sizeof(uiid), &written);
+    free(tmp);
+    _compactnote(db, ord);
+    if (!bOk || written != cb) {
+        fprintf(stderr, "WriteFile failed. (system error %lu).\n", (unsigned long)GetLastError());
+        return -1;
     }
-    if (!FlushFileBuffers(db->hWrite)) {
-        fprintf(stderr, "Failed to flush data to disk (system error %lu).\n", GetLastError());
-        return FALSE;
+    if (bFlush && !_iosync(h)) {
+        fprintf(stderr, "Failed to flush data to disk (system error %lu).\n", (unsigned long)GetLastError());
+        return -1;
     }
-    return TRUE;
+    return 1;
 }
 
-static inline float cblas_sdot(const float* a, const float* b, uint32_t n) {
-    double s = 0.0;
-    for (uint32_t i = 0; i < n; ++i) s += (double)a[i] * (double)b[i];
-    return (float)s;
+EMBEDDINGS_API int32_t EMBEDDINGS_CALL fileupdate(Embeddings* db, uiid id, const void* blob, DWORD blobSize, BOOL bFlush)
+{
+    _gateenter(db, FALSE);
+    int32_t result = _fileupdate(db, id, blob, blobSize, bFlush);
+    _gateleave(db);
+    return result;
 }
 
-static inline float cblas_snrm2(const float* a, uint32_t n) {
-    double s = 0.0;
-    for (uint32_t i = 0; i < n; ++i) s += (double)a[i] * (double)a[i];
-    return (float)sqrt(s);
-}
+/*
+    Compaction: copies the latest live record of every id to a new file and swaps it in.
 
-const float EPSILON = 1e-6f;
+    The copy does not block the other calls. It takes a snapshot of the live bitmap of the id index
+    and dwThreads workers copy their part of records [0, count) to the positions the bitmap ranks
+    give them, so the records keep their order. Records appended meanwhile (tombstones included)
+    are carried over as they are, in rounds, until fewer than COMPACT_TAIL are left. The swap then
+    waits for the calls in progress (see struct Compact), copies the rest of the tail and the records
+    fileupdate overwrote during the copy, and renames the new file over the old one. Other handles
+    on the old file, cursors included, keep reading it until they are closed.
 
-static int __cdecl heap_qsort_func(const void* pa, const void* pb)
+    The IVF lists, HNSW graph, PQ codes and sign sketches refer to records by ordinal. The swap drops
+    them and filecompact builds the ones the file had again, with the same parameters; searches use
+    the exhaustive scan meanwhile. The id index is rebuilt from the copy.
+*/
+
+#define COMPACT_TAIL 4096 /* appended records left for the swap to copy */
+#define COMPACT_ROUNDS 8 /* catch-up rounds before the swap copies whatever is left */
+
+typedef struct CompactJob {
+    uint64_t begin, end; /* record ordinals of this worker, see _parallel */
+    BOOL bOk;
+    Embeddings* db;
+    HANDLE hDst;
+    const uint64_t* live;
+    const uint32_t* rank; /* live records before each word of live */
+    uiid* keys; /* ids of the copied records, by position in the copy */
+} CompactJob;
+
+/* Position of record i of the snapshot in the copy. */
+static inline uint64_t _compactrank(const CompactJob* job, uint64_t i)
 {
-    const Score* a = (const Score*)pa;
-    const Score* b = (const Score*)pb;
-    return (a->score < b->score) - (a->score > b->score);
+    return job->rank[i >> 6] + _livecount(job->live[i >> 6] & (((uint64_t)1 << (i & 63)) - 1));
+}
+
+/* A copied record is the first of its id in the new file. */
+static inline void _compactop(const Embeddings* db, uint8_t* rec)
+{
+    if (db->header.version >= 3) {
+        uint32_t op = RECORD_ADD;
+        memcpy(rec + sizeof(uiid) + db->header.blobSize + sizeof(float), &op, sizeof(op));
+    }
 }
 
-static int find_in_heap(const Score* heap, size_t num, const uiid* id)
+/* Copies the live records of [begin, end) to their positions in the new file. */
+static void _compactrange(void* arg)
 {
-    for (size_t i = 0; i < num; ++i) {
-        if (_uiidcmp(&heap[i].id, id)) {
-            return (int)i;
+    CompactJob* job = (CompactJob*)arg;
+    Embeddings* db = job->db;
+    const uint32_t MAX = 1024;
+    const uint32_t stride = _recsize(&db->header);
+    job->bOk = FALSE;
+    uint8_t* big = (uint8_t*)_aligned_malloc((size_t)MAX * stride, db->header.alignment);
+    if (!big) return;
+    uint64_t out = job->begin < job->end ? _compactrank(job, job->begin) : 0;
+    for (uint64_t i = job->begin; i < job->end;) {
+        uint32_t n = job->end - i < MAX ? (uint32_t)(job->end - i) : MAX;
+        if (!_ioreadall(db->hWrite, big, (size_t)n * stride, MAXHEAD + i * stride)) goto done;
+        // Move the live records to the front of the buffer and write them with one call.
+        uint32_t m = 0;
+        for (uint32_t r = 0; r < n; ++r) {
+            if (!_liveget(job->live, i + r)) continue;
+            uint8_t* rec = big + (size_t)m * stride;
+            if (m != r) memcpy(rec, big + (size_t)r * stride, stride);
+            _compactop(db, rec);
+            _uiidcpy(&job->keys[out + m], (const uiid*)rec);
+            m++;
         }
+        if (m > 0 && !_iowriteall(job->hDst, big, (size_t)m * stride, MAXHEAD + out * stride)) goto done;
+        out += m;
+        i += n;
     }
-    return -1;
+    job->bOk = TRUE;
+done:
+    _aligned_free(big);
 }
 
-static void remove_from_heap(Score* heap, size_t* num, size_t idx)
+/* Copies records [from, to) as they are to the new file from position next. */
+static BOOL _compacttail(Embeddings* db, HANDLE hDst, uint64_t from, uint64_t to, uint64_t next)
 {
-    if (idx >= *num) return;
-    for (size_t i = idx; i + 1 < *num; ++i) {
-        heap[i] = heap[i + 1];
+    const uint32_t MAX = 1024;
+    const uint32_t stride = _recsize(&db->header);
+    uint8_t* big = (uint8_t*)_aligned_malloc((size_t)MAX * stride, db->header.alignment);
+    if (!big) return FALSE;
+    BOOL bOk = TRUE;
+    for (uint64_t i = from; i < to && bOk;) {
+        uint32_t n = to - i < MAX ? (uint32_t)(to - i) : MAX;
+        bOk = _ioreadall(db->hWrite, big, (size_t)n * stride, MAXHEAD + i * stride) &&
+            _iowriteall(hDst, big, (size_t)n * stride, MAXHEAD + (next + (i - from)) * stride);
+        i += n;
     }
-    (*num)--;
+    _aligned_free(big);
+    return bOk;
+}
+
+/* Records in the file, counting whole records only. */
+static BOOL _compactrecords(Embeddings* db, uint64_t* precords)
+{
+    uint64_t fileSize = 0;
+    if (!_iosize(db->hWrite, &fileSize)) return FALSE;
+    uint64_t records = fileSize > MAXHEAD ? (fileSize - MAXHEAD) / _recsize(&db->header) : 0;
+    *precords = records < UINT32_MAX ? records : UINT32_MAX - 1;
+    return TRUE;
 }
 
-static void remove_from_heap_if(Score* heap, size_t* num, const uiid* id)
+/* The id index of the copy: the copied records are all live and the tail is indexed by _idssync. */
+static struct Ids* _compactids(Embeddings* db, HANDLE hDst, const uiid* keys, uint64_t nLive)
 {
-    int idx = find_in_heap(heap, *num, id);
-    if (idx >= 0) {
-        remove_from_heap(heap, num, (size_t)idx);
+    struct Ids* ids = _idscreate(db);
+    if (!ids) return NULL;
+    ids->cbLive = _livesize(nLive > 1024 ? nLive : 1024);
+    ids->live = (uint64_t*)calloc(1, ids->cbLive);
+    if (!ids->live || !_idmapreserve(&ids->map, (size_t)nLive)) {
+        _idsfree(ids);
+        return NULL;
     }
+    for (uint64_t i = 0; i < nLive; ++i) {
+        _idmapputid(&ids->map, &keys[i], (uint32_t)i);
+        ids->live[i >> 6] |= (uint64_t)1 << (i & 63);
+    }
+    if (nLive > 0 && !_ioreadall(hDst, &ids->header.last, sizeof(uiid), MAXHEAD + (nLive - 1) * ids->header.stride)) {
+        _idsfree(ids);
+        return NULL;
+    }
+    ids->header.count = (uint32_t)nLive;
+    ids->bReady = TRUE;
+    ids->bDirty = TRUE;
+    return ids;
 }
 
-void cosine(const float* query, uint32_t len,
-    float qnorm,
-    const uint8_t* buff,
-    float min,
-    size_t* num,
-    uint32_t topk,
-    Score* heap,
-    BOOL bNorm)
+/* Ends the compaction: fileupdate stops noting, and a swap tells the builds in progress that they are stale. */
+static void _compactend(Embeddings* db, BOOL bSwapped)
 {
-    const uiid* id = (const uiid*)buff;
-    const float* blob = (const float*)(buff + sizeof(uiid));
-    float norm = bNorm
-        ? cblas_snrm2(blob, len)
-        : 1;
-    if (norm < EPSILON) {
-        return;
+    struct Compact* cp = db->compact;
+    _lockenter(&cp->lock);
+    cp->bRunning = FALSE;
+    cp->nUpdated = 0;
+    if (bSwapped) cp->swaps++;
+    _lockleave(&cp->lock);
+}
+
+/*
+    Copies the records fileupdate overwrote during the copy again: a record of the snapshot to its
+    rank if it was live, a record of the tail to its place in the tail. The caller holds the gate.
+*/
+static BOOL _compactupdated(CompactJob* job, uint64_t count, uint64_t nLive, uint64_t records, uint8_t* rec)
+{
+    Embeddings* db = job->db;
+    struct Compact* cp = db->compact;
+    const uint32_t stride = _recsize(&db->header);
+    if (cp->bLost) {
+        fprintf(stderr, "Memory allocation failed while tracking the records updated during the compaction.\n");
+        return FALSE;
     }
-    remove_from_heap_if(
-        heap,
-        num,
-        id
-    );
-    double dot = cblas_sdot(blob, query, len);
-    float score = (float)(dot / ((double)qnorm * (double)norm));
-    if (score >= min) {
-        if (*num < topk) {
-            // start accumulating until we fill the heap
-            _uiidcpy(&heap[*num].id, id);
-            heap[*num].score = score;
-            (*num) = (*num) + 1;
-            qsort(heap, *num, sizeof(Score), heap_qsort_func);
+    for (size_t u = 0; u < cp->nUpdated; ++u) {
+        uint64_t ord = cp->updated[u], pos;
+        if (ord < count) {
+            if (!_liveget(job->live, ord)) continue;
+            pos = _compactrank(job, ord);
         }
-        else if (score > heap[topk - 1].score) {
-            // evict the lowest score
-            _uiidcpy(&heap[topk - 1].id, id);
-            heap[topk - 1].score = score;
-            qsort(heap, *num, sizeof(Score), heap_qsort_func);
+        else if (ord < records) {
+            pos = nLive + (ord - count);
         }
+        else {
+            continue;
+        }
+        if (!_ioreadall(db->hWrite, rec, stride, MAXHEAD + ord * stride)) return FALSE;
+        if (ord < count) _compactop(db, rec);
+        if (!_iowriteall(job->hDst, rec, stride, MAXHEAD + pos * stride)) return FALSE;
     }
+    return TRUE;
 }
 
-EMBEDDINGS_API int32_t EMBEDDINGS_CALL filesearch(
-    Embeddings* db,
-    const float* query, uint32_t len,
-    uint32_t topk,
-    Score* scores,
-    float min,
-    BOOL bNorm)
+static BOOL _filecompact(Embeddings* db, uint32_t dwThreads)
 {
-    _dbglog("filesearch(min = %f);\n", min);
+    _dbglog("filecompact(threads = %u);\n", dwThreads);
     if (!db) {
         fprintf(stderr, "The specified database pointer is NULL.\n");
-        return -1;
+        return FALSE;
     }
-    if (!query) {
-        fprintf(stderr, "The specified query pointer is NULL.\n");
-        return -1;
+    if (!db->hWrite || db->hWrite == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "The specified database is closed or invalid.\n");
+        return FALSE;
     }
-    float qnorm = bNorm
-        ? cblas_snrm2(query, len)
-        : 1;
-    _dbglog("qnorm = %f;\n", qnorm);
-    if (qnorm < EPSILON) {
-        fprintf(stderr, "Query vector norm too small (%.8g).\n", qnorm);
-        return -1;
+    if (!(db->access & (FILE_WRITE_DATA | FILE_APPEND_DATA))) {
+        fprintf(stderr, "The database was not opened for writing.\n");
+        return FALSE;
     }
-    if (len == 0) {
-        fprintf(stderr, "The specified query length is zero.\n");
-        return -1;
+    struct Compact* cp = db->compact;
+    _lockenter(&cp->lock);
+    BOOL bBusy = cp->bRunning;
+    if (!bBusy) {
+        // From here on fileupdate notes what it overwrites, so set before the snapshot is taken.
+        cp->bRunning = TRUE;
+        cp->bLost = FALSE;
+        cp->nUpdated = 0;
     }
-    if (!db->hWrite || db->hWrite == INVALID_HANDLE_VALUE) {
-        fprintf(stderr, "The specified database is closed or invalid.\n");
-        return -1;
+    _lockleave(&cp->lock);
+    if (bBusy) {
+        fprintf(stderr, "A compaction of this database is already running.\n");
+        return FALSE;
     }
-    if (topk == 0) {
-        fprintf(stderr, "The specified topk value must be greater than zero.\n");
-        return -1;
+    // Records another writer appends to the file being replaced would be lost, so it runs alone.
+    if (!_iowriters(db->hWrite, TRUE)) {
+        fprintf(stderr, "Another handle, cursor or process has the database open for writing; compaction needs to be the only writer.\n");
+        _compactend(db, FALSE);
+        return FALSE;
     }
-    if (!scores) {
-        fprintf(stderr, "The specified scores buffer is NULL.\n");
-        return -1;
+    if (dwThreads == 0) {
+        dwThreads = db->os.dwNumberOfProcessors ? db->os.dwNumberOfProcessors : 1;
     }
-    if (db->header.blobSize != len * sizeof(float)) {
-        fprintf(stderr,
-            "Query size (%u bytes) does not match database blob size (%u bytes).\n",
-            len * (unsigned)sizeof(float),
-            db->header.blobSize);
-        return -1;
+    BOOL bOk = FALSE, bSwapped = FALSE, bLocked = FALSE;
+    uint64_t count = 0, nLive = 0;
+    wchar_t wszNew[PATH], wszPath[PATH];
+    HANDLE hDst = INVALID_HANDLE_VALUE, hNew = INVALID_HANDLE_VALUE, hOld = INVALID_HANDLE_VALUE;
+    uint32_t* rank = NULL;
+    uiid* keys = NULL;
+    uint8_t* head = NULL;
+    uint8_t* rec = NULL;
+    CompactJob* jobs = NULL;
+    Thread* threads = NULL;
+    struct Ids* ids = NULL;
+    uint64_t* live = _idssnapshot(db, &count);
+    if (!live) {
+        fprintf(stderr, "The id index is not available.\n");
+        _iowriters(db->hWrite, FALSE);
+        _compactend(db, FALSE);
+        return FALSE;
     }
-    HANDLE hRead = NULL;
-    if (!DuplicateHandle(GetCurrentProcess(), db->hWrite, GetCurrentProcess(),
-        &hRead, FILE_READ_DATA, FALSE, 0))
-    {
-        fprintf(stderr, "Failed to duplicate file handle for search (system error %lu).\n", GetLastError());
-        return -1;
+    // A temporary file is replaced by another temporary file, which goes away on close like the first.
+    _iosidecar(db, L"", wszPath);
+    if (db->bTemporary ? !_iotemppath(wszNew) : !_iosidecar(db, L".compact", wszNew)) {
+        fprintf(stderr, "Failed to name the compacted file (system error %lu).\n", (unsigned long)GetLastError());
+        free(live);
+        _iowriters(db->hWrite, FALSE);
+        _compactend(db, FALSE);
+        return FALSE;
     }
-    LARGE_INTEGER offset = { MAXHEAD };
-    if (!SetFilePointerEx(hRead, offset, NULL, FILE_BEGIN)) {
-        fprintf(stderr, "Failed to seek to the first record (system error %lu).\n", GetLastError());
-        CloseHandle(hRead);
-        return -1;
+    hDst = _ioopen(wszNew, FILE_READ_DATA | FILE_WRITE_DATA, CREATE_ALWAYS, db->bTemporary);
+    if (!hDst || hDst == INVALID_HANDLE_VALUE) {
+        hDst = INVALID_HANDLE_VALUE;
+        fprintf(stderr, "Failed to create '%ls' (system error %lu).\n", wszNew, (unsigned long)GetLastError());
+        goto done;
     }
-    Score* heap = (Score*)calloc(topk, sizeof(Score));
-    if (!heap) {
-        fprintf(stderr, "Memory allocation failed while preparing the top-k heap.\n");
-        CloseHandle(hRead);
-        return -1;
+    size_t words = (size_t)((count + 63) / 64);
+    rank = (uint32_t*)malloc((words + 1) * sizeof(uint32_t));
+    head = (uint8_t*)_aligned_malloc(MAXHEAD, MAXHEAD);
+    rec = (uint8_t*)_aligned_malloc(_recsize(&db->header), db->header.alignment);
+    if (!rank || !head || !rec) {
+        fprintf(stderr, "Memory allocation failed while preparing the compaction.\n");
+        goto done;
     }
-    uint32_t stride = __alignup(sizeof(uiid) + db->header.blobSize, db->header.alignment);
-    uint8_t* carry = (uint8_t*)malloc(stride);
-    if (!carry) {
-        fprintf(stderr, "Memory allocation failed while preparing the read buffers.\n");
-        free(heap);
-        CloseHandle(hRead);
-        return -1;
+    for (size_t w = 0; w < words; ++w) {
+        rank[w] = (uint32_t)nLive;
+        nLive += _livecount(live[w]);
     }
-    const uint32_t MAX = 1024;
-    uint8_t* big = (uint8_t*)_aligned_malloc((size_t)(MAX * stride), db->header.alignment);
-    if (!big) {
-        fprintf(stderr, "Memory allocation failed while preparing the read buffers.\n");
-        free(heap);
-        free(carry);
-        CloseHandle(hRead);
-        return -1;
+    rank[words] = (uint32_t)nLive;
+    if (dwThreads > (count + 1023) / 1024) {
+        dwThreads = count ? (uint32_t)((count + 1023) / 1024) : 1;
     }
-    size_t num = 0; size_t leftoverBytes = 0;
-    for (;;) {
-        if (leftoverBytes) {
-            memcpy(big, carry, leftoverBytes);
+    keys = (uiid*)malloc((nLive ? nLive : 1) * sizeof(uiid));
+    jobs = (CompactJob*)calloc(dwThreads, sizeof(CompactJob));
+    threads = (Thread*)calloc(dwThreads, sizeof(Thread));
+    if (!keys || !jobs || !threads) {
+        fprintf(stderr, "Memory allocation failed while preparing the compaction.\n");
+        goto done;
+    }
+    for (uint32_t t = 0; t < dwThreads; ++t) {
+        jobs[t].db = db;
+        jobs[t].hDst = hDst;
+        jobs[t].live = live;
+        jobs[t].rank = rank;
+        jobs[t].keys = keys;
+    }
+    if (!_ioreadall(db->hWrite, head, MAXHEAD, 0) || !_iowriteall(hDst, head, MAXHEAD, 0) ||
+        !_parallel(jobs, sizeof(CompactJob), threads, dwThreads, count, _compactrange)) {
+        fprintf(stderr, "Failed to copy the records (system error %lu).\n", (unsigned long)GetLastError());
+        goto done;
+    }
+    ids = _compactids(db, hDst, keys, nLive);
+    if (!ids) {
+        fprintf(stderr, "Failed to index the compacted records (system error %lu).\n", (unsigned long)GetLastError());
+        goto done;
+    }
+    // Carry over the records appended during the copy while there are many of them.
+    uint64_t copied = count, next = nLive, records = 0;
+    for (uint32_t round = 0; round < COMPACT_ROUNDS; ++round) {
+        if (!_compactrecords(db, &records) || !_compacttail(db, hDst, copied, records, next)) {
+            fprintf(stderr, "Failed to copy the appended records (system error %lu).\n", (unsigned long)GetLastError());
+            goto done;
         }
-        DWORD bytesRead = 0;
-        BOOL ok = ReadFile(hRead, big + leftoverBytes, (DWORD)(MAX * stride - leftoverBytes), &bytesRead, NULL);
-        if (!ok || bytesRead == 0) {
-            break; // EOF
+        BOOL bLast = records - copied < COMPACT_TAIL;
+        next += records - copied;
+        copied = records;
+        if (bLast) break;
+    }
+    hNew = _ioopen(wszNew, db->access, OPEN_EXISTING, db->bTemporary);
+    if (!hNew || hNew == INVALID_HANDLE_VALUE) {
+        hNew = INVALID_HANDLE_VALUE;
+        fprintf(stderr, "Failed to open '%ls' (system error %lu).\n", wszNew, (unsigned long)GetLastError());
+        goto done;
+    }
+    // Nobody else has the new file open yet.
+    if (!_iowriters(hNew, FALSE)) {
+        fprintf(stderr, "Failed to lock '%ls' (system error %lu).\n", wszNew, (unsigned long)GetLastError());
+        goto done;
+    }
+    _gatelock(db);
+    bLocked = TRUE;
+    if (!_compactrecords(db, &records) || !_compacttail(db, hDst, copied, records, next) ||
+        !_compactupdated(&jobs[0], count, nLive, records, rec) || !_iosync(hDst)) {
+        fprintf(stderr, "Failed to complete the compacted file (system error %lu).\n", (unsigned long)GetLastError());
+        goto done;
+    }
+    if (!db->bTemporary && !_iorename(wszNew, wszPath)) {
+        fprintf(stderr, "Failed to replace '%ls' (system error %lu).\n", wszPath, (unsigned long)GetLastError());
+        goto done;
+    }
+    // Swap: from here on every call sees the new file.
+    hOld = db->hWrite;
+    db->hWrite = hNew;
+    hNew = INVALID_HANDLE_VALUE;
+    if (db->bTemporary) {
+        memcpy((uint8_t*)db->wszPath, wszNew, sizeof(db->wszPath));
+    }
+    if (db->hDirect) {
+        _ioclose(db->hDirect);
+        db->hDirect = _ioopendirect(db->bTemporary ? wszNew : wszPath);
+        if (db->hDirect == INVALID_HANDLE_VALUE) {
+            db->hDirect = NULL;
+            fprintf(stderr, "Warning: failed to open the compacted file for direct I/O (system error %lu); using buffered reads.\n", (unsigned long)GetLastError());
         }
-        size_t total = leftoverBytes + bytesRead;
-        size_t offset = 0;
-        while (offset + stride <= total) {
-            cosine(
-                query,
-                len,
-                qnorm,
-                (uint8_t*)big + offset,
-                min,
-                &num,
-                topk,
-                heap,
-                bNorm);
-            offset += stride;
-        } 
-        leftoverBytes = total - offset;
-        if (leftoverBytes) {
-            memcpy(carry, big + offset, leftoverBytes);
-        }
-    }
-    assert(num <= topk);
-	memset(scores, 0, topk * sizeof(Score));
-    for (DWORD i = 0; i < num; ++i) {
-        _uiidcpy(&scores[i].id, &heap[i].id);
-		scores[i].score = heap[i].score;
     }
-    _aligned_free(big);
-    free(carry);
-    free(heap);
-    CloseHandle(hRead);
-    _dbglog("filesearch() = %u;\n", (unsigned int)num);
-    return num;
+    if (db->view && db->view->current) {
+        // Mappings of the old file still referenced go away on their last _maprelease.
+        if (--db->view->current->refs == 0) _mapdestroy(db->view->current);
+        db->view->current = NULL;
+    }
+    _idsfree(db->ids);
+    db->ids = ids;
+    ids = NULL;
+    _lockenter(&db->ids->lock);
+    if (!_idssync(db, db->ids)) {
+        fprintf(stderr, "Warning: failed to index the appended ids (system error %lu); retrying on the next append.\n", (unsigned long)GetLastError());
+    }
+    _lockleave(&db->ids->lock);
+    bSwapped = TRUE;
+    bOk = TRUE;
+done:
+    {
+        // Indexes that refer to records of the old file by ordinal are dropped and built again.
+        uint32_t nlist = 0, hnswM = 0, efConstruction = 0, pqM = 0, nbits = 0;
+        BOOL bSign = FALSE;
+        if (bSwapped) {
+            if (db->ivf) nlist = db->ivf->header.nlist;
+            if (db->hnsw) { hnswM = db->hnsw->header.M; efConstruction = db->hnsw->header.efConstruction; }
+            if (db->pq) { pqM = db->pq->header.M; nbits = db->pq->header.nbits; }
+            bSign = db->sign != NULL;
+            _ivffree(db->ivf);
+            _hnswfree(db->hnsw);
+            _pqfree(db->pq);
+            _signfree(db->sign);
+            db->ivf = NULL;
+            db->hnsw = NULL;
+            db->pq = NULL;
+            db->sign = NULL;
+            for (size_t i = 0; i < sizeof(kIndexes) / sizeof(kIndexes[0]) && !db->bTemporary; ++i) {
+                wchar_t wszIndex[PATH];
+                if (_iosidecar(db, kIndexes[i], wszIndex)) {
+                    _iodelete(wszIndex);
+                }
+            }
+        }
+        if (!bSwapped) _iowriters(db->hWrite, FALSE);
+        _compactend(db, bSwapped);
+        if (bLocked) _gateunlock(db);
+        if (hOld != INVALID_HANDLE_VALUE) {
+            _ioclose(hOld);
+            // The old temporary file (FILE_FLAG_DELETE_ON_CLOSE on Windows).
+#if !defined(_WIN32)
+            if (db->bTemporary) _iodelete(wszPath);
+#endif
+        }
+        if (hNew != INVALID_HANDLE_VALUE) _ioclose(hNew);
+        if (hDst != INVALID_HANDLE_VALUE) _ioclose(hDst);
+        if (!bSwapped) _iodelete(wszNew);
+        _idsfree(ids);
+        free(jobs);
+        free(threads);
+        free(keys);
+        free(rank);
+        _aligned_free(head);
+        _aligned_free(rec);
+        free(live);
+        if (nlist && !ivfbuild(db, nlist, dwThreads)) {
+            fprintf(stderr, "Warning: failed to rebuild the IVF index after the compaction.\n");
+        }
+        if (hnswM && !hnswbuild(db, hnswM, efConstruction)) {
+            fprintf(stderr, "Warning: failed to rebuild the HNSW graph after the compaction.\n");
+        }
+        if (pqM && !pqbuild(db, pqM, nbits, dwThreads)) {
+            fprintf(stderr, "Warning: failed to rebuild the PQ index after the compaction.\n");
+        }
+        if (bSign && !signbuild(db, dwThreads)) {
+            fprintf(stderr, "Warning: failed to rebuild the sign sketches after the compaction.\n");
+        }
+    }
+    return bOk;
+}
+
+EMBEDDINGS_API BOOL EMBEDDINGS_CALL filecompact(Embeddings* db, uint32_t dwThreads)
+{
+    // The gate is taken inside: the swap waits for every other call to leave it.
+    return _filecompact(db, dwThreads);
 }
 
 /* Cursor API is desined for offline processing. It should not be used on a live index for upserting. */
@@ -601,8 +8220,10 @@ EMBEDDINGS_API void EMBEDDINGS_CALL cursorclose(Cursor* cur)
     if (!cur) return;
     if (cur->buffer)
         _aligned_free(cur->buffer);
+    if (cur->window)
+        _aligned_free(cur->window);
     if (cur->hReadWrite && cur->hReadWrite != INVALID_HANDLE_VALUE)
-        CloseHandle(cur->hReadWrite);
+        _ioclose(cur->hReadWrite);
     free(cur);
 }
 
@@ -616,16 +8237,13 @@ EMBEDDINGS_API BOOL EMBEDDINGS_CALL cursorreset(Cursor* cur) {
         fprintf(stderr, "The specified database is closed or invalid.\n");
         return FALSE;
     }
-    LARGE_INTEGER offset = { MAXHEAD };
-    if (!SetFilePointerEx(cur->hReadWrite, offset, NULL, FILE_BEGIN))
-    {
-        fprintf(stderr, "Failed to seek to the first record (system error %lu).\n", GetLastError());
-        return FALSE;
-    }
+    cur->offset.QuadPart = 0;
+    cur->next.QuadPart = MAXHEAD;
+    cur->cbFilled = 0;
     return TRUE;
 }
 
-EMBEDDINGS_API Cursor* EMBEDDINGS_CALL cursoropen(Embeddings * db, BOOL bReadOnly) {
+static Cursor*_cursoropen(Embeddings * db, BOOL bReadOnly) {
     _dbglog("cursoropen(bReadOnly=%d);\n", bReadOnly);
     if (!db) {
         fprintf(stderr, "The specified database pointer is NULL.\n");
@@ -641,47 +8259,89 @@ EMBEDDINGS_API Cursor* EMBEDDINGS_CALL cursoropen(Embeddings * db, BOOL bReadOnl
         return NULL;
     }
 	memset(cur, 0, sizeof(*cur));
-    HANDLE hReadWrite = NULL;
-    if (!DuplicateHandle(
-        GetCurrentProcess(),
-        db->hWrite,
-        GetCurrentProcess(),
-        &hReadWrite,
-        bReadOnly
-            ? FILE_READ_DATA // The most basic level read possible
-            : FILE_READ_DATA | FILE_WRITE_DATA, // Allow updates
-        FALSE,
-        0))
+    // Read-only cursors of a database in direct I/O mode read a window of the file at a time.
+    wchar_t wszPath[PATH];
+    BOOL bDirect = bReadOnly && db->hDirect && _iosidecar(db, L"", wszPath);
+    HANDLE hReadWrite = bDirect ? _ioopendirect(wszPath) : _ioreopen(db, bReadOnly);
+    if (!hReadWrite || hReadWrite == INVALID_HANDLE_VALUE)
     {
         free(cur);
-        fprintf(stderr, "Failed to duplicate file handle for scanning (system error %lu).\n", GetLastError());
+        fprintf(stderr, "Failed to duplicate file handle for scanning (system error %lu).\n", (unsigned long)GetLastError());
         return NULL;
     }
-    LARGE_INTEGER offset = { MAXHEAD };
-    if (!SetFilePointerEx(hReadWrite, offset, NULL, FILE_BEGIN))
-    {
+    // cursorupdate writes the file, so an updating cursor is a writer (see _iowriters).
+    if (!bReadOnly && !_iowriters(hReadWrite, FALSE)) {
+        _ioclose(hReadWrite);
         free(cur);
-        fprintf(stderr, "Failed to seek to the first record (system error %lu).\n", GetLastError());
-        CloseHandle(hReadWrite);
+        fprintf(stderr, "The database is being compacted; open the cursor for updates once the compaction is done.\n");
         return NULL;
     }
     memcpy(&cur->header, &db->header, sizeof(FileHeader));
     cur->hReadWrite = hReadWrite;
-    size_t cc = __alignup(sizeof(uiid) + cur->header.blobSize, cur->header.alignment);
-    uint8_t* buffer = (uint8_t*)_aligned_malloc(cc, cur->header.alignment);
+    size_t cc = _recsize(&cur->header);
+    // Records that are not stored as float32 are widened after the raw record, so cur->blob is always float32.
+    size_t cbDecoded = cur->header.dtype != DTYPE_FLOAT32
+        ? (size_t)_vecdim(&cur->header) * sizeof(float)
+        : 0;
+    uint8_t* buffer = (uint8_t*)_aligned_malloc(cc + cbDecoded, cur->header.alignment);
     if (!buffer) {
         fprintf(stderr, "Memory allocation failed while preparing the read buffer.\n");
-        CloseHandle(hReadWrite);
+        _ioclose(hReadWrite);
+        free(cur);
         return NULL;
+    }
+    if (bDirect) {
+        cur->cbWindow = (uint32_t)__alignup(cc + DIRECT_ALIGN, DIRECT_ALIGN);
+        if (cur->cbWindow < DIRECT_WINDOW) cur->cbWindow = DIRECT_WINDOW;
+        cur->window = (uint8_t*)_aligned_malloc(cur->cbWindow, DIRECT_ALIGN);
+        if (!cur->window) {
+            fprintf(stderr, "Memory allocation failed while preparing the read buffer.\n");
+            _aligned_free(buffer);
+            _ioclose(hReadWrite);
+            free(cur);
+            return NULL;
+        }
     }
 	cur->cc = cc;
 	cur->buffer = buffer;
     cur->id = (uiid*)buffer;
-    cur->blob = buffer + sizeof(uiid);
-	cur->blobSize = cur->header.blobSize;
+    cur->blob = cbDecoded ? buffer + cc : buffer + sizeof(uiid);
+	cur->blobSize = _vecdim(&cur->header) * sizeof(float);
+    cur->next.QuadPart = MAXHEAD;
     return cur;
 }
 
+EMBEDDINGS_API Cursor* EMBEDDINGS_CALL cursoropen(Embeddings * db, BOOL bReadOnly)
+{
+    _gateenter(db, FALSE);
+    Cursor* result = _cursoropen(db, bReadOnly);
+    _gateleave(db);
+    return result;
+}
+
+/* Reads the record at offset into cur->buffer, from the window of a direct cursor when it has one. */
+static BOOL _cursorfetch(Cursor* cur, uint64_t offset, DWORD* pcbRead)
+{
+    if (!cur->window) {
+        return _ioread(cur->hReadWrite, cur->buffer, cur->cc, offset, pcbRead);
+    }
+    uint64_t start = (uint64_t)cur->windowOffset.QuadPart;
+    if (offset < start || offset + cur->cc > start + cur->cbFilled) {
+        // Read the window again from the block of the record; cbWindow leaves room for a whole record.
+        start = offset & ~(uint64_t)(DIRECT_ALIGN - 1);
+        cur->cbFilled = 0;
+        cur->windowOffset.QuadPart = (int64_t)start;
+        if (!_ioreaddirect(cur->hReadWrite, cur->window, cur->cbWindow, start, &cur->cbFilled)) {
+            *pcbRead = 0;
+            return FALSE;
+        }
+    }
+    uint64_t avail = start + cur->cbFilled > offset ? start + cur->cbFilled - offset : 0;
+    *pcbRead = avail < cur->cc ? (DWORD)avail : cur->cc;
+    if (*pcbRead) memcpy(cur->buffer, cur->window + (offset - start), *pcbRead);
+    return TRUE;
+}
+
 EMBEDDINGS_API BOOL EMBEDDINGS_CALL cursorread(Cursor* cur, DWORD* err)
 {
     if (err) *err = NOERROR;
@@ -700,30 +8360,118 @@ EMBEDDINGS_API BOOL EMBEDDINGS_CALL cursorread(Cursor* cur, DWORD* err)
         fprintf(stderr, "The specified database is closed or invalid.\n");
         return FALSE;
     }
-    cur->offset.QuadPart = 0;
-    LARGE_INTEGER zero = { 0 };
-    if (!SetFilePointerEx(cur->hReadWrite, zero, &cur->offset, FILE_CURRENT)) {
-		DWORD sys = GetLastError();
-        fprintf(stderr, "GetFilePointerEx failed. (system error %lu).\n", sys);
-        if (err) *err = sys;
-        return FALSE;
-    }
-    DWORD bytesRead = 0; BOOL ok = ReadFile(cur->hReadWrite, cur->buffer, cur->cc, &bytesRead, NULL);
-    if (!ok) {
-		DWORD sys = GetLastError();
-        if (sys == ERROR_HANDLE_EOF || sys == ERROR_BROKEN_PIPE || sys == NO_ERROR) {
+    // Tombstones (filedelete) are stepped over.
+    do {
+        DWORD bytesRead = 0; BOOL ok = _cursorfetch(cur, (uint64_t)cur->next.QuadPart, &bytesRead);
+        if (!ok) {
+            DWORD sys = GetLastError();
+            if (sys == ERROR_HANDLE_EOF || sys == ERROR_BROKEN_PIPE || sys == NO_ERROR) {
+                if (err) *err = ERROR_HANDLE_EOF;
+            }
+            else {
+                if (err) *err = sys; // True error
+            }
+            return FALSE;
+        }
+        if (bytesRead < cur->cc) { /* Partial read EOF */
             if (err) *err = ERROR_HANDLE_EOF;
+            return FALSE;
         }
-        else {
-            if (err) *err = sys; // True error
+        cur->offset = cur->next;
+        cur->next.QuadPart += cur->cc;
+    } while (_recop(&cur->header, (const uint8_t*)cur->buffer) == RECORD_DELETE);
+    if (cur->header.dtype != DTYPE_FLOAT32) {
+        _vecdecode(cur->header.dtype, (float*)cur->blob, (uint8_t*)cur->buffer + sizeof(uiid), _vecdim(&cur->header));
+    }
+    return TRUE;
+}
+
+/* Copies the id and the float32 vector of the raw record rec out of the cursor. */
+static inline void _cursorcopy(const Cursor* cur, const uint8_t* rec, uiid* id, float* blob)
+{
+    _uiidcpy(id, (const uiid*)rec);
+    if (cur->header.dtype != DTYPE_FLOAT32) {
+        _vecdecode(cur->header.dtype, blob, rec + sizeof(uiid), _vecdim(&cur->header));
+    }
+    else {
+        memcpy(blob, rec + sizeof(uiid), cur->blobSize);
+    }
+}
+
+EMBEDDINGS_API int32_t EMBEDDINGS_CALL cursorreadbatch(Cursor* cur, uint32_t n, uiid* ids, float* blobs, uint64_t* offsets)
+{
+    if (!cur) {
+        fprintf(stderr, "The specified cursor pointer is NULL.\n");
+        return -1;
+    }
+    if (!cur->buffer) {
+        fprintf(stderr, "The specified cursor pointer is corrupt.\n");
+        return -1;
+    }
+    if (!cur->hReadWrite || cur->hReadWrite == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "The specified database is closed or invalid.\n");
+        return -1;
+    }
+    if (n == 0) {
+        return 0;
+    }
+    if (!ids || !blobs) {
+        fprintf(stderr, "The specified ids or blobs pointer is NULL.\n");
+        return -1;
+    }
+    if (n > INT32_MAX) n = INT32_MAX;
+    const uint32_t dim = _vecdim(&cur->header);
+    uint32_t got = 0;
+    if (cur->window) {
+        // Direct cursors already read a whole window at a time.
+        while (got < n) {
+            uint64_t offset = (uint64_t)cur->next.QuadPart;
+            DWORD bytesRead = 0;
+            if (!_cursorfetch(cur, offset, &bytesRead)) {
+                fprintf(stderr, "Failed to read the records (system error %lu).\n", (unsigned long)GetLastError());
+                return -1;
+            }
+            if (bytesRead < cur->cc) break; // EOF
+            cur->next.QuadPart += cur->cc;
+            if (_recop(&cur->header, (const uint8_t*)cur->buffer) == RECORD_DELETE) continue;
+            _cursorcopy(cur, (const uint8_t*)cur->buffer, &ids[got], blobs + (size_t)got * dim);
+            if (offsets) offsets[got] = offset;
+            cur->offset.QuadPart = (int64_t)offset;
+            got++;
         }
-        return FALSE;
+        return (int32_t)got;
     }
-    if (bytesRead < cur->cc) { /* Partial read EOF */
-        if (err) *err = ERROR_HANDLE_EOF;
-        return FALSE;
+    uint32_t most = CURSOR_BATCH / cur->cc;
+    if (most == 0) most = 1;
+    uint32_t count = n < most ? n : most;
+    uint8_t* big = (uint8_t*)_aligned_malloc((size_t)count * cur->cc, cur->header.alignment);
+    if (!big) {
+        fprintf(stderr, "Memory allocation failed while preparing the read buffer.\n");
+        return -1;
     }
-    return TRUE;
+    while (got < n) {
+        uint32_t want = n - got < most ? n - got : most;
+        uint64_t offset = (uint64_t)cur->next.QuadPart;
+        DWORD bytesRead = 0;
+        if (!_ioread(cur->hReadWrite, big, want * cur->cc, offset, &bytesRead)) {
+            fprintf(stderr, "Failed to read the records (system error %lu).\n", (unsigned long)GetLastError());
+            _aligned_free(big);
+            return -1;
+        }
+        uint32_t records = bytesRead / cur->cc; // A partial record at EOF is an append in flight.
+        for (uint32_t r = 0; r < records; ++r) {
+            const uint8_t* rec = big + (size_t)r * cur->cc;
+            if (_recop(&cur->header, rec) == RECORD_DELETE) continue;
+            _cursorcopy(cur, rec, &ids[got], blobs + (size_t)got * dim);
+            if (offsets) offsets[got] = offset + (uint64_t)r * cur->cc;
+            cur->offset.QuadPart = (int64_t)(offset + (uint64_t)r * cur->cc);
+            got++;
+        }
+        cur->next.QuadPart += (int64_t)records * cur->cc;
+        if (records < want) break; // EOF
+    }
+    _aligned_free(big);
+    return (int32_t)got;
 }
 
 EMBEDDINGS_API BOOL EMBEDDINGS_CALL cursorupdate(Cursor* cur, uiid id, const void* blob, DWORD blobSize, BOOL bFlush) {
@@ -746,32 +8494,21 @@ EMBEDDINGS_API BOOL EMBEDDINGS_CALL cursorupdate(Cursor* cur, uiid id, const voi
             cur->blobSize);
         return FALSE;
     }
-    // _dbglog("Cursor_update();\n");
-    OVERLAPPED ov = { 0 };
-    if (!LockFileEx(cur->hReadWrite, LOCKFILE_EXCLUSIVE_LOCK, 0, MAXHEAD, 0, &ov)) {
-        fprintf(stderr, "LockFileEx failed: %lu\n", GetLastError());
-        return FALSE;
-    }
-    LARGE_INTEGER zero = { 0 }; LARGE_INTEGER current = { 0 };
-    // Remember the current file offset.
-    if (!SetFilePointerEx(cur->hReadWrite, zero, &current, FILE_CURRENT)) {
-        DWORD sys = GetLastError();
-        fprintf(stderr, "GetFilePointerEx failed. (system error %lu).\n", sys);
-        UnlockFileEx(cur->hReadWrite, 0, MAXHEAD, 0, &ov);
+    if (cur->offset.QuadPart < MAXHEAD) {
+        fprintf(stderr, "The cursor is not positioned on a record.\n");
         return FALSE;
     }
-	// Move to the record start. If doing this during the cursor read loop this is as if we are moving (-1) blob.
-    if (!SetFilePointerEx(cur->hReadWrite, cur->offset, NULL, FILE_BEGIN)) {
-        DWORD sys = GetLastError();
-        fprintf(stderr, "SetFilePointerEx to address %08lX:%08lX failed. (system error %lu).\n", cur->offset.HighPart, cur->offset.LowPart, sys);
-        UnlockFileEx(cur->hReadWrite, 0, MAXHEAD, 0, &ov);
+    // _dbglog("Cursor_update();\n");
+    if (!_iolock(cur->hReadWrite)) {
+        fprintf(stderr, "LockFileEx failed: %lu\n", (unsigned long)GetLastError());
         return FALSE;
     }
-    uiid idOnDisk; DWORD bytesRead = 0; BOOL ok = ReadFile(cur->hReadWrite, &idOnDisk, sizeof(uiid), &bytesRead, NULL);
+    // The record start of the last read. If doing this during the cursor read loop this is as if we are moving (-1) blob.
+    uiid idOnDisk; DWORD bytesRead = 0; BOOL ok = _ioread(cur->hReadWrite, &idOnDisk, sizeof(uiid), (uint64_t)cur->offset.QuadPart, &bytesRead);
     if (!ok || bytesRead != sizeof(uiid)) {
         DWORD sys = GetLastError();
-        fprintf(stderr, "ReadFile failed. (system error %lu).\n", sys);
-        UnlockFileEx(cur->hReadWrite, 0, MAXHEAD, 0, &ov);
+        fprintf(stderr, "ReadFile failed. (system error %lu).\n", (unsigned long)sys);
+        _iounlock(cur->hReadWrite);
         return FALSE;
 	}
 	// Make sure the blob id is the expected one. The first 16 bytes are id followed by blob data.
@@ -781,39 +8518,48 @@ EMBEDDINGS_API BOOL EMBEDDINGS_CALL cursorupdate(Cursor* cur, uiid id, const voi
         fprintf(stderr, "', found '");
         for (int i = 0; i < 16; ++i) fprintf(stderr, "%02X", idOnDisk.bytes[i]);
         fprintf(stderr, "'.\n");
-        UnlockFileEx(cur->hReadWrite, 0, MAXHEAD, 0, &ov);
+        _iounlock(cur->hReadWrite);
         return FALSE;
 	}
-	// Update just the blob part.
-    DWORD bytesWritten = 0; ok = WriteFile(cur->hReadWrite, blob, blobSize, &bytesWritten, NULL);
-    if (!ok || bytesWritten != blobSize) {
-        fprintf(stderr, "WriteFile failed. (system error %lu).\n", GetLastError());
-        UnlockFileEx(cur->hReadWrite, 0, MAXHEAD, 0, &ov);
+	// Update just the blob part (and its norm, which directly follows it).
+    const uint32_t dim = _vecdim(&cur->header);
+    DWORD cb = cur->header.blobSize + ((cur->header.flags & HEADER_NORMS) ? sizeof(float) : 0);
+    uint8_t* tmp = (uint8_t*)malloc(cb);
+    if (!tmp) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        _iounlock(cur->hReadWrite);
         return FALSE;
     }
-    // Restore to where we were before.
-    if (!SetFilePointerEx(cur->hReadWrite, current, NULL, FILE_BEGIN)) {
-        DWORD sys = GetLastError();
-        fprintf(stderr, "SetFilePointerEx failed. (system error %lu).\n", sys);
-        UnlockFileEx(cur->hReadWrite, 0, MAXHEAD, 0, &ov);
+    _vecencode(cur->header.dtype, tmp, (const float*)blob, dim);
+    if (cur->header.flags & HEADER_NORMS) {
+        float norm = _vecnrm2(cur->header.dtype, tmp, dim);
+        memcpy(tmp + cur->header.blobSize, &norm, sizeof(float));
+    }
+    DWORD bytesWritten = 0; ok = _iowrite(cur->hReadWrite, tmp, cb, (uint64_t)cur->offset.QuadPart + sizeof(uiid), &bytesWritten);
+    free(tmp);
+    if (!ok || bytesWritten != cb) {
+        fprintf(stderr, "WriteFile failed. (system error %lu).\n", (unsigned long)GetLastError());
+        _iounlock(cur->hReadWrite);
         return FALSE;
     }
-    if (bFlush && !FlushFileBuffers(cur->hReadWrite)) {
-        fprintf(stderr, "Failed to flush data to disk (system error %lu).\n", GetLastError());
-        UnlockFileEx(cur->hReadWrite, 0, MAXHEAD, 0, &ov);
+    if (bFlush && !_iosync(cur->hReadWrite)) {
+        fprintf(stderr, "Failed to flush data to disk (system error %lu).\n", (unsigned long)GetLastError());
+        _iounlock(cur->hReadWrite);
         return FALSE;
     }
     // _dbglog("Cursor_update(OK);\n");
-    UnlockFileEx(cur->hReadWrite, 0, MAXHEAD, 0, &ov);
+    _iounlock(cur->hReadWrite);
     return TRUE;
 }
 
+#if defined(_WIN32)
 BOOL APIENTRY DllMain(HMODULE hModule, DWORD  reason,LPVOID lpReserved)
 {
     switch (reason)
     {
     case DLL_PROCESS_ATTACH:
         _dbglog("DLL_PROCESS_ATTACH();\n");
+        _simdinit();
         break;
     case DLL_THREAD_ATTACH:
         _dbglog( "DLL_THREAD_ATTACH();\n");
@@ -827,15 +8573,27 @@ BOOL APIENTRY DllMain(HMODULE hModule, DWORD  reason,LPVOID lpReserved)
     }
     return TRUE;
 }
+#endif
 
 #if defined(PYTHON312)
 
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 
+/*
+    The methods run the native calls without the GIL (and the module runs without one where the
+    interpreter can), so a handle is used by many threads at once. close() waits for the calls in
+    progress on the handle (see PyEmbeddings_Enter) before it frees it. A cursor is used by one
+    thread at a time: a call on a cursor that is busy on another thread raises RuntimeError.
+*/
+
 typedef struct {
     PyObject_HEAD
     Embeddings* db;
+    Lock lock;
+    Cond idle;
+    uint32_t calls; /* method calls using db */
+    BOOL bClosing; /* close() waits for the calls to finish */
 } PyEmbeddingsObject;
 
 
@@ -843,12 +8601,22 @@ typedef struct {
     PyObject_HEAD
     Cursor* cur;
     PyObject* py_db_owner;
+    Lock lock;
+    BOOL bBusy; /* a method is using cur */
+    Py_ssize_t exports; /* memoryviews of the record buffer, see read(copy=False) */
 } PyCursorObject;
 
 
 /* Forward declarations */
 
 static PyObject* PyEmbeddings_Append(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds);
+static PyObject* PyEmbeddings_AppendBatch(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds);
+static PyObject* PyEmbeddings_GroupCommit(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds);
+static PyObject* PyEmbeddings_ReadAhead(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds);
+static PyObject* PyEmbeddings_Get(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds);
+static PyObject* PyEmbeddings_GetMany(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds);
+static PyObject* PyEmbeddings_Update(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds);
+static PyObject* PyEmbeddings_Delete(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds);
 static void PyEmbeddings_Dealloc(PyEmbeddingsObject* self);
 static int PyEmbeddings_Init(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds);
 static PyEmbeddingsObject* PyEmbeddings_New(PyTypeObject* type, PyObject* args, PyObject* kwds);
@@ -857,15 +8625,85 @@ static PyObject* PyEmbeddings_Close(PyObject* obj, PyObject* ignored);
 static PyObject* PyEmbeddings_Flush(PyEmbeddingsObject* obj, PyObject* ignored);
 static PyObject* PyEmbeddings_Cursor(PyEmbeddingsObject* self, PyObject* Py_UNUSED(args));
 static PyObject* PyEmbeddings_Search(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds);
+static PyObject* PyEmbeddings_SearchBatch(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds);
+static PyObject* PyEmbeddings_Map(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds);
+static PyObject* PyEmbeddings_Unmap(PyEmbeddingsObject* self, PyObject* Py_UNUSED(args));
+static PyObject* PyEmbeddings_IvfBuild(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds);
+static PyObject* PyEmbeddings_HnswBuild(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds);
+static PyObject* PyEmbeddings_PqBuild(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds);
+static PyObject* PyEmbeddings_SignBuild(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds);
+static PyObject* PyEmbeddings_Compact(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds);
+
+/* Counts a call that uses the handle, or raises if it is closed. */
+static BOOL PyEmbeddings_Enter(PyEmbeddingsObject* self)
+{
+    _lockenter(&self->lock);
+    BOOL bOpen = self->db && !self->bClosing;
+    if (bOpen) self->calls++;
+    _lockleave(&self->lock);
+    if (!bOpen) {
+        PyErr_SetString(PyExc_RuntimeError, "Database is closed.");
+    }
+    return bOpen;
+}
+
+static void PyEmbeddings_Leave(PyEmbeddingsObject* self)
+{
+    _lockenter(&self->lock);
+    if (--self->calls == 0) _condbroadcast(&self->idle);
+    _lockleave(&self->lock);
+}
+
+/* name##Call runs the method name between PyEmbeddings_Enter and PyEmbeddings_Leave. */
+#define PYEMBEDDINGS_CALL(name) \
+    static PyObject* name##Call(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds) \
+    { \
+        if (!PyEmbeddings_Enter(self)) return NULL; \
+        PyObject* result = name(self, args, kwds); \
+        PyEmbeddings_Leave(self); \
+        return result; \
+    }
+
+PYEMBEDDINGS_CALL(PyEmbeddings_Append)
+PYEMBEDDINGS_CALL(PyEmbeddings_AppendBatch)
+PYEMBEDDINGS_CALL(PyEmbeddings_GroupCommit)
+PYEMBEDDINGS_CALL(PyEmbeddings_ReadAhead)
+PYEMBEDDINGS_CALL(PyEmbeddings_Get)
+PYEMBEDDINGS_CALL(PyEmbeddings_GetMany)
+PYEMBEDDINGS_CALL(PyEmbeddings_Update)
+PYEMBEDDINGS_CALL(PyEmbeddings_Delete)
+PYEMBEDDINGS_CALL(PyEmbeddings_Search)
+PYEMBEDDINGS_CALL(PyEmbeddings_SearchBatch)
+PYEMBEDDINGS_CALL(PyEmbeddings_Map)
+PYEMBEDDINGS_CALL(PyEmbeddings_IvfBuild)
+PYEMBEDDINGS_CALL(PyEmbeddings_HnswBuild)
+PYEMBEDDINGS_CALL(PyEmbeddings_PqBuild)
+PYEMBEDDINGS_CALL(PyEmbeddings_SignBuild)
+PYEMBEDDINGS_CALL(PyEmbeddings_Compact)
 
 /* Method definitions */
 
 static PyMethodDef PyEmbeddingsMethods[] = {
     {"flush", (PyCFunction)PyEmbeddings_Flush, METH_NOARGS, "Flushes the buffers and causes all buffered data to be written to a file."},
     {"close", (PyCFunction)PyEmbeddings_Close, METH_NOARGS, "Close the embeddings database file and release resources."},
-    {"append", (PyCFunction)PyEmbeddings_Append, METH_VARARGS | METH_KEYWORDS, "Append a record to the embeddings database." },
+    {"append", (PyCFunction)PyEmbeddings_AppendCall, METH_VARARGS | METH_KEYWORDS, "Append a record to the embeddings database." },
+    {"appendbatch", (PyCFunction)PyEmbeddings_AppendBatchCall, METH_VARARGS | METH_KEYWORDS, "Append n ids and a (n, dim) batch of vectors with one write." },
+    {"groupcommit", (PyCFunction)PyEmbeddings_GroupCommitCall, METH_VARARGS | METH_KEYWORDS, "Turn group commit of durable appends on or off." },
+    {"readahead", (PyCFunction)PyEmbeddings_ReadAheadCall, METH_VARARGS | METH_KEYWORDS, "Set how many read buffers of how many records each scan thread keeps in flight." },
+    {"get", (PyCFunction)PyEmbeddings_GetCall, METH_VARARGS | METH_KEYWORDS, "Read the vector of an id, or None if there is no such id." },
+    {"getmany", (PyCFunction)PyEmbeddings_GetManyCall, METH_VARARGS | METH_KEYWORDS, "Read the vectors of many ids in file order; None for missing ids." },
+    {"update", (PyCFunction)PyEmbeddings_UpdateCall, METH_VARARGS | METH_KEYWORDS, "Overwrite the vector of an id in place. Returns False if there is no such id." },
+    {"delete", (PyCFunction)PyEmbeddings_DeleteCall, METH_VARARGS | METH_KEYWORDS, "Delete an id by appending a tombstone. Returns False if there is no such id." },
     {"cursor",(PyCFunction)PyEmbeddings_Cursor, METH_NOARGS, "Create a cursor for sequential scan."},
-    {"search", (PyCFunction)PyEmbeddings_Search, METH_VARARGS | METH_KEYWORDS, "Perform cosine similarity search."},
+    {"search", (PyCFunction)PyEmbeddings_SearchCall, METH_VARARGS | METH_KEYWORDS, "Perform cosine similarity search."},
+    {"searchbatch", (PyCFunction)PyEmbeddings_SearchBatchCall, METH_VARARGS | METH_KEYWORDS, "Perform cosine similarity search for a (n, dim) batch of queries in a single pass."},
+    {"map", (PyCFunction)PyEmbeddings_MapCall, METH_VARARGS | METH_KEYWORDS, "Memory-map the file so that searches score records in place."},
+    {"unmap", (PyCFunction)PyEmbeddings_Unmap, METH_NOARGS, "Drop the memory mapping and go back to buffered reads."},
+    {"ivfbuild", (PyCFunction)PyEmbeddings_IvfBuildCall, METH_VARARGS | METH_KEYWORDS, "Build an IVF index with nlist lists; search(..., nprobe=n) then scans the n nearest lists."},
+    {"hnswbuild", (PyCFunction)PyEmbeddings_HnswBuildCall, METH_VARARGS | METH_KEYWORDS, "Build an HNSW graph kept current by append; search(..., ef=n) then walks the graph."},
+    {"pqbuild", (PyCFunction)PyEmbeddings_PqBuildCall, METH_VARARGS | METH_KEYWORDS, "Build a product quantization index; search(..., pq=True) then scans the codes and reranks the best."},
+    {"signbuild", (PyCFunction)PyEmbeddings_SignBuildCall, METH_VARARGS | METH_KEYWORDS, "Build sign sketches kept current by append; search(..., sign=True) then ranks them by Hamming distance and reranks the best."},
+    {"compact", (PyCFunction)PyEmbeddings_CompactCall, METH_VARARGS | METH_KEYWORDS, "Rewrite the file with only the latest live record of every id while appends and searches go on. Returns True; raises on failure."},
     {NULL}  /* Sentinel */
 };
 
@@ -876,7 +8714,7 @@ static PyTypeObject PyEmbeddings = {
     .tp_name = "embeddings.Embeddings",
     .tp_basicsize = sizeof(PyEmbeddingsObject),
     .tp_flags = Py_TPFLAGS_DEFAULT,
-    .tp_new = PyEmbeddings_New,
+    .tp_new = (newfunc)PyEmbeddings_New,
     .tp_init = (initproc)PyEmbeddings_Init,
     .tp_dealloc = (destructor)PyEmbeddings_Dealloc,
     .tp_methods = PyEmbeddingsMethods,
@@ -902,6 +8740,15 @@ static struct PyModuleDef PyModule = {
 
 /* Implementation of methods */
 
+static PyCursorObject* PyCursor_New(PyTypeObject* type, PyObject* args, PyObject* kwds)
+{
+    PyCursorObject* self = (PyCursorObject*)type->tp_alloc(type, 0);
+    if (self) {
+        _lockinit(&self->lock);
+    }
+    return self;
+}
+
 static void PyCursor_Dealloc(PyCursorObject* self)
 {
     _dbglog("PyCursor_Dealloc();\n");
@@ -909,61 +8756,220 @@ static void PyCursor_Dealloc(PyCursorObject* self)
         cursorclose(self->cur);
         self->cur = NULL;
     }
-    Py_XDECREF(self->py_db_owner);
-    Py_TYPE(self)->tp_free((PyObject*)self);
+    Py_XDECREF(self->py_db_owner);
+    _lockfree(&self->lock);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/* Marks the cursor busy for a method, or raises if it is closed or busy on another thread. */
+static BOOL PyCursor_Enter(PyCursorObject* self)
+{
+    _lockenter(&self->lock);
+    BOOL bClosed = !self->cur, bBusy = self->bBusy;
+    if (!bClosed && !bBusy) self->bBusy = TRUE;
+    _lockleave(&self->lock);
+    if (bClosed || bBusy) {
+        PyErr_SetString(PyExc_RuntimeError, bClosed ? "Cursor is closed." : "Cursor is in use by another thread.");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void PyCursor_Leave(PyCursorObject* self)
+{
+    _lockenter(&self->lock);
+    self->bBusy = FALSE;
+    _lockleave(&self->lock);
+}
+
+static PyObject* PyCursor_Tuple(Cursor* cur)
+{
+    // _dbglog("PyCursor_tuple();\n");
+    PyObject* id = PyBytes_FromStringAndSize((const char*)cur->id, (Py_ssize_t)sizeof(uiid));
+    if (!id) {
+        return NULL;
+    }
+    PyObject* blob = PyBytes_FromStringAndSize((const char*)cur->blob, (Py_ssize_t)cur->blobSize);
+    if (!blob) {
+        Py_DECREF(id);
+        return NULL;
+    }
+    PyObject* tuple = PyTuple_New(2);
+    if (!tuple) {
+        Py_DECREF(id);
+        Py_DECREF(blob);
+        return NULL;
+    }
+    PyTuple_SET_ITEM(tuple, 0, id);
+    PyTuple_SET_ITEM(tuple, 1, blob);
+    return tuple;
+}
+
+/* The cursor exports its record buffer (raw record, then the float32 vector when it is decoded). */
+static void PyCursor_ReleaseBuffer(PyCursorObject* self, Py_buffer* Py_UNUSED(view))
+{
+    _lockenter(&self->lock);
+    self->exports--;
+    _lockleave(&self->lock);
+}
+
+static int PyCursor_GetBuffer(PyCursorObject* self, Py_buffer* view, int flags)
+{
+    // Counted first, so that close() on another thread cannot free the buffer meanwhile.
+    _lockenter(&self->lock);
+    Cursor* cur = self->cur;
+    if (cur) self->exports++;
+    _lockleave(&self->lock);
+    if (!cur) {
+        PyErr_SetString(PyExc_BufferError, "Cursor is closed.");
+        view->obj = NULL;
+        return -1;
+    }
+    Py_ssize_t cb = (Py_ssize_t)(cur->blob - (uint8_t*)cur->buffer) + (Py_ssize_t)cur->blobSize;
+    if (PyBuffer_FillInfo(view, (PyObject*)self, cur->buffer, cb, 1, flags) < 0) {
+        PyCursor_ReleaseBuffer(self, view);
+        return -1;
+    }
+    return 0;
+}
+
+static PyBufferProcs PyCursorBuffer = {
+    .bf_getbuffer = (getbufferproc)PyCursor_GetBuffer,
+    .bf_releasebuffer = (releasebufferproc)PyCursor_ReleaseBuffer,
+};
+
+/* (id, vector) as memoryviews of the cursor's record buffer: no copy, overwritten by the next read. */
+static PyObject* PyCursor_Views(PyCursorObject* self)
+{
+    Cursor* cur = self->cur;
+    PyObject* view = PyMemoryView_FromObject((PyObject*)self);
+    if (!view) {
+        return NULL;
+    }
+    Py_ssize_t blob = (Py_ssize_t)(cur->blob - (uint8_t*)cur->buffer);
+    PyObject* id = PySequence_GetSlice(view, 0, (Py_ssize_t)sizeof(uiid));
+    PyObject* bytes = id ? PySequence_GetSlice(view, blob, blob + (Py_ssize_t)cur->blobSize) : NULL;
+    Py_DECREF(view);
+    PyObject* vec = bytes ? PyObject_CallMethod(bytes, "cast", "s", "f") : NULL;
+    Py_XDECREF(bytes);
+    if (!vec) {
+        Py_XDECREF(id);
+        return NULL;
+    }
+    return Py_BuildValue("(NN)", id, vec);
 }
 
-static PyObject* PyCursor_Tuple(Cursor* cur)
+/* read(copy=True): (id, vector) as bytes, or with copy=False as memoryviews valid until the next read. */
+static PyObject* PyCursor_read(PyCursorObject* self, PyObject* args, PyObject* kwds)
 {
-    // _dbglog("PyCursor_tuple();\n");
-    PyObject* id = PyBytes_FromStringAndSize((const char*)cur->id, (Py_ssize_t)sizeof(uiid));
-    if (!id) {
+    // _dbglog("PyCursor_read();\n");
+    static char* kwlist[] = { "copy", NULL };
+    int copy = 1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|p:read", kwlist, &copy)) {
         return NULL;
     }
-    PyObject* blob = PyBytes_FromStringAndSize((const char*)cur->blob, (Py_ssize_t)cur->blobSize);
-    if (!blob) {
-        Py_DECREF(id);
+    if (!PyCursor_Enter(self)) {
         return NULL;
     }
-    PyObject* tuple = PyTuple_New(2);
-    if (!tuple) {
-        Py_DECREF(id);
-        Py_DECREF(blob);
+    DWORD err;
+    BOOL ok;
+    Py_BEGIN_ALLOW_THREADS
+    ok = cursorread(
+        self->cur, &err
+    );
+    Py_END_ALLOW_THREADS
+    PyObject* result = NULL;
+    if (ok) {
+        result = copy ? PyCursor_Tuple(self->cur) : PyCursor_Views(self);
+    }
+    else if (err == ERROR_HANDLE_EOF) {
+        result = Py_NewRef(Py_None);
+    }
+    else {
+        PyErr_Format(PyExc_OSError, "Read failed (WinError %lu)", (unsigned long)err);
+    }
+    PyCursor_Leave(self);
+    return result;
+}
+
+/* Shapes the first rows x cols items of a bytes object as a 2-D memoryview of format. Steals bytes. */
+static PyObject* PyCursor_Rows(PyObject* bytes, const char* format, Py_ssize_t itemsize, Py_ssize_t rows, Py_ssize_t cols)
+{
+    if (_PyBytes_Resize(&bytes, rows * cols * itemsize) < 0) {
         return NULL;
     }
-    PyTuple_SET_ITEM(tuple, 0, id);
-    PyTuple_SET_ITEM(tuple, 1, blob);
-    return tuple;
+    PyObject* view = PyMemoryView_FromObject(bytes);
+    Py_DECREF(bytes);
+    if (!view) {
+        return NULL;
+    }
+    PyObject* shaped = PyObject_CallMethod(view, "cast", "s(nn)", format, rows, cols);
+    Py_DECREF(view);
+    return shaped;
 }
 
-static PyObject* PyCursor_read(PyCursorObject* self, PyObject* Py_UNUSED(args))
+/* readbatch(n=1024): (ids, vectors) as (k, 16) uint8 and (k, dim) float32 memoryviews, k <= n, or None at EOF. */
+static PyObject* PyCursor_readbatch(PyCursorObject* self, PyObject* args, PyObject* kwds)
 {
-    // _dbglog("PyCursor_read();\n");
-    if (!self->cur) {
-        PyErr_SetString(PyExc_RuntimeError, "Cursor is closed.");
+    static char* kwlist[] = { "n", NULL };
+    unsigned int n = 1024;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|I:readbatch", kwlist, &n)) {
         return NULL;
     }
-    DWORD err;
-    BOOL ok = cursorread(
-        self->cur, &err
-    );
-    if (!ok) {
-        if (err == ERROR_HANDLE_EOF) {
+    if (n == 0 || n > INT32_MAX) {
+        PyErr_SetString(PyExc_ValueError, "'n' must be between 1 and 2**31 - 1");
+        return NULL;
+    }
+    if (!PyCursor_Enter(self)) {
+        return NULL;
+    }
+    const Py_ssize_t dim = (Py_ssize_t)_vecdim(&self->cur->header);
+    // The records are read straight into the bytes objects the views are made of.
+    PyObject* ids = PyBytes_FromStringAndSize(NULL, (Py_ssize_t)n * (Py_ssize_t)sizeof(uiid));
+    PyObject* blobs = ids ? PyBytes_FromStringAndSize(NULL, (Py_ssize_t)n * dim * (Py_ssize_t)sizeof(float)) : NULL;
+    if (!ids || !blobs) {
+        Py_XDECREF(ids);
+        PyCursor_Leave(self);
+        return NULL;
+    }
+    int32_t count;
+    Py_BEGIN_ALLOW_THREADS
+    count = cursorreadbatch(self->cur, n, (uiid*)PyBytes_AS_STRING(ids), (float*)PyBytes_AS_STRING(blobs), NULL);
+    Py_END_ALLOW_THREADS
+    PyCursor_Leave(self);
+    if (count <= 0) {
+        Py_DECREF(ids);
+        Py_DECREF(blobs);
+        if (count == 0) {
             Py_RETURN_NONE;
         }
-        PyErr_Format(PyExc_OSError, "Read failed (WinError %lu)", (unsigned long)err);
+        PyErr_SetString(PyExc_OSError, "cursorreadbatch() failed");
+        return NULL;
+    }
+    PyObject* idview = PyCursor_Rows(ids, "B", 1, count, (Py_ssize_t)sizeof(uiid));
+    if (!idview) {
+        Py_DECREF(blobs);
         return NULL;
     }
-    return PyCursor_Tuple(self->cur);
+    PyObject* blobview = PyCursor_Rows(blobs, "f", (Py_ssize_t)sizeof(float), count, dim);
+    if (!blobview) {
+        Py_DECREF(idview);
+        return NULL;
+    }
+    return Py_BuildValue("(NN)", idview, blobview);
 }
 
 static PyObject* PyCursorReset(PyCursorObject* self, PyObject* Py_UNUSED(args))
 {
-    if (!self->cur) {
-        PyErr_SetString(PyExc_RuntimeError, "Cursor is closed.");
+    if (!PyCursor_Enter(self)) {
         return NULL;
     }
-    if (!cursorreset(self->cur)) {
+    BOOL bOk;
+    Py_BEGIN_ALLOW_THREADS
+    bOk = cursorreset(self->cur);
+    Py_END_ALLOW_THREADS
+    PyCursor_Leave(self);
+    if (!bOk) {
         PyErr_SetString(PyExc_OSError, "Failed to reset cursor to beginning.");
         return NULL;
     }
@@ -972,9 +8978,21 @@ static PyObject* PyCursorReset(PyCursorObject* self, PyObject* Py_UNUSED(args))
 
 static PyObject* PyCursorClose(PyCursorObject* self, PyObject* Py_UNUSED(args))
 {
-    if (self->cur) {
-        cursorclose(self->cur);
-        self->cur = NULL;
+    _lockenter(&self->lock);
+    BOOL bExported = self->exports > 0, bBusy = self->bBusy;
+    Cursor* cur = bExported || bBusy ? NULL : self->cur;
+    self->cur = bExported || bBusy ? self->cur : NULL;
+    _lockleave(&self->lock);
+    if (bExported) {
+        PyErr_SetString(PyExc_BufferError, "Cursor is still referenced by memoryviews of its records.");
+        return NULL;
+    }
+    if (bBusy) {
+        PyErr_SetString(PyExc_RuntimeError, "Cursor is in use by another thread.");
+        return NULL;
+    }
+    if (cur) {
+        cursorclose(cur);
     }
     Py_RETURN_NONE;
 }
@@ -1023,7 +9041,15 @@ static PyObject* PyCursorUpdate(PyCursorObject* self, PyObject* args, PyObject*
         }
     }
     /* Update the record */
-    if (!cursorupdate(self->cur, u, blob.buf, (DWORD)blob.len, bFlush)) {
+    if (!PyCursor_Enter(self)) {
+        goto error;
+    }
+    BOOL bOk;
+    Py_BEGIN_ALLOW_THREADS
+    bOk = cursorupdate(self->cur, u, blob.buf, (DWORD)blob.len, bFlush);
+    Py_END_ALLOW_THREADS
+    PyCursor_Leave(self);
+    if (!bOk) {
         PyErr_SetString(PyExc_OSError, "Cursor_update failed");
         goto error;
     }
@@ -1035,8 +9061,10 @@ error:
 }
 
 static PyMethodDef PyCursorMethods[] = {
-    {"read",  (PyCFunction)PyCursor_read,  METH_NOARGS,
-     "Read the next record. Returns the record or None if EOF."},
+    {"read",  (PyCFunction)PyCursor_read,  METH_VARARGS | METH_KEYWORDS,
+     "Read the next record. Returns the record or None if EOF; copy=False returns views of the cursor's buffer."},
+    {"readbatch",  (PyCFunction)PyCursor_readbatch,  METH_VARARGS | METH_KEYWORDS,
+     "Read up to n records. Returns (ids, vectors) as (k, 16) and (k, dim) memoryviews or None if EOF."},
     {"update",  (PyCFunction)PyCursorUpdate,  METH_VARARGS | METH_KEYWORDS,
      "Update the current record."},
     {"reset", (PyCFunction)PyCursorReset, METH_NOARGS,
@@ -1055,6 +9083,7 @@ static PyTypeObject PyCursorType = {
     .tp_doc = "Embeddings DB cursor",
     .tp_dealloc = (destructor)PyCursor_Dealloc,
     .tp_methods = PyCursorMethods,
+    .tp_as_buffer = &PyCursorBuffer,
 };
 
 static PyEmbeddingsObject* PyEmbeddings_New(PyTypeObject* type, PyObject* args, PyObject* kwds)
@@ -1064,17 +9093,19 @@ static PyEmbeddingsObject* PyEmbeddings_New(PyTypeObject* type, PyObject* args,
     self = (PyEmbeddingsObject*)type->tp_alloc(type, 0);
     if (self) {
         self->db = NULL;
+        _lockinit(&self->lock);
+        _condinit(&self->idle);
     }
     return self;
 }
 
 static PyObject* PyEmbeddings_Cursor(PyEmbeddingsObject* self, PyObject* Py_UNUSED(args)) {
     _dbglog("PyEmbeddings_Cursor();\n");
-    if (!self->db->hWrite || self->db->hWrite == INVALID_HANDLE_VALUE) {
-        PyErr_SetString(PyExc_RuntimeError, "Database is closed.");
+    if (!PyEmbeddings_Enter(self)) {
         return NULL;
     }
-    Cursor* cur = cursoropen(self->db, FALSE);
+    Cursor* cur = self->db->hWrite && self->db->hWrite != INVALID_HANDLE_VALUE ? cursoropen(self->db, FALSE) : NULL;
+    PyEmbeddings_Leave(self);
     if (!cur) {
         PyErr_SetString(PyExc_OSError, "Failed to create cursor.");
         return NULL;
@@ -1097,8 +9128,20 @@ static PyObject* PyEmbeddings_Close(PyObject* obj, PyObject* ignored)
     _dbglog("PyEmbeddings_close()\n");
     if (obj) {
         PyEmbeddingsObject* self = (PyEmbeddingsObject*)obj;
-        fileclose(self->db);
+        Embeddings* db;
+        // New calls fail from here on; the ones in progress on other threads finish first.
+        Py_BEGIN_ALLOW_THREADS
+        _lockenter(&self->lock);
+        self->bClosing = TRUE;
+        while (self->calls > 0) {
+            _condwait(&self->idle, &self->lock, UINT32_MAX);
+        }
+        db = self->db;
         self->db = NULL;
+        self->bClosing = FALSE;
+        _lockleave(&self->lock);
+        fileclose(db);
+        Py_END_ALLOW_THREADS
     }
     Py_RETURN_NONE;
 }
@@ -1106,11 +9149,68 @@ static PyObject* PyEmbeddings_Close(PyObject* obj, PyObject* ignored)
 static PyObject* PyEmbeddings_Flush(PyEmbeddingsObject* obj, PyObject* ignored)
 {
     _dbglog("PyEmbeddings_flush()\n");
-    if (!obj->db->hWrite || obj->db->hWrite == INVALID_HANDLE_VALUE) {
-        PyErr_SetString(PyExc_RuntimeError, "Database is closed.");
+    if (!PyEmbeddings_Enter(obj)) {
+        return NULL;
+    }
+    BOOL bOk;
+    Py_BEGIN_ALLOW_THREADS
+    bOk = fileflush(obj->db);
+    Py_END_ALLOW_THREADS
+    PyEmbeddings_Leave(obj);
+    if (!bOk) {
+        PyErr_SetString(PyExc_OSError, "EmbeddingsFlush failed");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+/* readahead(depth=0, records=0): see filesetreadahead, 0 keeps the default. */
+static PyObject* PyEmbeddings_ReadAhead(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds)
+{
+    _dbglog("PyEmbeddings_readahead();\n");
+    static char* kwlist[] = { "depth", "records", NULL };
+    unsigned int depth = 0, records = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|II:readahead", kwlist, &depth, &records)) {
+        return NULL;
+    }
+    if (!self->db->hWrite || self->db->hWrite == INVALID_HANDLE_VALUE) {
+        PyErr_SetString(PyExc_RuntimeError, "Database is closed or invalid.");
+        return NULL;
+    }
+    BOOL bOk;
+    // Waits for the searches in progress.
+    Py_BEGIN_ALLOW_THREADS
+    bOk = filesetreadahead(self->db, depth, records);
+    Py_END_ALLOW_THREADS
+    if (!bOk) {
+        PyErr_SetString(PyExc_ValueError, "filesetreadahead() failed");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+/* groupcommit(enable=True, max_delay=0, max_batch=0): see filesetgroupcommit, max_delay in microseconds. */
+static PyObject* PyEmbeddings_GroupCommit(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds)
+{
+    _dbglog("PyEmbeddings_groupcommit();\n");
+    static char* kwlist[] = { "enable", "max_delay", "max_batch", NULL };
+    int enable = 1;
+    unsigned int maxDelay = 0, maxBatch = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|pII:groupcommit", kwlist, &enable, &maxDelay, &maxBatch)) {
+        return NULL;
+    }
+    if (!self->db->hWrite || self->db->hWrite == INVALID_HANDLE_VALUE) {
+        PyErr_SetString(PyExc_RuntimeError, "Database is closed or invalid.");
+        return NULL;
+    }
+    BOOL bOk;
+    Py_BEGIN_ALLOW_THREADS
+    bOk = filesetgroupcommit(self->db, enable ? TRUE : FALSE, maxDelay, maxBatch);
+    Py_END_ALLOW_THREADS
+    if (!bOk) {
+        PyErr_SetString(PyExc_OSError, "filesetgroupcommit() failed");
         return NULL;
     }
-    fileflush(obj->db);
     Py_RETURN_NONE;
 }
 
@@ -1163,16 +9263,55 @@ static int PyEmbeddings_Init(PyEmbeddingsObject* self, PyObject* args, PyObject*
     PyObject* modeobj = Py_None;
 
     unsigned int dim = 0;
+    const char* dtypename = NULL;
+    int rescore = 1;
+    const char* metricname = NULL;
+    int direct = 0;
 
-    static char* kwlist[] = { "path", "dim", "mode", NULL };
+    static char* kwlist[] = { "path", "dim", "mode", "dtype", "rescore", "metric", "direct", NULL };
 
-    /* Allow all arguments to be optional, order: path, dim, mode */
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OIO", kwlist,
+    /* Allow all arguments to be optional, order: path, dim, mode, dtype, rescore, metric, direct */
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OIOzpzp", kwlist,
         &pathobj,
         &dim,
-        &modeobj))
+        &modeobj,
+        &dtypename,
+        &rescore,
+        &metricname,
+        &direct))
         return -1;
 
+    uint8_t dtype = DTYPE_FLOAT32;
+    if (dtypename && strcmp(dtypename, "float32") != 0) {
+        if (strcmp(dtypename, "float16") == 0) {
+            dtype = DTYPE_FLOAT16;
+        }
+        else if (strcmp(dtypename, "int8") == 0) {
+            dtype = DTYPE_INT8;
+        }
+        else {
+            PyErr_SetString(PyExc_ValueError, "'dtype' must be one of 'float32', 'float16' or 'int8'");
+            return -1;
+        }
+    }
+
+    uint8_t metric = METRIC_COSINE;
+    if (metricname && strcmp(metricname, "cosine") != 0) {
+        if (strcmp(metricname, "ip") == 0) {
+            metric = METRIC_IP;
+        }
+        else if (strcmp(metricname, "l2") == 0) {
+            metric = METRIC_L2;
+        }
+        else if (strcmp(metricname, "l1") == 0) {
+            metric = METRIC_L1;
+        }
+        else {
+            PyErr_SetString(PyExc_ValueError, "'metric' must be one of 'cosine', 'ip', 'l2' or 'l1'");
+            return -1;
+        }
+    }
+
     const wchar_t* pwszpath = NULL;
     const wchar_t* pwszmode = NULL;
 
@@ -1197,108 +9336,445 @@ static int PyEmbeddings_Init(PyEmbeddingsObject* self, PyObject* args, PyObject*
         if (!pwszmode)
             goto error;
     }
-
-    DWORD disposition = 0, access = 0;
-    if (!GetFileCreationFlags(pwszmode, &disposition, &access)) {
-        PyErr_SetString(PyExc_ValueError, "'mode' must be one of 'r', 'a', or 'a+'");
-        goto error;
+
+    DWORD disposition = 0, access = 0;
+    if (!GetFileCreationFlags(pwszmode, &disposition, &access)) {
+        PyErr_SetString(PyExc_ValueError, "'mode' must be one of 'r', 'a', or 'a+'");
+        goto error;
+    }
+
+    _dbglog("path='%ls' dim=%u mode=%ls\n",
+        pwszpath ? pwszpath : L"(null)",
+        dim,
+        pwszmode ? pwszmode : L"(null)");
+
+    if (!(self->db = fileopenex(pwszpath, access, disposition, dim * sizeof(float), dtype, metric))) {
+        PyErr_SetString(PyExc_OSError, "Embeddings_open() failed");
+        goto error;
+    }
+    filesetrescore(self->db, rescore);
+    if (direct && !filesetdirect(self->db, TRUE)) {
+        PyErr_SetString(PyExc_OSError, "Direct I/O is not available for this file");
+        fileclose(self->db);
+        self->db = NULL;
+        goto error;
+    }
+
+    if (pwszpath) PyMem_Free((void*)pwszpath);
+    if (pwszmode) PyMem_Free((void*)pwszmode);
+    return 0;
+
+error:
+    if (pwszpath) PyMem_Free((void*)pwszpath);
+    if (pwszmode) PyMem_Free((void*)pwszmode);
+    return -1;
+}
+
+
+static void PyEmbeddings_Dealloc(PyEmbeddingsObject* self)
+{
+    _dbglog("PyEmbeddings_Dealloc();\n");
+    fileclose(self->db);
+    self->db = NULL;
+    _condfree(&self->idle);
+    _lockfree(&self->lock);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/* id as 16 bytes or uuid.UUID. Sets the Python error and returns FALSE otherwise. */
+static BOOL PyEmbeddings_Uiid(PyObject* id, uiid* u)
+{
+    memset(u, 0, sizeof(*u));
+    /* Case 1: id is bytes */
+    if (PyBytes_Check(id)) {
+        Py_ssize_t len = PyBytes_Size(id);
+        if (len != sizeof(u->bytes)) {
+            PyErr_SetString(PyExc_ValueError, "'id' must be exactly 16 bytes");
+            return FALSE;
+        }
+        memcpy(u->bytes, PyBytes_AsString(id), sizeof(u->bytes));
+        return TRUE;
+    }
+    /* Case 2: id is uuid.UUID */
+    PyObject* typename = PyObject_GetAttrString((PyObject*)Py_TYPE(id), "__name__");
+    if (!typename) return FALSE;
+    int ok = PyUnicode_Check(typename) &&
+        PyUnicode_CompareWithASCIIString(typename, "UUID") == 0;
+    Py_DECREF(typename);
+    if (!ok) {
+        PyErr_SetString(PyExc_TypeError, "'id' must be bytes or uuid.UUID");
+        return FALSE;
+    }
+    PyObject* b = PyObject_GetAttrString(id, "bytes");
+    if (!b) return FALSE;
+    if (!PyBytes_Check(b) || PyBytes_Size(b) != sizeof(u->bytes)) {
+        PyErr_SetString(PyExc_ValueError, "'UUID.bytes' must be exactly 16 bytes");
+        Py_DECREF(b);
+        return FALSE;
+    }
+    memcpy(u->bytes, PyBytes_AsString(b), sizeof(u->bytes));
+    Py_DECREF(b);
+    return TRUE;
+}
+
+/*
+    A list of ids: a buffer of n x 16 bytes (borrowed through idbuf) or a sequence of n bytes / uuid.UUID
+    (copied to *owned, which the caller frees). Returns NULL with an exception set on error.
+*/
+static const uiid* PyEmbeddings_Uiids(PyObject* ids, Py_buffer* idbuf, uiid** owned, uint32_t* count)
+{
+    *owned = NULL;
+    if (PyObject_CheckBuffer(ids)) {
+        if (PyObject_GetBuffer(ids, idbuf, PyBUF_SIMPLE) < 0) return NULL;
+        if ((idbuf->len % (Py_ssize_t)sizeof(uiid)) != 0 || idbuf->len / (Py_ssize_t)sizeof(uiid) > INT32_MAX) {
+            PyErr_SetString(PyExc_ValueError, "'ids' must hold a whole number of 16 byte ids.");
+            return NULL;
+        }
+        *count = (uint32_t)(idbuf->len / (Py_ssize_t)sizeof(uiid));
+        return (const uiid*)idbuf->buf;
+    }
+    PyObject* seq = PySequence_Fast(ids, "'ids' must be a bytes-like object or a sequence of ids");
+    if (!seq) return NULL;
+    Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+    if (n > INT32_MAX) {
+        PyErr_SetString(PyExc_ValueError, "Too many ids.");
+        Py_DECREF(seq);
+        return NULL;
+    }
+    uiid* us = (uiid*)malloc((n ? (size_t)n : 1) * sizeof(uiid));
+    if (!us) {
+        Py_DECREF(seq);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    for (Py_ssize_t i = 0; i < n; ++i) {
+        if (!PyEmbeddings_Uiid(PySequence_Fast_GET_ITEM(seq, i), &us[i])) {
+            Py_DECREF(seq);
+            free(us);
+            return NULL;
+        }
+    }
+    Py_DECREF(seq);
+    *owned = us;
+    *count = (uint32_t)n;
+    return us;
+}
+
+/* TRUE for a struct format of one float32 (NULL is unsigned bytes, e.g. bytes itself). */
+static BOOL PyEmbeddings_IsFloat32(const char* format)
+{
+    if (!format) return FALSE;
+    if (*format == '@' || *format == '=' || *format == '<') format++;
+    return strcmp(format, "f") == 0;
+}
+
+static PyObject* PyEmbeddings_AppendRows(PyEmbeddingsObject* self, PyObject* ids, const Py_buffer* blobs, int flush);
+
+/*
+    append(id, blob, flush=False). A 2-D C-contiguous float32 buffer of shape (n, dim), e.g. a numpy
+    array, appends its n rows with the n ids in id like appendbatch, straight from the array's memory.
+*/
+static PyObject* PyEmbeddings_Append(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds)
+{
+    // _dbglog("PyEmbeddings_append()\n");
+    PyObject* id = NULL;
+    PyObject* blobobj = NULL;
+    Py_buffer blob = { 0 };
+    int flush = 0;
+    static char* kwlist[] = { "id", "blob", "flush", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|p", kwlist, &id, &blobobj, &flush))
+        return NULL;
+    if (PyObject_GetBuffer(blobobj, &blob, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0)
+        return NULL;
+    if (blob.ndim == 2) {
+        if (!PyEmbeddings_IsFloat32(blob.format)) {
+            PyErr_Format(PyExc_TypeError, "A 2-D 'blob' must hold float32 rows (format 'f', not '%s').", blob.format ? blob.format : "B");
+            goto error;
+        }
+        PyObject* result = PyEmbeddings_AppendRows(self, id, &blob, flush);
+        PyBuffer_Release(&blob);
+        return result;
+    }
+    uiid u;
+    if (!PyEmbeddings_Uiid(id, &u)) {
+        goto error;
+    }
+    /* Append to database; other threads run while it writes (and waits for the disk with flush). */
+    BOOL bOk;
+    Py_BEGIN_ALLOW_THREADS
+    bOk = fileappend(self->db, u, blob.buf, (DWORD)blob.len, flush ? TRUE : FALSE);
+    Py_END_ALLOW_THREADS
+    if (!bOk) {
+        PyErr_SetString(PyExc_OSError, "EmbeddingsAppend failed");
+        goto error;
+    }
+    PyBuffer_Release(&blob);
+    Py_RETURN_NONE;
+error:
+    PyBuffer_Release(&blob);
+    return NULL;
+}
+
+/*
+    appendbatch(ids, blobs, flush=False): blobs holds n rows of dim floats (e.g. a C-contiguous float32
+    array of shape (n, dim)); ids is either a buffer of n x 16 bytes or a sequence of n bytes / uuid.UUID.
+*/
+static PyObject* PyEmbeddings_AppendBatch(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds)
+{
+    _dbglog("PyEmbeddings_appendbatch();\n");
+    static char* kwlist[] = { "ids", "blobs", "flush", NULL };
+    PyObject* ids = NULL;
+    Py_buffer blobs = { 0 };
+    int flush = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Oy*|p:appendbatch", kwlist, &ids, &blobs, &flush)) {
+        return NULL;
+    }
+    PyObject* result = PyEmbeddings_AppendRows(self, ids, &blobs, flush);
+    PyBuffer_Release(&blobs);
+    return result;
+}
+
+/* The rows of blobs with the ids, see appendbatch. The caller releases blobs. */
+static PyObject* PyEmbeddings_AppendRows(PyEmbeddingsObject* self, PyObject* ids, const Py_buffer* blobs, int flush)
+{
+    Py_buffer idbuf = { 0 };
+    uiid* us = NULL;
+    if (!self->db->hWrite || self->db->hWrite == INVALID_HANDLE_VALUE) {
+        PyErr_SetString(PyExc_RuntimeError, "Database is closed or invalid.");
+        goto error;
+    }
+    Py_ssize_t row = (Py_ssize_t)(_vecdim(&self->db->header) * sizeof(float));
+    if (row == 0 || (blobs->len % row) != 0 || blobs->len / row > UINT32_MAX) {
+        PyErr_Format(PyExc_ValueError,
+            "Blobs buffer size (%zd) is not a multiple of the database blob size (%zd bytes).", blobs->len, row);
+        goto error;
+    }
+    uint32_t n = (uint32_t)(blobs->len / row);
+    uint32_t count = 0;
+    const uiid* pids = PyEmbeddings_Uiids(ids, &idbuf, &us, &count);
+    if (!pids) goto error;
+    if (count != n) {
+        PyErr_Format(PyExc_ValueError, "'ids' has %u ids but 'blobs' has %u rows.", count, n);
+        goto error;
+    }
+    BOOL bOk;
+    Py_BEGIN_ALLOW_THREADS
+    bOk = fileappendbatch(self->db, pids, (const float*)blobs->buf, n, flush ? TRUE : FALSE);
+    Py_END_ALLOW_THREADS
+    if (!bOk) {
+        PyErr_SetString(PyExc_OSError, "EmbeddingsAppendBatch failed");
+        goto error;
+    }
+    free(us);
+    if (idbuf.obj) PyBuffer_Release(&idbuf);
+    Py_RETURN_NONE;
+error:
+    free(us);
+    if (idbuf.obj) PyBuffer_Release(&idbuf);
+    return NULL;
+}
+
+/* get(id): the float32 vector of id as bytes, or None. */
+static PyObject* PyEmbeddings_Get(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds)
+{
+    static char* kwlist[] = { "id", NULL };
+    PyObject* id = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O:get", kwlist, &id)) {
+        return NULL;
+    }
+    if (!self->db || !self->db->hWrite || self->db->hWrite == INVALID_HANDLE_VALUE) {
+        PyErr_SetString(PyExc_RuntimeError, "Database is closed or invalid.");
+        return NULL;
+    }
+    uiid u;
+    if (!PyEmbeddings_Uiid(id, &u)) {
+        return NULL;
+    }
+    DWORD cb = _vecdim(&self->db->header) * sizeof(float);
+    PyObject* blob = PyBytes_FromStringAndSize(NULL, (Py_ssize_t)cb);
+    if (!blob) {
+        return NULL;
+    }
+    int32_t found;
+    char* out = PyBytes_AS_STRING(blob);
+    Py_BEGIN_ALLOW_THREADS
+    found = fileget(self->db, u, out, cb);
+    Py_END_ALLOW_THREADS
+    if (found < 0) {
+        Py_DECREF(blob);
+        PyErr_SetString(PyExc_OSError, "fileget() failed");
+        return NULL;
+    }
+    if (found == 0) {
+        Py_DECREF(blob);
+        Py_RETURN_NONE;
+    }
+    return blob;
+}
+
+/* getmany(ids): a list with the vector of each id as bytes, or None; ids as in appendbatch. */
+static PyObject* PyEmbeddings_GetMany(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds)
+{
+    static char* kwlist[] = { "ids", NULL };
+    PyObject* ids = NULL;
+    Py_buffer idbuf = { 0 };
+    uiid* us = NULL;
+    float* blobs = NULL;
+    uint8_t* found = NULL;
+    PyObject* list = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O:getmany", kwlist, &ids)) {
+        return NULL;
+    }
+    if (!self->db || !self->db->hWrite || self->db->hWrite == INVALID_HANDLE_VALUE) {
+        PyErr_SetString(PyExc_RuntimeError, "Database is closed or invalid.");
+        return NULL;
+    }
+    uint32_t n = 0;
+    const uiid* pids = PyEmbeddings_Uiids(ids, &idbuf, &us, &n);
+    if (!pids) goto done;
+    const uint32_t dim = _vecdim(&self->db->header);
+    blobs = (float*)malloc((n ? (size_t)n : 1) * dim * sizeof(float));
+    found = (uint8_t*)malloc(n ? n : 1);
+    if (!blobs || !found) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    int32_t result;
+    Py_BEGIN_ALLOW_THREADS
+    result = filegetmany(self->db, pids, n, blobs, found);
+    Py_END_ALLOW_THREADS
+    if (result < 0) {
+        PyErr_SetString(PyExc_OSError, "filegetmany() failed");
+        goto done;
     }
-
-    _dbglog("path='%ls' dim=%u mode=%ls\n",
-        pwszpath ? pwszpath : L"(null)",
-        dim,
-        pwszmode ? pwszmode : L"(null)");
-
-    if (!(self->db = fileopen(pwszpath, access, disposition, dim * sizeof(float)))) {
-        PyErr_SetString(PyExc_OSError, "Embeddings_open() failed");
-        goto error;
+    list = PyList_New((Py_ssize_t)n);
+    if (!list) goto done;
+    for (uint32_t i = 0; i < n; ++i) {
+        PyObject* item;
+        if (found[i]) {
+            item = PyBytes_FromStringAndSize((const char*)(blobs + (size_t)i * dim), (Py_ssize_t)dim * sizeof(float));
+            if (!item) {
+                Py_CLEAR(list);
+                goto done;
+            }
+        }
+        else {
+            item = Py_None;
+            Py_INCREF(item);
+        }
+        PyList_SET_ITEM(list, (Py_ssize_t)i, item);
     }
-
-    if (pwszpath) PyMem_Free((void*)pwszpath);
-    if (pwszmode) PyMem_Free((void*)pwszmode);
-    return 0;
-
-error:
-    if (pwszpath) PyMem_Free((void*)pwszpath);
-    if (pwszmode) PyMem_Free((void*)pwszmode);
-    return -1;
+done:
+    free(us);
+    free(blobs);
+    free(found);
+    if (idbuf.obj) PyBuffer_Release(&idbuf);
+    return list;
 }
 
-
-static void PyEmbeddings_Dealloc(PyEmbeddingsObject* self)
+/* update(id, blob, flush=False): overwrites the vector of id in place. Returns False if there is no such id. */
+static PyObject* PyEmbeddings_Update(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds)
 {
-    _dbglog("PyEmbeddings_Dealloc();\n");
-    fileclose(self->db);
-    self->db = NULL;
-    Py_TYPE(self)->tp_free((PyObject*)self);
+    static char* kwlist[] = { "id", "blob", "flush", NULL };
+    PyObject* id = NULL;
+    Py_buffer blob = { 0 };
+    int flush = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Oy*|p:update", kwlist, &id, &blob, &flush)) {
+        return NULL;
+    }
+    if (!self->db || !self->db->hWrite || self->db->hWrite == INVALID_HANDLE_VALUE) {
+        PyErr_SetString(PyExc_RuntimeError, "Database is closed or invalid.");
+        PyBuffer_Release(&blob);
+        return NULL;
+    }
+    uiid u;
+    if (!PyEmbeddings_Uiid(id, &u)) {
+        PyBuffer_Release(&blob);
+        return NULL;
+    }
+    int32_t result;
+    Py_BEGIN_ALLOW_THREADS
+    result = fileupdate(self->db, u, blob.buf, (DWORD)blob.len, flush ? TRUE : FALSE);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&blob);
+    if (result < 0) {
+        PyErr_SetString(PyExc_OSError, "fileupdate() failed");
+        return NULL;
+    }
+    return PyBool_FromLong(result > 0);
 }
 
-static PyObject* PyEmbeddings_Append(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds)
+static PyObject* PyEmbeddings_Delete(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds)
 {
-    // _dbglog("PyEmbeddings_append()\n");
+    static char* kwlist[] = { "id", "flush", NULL };
     PyObject* id = NULL;
-    Py_buffer blob = { 0 };
-    static char* kwlist[] = { "id", "blob", NULL };
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Oy*", kwlist, &id, &blob))
+    int flush = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|p:delete", kwlist, &id, &flush)) {
+        return NULL;
+    }
+    if (!self->db || !self->db->hWrite || self->db->hWrite == INVALID_HANDLE_VALUE) {
+        PyErr_SetString(PyExc_RuntimeError, "Database is closed or invalid.");
         return NULL;
+    }
     uiid u;
-    memset(&u, 0, sizeof(u));
-    /* Case 1: id is bytes */
-    if (PyBytes_Check(id)) {
-        Py_ssize_t len = PyBytes_Size(id);
-        if (len != sizeof(u.bytes)) {
-            PyErr_SetString(PyExc_ValueError, "'id' must be exactly 16 bytes");
-            goto error;
-        }
-        memcpy(u.bytes, PyBytes_AsString(id), sizeof(u.bytes));
+    if (!PyEmbeddings_Uiid(id, &u)) {
+        return NULL;
     }
-    /* Case 2: id is uuid.UUID */
-    else {
-        PyObject* typename = PyObject_GetAttrString((PyObject*)Py_TYPE(id), "__name__");
-        if (!typename) goto error;
-        int ok = PyUnicode_Check(typename) &&
-            PyUnicode_CompareWithASCIIString(typename, "UUID") == 0;
-        Py_DECREF(typename);
-        if (ok) {
-            PyObject* b = PyObject_GetAttrString(id, "bytes");
-            if (!b) goto error;
-            if (!PyBytes_Check(b) || PyBytes_Size(b) != sizeof(u.bytes)) {
-                PyErr_SetString(PyExc_ValueError, "'UUID.bytes' must be exactly 16 bytes");
-                Py_DECREF(b);
-                goto error;
-            }
-            memcpy(u.bytes, PyBytes_AsString(b), sizeof(u.bytes));
-            Py_DECREF(b);
-        }
-        else {
-            PyErr_SetString(PyExc_TypeError, "'id' must be bytes or uuid.UUID");
-            goto error;
-        }
+    int32_t result;
+    Py_BEGIN_ALLOW_THREADS
+    result = filedelete(self->db, u, flush ? TRUE : FALSE);
+    Py_END_ALLOW_THREADS
+    if (result < 0) {
+        PyErr_SetString(PyExc_OSError, "filedelete() failed");
+        return NULL;
     }
-    /* Append to database */
-    BOOL bFlush = FALSE;
-    if (!fileappend(self->db, u, blob.buf, (DWORD)blob.len, bFlush)) {
-        PyErr_SetString(PyExc_OSError, "EmbeddingsAppend failed");
-        goto error;
+    return PyBool_FromLong(result > 0);
+}
+
+/*
+    The out= buffer of search and searchbatch: writable, C-contiguous and room for count Score records
+    (16 byte id, float32 score, packed), e.g. a numpy array of dtype [("id", "S16"), ("score", "<f4")].
+    The search writes the hits straight into it. Returns NULL with an exception set on error.
+*/
+static Score* PyEmbeddings_Out(PyObject* out, size_t count, Py_buffer* view)
+{
+    if (PyObject_GetBuffer(out, view, PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS) < 0) {
+        return NULL;
     }
-    PyBuffer_Release(&blob);
-    Py_RETURN_NONE;
-error:
-    PyBuffer_Release(&blob);
-    return NULL;
+    if ((size_t)view->len < count * sizeof(Score)) {
+        PyErr_Format(PyExc_ValueError,
+            "'out' holds %zd bytes but the hits take %zu (%zu records of %zu bytes).",
+            view->len, count * sizeof(Score), count, sizeof(Score));
+        PyBuffer_Release(view);
+        return NULL;
+    }
+    return (Score*)view->buf;
 }
 
 static PyObject* PyEmbeddings_Search(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds)
 {
     _dbglog("PyEmbeddings_search();\n");
-    static char* kwlist[] = { "query", "len", "topk", "threshold", "norm", NULL };
+    static char* kwlist[] = { "query", "len", "topk", "threshold", "norm", "threads", "nprobe", "ef", "pq", "rerank", "sign", "out", NULL };
     Py_buffer buf;
     PyObject* len_obj = NULL;
     DWORD len = 0, topk = 0;
     float threshold = 0.0f;
 	int norm = 1; // Normalize by default
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*|OIfp:search", kwlist,
-        &buf, &len_obj, &topk, &threshold, &norm)) {
+    unsigned int threads = 1; // 0: one per processor
+    unsigned int nprobe = 0; // 0: exhaustive scan, otherwise search the IVF index (see ivfbuild)
+    unsigned int ef = 0; // 0: exhaustive scan, otherwise search the HNSW graph (see hnswbuild)
+    int pq = 0; // Scan the PQ codes (see pqbuild)
+    unsigned int rerank = 0; // PQ or sign candidates scored exactly, 0: PQ_RERANK or SIGN_RERANK x topk
+    int sign = 0; // Rank the sign sketches (see signbuild)
+    PyObject* out = NULL; // Optional buffer of topk Score records the hits are written to
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*|OIfpIIIpIpO:search", kwlist,
+        &buf, &len_obj, &topk, &threshold, &norm, &threads, &nprobe, &ef, &pq, &rerank, &sign, &out)) {
+        return NULL;
+    }
+
+    if ((nprobe != 0) + (ef != 0) + (pq != 0) + (sign != 0) > 1) {
+        PyBuffer_Release(&buf);
+        PyErr_SetString(PyExc_ValueError, "nprobe (IVF), ef (HNSW), pq and sign are mutually exclusive.");
         return NULL;
     }
 
@@ -1340,32 +9816,86 @@ static PyObject* PyEmbeddings_Search(PyEmbeddingsObject* self, PyObject* args, P
         return NULL;
     }
 
-    if (self->db->header.blobSize != len * sizeof(float)) {
+    if (_vecdim(&self->db->header) != len) {
         PyBuffer_Release(&buf);
         PyErr_Format(PyExc_ValueError,
             "Query size (%u bytes) does not match database blob size (%u bytes).",
             len * (unsigned)sizeof(float),
-            self->db->header.blobSize);
+            _vecdim(&self->db->header) * (unsigned)sizeof(float));
         return NULL;
     }
 
-    Score* scores = (Score*)calloc(topk, sizeof(Score));
+    Py_buffer outbuf = { 0 };
+    Score* scores = out && out != Py_None
+        ? PyEmbeddings_Out(out, topk, &outbuf)
+        : (Score*)calloc(topk, sizeof(Score));
     if (!scores) {
         PyBuffer_Release(&buf);
-        PyErr_SetString(PyExc_MemoryError, "Failed to allocate score buffer.");
+        if (!PyErr_Occurred()) PyErr_SetString(PyExc_MemoryError, "Failed to allocate score buffer.");
         return NULL;
     }
 
-    int32_t count = filesearch(self->db,
-        (const float*)buf.buf,
-        len,
-        topk,
-        scores,
-        threshold,
-        norm);
+    int32_t count;
+    // The scan runs without the GIL: other threads search the same handle meanwhile.
+    Py_BEGIN_ALLOW_THREADS
+    count = nprobe
+        ? ivfsearch(self->db,
+            (const float*)buf.buf,
+            len,
+            topk,
+            scores,
+            threshold,
+            norm,
+            nprobe)
+        : ef
+        ? hnswsearch(self->db,
+            (const float*)buf.buf,
+            len,
+            topk,
+            scores,
+            threshold,
+            norm,
+            ef)
+        : pq
+        ? pqsearch(self->db,
+            (const float*)buf.buf,
+            len,
+            topk,
+            scores,
+            threshold,
+            norm,
+            rerank)
+        : sign
+        ? signsearch(self->db,
+            (const float*)buf.buf,
+            len,
+            topk,
+            scores,
+            threshold,
+            norm,
+            rerank)
+        : filesearchex(self->db,
+            (const float*)buf.buf,
+            len,
+            topk,
+            scores,
+            threshold,
+            norm,
+            threads);
+    Py_END_ALLOW_THREADS
 
     PyBuffer_Release(&buf);
 
+    if (outbuf.obj) {
+        // The hits are already in out: only their number is returned.
+        PyBuffer_Release(&outbuf);
+        if (count < 0) {
+            PyErr_SetString(PyExc_RuntimeError, "filesearch failed.");
+            return NULL;
+        }
+        return PyLong_FromLong(count);
+    }
+
     if (count < 0) {
         free(scores);
         PyErr_SetString(PyExc_RuntimeError, "filesearch failed.");
@@ -1392,14 +9922,306 @@ static PyObject* PyEmbeddings_Search(PyEmbeddingsObject* self, PyObject* args, P
     return list;
 }
 
+static PyObject* PyEmbeddings_SearchBatch(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds)
+{
+    _dbglog("PyEmbeddings_searchbatch();\n");
+    static char* kwlist[] = { "queries", "topk", "threshold", "norm", "out", NULL };
+    Py_buffer buf;
+    DWORD topk = 0;
+    float threshold = 0.0f;
+    int norm = 1; // Normalize by default
+    PyObject* out = NULL; // Optional buffer of n x topk Score records the hits are written to
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*|IfpO:searchbatch", kwlist,
+        &buf, &topk, &threshold, &norm, &out)) {
+        return NULL;
+    }
+
+    /* Validate DB handle */
+    if (!self->db->hWrite || self->db->hWrite == INVALID_HANDLE_VALUE) {
+        PyBuffer_Release(&buf);
+        PyErr_SetString(PyExc_RuntimeError, "Database is closed or invalid.");
+        return NULL;
+    }
+
+    /* The queries are rows of dim floats, e.g. a C-contiguous float32 array of shape (n, dim) */
+    Py_ssize_t row = (Py_ssize_t)(_vecdim(&self->db->header) * sizeof(float));
+    if (row == 0 || buf.len == 0 || (buf.len % row) != 0) {
+        PyBuffer_Release(&buf);
+        PyErr_Format(PyExc_ValueError,
+            "Queries buffer size (%zd) is not a multiple of the database blob size (%zd bytes).", buf.len, row);
+        return NULL;
+    }
+    if (buf.len / row > INT32_MAX) {
+        PyBuffer_Release(&buf);
+        PyErr_SetString(PyExc_ValueError, "Too many queries.");
+        return NULL;
+    }
+    uint32_t nq = (uint32_t)(buf.len / row);
+    uint32_t len = (uint32_t)(row / sizeof(float));
+
+    if (topk == 0) {
+        PyBuffer_Release(&buf);
+        PyErr_SetString(PyExc_ValueError, "topk must be greater than zero.");
+        return NULL;
+    }
+
+    Py_buffer outbuf = { 0 };
+    Score* scores = out && out != Py_None
+        ? PyEmbeddings_Out(out, (size_t)nq * topk, &outbuf)
+        : (Score*)calloc((size_t)nq * topk, sizeof(Score));
+    int32_t* counts = scores ? (int32_t*)calloc(nq, sizeof(int32_t)) : NULL;
+    if (!scores || !counts) {
+        if (outbuf.obj) PyBuffer_Release(&outbuf);
+        else free(scores);
+        free(counts);
+        PyBuffer_Release(&buf);
+        if (!PyErr_Occurred()) PyErr_SetString(PyExc_MemoryError, "Failed to allocate score buffer.");
+        return NULL;
+    }
+
+    int32_t count;
+    Py_BEGIN_ALLOW_THREADS
+    count = filesearchbatch(self->db,
+        (const float*)buf.buf,
+        nq,
+        len,
+        topk,
+        scores,
+        counts,
+        threshold,
+        norm);
+    Py_END_ALLOW_THREADS
+
+    PyBuffer_Release(&buf);
+
+    if (outbuf.obj) {
+        // Row j of out holds the hits of query j: only their numbers are returned.
+        PyBuffer_Release(&outbuf);
+        PyObject* sizes = count < 0 ? NULL : PyList_New(nq);
+        for (uint32_t j = 0; sizes && j < nq; ++j) {
+            PyObject* size = PyLong_FromLong(counts[j]);
+            if (!size) {
+                Py_CLEAR(sizes);
+                break;
+            }
+            PyList_SET_ITEM(sizes, j, size); /* steals ref */
+        }
+        free(counts);
+        if (count < 0) {
+            PyErr_SetString(PyExc_RuntimeError, "filesearchbatch failed.");
+        }
+        return sizes;
+    }
+
+    if (count < 0) {
+        free(scores);
+        free(counts);
+        PyErr_SetString(PyExc_RuntimeError, "filesearchbatch failed.");
+        return NULL;
+    }
+
+    PyObject* lists = PyList_New(nq);
+    if (!lists) {
+        free(scores);
+        free(counts);
+        return NULL;
+    }
+    for (uint32_t j = 0; j < nq; ++j) {
+        const Score* row_scores = scores + (size_t)j * topk;
+        PyObject* list = PyList_New(counts[j]);
+        if (!list) {
+            Py_DECREF(lists);
+            free(scores);
+            free(counts);
+            return NULL;
+        }
+        for (int i = 0; i < counts[j]; ++i) {
+            PyObject* id_bytes = PyBytes_FromStringAndSize((const char*)&row_scores[i].id, sizeof(uiid));
+            PyObject* score_f = PyFloat_FromDouble(row_scores[i].score);
+            PyObject* tuple = PyTuple_Pack(2, id_bytes, score_f);
+            Py_DECREF(id_bytes);
+            Py_DECREF(score_f);
+            PyList_SET_ITEM(list, i, tuple); /* steals ref */
+        }
+        PyList_SET_ITEM(lists, j, list); /* steals ref */
+    }
+
+    free(scores);
+    free(counts);
+    return lists;
+}
+
+static PyObject* PyEmbeddings_Map(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds)
+{
+    _dbglog("PyEmbeddings_map();\n");
+    static char* kwlist[] = { "sequential", "willneed", "hugepages", NULL };
+    int sequential = 1, willneed = 0, hugepages = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|ppp:map", kwlist,
+        &sequential, &willneed, &hugepages)) {
+        return NULL;
+    }
+    if (!self->db || !self->db->hWrite || self->db->hWrite == INVALID_HANDLE_VALUE) {
+        PyErr_SetString(PyExc_RuntimeError, "Database is closed or invalid.");
+        return NULL;
+    }
+    DWORD dwHints = (sequential ? MAPHINT_SEQUENTIAL : 0)
+        | (willneed ? MAPHINT_WILLNEED : 0)
+        | (hugepages ? MAPHINT_HUGEPAGES : 0);
+    BOOL bOk;
+    // Waits for the searches in progress.
+    Py_BEGIN_ALLOW_THREADS
+    bOk = filemap(self->db, dwHints);
+    Py_END_ALLOW_THREADS
+    if (!bOk) {
+        PyErr_SetString(PyExc_OSError, "filemap failed.");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject* PyEmbeddings_Unmap(PyEmbeddingsObject* self, PyObject* Py_UNUSED(args))
+{
+    if (!PyEmbeddings_Enter(self)) {
+        PyErr_Clear();
+        Py_RETURN_NONE;
+    }
+    // Waits for the searches scoring records in place.
+    Py_BEGIN_ALLOW_THREADS
+    fileunmap(self->db);
+    Py_END_ALLOW_THREADS
+    PyEmbeddings_Leave(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject* PyEmbeddings_IvfBuild(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds)
+{
+    _dbglog("PyEmbeddings_ivfbuild();\n");
+    static char* kwlist[] = { "nlist", "threads", NULL };
+    unsigned int nlist = 0, threads = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "I|I:ivfbuild", kwlist,
+        &nlist, &threads)) {
+        return NULL;
+    }
+    if (!self->db || !self->db->hWrite || self->db->hWrite == INVALID_HANDLE_VALUE) {
+        PyErr_SetString(PyExc_RuntimeError, "Database is closed or invalid.");
+        return NULL;
+    }
+    BOOL bOk;
+    Py_BEGIN_ALLOW_THREADS
+    bOk = ivfbuild(self->db, nlist, threads);
+    Py_END_ALLOW_THREADS
+    if (!bOk) {
+        PyErr_SetString(PyExc_RuntimeError, "ivfbuild failed.");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject* PyEmbeddings_HnswBuild(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds)
+{
+    _dbglog("PyEmbeddings_hnswbuild();\n");
+    static char* kwlist[] = { "M", "ef_construction", NULL };
+    unsigned int M = 0, efConstruction = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|II:hnswbuild", kwlist,
+        &M, &efConstruction)) {
+        return NULL;
+    }
+    if (!self->db || !self->db->hWrite || self->db->hWrite == INVALID_HANDLE_VALUE) {
+        PyErr_SetString(PyExc_RuntimeError, "Database is closed or invalid.");
+        return NULL;
+    }
+    BOOL bOk;
+    Py_BEGIN_ALLOW_THREADS
+    bOk = hnswbuild(self->db, M, efConstruction);
+    Py_END_ALLOW_THREADS
+    if (!bOk) {
+        PyErr_SetString(PyExc_RuntimeError, "hnswbuild failed.");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject* PyEmbeddings_PqBuild(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds)
+{
+    _dbglog("PyEmbeddings_pqbuild();\n");
+    static char* kwlist[] = { "M", "nbits", "threads", NULL };
+    unsigned int M = 0, nbits = 4, threads = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|III:pqbuild", kwlist,
+        &M, &nbits, &threads)) {
+        return NULL;
+    }
+    if (!self->db || !self->db->hWrite || self->db->hWrite == INVALID_HANDLE_VALUE) {
+        PyErr_SetString(PyExc_RuntimeError, "Database is closed or invalid.");
+        return NULL;
+    }
+    BOOL bOk;
+    Py_BEGIN_ALLOW_THREADS
+    bOk = pqbuild(self->db, M, nbits, threads);
+    Py_END_ALLOW_THREADS
+    if (!bOk) {
+        PyErr_SetString(PyExc_RuntimeError, "pqbuild failed.");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject* PyEmbeddings_SignBuild(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds)
+{
+    _dbglog("PyEmbeddings_signbuild();\n");
+    static char* kwlist[] = { "threads", NULL };
+    unsigned int threads = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|I:signbuild", kwlist,
+        &threads)) {
+        return NULL;
+    }
+    if (!self->db || !self->db->hWrite || self->db->hWrite == INVALID_HANDLE_VALUE) {
+        PyErr_SetString(PyExc_RuntimeError, "Database is closed or invalid.");
+        return NULL;
+    }
+    BOOL bOk;
+    Py_BEGIN_ALLOW_THREADS
+    bOk = signbuild(self->db, threads);
+    Py_END_ALLOW_THREADS
+    if (!bOk) {
+        PyErr_SetString(PyExc_RuntimeError, "signbuild failed.");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject* PyEmbeddings_Compact(PyEmbeddingsObject* self, PyObject* args, PyObject* kwds)
+{
+    _dbglog("PyEmbeddings_compact();\n");
+    static char* kwlist[] = { "threads", NULL };
+    unsigned int threads = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|I:compact", kwlist,
+        &threads)) {
+        return NULL;
+    }
+    if (!self->db || !self->db->hWrite || self->db->hWrite == INVALID_HANDLE_VALUE) {
+        PyErr_SetString(PyExc_RuntimeError, "Database is closed or invalid.");
+        return NULL;
+    }
+    BOOL bOk;
+    // Other threads keep appending and searching while the records are copied.
+    Py_BEGIN_ALLOW_THREADS
+    bOk = filecompact(self->db, threads);
+    Py_END_ALLOW_THREADS
+    if (!bOk) {
+        PyErr_SetString(PyExc_RuntimeError, "compact failed.");
+        return NULL;
+    }
+    Py_RETURN_TRUE;
+}
+
 /* Module init */
 
 PyMODINIT_FUNC PyInit_embeddings(void)
 {
     _dbglog("PyInit_embeddings();\n");
-    /* Ensure both types have a valid tp_new */
-    PyEmbeddings.tp_new = PyType_GenericNew;
-    PyCursorType.tp_new = PyType_GenericNew;
+    /* Both types set up their locks in tp_new */
+    PyEmbeddings.tp_new = (newfunc)PyEmbeddings_New;
+    PyCursorType.tp_new = (newfunc)PyCursor_New;
     if (PyType_Ready(&PyEmbeddings) < 0)
         return NULL;
     if (PyType_Ready(&PyCursorType) < 0)
@@ -1408,6 +10230,10 @@ PyMODINIT_FUNC PyInit_embeddings(void)
     PyObject* m = PyModule_Create(&PyModule);
     if (!m)
         return NULL;
+#ifdef Py_GIL_DISABLED
+    /* Free-threaded builds: the handles and cursors guard their own state (see PyEmbeddings_Enter). */
+    PyUnstable_Module_SetGIL(m, Py_MOD_GIL_NOT_USED);
+#endif
     /* Add Embeddings type */
     Py_INCREF(&PyEmbeddings);
     if (PyModule_AddObject(m, "Embeddings", (PyObject*)&PyEmbeddings) < 0) {
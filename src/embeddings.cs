@@ -43,6 +43,27 @@ namespace embeddings {
         }
     }
 
+    public enum DType : byte {
+        Float32 = 0,
+        Float16 = 1,
+        Int8 = 2,
+    }
+
+    public enum Metric : byte {
+        Cosine = 0,
+        InnerProduct = 1,
+        L2 = 2,
+        L1 = 3,
+    }
+
+    [Flags]
+    public enum MapHint : uint {
+        None = 0,
+        Sequential = 1,
+        WillNeed = 2,
+        HugePages = 4,
+    }
+
     [StructLayout(LayoutKind.Sequential, Pack = 1)]
     public struct FileHeader {
         public unsafe fixed byte magic[16];
@@ -51,6 +72,8 @@ namespace embeddings {
         public UInt32 alignment;
         public UInt32 blobSize;
         public byte dtype;
+        public byte flags;
+        public byte metric;
     }
 
     [StructLayout(LayoutKind.Sequential, Pack = 1)]
@@ -69,6 +92,14 @@ namespace embeddings {
             UInt32 creationDisposition,
             UInt32 blobSize);
 
+        [DllImport(DLL, CallingConvention = CallingConvention.StdCall, CharSet = CharSet.Unicode)]
+        internal static extern IntPtr fileopenex(
+            string szPath,
+            UInt32 access,
+            UInt32 creationDisposition,
+            UInt32 blobSize,
+            byte dtype,
+            byte metric);
 
         [DllImport(DLL, CallingConvention = CallingConvention.StdCall)]
         internal static extern int fileappend(
@@ -78,6 +109,66 @@ namespace embeddings {
             UInt32 blobSize,
             int bFlush /* BOOL */);
 
+        [DllImport(DLL, CallingConvention = CallingConvention.StdCall)]
+        internal static extern int fileappendbatch(
+            IntPtr db,
+            Uiid* ids,
+            float* blobs,
+            UInt32 n,
+            int bFlush /* BOOL */);
+
+        [DllImport(DLL, CallingConvention = CallingConvention.StdCall)]
+        internal static extern int filesetdirect(
+            IntPtr db,
+            int bDirect /* BOOL */);
+
+        [DllImport(DLL, CallingConvention = CallingConvention.StdCall)]
+        internal static extern int filesetreadahead(
+            IntPtr db,
+            UInt32 depth,
+            UInt32 records);
+
+        [DllImport(DLL, CallingConvention = CallingConvention.StdCall)]
+        internal static extern int filesetgroupcommit(
+            IntPtr db,
+            int bEnable /* BOOL */,
+            UInt32 maxDelay,
+            UInt32 maxBatch);
+
+        [DllImport(DLL, CallingConvention = CallingConvention.StdCall)]
+        internal static extern Int32 fileget(
+            IntPtr db,
+            ref Uiid id,
+            IntPtr blob,
+            UInt32 blobSize);
+
+        [DllImport(DLL, CallingConvention = CallingConvention.StdCall)]
+        internal static extern Int32 filegetmany(
+            IntPtr db,
+            Uiid* ids,
+            UInt32 n,
+            float* blobs,
+            byte* found);
+
+        [DllImport(DLL, CallingConvention = CallingConvention.StdCall)]
+        internal static extern Int32 fileupdate(
+            IntPtr db,
+            ref Uiid id,
+            IntPtr blob,
+            UInt32 blobSize,
+            int bFlush /* BOOL */);
+
+        [DllImport(DLL, CallingConvention = CallingConvention.StdCall)]
+        internal static extern Int32 filedelete(
+            IntPtr db,
+            ref Uiid id,
+            int bFlush /* BOOL */);
+
+        [DllImport(DLL, CallingConvention = CallingConvention.StdCall)]
+        internal static extern int filecompact(
+            IntPtr db,
+            UInt32 threads);
+
         [DllImport(DLL, CallingConvention = CallingConvention.StdCall)]
         internal static extern void fileclose(
             IntPtr db);
@@ -91,6 +182,106 @@ namespace embeddings {
             [Out] Score[] scores,
             float threshold);
 
+        [DllImport(DLL, CallingConvention = CallingConvention.StdCall)]
+        internal static extern Int32 filesearchex(
+            IntPtr db,
+            float* query,
+            UInt32 len,
+            UInt32 topk,
+            [Out] Score[] scores,
+            float threshold,
+            int bNorm /* BOOL */,
+            UInt32 threads);
+
+        [DllImport(DLL, CallingConvention = CallingConvention.StdCall)]
+        internal static extern Int32 filesearchbatch(
+            IntPtr db,
+            float* queries,
+            UInt32 nq,
+            UInt32 len,
+            UInt32 topk,
+            [Out] Score[] scores,
+            [Out] Int32[] counts,
+            float threshold,
+            int bNorm /* BOOL */);
+
+        [DllImport(DLL, CallingConvention = CallingConvention.StdCall)]
+        internal static extern int filemap(
+            IntPtr db,
+            UInt32 hints);
+
+        [DllImport(DLL, CallingConvention = CallingConvention.StdCall)]
+        internal static extern void fileunmap(
+            IntPtr db);
+
+        [DllImport(DLL, CallingConvention = CallingConvention.StdCall)]
+        internal static extern int ivfbuild(
+            IntPtr db,
+            UInt32 nlist,
+            UInt32 threads);
+
+        [DllImport(DLL, CallingConvention = CallingConvention.StdCall)]
+        internal static extern Int32 ivfsearch(
+            IntPtr db,
+            float* query,
+            UInt32 len,
+            UInt32 topk,
+            [Out] Score[] scores,
+            float threshold,
+            int bNorm /* BOOL */,
+            UInt32 nprobe);
+
+        [DllImport(DLL, CallingConvention = CallingConvention.StdCall)]
+        internal static extern int hnswbuild(
+            IntPtr db,
+            UInt32 M,
+            UInt32 efConstruction);
+
+        [DllImport(DLL, CallingConvention = CallingConvention.StdCall)]
+        internal static extern Int32 hnswsearch(
+            IntPtr db,
+            float* query,
+            UInt32 len,
+            UInt32 topk,
+            [Out] Score[] scores,
+            float threshold,
+            int bNorm /* BOOL */,
+            UInt32 efSearch);
+
+        [DllImport(DLL, CallingConvention = CallingConvention.StdCall)]
+        internal static extern int pqbuild(
+            IntPtr db,
+            UInt32 M,
+            UInt32 nbits,
+            UInt32 threads);
+
+        [DllImport(DLL, CallingConvention = CallingConvention.StdCall)]
+        internal static extern Int32 pqsearch(
+            IntPtr db,
+            float* query,
+            UInt32 len,
+            UInt32 topk,
+            [Out] Score[] scores,
+            float threshold,
+            int bNorm /* BOOL */,
+            UInt32 rerank);
+
+        [DllImport(DLL, CallingConvention = CallingConvention.StdCall)]
+        internal static extern int signbuild(
+            IntPtr db,
+            UInt32 threads);
+
+        [DllImport(DLL, CallingConvention = CallingConvention.StdCall)]
+        internal static extern Int32 signsearch(
+            IntPtr db,
+            float* query,
+            UInt32 len,
+            UInt32 topk,
+            [Out] Score[] scores,
+            float threshold,
+            int bNorm /* BOOL */,
+            UInt32 rerank);
+
         /* Cursor* __stdcall cursoropen(Embeddings* db); */
         [DllImport(DLL, CallingConvention = CallingConvention.StdCall)]
         internal static extern IntPtr cursoropen(
@@ -112,6 +303,15 @@ namespace embeddings {
             IntPtr cur,
             out UInt32 err);
 
+        /* int32_t __stdcall cursorreadbatch(Cursor* cur, uint32_t n, uiid* ids, float* blobs, uint64_t* offsets); */
+        [DllImport(DLL, CallingConvention = CallingConvention.StdCall)]
+        internal static extern Int32 cursorreadbatch(
+            IntPtr cur,
+            UInt32 n,
+            Uiid* ids,
+            float* blobs,
+            UInt64* offsets);
+
         [StructLayout(LayoutKind.Sequential, Pack = 1)]
         internal struct Cursor {
             public IntPtr hReadWrite;
@@ -122,6 +322,11 @@ namespace embeddings {
             public Uiid* id;
             public byte* blob;
             public UInt32 blobSize;
+            public UInt64 next;
+            public byte* window;
+            public UInt32 cbWindow;
+            public UInt32 cbFilled;
+            public UInt64 windowOffset;
         }
 
         const uint FILE_READ_DATA = 0x0001;
@@ -141,7 +346,9 @@ namespace embeddings {
         public static IntPtr Open(
             string pathOrNull,
             string mode,
-            uint dim) {
+            uint dim,
+            DType dtype = DType.Float32,
+            Metric metric = Metric.Cosine) {
             uint access = 0;
             uint disposition = 0;
             if (string.IsNullOrEmpty(mode) || mode == "r") {
@@ -159,11 +366,13 @@ namespace embeddings {
             } else {
                 throw new ArgumentException("Unsupported mode. Use \"r\", \"a\", \"a+\", or \"a++\".", nameof(mode));
             }
-            return fileopen(
+            return fileopenex(
                 pathOrNull,
                 access,
                 disposition,
-                dim * 4u);
+                dim * 4u,
+                (byte)dtype,
+                (byte)metric);
         }
 
         public static void Close(IntPtr db) {
@@ -185,6 +394,68 @@ namespace embeddings {
             return ok != 0;
         }
 
+        public static bool AppendBatch(
+            IntPtr db,
+            Uiid* ids,
+            float* blobs,
+            uint n,
+            bool flush) {
+            return fileappendbatch(db, ids, blobs, n, flush ? 1 : 0) != 0;
+        }
+
+        public static bool SetGroupCommit(IntPtr db, bool enable, uint maxDelayMicroseconds = 0, uint maxBatch = 0) {
+            return filesetgroupcommit(db, enable ? 1 : 0, maxDelayMicroseconds, maxBatch) != 0;
+        }
+
+        public static bool SetReadAhead(IntPtr db, uint depth = 0, uint records = 0) {
+            return filesetreadahead(db, depth, records) != 0;
+        }
+
+        public static bool SetDirect(IntPtr db, bool direct) {
+            return filesetdirect(db, direct ? 1 : 0) != 0;
+        }
+
+        /* 1 if found, 0 if there is no such id, -1 on error. */
+        public static int Get(
+            IntPtr db,
+            ref Uiid id,
+            void* blobPtr,
+            uint blobSizeBytes) {
+            return fileget(db, ref id, (IntPtr)blobPtr, blobSizeBytes);
+        }
+
+        /* Number of ids found or -1 on error; rows of missing ids are zeroed. */
+        public static int GetMany(
+            IntPtr db,
+            Uiid* ids,
+            uint n,
+            float* blobs,
+            byte* found = null) {
+            return filegetmany(db, ids, n, blobs, found);
+        }
+
+        /* 1 if updated, 0 if there is no such id, -1 on error. */
+        public static int Update(
+            IntPtr db,
+            ref Uiid id,
+            void* blobPtr,
+            uint blobSizeBytes,
+            bool flush) {
+            return fileupdate(db, ref id, (IntPtr)blobPtr, blobSizeBytes, flush ? 1 : 0);
+        }
+
+        /* 1 if deleted, 0 if there is no such id, -1 on error. */
+        public static int Delete(
+            IntPtr db,
+            ref Uiid id,
+            bool flush) {
+            return filedelete(db, ref id, flush ? 1 : 0);
+        }
+
+        public static bool Compact(IntPtr db, uint threads = 0) {
+            return filecompact(db, threads) != 0;
+        }
+
         public static int Search(
             IntPtr db,
             float* queryPtr,
@@ -208,6 +479,175 @@ namespace embeddings {
             return count;
         }
 
+        /* Splits the scan across threads workers (0: one per processor). */
+        public static int SearchEx(
+            IntPtr db,
+            float* queryPtr,
+            uint len,
+            uint topk,
+            float threshold,
+            uint threads,
+            out Score[] results) {
+            Score[] scores = new Score[topk];
+            int count = filesearchex(
+                db,
+                queryPtr,
+                len,
+                topk,
+                scores,
+                threshold,
+                1,
+                threads);
+            results = count < 0 ? new Score[0] : scores;
+            return count;
+        }
+
+        /* nq queries (nq x len, row-major) in one pass; results[j] holds the hits of query j. nq or -1 on error. */
+        public static int SearchBatch(
+            IntPtr db,
+            float* queriesPtr,
+            uint nq,
+            uint len,
+            uint topk,
+            float threshold,
+            out Score[][] results) {
+            Score[] scores = new Score[(long)nq * topk];
+            Int32[] counts = new Int32[nq];
+            int count = filesearchbatch(
+                db,
+                queriesPtr,
+                nq,
+                len,
+                topk,
+                scores,
+                counts,
+                threshold,
+                1);
+            if (count < 0) {
+                results = new Score[0][];
+                return count;
+            }
+            results = new Score[nq][];
+            for (uint j = 0; j < nq; j++) {
+                results[j] = new Score[counts[j]];
+                Array.Copy(scores, (long)j * topk, results[j], 0, counts[j]);
+            }
+            return count;
+        }
+
+        /* Maps the file so that searches score records in place; Map and Unmap wait for the searches in progress. */
+        public static bool Map(IntPtr db, MapHint hints = MapHint.None) {
+            return filemap(db, (uint)hints) != 0;
+        }
+
+        public static void Unmap(IntPtr db) {
+            fileunmap(db);
+        }
+
+        public static bool BuildIvf(IntPtr db, uint nlist, uint threads = 0) {
+            return ivfbuild(db, nlist, threads) != 0;
+        }
+
+        public static int SearchIvf(
+            IntPtr db,
+            float* queryPtr,
+            uint len,
+            uint topk,
+            float threshold,
+            uint nprobe,
+            out Score[] results) {
+            Score[] scores = new Score[topk];
+            int count = ivfsearch(
+                db,
+                queryPtr,
+                len,
+                topk,
+                scores,
+                threshold,
+                1,
+                nprobe);
+            results = count < 0 ? new Score[0] : scores;
+            return count;
+        }
+
+        public static bool BuildHnsw(IntPtr db, uint M = 0, uint efConstruction = 0) {
+            return hnswbuild(db, M, efConstruction) != 0;
+        }
+
+        public static int SearchHnsw(
+            IntPtr db,
+            float* queryPtr,
+            uint len,
+            uint topk,
+            float threshold,
+            uint efSearch,
+            out Score[] results) {
+            Score[] scores = new Score[topk];
+            int count = hnswsearch(
+                db,
+                queryPtr,
+                len,
+                topk,
+                scores,
+                threshold,
+                1,
+                efSearch);
+            results = count < 0 ? new Score[0] : scores;
+            return count;
+        }
+
+        public static bool BuildPq(IntPtr db, uint M = 0, uint nbits = 4, uint threads = 0) {
+            return pqbuild(db, M, nbits, threads) != 0;
+        }
+
+        public static int SearchPq(
+            IntPtr db,
+            float* queryPtr,
+            uint len,
+            uint topk,
+            float threshold,
+            uint rerank,
+            out Score[] results) {
+            Score[] scores = new Score[topk];
+            int count = pqsearch(
+                db,
+                queryPtr,
+                len,
+                topk,
+                scores,
+                threshold,
+                1,
+                rerank);
+            results = count < 0 ? new Score[0] : scores;
+            return count;
+        }
+
+        public static bool BuildSign(IntPtr db, uint threads = 0) {
+            return signbuild(db, threads) != 0;
+        }
+
+        public static int SearchSign(
+            IntPtr db,
+            float* queryPtr,
+            uint len,
+            uint topk,
+            float threshold,
+            uint rerank,
+            out Score[] results) {
+            Score[] scores = new Score[topk];
+            int count = signsearch(
+                db,
+                queryPtr,
+                len,
+                topk,
+                scores,
+                threshold,
+                1,
+                rerank);
+            results = count < 0 ? new Score[0] : scores;
+            return count;
+        }
+
         /* Cursor API: zero-copy sequential scan
          *
          * Usage:
@@ -237,6 +677,11 @@ namespace embeddings {
             return cursorreset(cur) != 0;
         }
 
+        /* Up to n records into ids (n) and blobs (n x dim); the count, 0 at EOF or -1 on error. */
+        public static int CursorReadBatch(IntPtr cur, uint n, Uiid* ids, float* blobs, UInt64* offsets = null) {
+            return cursorreadbatch(cur, n, ids, blobs, offsets);
+        }
+
         // public static bool CursorRead(
         //     IntPtr cur,
         //     out uint errorCode /* 0 or ERROR_HANDLE_EOF etc. */) {
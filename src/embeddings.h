@@ -1,13 +1,59 @@
 #ifndef EMBEDDINGS_H
 #define EMBEDDINGS_H
 
+#if defined(_WIN32)
 #define WIN32_LEAN_AND_MEAN
 #define _CRT_SECURE_NO_WARNINGS
 #include <windows.h>
+#endif
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <wchar.h>
+
+#if !defined(_WIN32)
+/* POSIX: the public API keeps the Win32 vocabulary so that the bindings are the same on every platform. */
+typedef int BOOL;
+typedef uint32_t DWORD;
+typedef void* HANDLE;
+typedef union _LARGE_INTEGER {
+    struct {
+        uint32_t LowPart;
+        int32_t HighPart;
+    };
+    int64_t QuadPart;
+} LARGE_INTEGER;
+typedef struct _SYSTEM_INFO {
+    DWORD dwPageSize;
+    DWORD dwAllocationGranularity;
+    DWORD dwNumberOfProcessors;
+} SYSTEM_INFO;
+#ifndef TRUE
+#define TRUE 1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+#define INVALID_HANDLE_VALUE ((HANDLE)(intptr_t)-1)
+#define MAX_PATH 260
+/* Access */
+#define FILE_READ_DATA 0x0001
+#define FILE_WRITE_DATA 0x0002
+#define FILE_APPEND_DATA 0x0004
+/* Creation disposition */
+#define CREATE_NEW 1
+#define CREATE_ALWAYS 2
+#define OPEN_EXISTING 3
+#define OPEN_ALWAYS 4
+/* Error codes */
+#define NO_ERROR 0
+#define NOERROR 0
+#define ERROR_INVALID_HANDLE 6
+#define ERROR_HANDLE_EOF 38
+#define ERROR_BROKEN_PIPE 109
+#define ERROR_BAD_ARGUMENTS 160
+#endif
 
 #ifdef _WIN32
 #ifdef EMBEDDINGS_C
@@ -31,6 +77,30 @@ typedef enum DTYPE {
     DTYPE_INT8 = 2 /* per-vector: [float scale][dim x int8_t] */
 } DTYPE;
 
+typedef enum METRIC {
+    METRIC_COSINE = 0, /* dot product over both norms (bNorm), higher is better */
+    METRIC_IP = 1, /* raw dot product, higher is better */
+    METRIC_L2 = 2, /* squared Euclidean distance, lower is better */
+    METRIC_L1 = 3 /* Manhattan distance, lower is better */
+} METRIC;
+
+typedef enum HEADERFLAGS {
+    HEADER_NORMS = 1 /* each record stores the float32 L2 norm of its vector right after the blob (0: not known) */
+} HEADERFLAGS;
+
+typedef enum RECORDOP {
+    RECORD_ADD = 0, /* the first record of an id */
+    RECORD_DELETE = 1, /* tombstone: the id has no vector from here on */
+    RECORD_UPDATE = 2 /* replaces the earlier record of the id (upsert) */
+} RECORDOP;
+
+typedef enum MAPHINT {
+    MAPHINT_NONE = 0,
+    MAPHINT_SEQUENTIAL = 1, /* madvise(MADV_SEQUENTIAL) */
+    MAPHINT_WILLNEED = 2, /* madvise(MADV_WILLNEED) / PrefetchVirtualMemory */
+    MAPHINT_HUGEPAGES = 4 /* madvise(MADV_HUGEPAGE) where supported */
+} MAPHINT;
+
 #pragma pack(push, 1)
     typedef struct uiid {
         unsigned char bytes[16];
@@ -45,11 +115,22 @@ typedef enum DTYPE {
         uint32_t alignment;
         uint32_t blobSize;
         uint8_t dtype;
+        uint8_t flags; /* HEADERFLAGS, absent in files written before it was added */
+        uint8_t metric; /* METRIC, absent (METRIC_COSINE) in files written before it was added */
     } FileHeader;
 #pragma pack(pop)
 
 #define PATH 1024
 
+    struct View;
+    struct Ivf;
+    struct Hnsw;
+    struct Pq;
+    struct Sign;
+    struct Commit;
+    struct Ids;
+    struct Compact;
+
 #pragma pack(push, 1)
     typedef struct Embeddings {
         HANDLE hWrite;
@@ -58,19 +139,139 @@ typedef enum DTYPE {
         wchar_t wszPath[PATH];
         DWORD access;
         DWORD dwCreationDisposition;
+        BOOL bTemporary;
+        struct View* view;
+        BOOL bRescore;
+        uint32_t dwReadDepth;
+        uint32_t dwReadRecords;
+        HANDLE hDirect;
+        struct Ivf* ivf;
+        struct Hnsw* hnsw;
+        struct Pq* pq;
+        struct Sign* sign;
+        struct Commit* commit;
+        struct Ids* ids;
+        struct Compact* compact;
     } Embeddings;
 #pragma pack(pop)
 
     EMBEDDINGS_API Embeddings* EMBEDDINGS_CALL fileopen(
         const wchar_t* szPath, DWORD dwAccess, DWORD dwCreationDisposition,
         uint32_t dwBlobSize);
+    /*
+        Same as fileopen but creates new files with the given DTYPE storage and METRIC. dwBlobSize is
+        always the size of a float32 vector: appends, updates, cursor reads and queries stay float32 and
+        are converted to and from the stored form. Existing files keep the dtype and metric they were
+        created with.
+
+        Every search ranks by the file's metric. bNorm only applies to METRIC_COSINE. With METRIC_L2
+        and METRIC_L1 the hits come nearest first, their score is the distance and min is the largest
+        distance kept (0 or less: no limit).
+    */
+    EMBEDDINGS_API Embeddings* EMBEDDINGS_CALL fileopenex(
+        const wchar_t* szPath, DWORD dwAccess, DWORD dwCreationDisposition,
+        uint32_t dwBlobSize, uint8_t dtype, uint8_t metric);
     EMBEDDINGS_API BOOL EMBEDDINGS_CALL fileappend(
         Embeddings* db, uiid id,
         const void* blob, DWORD blobSize, BOOL bFlush);
+    /*
+        Appends n records: ids[i] with the float32 vector blobs[i x dim] (n x dim, row-major).
+        The records are laid out in one buffer and written with a single call per APPEND_CHUNK
+        bytes, so a batch costs one allocation and (usually) one write instead of one per record.
+    */
+    EMBEDDINGS_API BOOL EMBEDDINGS_CALL fileappendbatch(
+        Embeddings* db, const uiid* ids,
+        const float* blobs, uint32_t n, BOOL bFlush);
     EMBEDDINGS_API BOOL EMBEDDINGS_CALL fileflush(Embeddings* db);
+
+    /*
+        Group commit for concurrent durable appends. While it is on, fileappend and fileappendbatch
+        queue their records, and a background thread writes everything queued with one write and one
+        sync. bFlush then waits for the commit holding the records instead of syncing on its own;
+        without bFlush the call returns once the records are queued, and searches see them after
+        the next commit. filedelete and fileupdate of an id that is only queued commit the queue
+        first. A commit starts once the oldest queued record has waited dwMaxDelay microseconds (0:
+        as soon as the previous commit is done) or dwMaxBatch records are queued (0:
+        COMMIT_MAXBATCH). fileflush commits at once. Calling it again updates the limits; bEnable
+        FALSE (and fileclose) commits what is queued and goes back to direct writes. Waits for the
+        calls in progress.
+    */
+    EMBEDDINGS_API BOOL EMBEDDINGS_CALL filesetgroupcommit(Embeddings* db, BOOL bEnable, uint32_t dwMaxDelay, uint32_t dwMaxBatch);
+
+    /*
+        Reads by id through an index of the latest record of every id. The index follows appends, is
+        saved next to the file as <path>.ids by fileclose and is loaded (or built) by fileopen.
+        fileget copies the float32 vector of id to blob and returns 1, or 0 if there is no such id.
+        filegetmany does the same for n ids into blobs (n x dim, row-major), reading the records in file
+        order; rows of missing ids are zeroed and found[i] (optional) tells them apart. It returns the
+        number of ids found. Both return -1 on error.
+    */
+    EMBEDDINGS_API int32_t EMBEDDINGS_CALL fileget(Embeddings* db, uiid id, void* blob, DWORD blobSize);
+    EMBEDDINGS_API int32_t EMBEDDINGS_CALL filegetmany(Embeddings* db, const uiid* ids, uint32_t n, float* blobs, uint8_t* found);
+
+    /*
+        Overwrites the vector of the latest record of id in place with one positional write. Returns 1,
+        0 if there is no such id, or -1 on error. The IVF lists, PQ codes and sign sketches keep
+        describing the old vector until they are rebuilt; searches still score the record itself.
+    */
+    EMBEDDINGS_API int32_t EMBEDDINGS_CALL fileupdate(Embeddings* db, uiid id, const void* blob, DWORD blobSize, BOOL bFlush);
+
+    /*
+        Deletes id by appending a tombstone (RECORD_DELETE), which hides every earlier record of the id
+        from searches and fileget; cursors step over the tombstone itself. Returns 1, 0 if the id has no
+        live record, or -1 on error.
+        Files created before records carried an operation (fileversion < 3) cannot delete.
+    */
+    EMBEDDINGS_API int32_t EMBEDDINGS_CALL filedelete(Embeddings* db, uiid id, BOOL bFlush);
+
+    /*
+        Rewrites the file with only the latest live record of every id, copying on dwThreads threads
+        (0: one per processor), and replaces the file with the copy. Appends, updates and searches run
+        during the copy; appended records are carried over and the swap waits for the calls in progress.
+        Other handles and cursors keep reading the old file until they are closed. Indexes the file had
+        are built again with the same parameters. Returns FALSE on error, leaving the file as it was.
+        Records written through another handle would be lost with the old file, so it fails while another
+        handle or updating cursor (cursoropen with bReadOnly FALSE) has the file open for writing, and
+        those fail to open while it runs. Without OFD locks (F_OFD_SETLK) only other processes are seen.
+    */
+    EMBEDDINGS_API BOOL EMBEDDINGS_CALL filecompact(Embeddings* db, uint32_t dwThreads);
     EMBEDDINGS_API void EMBEDDINGS_CALL fileclose(Embeddings* db);
     EMBEDDINGS_API uint32_t EMBEDDINGS_CALL fileversion(Embeddings* db);
 
+    /*
+        Maps the file read-only so that searches score records in place instead of copying them (MAPHINT flags).
+        Both wait for the searches in progress on other threads to finish.
+    */
+    EMBEDDINGS_API BOOL EMBEDDINGS_CALL filemap(Embeddings* db, DWORD dwHints);
+    EMBEDDINGS_API void EMBEDDINGS_CALL fileunmap(Embeddings* db);
+
+    /*
+        DTYPE_INT8 only: when TRUE (the default) searches rescore the records that come close to the
+        top-k with the float32 query, so the hits match a float32 scan of the stored vectors. When
+        FALSE the scores are int8 x int8 approximations. Waits for the searches in progress.
+    */
+    EMBEDDINGS_API BOOL EMBEDDINGS_CALL filesetrescore(Embeddings* db, BOOL bRescore);
+
+    /*
+        Read-ahead of the exhaustive scan when the file is not mapped. Every scan thread reads buffers
+        of dwRecords records (0: SCAN_RECORDS, 1024) and keeps dwDepth of them (0: SCAN_DEPTH, 2) in
+        flight on a reader thread while it scores the one it has; dwDepth 1 reads and scores in turn.
+        Fails if the buffers of one scan thread would take more than 1 GiB. Waits for the searches in
+        progress.
+    */
+    EMBEDDINGS_API BOOL EMBEDDINGS_CALL filesetreadahead(Embeddings* db, uint32_t dwDepth, uint32_t dwRecords);
+
+    /*
+        Direct I/O for large cold scans. While it is on, searches that read the file (it is not mapped,
+        see filemap) and cursors opened read-only afterwards read through a second handle that bypasses
+        the page cache (O_DIRECT, FILE_FLAG_NO_BUFFERING, F_NOCACHE on macOS), so a scan neither evicts
+        other files from the cache nor pays for the copy out of it. Reads are widened to 4096 byte
+        boundaries. Fails, leaving the mode as it was, if the file system does not support it. Waits
+        for the searches in progress. On Windows the scan only sees the appends that have reached the
+        disk (see fileflush).
+    */
+    EMBEDDINGS_API BOOL EMBEDDINGS_CALL filesetdirect(Embeddings* db, BOOL bDirect);
+
 #pragma pack(push, 1)
     typedef struct {
         uiid id;
@@ -86,9 +287,120 @@ typedef enum DTYPE {
         float min,
         BOOL bNorm);
 
-    void remove_from_heap_if(Score* heap, size_t* num, const uiid* id);
+    /* Same as filesearch but splits the scan across dwThreads workers (0: one per processor). */
+    EMBEDDINGS_API int32_t EMBEDDINGS_CALL filesearchex(
+        Embeddings* db,
+        const float* query, uint32_t len,
+        uint32_t topk,
+        Score* scores,
+        float min,
+        BOOL bNorm,
+        uint32_t dwThreads);
 
-    void cosine(const float* query, uint32_t len, float qnorm, uint8_t* buff, float min, size_t* pnum, uint32_t topk, Score* heap, BOOL bNorm);
+    /*
+        Searches nq queries (nq x len, row-major) in a single pass over the file.
+        scores receives nq x topk entries, row j holding the hits of query j; counts[j] is the number of hits in row j.
+        Returns nq on success or -1 on error.
+    */
+    EMBEDDINGS_API int32_t EMBEDDINGS_CALL filesearchbatch(
+        Embeddings* db,
+        const float* queries, uint32_t nq, uint32_t len,
+        uint32_t topk,
+        Score* scores,
+        int32_t* counts,
+        float min,
+        BOOL bNorm);
+
+    /*
+        Builds an IVF index over the records in the file: nlist centroids trained with mini-batch
+        k-means (dwThreads workers, 0: one per processor) and one posting list of record offsets per
+        centroid. The index is saved next to the file as <path>.ivf and loaded by fileopen.
+        Records appended after the build are not in the lists; ivfsearch scans them exhaustively.
+        Searches on other threads go on with the old index during the build (as with hnswbuild, pqbuild
+        and signbuild); it is replaced once they finish.
+    */
+    EMBEDDINGS_API BOOL EMBEDDINGS_CALL ivfbuild(Embeddings* db, uint32_t nlist, uint32_t dwThreads);
+
+    /*
+        Same as filesearch but only scores the records in the nprobe lists nearest to the query
+        (0: IVF_NPROBE), plus the records appended since the index was built.
+        Without an index it falls back to the exhaustive scan.
+    */
+    EMBEDDINGS_API int32_t EMBEDDINGS_CALL ivfsearch(
+        Embeddings* db,
+        const float* query, uint32_t len,
+        uint32_t topk,
+        Score* scores,
+        float min,
+        BOOL bNorm,
+        uint32_t nprobe);
+
+    /*
+        Builds an HNSW graph over the records in the file (M links per node and layer, 2M on layer 0,
+        efConstruction candidates per insert; 0: HNSW_M and HNSW_EFCONSTRUCTION). The graph refers
+        to records by ordinal and reads their vectors from the file, which it maps (see filemap).
+        It is saved next to the file as <path>.hnsw, loaded by fileopen, kept current by fileappend
+        and saved again by fileclose.
+    */
+    EMBEDDINGS_API BOOL EMBEDDINGS_CALL hnswbuild(Embeddings* db, uint32_t M, uint32_t efConstruction);
+
+    /*
+        Same as filesearch but walks the HNSW graph, keeping the efSearch best records (0: HNSW_EFSEARCH,
+        at least topk). Without a graph it falls back to the exhaustive scan.
+    */
+    EMBEDDINGS_API int32_t EMBEDDINGS_CALL hnswsearch(
+        Embeddings* db,
+        const float* query, uint32_t len,
+        uint32_t topk,
+        Score* scores,
+        float min,
+        BOOL bNorm,
+        uint32_t efSearch);
+
+    /*
+        Builds a product quantization index: every vector, scaled to unit length, is split into M
+        subvectors that are each replaced by the nearest of 2^nbits centroids (nbits 4 or 8; 0: 4),
+        trained with k-means on a sample of the file (dwThreads workers, 0: one per processor).
+        M = 0 picks the largest divisor of the dimension up to PQ_MAXM. The codes take M / 2 bytes
+        (4 bits) or M bytes (8 bits) per record. They are saved next to the file as <path>.pq, loaded
+        by fileopen, extended by pqsearch with the records appended since and saved again by fileclose.
+    */
+    EMBEDDINGS_API BOOL EMBEDDINGS_CALL pqbuild(Embeddings* db, uint32_t M, uint32_t nbits, uint32_t dwThreads);
+
+    /*
+        Same as filesearch but scans the PQ codes instead of the records and scores only the best
+        rerank candidates (0: PQ_RERANK x topk, at least topk) exactly against their records.
+        Without an index it falls back to the exhaustive scan.
+    */
+    EMBEDDINGS_API int32_t EMBEDDINGS_CALL pqsearch(
+        Embeddings* db,
+        const float* query, uint32_t len,
+        uint32_t topk,
+        Score* scores,
+        float min,
+        BOOL bNorm,
+        uint32_t rerank);
+
+    /*
+        Builds the sign sketches of the records in the file (dwThreads workers, 0: one per processor):
+        one bit per dimension, set for positive components. They are saved next to the file as
+        <path>.sign, loaded by fileopen, kept current by fileappend and saved again by fileclose.
+    */
+    EMBEDDINGS_API BOOL EMBEDDINGS_CALL signbuild(Embeddings* db, uint32_t dwThreads);
+
+    /*
+        Same as filesearch but ranks the sketches by Hamming distance to the sketch of the query and
+        scores only the best rerank candidates (0: SIGN_RERANK x topk, at least topk) exactly against
+        their records. Without sketches it falls back to the exhaustive scan.
+    */
+    EMBEDDINGS_API int32_t EMBEDDINGS_CALL signsearch(
+        Embeddings* db,
+        const float* query, uint32_t len,
+        uint32_t topk,
+        Score* scores,
+        float min,
+        BOOL bNorm,
+        uint32_t rerank);
 
 #pragma pack(push, 1)
     typedef struct Cursor {
@@ -100,6 +412,11 @@ typedef enum DTYPE {
         uiid* id;
         uint8_t* blob;
         uint32_t blobSize;
+        LARGE_INTEGER next;
+        uint8_t* window; /* direct cursors (see filesetdirect): the block of the file the records are copied from */
+        uint32_t cbWindow;
+        uint32_t cbFilled;
+        LARGE_INTEGER windowOffset;
     } Cursor;
 #pragma pack(pop)
 
@@ -109,6 +426,14 @@ typedef enum DTYPE {
     EMBEDDINGS_API void EMBEDDINGS_CALL cursorclose(Cursor* cur);
     EMBEDDINGS_API BOOL EMBEDDINGS_CALL cursorreset(Cursor* cur);
     EMBEDDINGS_API BOOL EMBEDDINGS_CALL cursorread(Cursor* cur, DWORD* err);
+    /*
+        Reads up to n records from the cursor position, stepping over tombstones like cursorread: the ids
+        to ids (n), the float32 vectors to blobs (n x dim, row-major) and, if offsets is not NULL, the
+        file offsets of the records to offsets (n). The records come from reads of up to CURSOR_BATCH
+        bytes each instead of one read per record. Returns the number of records read, 0 at the end of
+        the file, or -1 on error. cursorupdate then updates the last record returned.
+    */
+    EMBEDDINGS_API int32_t EMBEDDINGS_CALL cursorreadbatch(Cursor* cur, uint32_t n, uiid* ids, float* blobs, uint64_t* offsets);
     EMBEDDINGS_API BOOL EMBEDDINGS_CALL cursorupdate(Cursor* cur, uiid id, const void* blob, DWORD blobSize, BOOL bFlush);
 
 #ifdef __cplusplus